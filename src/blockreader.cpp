@@ -0,0 +1,832 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "libpar2internal.h"
+
+#ifdef _MSC_VER
+#ifdef _DEBUG
+#undef THIS_FILE
+static char THIS_FILE[]=__FILE__;
+#define new DEBUG_NEW
+#endif
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// The number of threads used when io_uring is not available
+#define MAX_READ_THREADS 16
+
+
+BlockReader::BlockReader(std::ostream &serr, FileHandleCache &filecache)
+: serr(serr)
+, filecache(filecache)
+, engine(enSync)
+, depth(1)
+, direct(false)
+, strided(false)
+, bytesread(0)
+, slots(1)
+, head(0)
+, count(0)
+, stopping(false)
+#ifdef HAVE_LINUX_IO_URING_H
+, ringfd(-1)
+, sqring(MAP_FAILED)
+, sqringsize(0)
+, cqring(MAP_FAILED)
+, cqringsize(0)
+, sqes(MAP_FAILED)
+, sqessize(0)
+#endif
+{
+}
+
+BlockReader::~BlockReader(void)
+{
+  // Any reads which are still in flight must complete
+  // before their buffers can be released.
+  Finish();
+
+  StopWorkers();
+
+#ifdef HAVE_LINUX_IO_URING_H
+  UringDestroy();
+
+  for (vector<u8*>::iterator b = bounces.begin(); b != bounces.end(); ++b)
+  {
+    if (*b)
+      ALIGN_FREE(*b);
+  }
+#endif
+}
+
+void BlockReader::Init(u32 _depth, bool _direct, bool _strided)
+{
+  direct = _direct;
+  strided = _strided;
+  depth = _depth > 0 ? _depth : 1;
+  bytesread = 0;
+  starttime = std::chrono::steady_clock::now();
+  slots.resize(depth);
+  head = 0;
+  count = 0;
+
+  // A single read at a time needs no help
+  if (depth == 1)
+  {
+    engine = enSync;
+    return;
+  }
+
+#ifdef HAVE_LINUX_IO_URING_H
+  iovecs.resize(depth);
+  bounces.resize(depth, 0);
+  bouncesizes.resize(depth, 0);
+  if (UringSetup())
+  {
+    engine = enUring;
+    return;
+  }
+#endif
+
+#ifdef _WIN32
+  // Windows file handles have a shared file position,
+  // so reads cannot be issued from several threads.
+  engine = enSync;
+#else
+  // Fall back to issuing positional reads from a pool of threads
+  engine = enThreads;
+  u32 threads = min(depth, (u32)MAX_READ_THREADS);
+  for (u32 i=0; i<threads; i++)
+  {
+    workers.push_back(std::thread(&BlockReader::WorkerThread, this));
+  }
+#endif
+}
+
+const char* BlockReader::EngineName(void) const
+{
+  switch (engine)
+  {
+  case enUring:
+    return "io_uring";
+  case enThreads:
+    return "threads";
+  default:
+    return "synchronous";
+  }
+}
+
+void BlockReader::Prefetch(DataBlock *datablock, u64 position, size_t size)
+{
+  DiskFile *diskfile = datablock->GetDiskFile();
+  if (!strided || diskfile == 0 || !diskfile->IsOpen())
+    return;
+
+  u64    fileoffset;
+  size_t want = datablock->ReadExtent(position, size, fileoffset);
+  diskfile->Prefetch(fileoffset, want);
+}
+
+u64 BlockReader::ReadRate(void) const
+{
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+
+  return seconds > 0 ? (u64)(bytesread / seconds) : 0;
+}
+
+bool BlockReader::Submit(DataBlock *datablock, u64 position, size_t size, void *buffer)
+{
+  assert(count < depth);
+
+  DiskFile *diskfile = datablock->GetDiskFile();
+
+  // Open the file if it is not already open, and keep it
+  // open whilst the read is outstanding
+  bool wasopen = diskfile->IsOpen();
+  if (!filecache.Acquire(diskfile, direct))
+    return false;
+
+  if (!wasopen)
+  {
+    if (strided)
+      diskfile->AdviseRandom();
+    else
+      diskfile->AdviseSequential();
+  }
+
+  // Find out how much data is actually on disk, and zero the rest of the buffer
+  u64    fileoffset;
+  size_t want = datablock->ReadExtent(position, size, fileoffset);
+  if (want < size)
+  {
+    memset(&((u8*)buffer)[want], 0, size-want);
+  }
+
+  // The slot only becomes outstanding once the read has been started,
+  // so that a failure here does not leave Wait() expecting a completion
+  u32 slot = (head + count) % depth;
+
+  Request &request = slots[slot];
+  request.diskfile   = diskfile;
+  request.fileoffset = fileoffset;
+  request.buffer     = (u8*)buffer;
+  request.length     = want;
+  request.total      = want;
+  request.needed     = want;
+  request.target     = 0;
+  request.skip       = 0;
+  request.done       = (want == 0);
+  request.error      = 0;
+
+  if (request.done)
+  {
+    count++;
+    return true;
+  }
+
+#ifdef HAVE_LINUX_IO_URING_H
+  // DiskFile::Read deals with alignment for the other engines
+  if (engine == enUring && diskfile->IsDirect())
+  {
+    if (!Bounce(slot))
+    {
+      filecache.Release(diskfile);
+      return false;
+    }
+  }
+#endif
+
+  if (!Start(slot))
+  {
+    filecache.Release(diskfile);
+    return false;
+  }
+
+  bytesread += want;
+  count++;
+
+  return true;
+}
+
+bool BlockReader::Start(u32 slot)
+{
+  Request &request = slots[slot];
+
+  switch (engine)
+  {
+  case enSync:
+    {
+      // DiskFile::Read reports its own errors
+      if (!request.diskfile->Read(request.fileoffset, request.buffer, request.length))
+        request.error = -1;
+      request.length = 0;
+      request.done = true;
+    }
+    break;
+
+  case enThreads:
+    {
+      std::lock_guard<std::mutex> lock(workmutex);
+      work.push_back(slot);
+      workready.notify_one();
+    }
+    break;
+
+  case enUring:
+#ifdef HAVE_LINUX_IO_URING_H
+    return UringQueue(slot);
+#endif
+    break;
+  }
+
+  return true;
+}
+
+bool BlockReader::Wait(void)
+{
+  assert(count > 0);
+
+  Request &request = slots[head];
+
+  switch (engine)
+  {
+  case enSync:
+    break;
+
+  case enThreads:
+    {
+      std::unique_lock<std::mutex> lock(workmutex);
+      workdone.wait(lock, [&request]{return request.done;});
+    }
+    break;
+
+  case enUring:
+#ifdef HAVE_LINUX_IO_URING_H
+    while (!request.done)
+    {
+      if (!UringReap())
+        return false;
+    }
+#endif
+    break;
+  }
+
+  head = (head + 1) % depth;
+  count--;
+
+  filecache.Release(request.diskfile);
+
+  // Copy the data out of the bounce buffer
+  if (request.target != 0 && request.error == 0)
+  {
+    memcpy(request.target, request.buffer + request.skip, request.needed - request.skip);
+  }
+
+  if (request.error > 0)
+  {
+    serr << "Could not read " << (u64)request.total << " bytes from " << request.diskfile->FileName() << " at offset " << request.fileoffset << ": " << strerror(request.error) << endl;
+  }
+
+  return request.error == 0;
+}
+
+bool BlockReader::Ready(void)
+{
+  if (count == 0)
+    return false;
+
+  Request &request = slots[head];
+
+  switch (engine)
+  {
+  case enSync:
+    return true;
+
+  case enThreads:
+    {
+      std::unique_lock<std::mutex> lock(workmutex);
+      return request.done;
+    }
+
+  case enUring:
+#ifdef HAVE_LINUX_IO_URING_H
+    // Collect any completions which have already arrived
+    while (!request.done && *cqhead != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+    {
+      // Let Wait() report the failure
+      if (!UringReap())
+        return true;
+    }
+#endif
+    return request.done;
+  }
+
+  return true;
+}
+
+bool BlockReader::Finish(void)
+{
+  bool result = true;
+
+  while (count > 0)
+  {
+    if (!Wait())
+    {
+      result = false;
+
+      // The io_uring ring itself has failed; nothing more can be collected
+      if (engine == enUring && !slots[head].done)
+      {
+        for (; count > 0; count--, head = (head + 1) % depth)
+          filecache.Release(slots[head].diskfile);
+        break;
+      }
+    }
+  }
+
+  return result;
+}
+
+void BlockReader::WorkerThread(void)
+{
+  std::unique_lock<std::mutex> lock(workmutex);
+
+  for (;;)
+  {
+    workready.wait(lock, [this]{return stopping || !work.empty();});
+    if (work.empty())
+      break;
+
+    u32 slot = work.front();
+    work.pop_front();
+    Request &request = slots[slot];
+
+    // The read itself is done without holding the lock; the
+    // positional reads used by DiskFile make this safe.
+    lock.unlock();
+    bool ok = request.diskfile->Read(request.fileoffset, request.buffer, request.length);
+    lock.lock();
+
+    request.error = ok ? 0 : -1;
+    request.length = 0;
+    request.done = true;
+    workdone.notify_all();
+  }
+}
+
+void BlockReader::StopWorkers(void)
+{
+  {
+    std::lock_guard<std::mutex> lock(workmutex);
+    stopping = true;
+    workready.notify_all();
+  }
+
+  for (vector<std::thread>::iterator t = workers.begin(); t != workers.end(); ++t)
+  {
+    t->join();
+  }
+  workers.clear();
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+// Create the io_uring instance and map its rings into memory.
+// The raw system calls are used so that liburing is not required.
+bool BlockReader::UringSetup(void)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ringfd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  if (ringfd < 0)
+    return false;
+
+  sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  sqring = mmap(0, sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+
+  cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  cqring = mmap(0, cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+
+  sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(0, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+
+  if (sqring == MAP_FAILED || cqring == MAP_FAILED || sqes == MAP_FAILED)
+  {
+    UringDestroy();
+    return false;
+  }
+
+  sqhead  = (unsigned*)((u8*)sqring + params.sq_off.head);
+  sqtail  = (unsigned*)((u8*)sqring + params.sq_off.tail);
+  sqmask  = (unsigned*)((u8*)sqring + params.sq_off.ring_mask);
+  sqarray = (unsigned*)((u8*)sqring + params.sq_off.array);
+
+  cqhead  = (unsigned*)((u8*)cqring + params.cq_off.head);
+  cqtail  = (unsigned*)((u8*)cqring + params.cq_off.tail);
+  cqmask  = (unsigned*)((u8*)cqring + params.cq_off.ring_mask);
+  cqes    = (u8*)cqring + params.cq_off.cqes;
+
+  return true;
+}
+
+void BlockReader::UringDestroy(void)
+{
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqessize);
+  if (cqring != MAP_FAILED)
+    munmap(cqring, cqringsize);
+  if (sqring != MAP_FAILED)
+    munmap(sqring, sqringsize);
+  sqes = cqring = sqring = MAP_FAILED;
+
+  if (ringfd >= 0)
+    close(ringfd);
+  ringfd = -1;
+}
+
+// If a direct read is not aligned, widen it to aligned boundaries and
+// read into the slot's bounce buffer instead of the caller's buffer.
+bool BlockReader::Bounce(u32 slot)
+{
+  Request &request = slots[slot];
+  const u64 mask = DIRECT_IO_ALIGNMENT - 1;
+
+  if (((request.fileoffset | request.length | (u64)(uintptr_t)request.buffer) & mask) == 0)
+    return true;
+
+  u64 start = request.fileoffset & ~mask;
+  size_t skip = (size_t)(request.fileoffset - start);
+  size_t span = (size_t)((skip + request.length + mask) & ~mask);
+
+  if (bouncesizes[slot] < span)
+  {
+    if (bounces[slot])
+      ALIGN_FREE(bounces[slot]);
+    ALIGN_ALLOC(bounces[slot], span, DIRECT_IO_ALIGNMENT);
+    bouncesizes[slot] = bounces[slot] ? span : 0;
+    if (!bounces[slot])
+    {
+      serr << "Could not allocate buffer for reading " << request.diskfile->FileName() << endl;
+      return false;
+    }
+  }
+
+  request.target     = request.buffer;
+  request.skip       = skip;
+  request.needed     = skip + request.length;
+  request.buffer     = bounces[slot];
+  request.fileoffset = start;
+  request.length     = span;
+  request.total      = span;
+
+  return true;
+}
+
+// Queue a read for the remainder of a request
+bool BlockReader::UringQueue(u32 slot)
+{
+  Request &request = slots[slot];
+  size_t done = request.total - request.length;
+
+  iovecs[slot].iov_base = request.buffer + done;
+  iovecs[slot].iov_len  = request.length;
+
+  // There are never more requests outstanding than there are ring entries,
+  // and each one is submitted immediately, so the ring cannot be full.
+  unsigned tail = *sqtail;
+  unsigned index = tail & *sqmask;
+
+  struct io_uring_sqe *sqe = &((struct io_uring_sqe*)sqes)[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = IORING_OP_READV;
+  sqe->fd        = request.diskfile->Descriptor();
+  sqe->addr      = (u64)(uintptr_t)&iovecs[slot];
+  sqe->len       = 1;
+  sqe->off       = request.fileoffset + done;
+  sqe->user_data = slot;
+
+  sqarray[index] = index;
+  __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+
+  int result;
+  do
+  {
+    result = (int)syscall(__NR_io_uring_enter, ringfd, 1, 0, 0, NULL, 0);
+  } while (result < 0 && errno == EINTR);
+
+  if (result < 0)
+  {
+    // Take the entry back so that it is not submitted with a later read
+    __atomic_store_n(sqtail, tail, __ATOMIC_RELEASE);
+
+    serr << "Could not queue read from " << request.diskfile->FileName() << ": " << strerror(errno) << endl;
+    return false;
+  }
+
+  return true;
+}
+
+// Collect one completed read, waiting for it if required
+bool BlockReader::UringReap(void)
+{
+  unsigned chead = *cqhead;
+  while (chead == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+  {
+    int result = (int)syscall(__NR_io_uring_enter, ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (result < 0 && errno != EINTR)
+    {
+      serr << "Could not wait for read completion: " << strerror(errno) << endl;
+      return false;
+    }
+  }
+
+  struct io_uring_cqe *cqe = &((struct io_uring_cqe*)cqes)[chead & *cqmask];
+  u32 slot = (u32)cqe->user_data;
+  int res = cqe->res;
+  __atomic_store_n(cqhead, chead + 1, __ATOMIC_RELEASE);
+
+  Request &request = slots[slot];
+
+  if (res == -EINTR || res == -EAGAIN)
+  {
+    return UringQueue(slot);
+  }
+  else if (res < 0)
+  {
+    request.error = -res;
+    request.done = true;
+  }
+  else if (res == 0)
+  {
+    // The file is shorter than expected
+    request.error = EIO;
+    request.done = true;
+  }
+  else
+  {
+    // Continue after a short read.  A widened direct read may
+    // stop early at the end of the file once it has what is needed.
+    request.length -= res;
+    if (request.length > 0 && request.total - request.length < request.needed)
+      return UringQueue(slot);
+    request.done = true;
+  }
+
+  return true;
+}
+
+#endif // HAVE_LINUX_IO_URING_H
+
+
+ParallelReader::ParallelReader(std::ostream &serr, FileHandleCache &filecache)
+: serr(serr)
+, filecache(filecache)
+, nextlane(0)
+, blocks(0)
+, position(0)
+, size(0)
+, buffers(0)
+, buffersize(0)
+{
+}
+
+ParallelReader::~ParallelReader(void)
+{
+  for (vector<Lane>::iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+  {
+    delete lane->reader;
+  }
+
+  // The buffers must not be released while they are still in use
+  for (vector< std::future<void> >::iterator f = available.begin(); f != available.end(); ++f)
+  {
+    if (f->valid())
+      f->wait();
+  }
+}
+
+u32 ParallelReader::FindDevices(const vector<DataBlock*> &blocks, vector<u32> &devices)
+{
+  map<DiskFile*, u32> filedevice;
+  map<u64, u32> devicenumber;
+
+  devices.resize(blocks.size());
+  for (size_t i=0; i<blocks.size(); i++)
+  {
+    DiskFile *diskfile = blocks[i]->GetDiskFile();
+
+    map<DiskFile*, u32>::const_iterator f = filedevice.find(diskfile);
+    if (f == filedevice.end())
+    {
+      u64 id = diskfile ? DiskFile::GetDeviceId(diskfile->FileName()) : 0;
+
+      map<u64, u32>::const_iterator d = devicenumber.find(id);
+      if (d == devicenumber.end())
+        d = devicenumber.insert(pair<u64, u32>(id, (u32)devicenumber.size())).first;
+
+      f = filedevice.insert(pair<DiskFile*, u32>(diskfile, d->second)).first;
+    }
+
+    devices[i] = f->second;
+  }
+
+  return max((u32)1, (u32)devicenumber.size());
+}
+
+void ParallelReader::Init(u32 devicecount, u32 depth, bool direct, bool strided)
+{
+  lanes.resize(max((u32)1, devicecount));
+  for (vector<Lane>::iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+  {
+    lane->reader = new BlockReader(serr, filecache);
+    lane->reader->Init(depth, direct, strided);
+    lane->submitted = 0;
+    lane->collected = 0;
+  }
+
+  nextlane = 0;
+  starttime = std::chrono::steady_clock::now();
+}
+
+void ParallelReader::Start(const vector<DataBlock*> &_blocks, const vector<u32> &devices,
+                           u64 _position, size_t _size,
+                           void *_buffers, size_t _buffersize, u32 buffercount)
+{
+  assert(buffercount > Depth());
+
+  blocks = &_blocks;
+  position = _position;
+  size = _size;
+  buffers = (u8*)_buffers;
+  buffersize = _buffersize;
+
+  for (u32 i=0; i<_blocks.size(); i++)
+  {
+    lanes[devices[i]].blocks.push_back(i);
+  }
+
+  freebuffers.clear();
+  available.clear();
+  available.resize(buffercount);
+  for (u32 i=0; i<buffercount; i++)
+  {
+    freebuffers.push_back(i);
+  }
+}
+
+const char* ParallelReader::EngineName(void) const
+{
+  return lanes.empty() ? "synchronous" : lanes[0].reader->EngineName();
+}
+
+u32 ParallelReader::Depth(void) const
+{
+  u32 depth = 0;
+  for (vector<Lane>::const_iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+  {
+    depth += lane->reader->Depth();
+  }
+  return depth;
+}
+
+u64 ParallelReader::BytesRead(void) const
+{
+  u64 bytesread = 0;
+  for (vector<Lane>::const_iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+  {
+    bytesread += lane->reader->BytesRead();
+  }
+  return bytesread;
+}
+
+u64 ParallelReader::ReadRate(void) const
+{
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - starttime).count();
+
+  return seconds > 0 ? (u64)(BytesRead() / seconds) : 0;
+}
+
+bool ParallelReader::Fill(Lane &lane)
+{
+  BlockReader &reader = *lane.reader;
+
+  while (lane.submitted < lane.blocks.size() && lane.submitted - lane.collected < reader.Depth())
+  {
+    // Wait for the oldest free buffer to become available
+    u32 bufferindex = freebuffers.front();
+    freebuffers.pop_front();
+    if (available[bufferindex].valid())
+      available[bufferindex].get();
+
+    void *buffer = buffers + buffersize * bufferindex;
+    if (!reader.Submit((*blocks)[lane.blocks[lane.submitted]], position, size, buffer))
+    {
+      freebuffers.push_front(bufferindex);
+      return false;
+    }
+    lane.buffers.push_back(bufferindex);
+
+    // Ask for the slice which will be read after the current ones
+    if (lane.blocks.size() - lane.submitted > reader.Depth())
+      reader.Prefetch((*blocks)[lane.blocks[lane.submitted + reader.Depth()]], position, size);
+
+    lane.submitted++;
+  }
+
+  return true;
+}
+
+bool ParallelReader::Next(u32 &index, void *&buffer)
+{
+  // Keep every device busy
+  for (vector<Lane>::iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+  {
+    if (!Fill(*lane))
+      return false;
+  }
+
+  // Take a block from the first device which has one ready, or else
+  // wait on the next device in turn which has a read outstanding
+  u32 chosen = (u32)lanes.size();
+  for (u32 i=0; i<lanes.size(); i++)
+  {
+    u32 l = (nextlane + i) % lanes.size();
+    if (lanes[l].collected < lanes[l].submitted)
+    {
+      if (chosen == lanes.size())
+        chosen = l;
+      if (lanes[l].reader->Ready())
+      {
+        chosen = l;
+        break;
+      }
+    }
+  }
+  if (chosen == lanes.size())
+  {
+    serr << "No more blocks to read." << endl;
+    return false;
+  }
+  nextlane = (chosen + 1) % lanes.size();
+
+  Lane &lane = lanes[chosen];
+  bool result = lane.reader->Wait();
+
+  index = lane.blocks[lane.collected++];
+  u32 bufferindex = lane.buffers.front();
+  lane.buffers.pop_front();
+  buffer = buffers + buffersize * bufferindex;
+
+  if (!result)
+    freebuffers.push_back(bufferindex);
+
+  return result;
+}
+
+void ParallelReader::Done(void *buffer, std::future<void> _available)
+{
+  u32 bufferindex = (u32)(((u8*)buffer - buffers) / buffersize);
+
+  available[bufferindex] = std::move(_available);
+  freebuffers.push_back(bufferindex);
+}
+
+bool ParallelReader::Finish(void)
+{
+  bool result = true;
+
+  for (vector<Lane>::iterator lane = lanes.begin(); lane != lanes.end(); ++lane)
+  {
+    if (!lane->reader->Finish())
+      result = false;
+
+    for (list<u32>::const_iterator b = lane->buffers.begin(); b != lane->buffers.end(); ++b)
+      freebuffers.push_back(*b);
+    lane->buffers.clear();
+    lane->collected = lane->submitted;
+  }
+
+  return result;
+}
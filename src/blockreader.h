@@ -0,0 +1,274 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __BLOCKREADER_H__
+#define __BLOCKREADER_H__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <future>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/uio.h>
+#endif
+
+class DataBlock;
+class DiskFile;
+class FileHandleCache;
+
+// The default number of block reads which are kept in flight
+#define DEFAULT_READ_DEPTH 8
+
+// Read ahead is limited to this many bytes of buffer space
+#define MAX_READ_AHEAD (64 * 1048576)
+
+// A BlockReader keeps several DataBlock reads in flight at once, so that
+// the disks are busy while previously read blocks are being processed.
+//
+// Reads are queued with Submit() and collected with Wait() in the order
+// in which they were submitted.  On Linux the reads are issued through
+// io_uring.  If that is not available, a small pool of threads issues
+// them instead, and with a depth of 1 every read is done within Submit().
+//
+// Files are opened through a FileHandleCache, which keeps them open
+// between passes over the data.  They can be opened for direct
+// (uncached) reads, in which case io_uring reads which are not suitably
+// aligned go through a bounce buffer.
+//
+// When only a slice of each block is read (a strided pattern), kernel
+// read ahead is turned off for the files, and Prefetch() is used to ask
+// for the slices which will be read next instead.
+
+class BlockReader
+{
+public:
+  BlockReader(std::ostream &serr, FileHandleCache &filecache);
+  ~BlockReader(void);
+
+  // Set up the reader for the specified number of outstanding reads,
+  // whether the files it opens should bypass the OS file cache, and
+  // whether only a slice of each block will be read
+  void Init(u32 depth, bool direct = false, bool strided = false);
+
+  // Which I/O engine is being used
+  const char* EngineName(void) const;
+
+  // How many reads can be outstanding
+  u32 Depth(void) const {return depth;}
+
+  // How many reads are currently outstanding
+  u32 Pending(void) const {return count;}
+
+  // How many bytes have been read from disk
+  u64 BytesRead(void) const {return bytesread;}
+
+  // The average rate at which data has been read since Init(), in bytes/s
+  u64 ReadRate(void) const;
+
+  // Queue a read of some data at a specified position within a data block.
+  // As with DataBlock::ReadData, the part of the buffer which lies beyond
+  // the end of the data block is zeroed.
+  bool Submit(DataBlock *datablock, u64 position, size_t size, void *buffer);
+
+  // Hint that a read of some data within a data block will be submitted
+  // soon.  This only does anything for strided reads from an open file.
+  void Prefetch(DataBlock *datablock, u64 position, size_t size);
+
+  // Has the oldest outstanding read completed, so that Wait() will not block
+  bool Ready(void);
+
+  // Wait for the oldest outstanding read to complete
+  bool Wait(void);
+
+  // Wait for all outstanding reads
+  bool Finish(void);
+
+protected:
+  enum Engine
+  {
+    enSync = 0,
+    enThreads,
+    enUring
+  };
+
+  struct Request
+  {
+    DiskFile *diskfile;
+    u64       fileoffset;
+    u8       *buffer;
+    size_t    length;   // How much is still to be read
+    size_t    total;    // How much was requested
+    size_t    needed;   // How much must be read for the request to succeed
+    u8       *target;   // Where to copy the data from a bounce buffer (or 0)
+    size_t    skip;     // Where the wanted data starts in the bounce buffer
+    bool      done;
+    int       error;
+  };
+
+  // Start reading the request in a slot
+  bool Start(u32 slot);
+
+#ifdef HAVE_LINUX_IO_URING_H
+  bool Bounce(u32 slot);
+  bool UringSetup(void);
+  void UringDestroy(void);
+  bool UringQueue(u32 slot);
+  bool UringReap(void);
+#endif
+
+  void WorkerThread(void);
+  void StopWorkers(void);
+
+protected:
+  std::ostream &serr;
+  FileHandleCache &filecache;
+
+  Engine engine;
+  u32 depth;
+  bool direct;
+  bool strided;
+  u64 bytesread;
+  std::chrono::steady_clock::time_point starttime;
+
+  vector<Request> slots;  // Fixed storage for the outstanding requests
+  u32 head;               // Slot of the oldest outstanding request
+  u32 count;              // Number of outstanding requests
+
+  // Thread engine
+  vector<std::thread> workers;
+  std::mutex workmutex;
+  std::condition_variable workready;
+  std::condition_variable workdone;
+  list<u32> work;
+  bool stopping;
+
+#ifdef HAVE_LINUX_IO_URING_H
+  // io_uring engine
+  int ringfd;
+  void *sqring;
+  size_t sqringsize;
+  void *cqring;
+  size_t cqringsize;
+  void *sqes;
+  size_t sqessize;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  void *cqes;
+  vector<struct iovec> iovecs;
+
+  // Aligned buffers for direct reads, one per slot
+  vector<u8*> bounces;
+  vector<size_t> bouncesizes;
+#endif
+};
+
+// The data for a create or repair is often spread over several disks.  A
+// ParallelReader reads a list of data blocks with a separate BlockReader
+// for each device that they are on, so that all of the disks are kept busy
+// at once.  The blocks from one device are returned in the order in which
+// they appear in the list, but those from different devices are returned
+// in whichever order they become available.
+//
+// The data is read into a set of transfer buffers.  A buffer which has
+// been returned by Next() is reused once Done() has been called for it,
+// and the future given to Done() is ready.  There must be at least
+// Depth() + 1 buffers.
+
+class ParallelReader
+{
+public:
+  ParallelReader(std::ostream &serr, FileHandleCache &filecache);
+  ~ParallelReader(void);
+
+  // Work out which device each of the blocks is on, numbering the devices
+  // from 0.  Returns the number of devices.
+  static u32 FindDevices(const vector<DataBlock*> &blocks, vector<u32> &devices);
+
+  // Set up a reader for each device, with the specified number of
+  // outstanding reads each
+  void Init(u32 devicecount, u32 depth, bool direct = false, bool strided = false);
+
+  // Start reading some data at a specified position within each block
+  void Start(const vector<DataBlock*> &blocks, const vector<u32> &devices,
+             u64 position, size_t size,
+             void *buffers, size_t buffersize, u32 buffercount);
+
+  // Which I/O engine is being used
+  const char* EngineName(void) const;
+
+  // How many devices are being read from
+  u32 Devices(void) const {return (u32)lanes.size();}
+
+  // How many reads can be outstanding, in total
+  u32 Depth(void) const;
+
+  // How many bytes have been read from disk
+  u64 BytesRead(void) const;
+
+  // The average rate at which data has been read since Init(), in bytes/s
+  u64 ReadRate(void) const;
+
+  // Wait for the next block to be read.  Returns the position of the
+  // block in the list, and the buffer which holds its data.
+  bool Next(u32 &index, void *&buffer);
+
+  // Finish with a buffer, which can be reused when the future is ready
+  void Done(void *buffer, std::future<void> available);
+
+  // Wait for all outstanding reads
+  bool Finish(void);
+
+protected:
+  struct Lane
+  {
+    BlockReader *reader;
+    vector<u32>  blocks;    // Which blocks are on this device
+    size_t       submitted; // How many of them have been submitted
+    size_t       collected; // How many of them have been collected
+    list<u32>    buffers;   // The buffers of the outstanding reads
+  };
+
+  // Keep the reads for a device queued
+  bool Fill(Lane &lane);
+
+protected:
+  std::ostream &serr;
+  FileHandleCache &filecache;
+
+  vector<Lane> lanes;
+  u32 nextlane;           // Where to start looking for a completed read
+  std::chrono::steady_clock::time_point starttime;
+
+  const vector<DataBlock*> *blocks;
+  u64 position;
+  size_t size;
+
+  u8 *buffers;
+  size_t buffersize;
+  list<u32> freebuffers;                  // Buffers not being read into, oldest first
+  vector< std::future<void> > available;  // When each buffer can be reused
+
+private:
+  ParallelReader(const ParallelReader &);
+  ParallelReader& operator=(const ParallelReader &);
+};
+
+#endif // __BLOCKREADER_H__
@@ -0,0 +1,212 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "libpar2internal.h"
+
+#ifdef _MSC_VER
+#ifdef _DEBUG
+#undef THIS_FILE
+static char THIS_FILE[]=__FILE__;
+#define new DEBUG_NEW
+#endif
+#endif
+
+// The checkpoint starts with a header, which is followed by the crc of
+// each recovery packet, the hash of each source file, the hash and crc
+// of each source block, and the names of files, each ending with a zero.
+// The hash in the header covers everything which follows it.
+
+#ifdef _WIN32
+#pragma pack(push, 1)
+#define PACKED
+#else
+#define PACKED __attribute__ ((packed))
+#endif
+
+struct CHECKPOINTHEADER
+{
+  MAGIC   magic;
+  MD5Hash hash;
+  MD5Hash jobid;
+  leu32   passes;       // How many passes were finished
+  leu32   packetcount;  // How many recovery packets there are
+  leu32   filecount;    // How many source files have hashes
+  leu32   blockcount;   // How many source blocks have hashes
+  leu32   namesize;     // How long the file names are altogether
+} PACKED;
+
+#ifdef _WIN32
+#pragma pack(pop)
+#endif
+#undef PACKED
+
+static const MAGIC checkpoint_magic = {{'P', 'A', 'R', '2', 'C', 'K', 'P', 'T'}};
+
+
+Checkpoint::Checkpoint(std::ostream &sout, std::ostream &serr)
+: sout(sout)
+, serr(serr)
+, passes(0)
+{
+  memset(&jobid, 0, sizeof(jobid));
+}
+
+Checkpoint::~Checkpoint(void)
+{
+}
+
+string Checkpoint::FileName(const string &parfilename)
+{
+  string name = parfilename;
+  if (name.size() >= 5 && 0 == stricmp(name.substr(name.size()-5).c_str(), ".par2"))
+    name = name.substr(0, name.size()-5);
+
+  return name + ".par2checkpoint";
+}
+
+bool Checkpoint::Load(const string &filename)
+{
+  // If the old checkpoint was deleted before the new one replaced it,
+  // the new one is used
+  string name = DiskFile::ReplacedFileName(filename);
+  if (name.empty())
+    return false;
+
+  DiskFile file(sout, serr);
+  if (!file.Open(name))
+    return false;
+
+  CHECKPOINTHEADER header;
+  vector<u8> data;
+  bool success = file.FileSize() >= sizeof(header) &&
+                 file.Read(0, &header, sizeof(header)) &&
+                 header.magic == checkpoint_magic;
+  if (success)
+  {
+    u64 length = (u64)header.packetcount * sizeof(leu32) +
+                 (u64)header.filecount * sizeof(MD5Hash) +
+                 (u64)header.blockcount * sizeof(FILEVERIFICATIONENTRY) +
+                 header.namesize;
+    success = file.FileSize() == sizeof(header) + length;
+    if (success)
+    {
+      data.resize((size_t)length);
+      success = length == 0 || file.Read(sizeof(header), &data[0], (size_t)length);
+    }
+  }
+  file.Close();
+
+  if (success)
+  {
+    MD5Context context;
+    context.Update(&header.jobid, sizeof(header) - offsetof(CHECKPOINTHEADER, jobid));
+    context.Update(data.empty() ? 0 : &data[0], data.size());
+    MD5Hash hash;
+    context.Final(hash);
+    success = hash == header.hash;
+  }
+
+  if (!success)
+  {
+    sout << "The checkpoint " << name << " is damaged and cannot be used." << endl;
+    return false;
+  }
+
+  jobid = header.jobid;
+  passes = header.passes;
+
+  const u8 *current = data.empty() ? 0 : &data[0];
+  packetcrcs.resize(header.packetcount);
+  for (u32 i=0; i<header.packetcount; i++, current += sizeof(leu32))
+    packetcrcs[i] = *(const leu32*)current;
+
+  filehashes.resize(header.filecount);
+  for (u32 i=0; i<header.filecount; i++, current += sizeof(MD5Hash))
+    memcpy(&filehashes[i], current, sizeof(MD5Hash));
+
+  blockentries.resize(header.blockcount);
+  for (u32 i=0; i<header.blockcount; i++, current += sizeof(FILEVERIFICATIONENTRY))
+    memcpy(&blockentries[i], current, sizeof(FILEVERIFICATIONENTRY));
+
+  filenames.clear();
+  const u8 *end = current + header.namesize;
+  while (current < end)
+  {
+    const u8 *zero = (const u8*)memchr(current, 0, end - current);
+    if (zero == 0)
+      break;
+    filenames.push_back(string((const char*)current, zero - current));
+    current = zero + 1;
+  }
+
+  return true;
+}
+
+bool Checkpoint::Save(const string &filename)
+{
+  CHECKPOINTHEADER header;
+  header.magic = checkpoint_magic;
+  header.jobid = jobid;
+  header.passes = passes;
+  header.packetcount = (u32)packetcrcs.size();
+  header.filecount = (u32)filehashes.size();
+  header.blockcount = (u32)blockentries.size();
+
+  size_t namesize = 0;
+  for (size_t i=0; i<filenames.size(); i++)
+    namesize += filenames[i].size() + 1;
+  header.namesize = (u32)namesize;
+
+  size_t length = packetcrcs.size() * sizeof(leu32) +
+                  filehashes.size() * sizeof(MD5Hash) +
+                  blockentries.size() * sizeof(FILEVERIFICATIONENTRY) +
+                  namesize;
+  vector<u8> data(sizeof(header) + length);
+
+  u8 *current = &data[sizeof(header)];
+  for (size_t i=0; i<packetcrcs.size(); i++, current += sizeof(leu32))
+    *(leu32*)current = packetcrcs[i];
+  for (size_t i=0; i<filehashes.size(); i++, current += sizeof(MD5Hash))
+    memcpy(current, &filehashes[i], sizeof(MD5Hash));
+  for (size_t i=0; i<blockentries.size(); i++, current += sizeof(FILEVERIFICATIONENTRY))
+    memcpy(current, &blockentries[i], sizeof(FILEVERIFICATIONENTRY));
+  for (size_t i=0; i<filenames.size(); current += filenames[i].size() + 1, i++)
+    memcpy(current, filenames[i].c_str(), filenames[i].size() + 1);
+
+  MD5Context context;
+  context.Update(&header.jobid, sizeof(header) - offsetof(CHECKPOINTHEADER, jobid));
+  context.Update(&data[sizeof(header)], length);
+  context.Final(header.hash);
+  memcpy(&data[0], &header, sizeof(header));
+
+  // Write the new checkpoint in full before it replaces the old one
+  DiskFile file(sout, serr);
+  bool success = file.Replace(filename, &data[0], data.size());
+
+  if (!success)
+    serr << "Could not write the checkpoint " << filename << endl;
+
+  return success;
+}
+
+bool Checkpoint::Remove(const string &filename)
+{
+  DiskFile file(sout, serr);
+  return file.DeleteReplaced(filename);
+}
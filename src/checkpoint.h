@@ -0,0 +1,91 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+// A Checkpoint records how far a create or a repair has got, so that if
+// it is interrupted it can carry on from the last pass over the data
+// which it finished, rather than starting again.  The checkpoint is kept
+// next to the recovery files, with ".par2checkpoint" in place of ".par2".
+//
+// It holds the number of passes which were finished, the crc of the data
+// which they wrote to each recovery packet or repaired block, so that the
+// data can be checked before it is used, the hashes of the source files
+// once a create has computed them, and the files which a repair created
+// or renamed.  A new checkpoint is written in full to a temporary file,
+// which then replaces the old one.
+
+class Checkpoint
+{
+public:
+  Checkpoint(std::ostream &sout, std::ostream &serr);
+  ~Checkpoint(void);
+
+  // The name of the checkpoint for the recovery files with the specified base name
+  static string FileName(const string &parfilename);
+
+  // Load a checkpoint.  If there is no checkpoint, or it cannot be used,
+  // false is returned.
+  bool Load(const string &filename);
+
+  // Replace the checkpoint with the current progress
+  bool Save(const string &filename);
+
+  // Delete the checkpoint, once the create or repair has finished
+  bool Remove(const string &filename);
+
+  // Identifies the create or repair which the checkpoint belongs to
+  void JobId(const MD5Hash &_jobid) {jobid = _jobid;}
+  const MD5Hash& JobId(void) const {return jobid;}
+
+  // How many passes over the source data have been finished
+  void Passes(u32 _passes) {passes = _passes;}
+  u32 Passes(void) const {return passes;}
+
+  // The crc of the data which has been written to each recovery packet,
+  // or to each block of the files being repaired
+  vector<u32>& PacketCRCs(void) {return packetcrcs;}
+
+  // The full hash of each source file, and the hash and crc of each
+  // source block, once they have been computed
+  vector<MD5Hash>& FileHashes(void) {return filehashes;}
+  vector<FILEVERIFICATIONENTRY>& BlockEntries(void) {return blockentries;}
+
+  // The files which a repair created, each followed by the name which the
+  // damaged file was renamed to, or by an empty name if it was missing
+  vector<string>& FileNames(void) {return filenames;}
+
+protected:
+  std::ostream &sout;
+  std::ostream &serr;
+
+  MD5Hash                       jobid;
+  u32                           passes;
+  vector<u32>                   packetcrcs;
+  vector<MD5Hash>               filehashes;
+  vector<FILEVERIFICATIONENTRY> blockentries;
+  vector<string>                filenames;
+
+private:
+  Checkpoint(const Checkpoint &);
+  Checkpoint& operator=(const Checkpoint &);
+};
+
+#endif // __CHECKPOINT_H__
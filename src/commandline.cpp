@@ -49,6 +49,14 @@ CommandLine::CommandLine(void)
 #ifdef _OPENMP
 , filethreads( _FILE_THREADS ) // default from header file
 #endif
+, readdepth(0) // 0 means use default depth
+, directio(false)
+, inplace(false)
+, ondemand(false)
+, mapfiles(false)
+, packetindex(false)
+, rebuildpacketindex(false)
+, checkpoint(false)
 , parfilename()
 , rawfilenames()
 , extrafiles()
@@ -104,6 +112,8 @@ void CommandLine::usage(void)
     "  par2 c(reate) [options] <PAR2 file> [files] : Create PAR2 files\n"
     "  par2 v(erify) [options] <PAR2 file> [files] : Verify files using PAR2 file\n"
     "  par2 r(epair) [options] <PAR2 file> [files] : Repair files using PAR2 files\n"
+    "  par2 e(xtend) [options] <PAR2 file>         : Add recovery files to PAR2 files\n"
+    "  par2 u(pdate) [options] <PAR2 file> [files] : Update PAR2 files for changed files\n"
     "\n"
     "You may also leave out the \"c\", \"v\", and \"r\" commands by using \"par2create\",\n"
     "\"par2verify\", or \"par2repair\" instead.\n"
@@ -123,12 +133,27 @@ void CommandLine::usage(void)
     "  -t<n>    : Number of threads used for main processing (" << thread::hardware_concurrency() << " detected)\n";
 #endif
   cout <<
+    "  --io-depth=<n> : Number of block reads kept in flight (1 disables read ahead)\n"
+    "  --direct-io : Read data files without using the OS file cache\n"
     "  --       : Treat all following arguments as filenames\n"
     "Options: (verify or repair)\n"
     "  -p       : Purge backup files and par files on successful recovery or\n"
     "             when no recovery is needed\n"
     "  -N       : Data skipping (find badly mispositioned data blocks)\n"
     "  -S<n>    : Skip leaway (distance +/- from expected block position)\n"
+    "  --in-place : Repair damaged files where they are, rewriting only the\n"
+    "             damaged blocks, instead of rebuilding them as new files\n"
+    "  --on-demand : Only load the recovery volumes which are needed to repair\n"
+    "             the files, once they have been verified\n"
+    "  --mmap   : Scan data files through a memory mapping instead of reading\n"
+    "             them (a read error in a data file then stops par2)\n"
+    "  --checkpoint : Save the progress of a repair after each pass, so that an\n"
+    "             interrupted repair carries on where it stopped when it is run\n"
+    "             again (not with --in-place)\n"
+    "  --packet-index : Remember where the packets are in the PAR2 files, so\n"
+    "             that files which have not changed are not searched again\n"
+    "  --rebuild-packet-index : Search all of the PAR2 files, and replace the\n"
+    "             packet index with what is found\n"
     "Options: (create)\n"
     "  -a<file> : Set the main PAR2 archive name\n"
     "  -b<n>    : Set the Block-Count\n"
@@ -141,6 +166,12 @@ void CommandLine::usage(void)
     "  -l       : Limit size of recovery files (don't use both -u and -l)\n"
     "  -n<n>    : Number of recovery files (don't use both -n and -l)\n"
     "  -R       : Recurse into subdirectories\n"
+    "  --checkpoint : Save the progress after each pass, so that an interrupted\n"
+    "             create carries on where it stopped when it is run again\n"
+    "Options: (extend)\n"
+    "  -r<n>    : Level of redundancy to add (%%)\n"
+    "  -c<n>    : Number of recovery blocks to add (don't use both -r and -c)\n"
+    "  -u, -l, -n<n> : Size and number of the new recovery files, as for create\n"
     "\n";
   cout <<
     "Example:\n"
@@ -272,6 +303,14 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
       if (argv[0][1] == 0 || 0 == stricmp(argv[0], "repair"))
         operation = opRepair;
       break;
+    case 'e':
+      if (argv[0][1] == 0 || 0 == stricmp(argv[0], "extend"))
+        operation = opExtend;
+      break;
+    case 'u':
+      if (argv[0][1] == 0 || 0 == stricmp(argv[0], "update"))
+        operation = opUpdate;
+      break;
     }
 
     if (operation == opNone)
@@ -433,9 +472,9 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'r':  // Set the amount of redundancy required
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opExtend)
             {
-              cerr << "Cannot specify redundancy unless creating." << endl;
+              cerr << "Cannot specify redundancy unless creating or extending." << endl;
               return false;
             }
             if (redundancyset)
@@ -454,6 +493,12 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
                 || argv[0][2] == 'g'
             )
             {
+              if (operation == opExtend)
+              {
+                cerr << "Cannot specify a redundancy target size when extending." << endl;
+                return false;
+              }
+
               const char *p = &argv[0][3];
               while (*p && isdigit(*p))
               {
@@ -500,9 +545,9 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'c': // Set the number of recovery blocks to create
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opExtend)
             {
-              cerr << "Cannot specify recovery block count unless creating." << endl;
+              cerr << "Cannot specify recovery block count unless creating or extending." << endl;
               return false;
             }
             if (recoveryblockcountset)
@@ -565,9 +610,9 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'u':  // Specify uniformly sized recovery files
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opExtend)
             {
-              cerr << "Cannot specify uniform files unless creating." << endl;
+              cerr << "Cannot specify uniform files unless creating or extending." << endl;
               return false;
             }
             if (argv[0][2])
@@ -587,9 +632,9 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'l':  // Limit the size of the recovery files
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opExtend)
             {
-              cerr << "Cannot specify limit files unless creating." << endl;
+              cerr << "Cannot specify limit files unless creating or extending." << endl;
               return false;
             }
             if (argv[0][2])
@@ -614,9 +659,9 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'n':  // Specify the number of recovery files
           {
-            if (operation != opCreate)
+            if (operation != opCreate && operation != opExtend)
             {
-              cerr << "Cannot specify recovery file count unless creating." << endl;
+              cerr << "Cannot specify recovery file count unless creating or extending." << endl;
               return false;
             }
             if (recoveryfilecount > 0)
@@ -754,7 +799,7 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'N':
           {
-            if (operation == opCreate)
+            if (operation != opRepair && operation != opVerify)
             {
               cerr << "Cannot specify Data Skipping unless reparing or verifying." << endl;
               return false;
@@ -765,9 +810,9 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case 'S':  // Set the skip leaway
           {
-            if (operation == opCreate)
+            if (operation != opRepair && operation != opVerify)
             {
-              cerr << "Cannot specify skip leaway when creating." << endl;
+              cerr << "Cannot specify skip leaway unless repairing or verifying." << endl;
               return false;
             }
             if (!skipdata)
@@ -808,6 +853,89 @@ bool CommandLine::ReadArgs(int argc, const char * const *argv)
 
         case '-':
           {
+            if (0 == strncmp(argv[0], "--io-depth=", 11))
+            {
+              readdepth = 0;
+              const char *p = &argv[0][11];
+
+              while (*p && isdigit(*p))
+              {
+                readdepth = readdepth * 10 + (*p - '0');
+                p++;
+              }
+
+              if (!readdepth || *p)
+              {
+                cerr << "Invalid I/O depth option: " << argv[0] << endl;
+                return false;
+              }
+              break;
+            }
+
+            if (argv[0] == string("--direct-io"))
+            {
+              directio = true;
+              break;
+            }
+
+            if (argv[0] == string("--in-place"))
+            {
+              if (operation != opVerify && operation != opRepair)
+              {
+                cerr << "Cannot repair files in place unless verifying or repairing." << endl;
+                return false;
+              }
+              inplace = true;
+              break;
+            }
+
+            if (argv[0] == string("--on-demand"))
+            {
+              if (operation != opVerify && operation != opRepair)
+              {
+                cerr << "Cannot load recovery volumes on demand unless verifying or repairing." << endl;
+                return false;
+              }
+              ondemand = true;
+              break;
+            }
+
+            if (argv[0] == string("--mmap"))
+            {
+              if (operation != opVerify && operation != opRepair)
+              {
+                cerr << "Cannot scan data files through a memory mapping unless verifying or repairing." << endl;
+                return false;
+              }
+              mapfiles = true;
+              break;
+            }
+
+            if (argv[0] == string("--packet-index") || argv[0] == string("--rebuild-packet-index"))
+            {
+              if (operation != opVerify && operation != opRepair)
+              {
+                cerr << "Cannot use a packet index unless verifying or repairing." << endl;
+                return false;
+              }
+              if (argv[0] == string("--packet-index"))
+                packetindex = true;
+              else
+                rebuildpacketindex = true;
+              break;
+            }
+
+            if (argv[0] == string("--checkpoint"))
+            {
+              if (operation != opCreate && operation != opRepair)
+              {
+                cerr << "Cannot save checkpoints unless creating or repairing." << endl;
+                return false;
+              }
+              checkpoint = true;
+              break;
+            }
+
 	    if (argv[0] != string("--")) {
               cerr << "Unknown option: " << argv[0] << endl;
 	      cerr << "  (Options must appear after create, repair or verify.)" << endl;
@@ -930,6 +1058,57 @@ bool CommandLine::CheckValuesAndSetDefaults() {
     return false;
   }
 
+  // A file repaired in place is put back as it was if the repair is
+  // interrupted, so there would be nothing to resume
+  if (checkpoint && inplace)
+  {
+    cerr << "Cannot save checkpoints when repairing files in place." << endl;
+    return false;
+  }
+
+  // If we are extending, the recovery set lists the source files
+  if (operation == opExtend)
+  {
+    if (version != verPar2)
+    {
+      cerr << "Only PAR2 recovery sets can be extended." << endl;
+      return false;
+    }
+
+    if (rawfilenames.size() > 0)
+    {
+      cerr << "Cannot specify files when extending." << endl;
+      return false;
+    }
+
+    if ((recoveryblockcountset && recoveryblockcount == 0) ||
+        (redundancyset && redundancy == 0))
+    {
+      cerr << "Cannot extend a recovery set by 0 recovery blocks." << endl;
+      return false;
+    }
+
+    // If no recovery file size scheme is specified then use Variable
+    if (recoveryfilescheme == scUnknown)
+    {
+      recoveryfilescheme = scVariable;
+    }
+
+    // Assume a redundancy of 5% if neither redundancy or recoveryblockcount were set.
+    if (!redundancyset && !recoveryblockcountset)
+    {
+      redundancy = 5;
+      redundancyset = true;
+    }
+  }
+
+  // If we are updating, the files default to those in the recovery set
+  if (operation == opUpdate && version != verPar2)
+  {
+    cerr << "Only PAR2 recovery sets can be updated." << endl;
+    return false;
+  }
+
 
   // Default noise level
   if (noiselevel == nlUnknown)
@@ -1042,7 +1221,7 @@ bool CommandLine::CheckValuesAndSetDefaults() {
 
   // operation should always be set, but let's be thorough.
   if (operation == opNone) {
-    cerr << "ERROR: No operation was specified (create, repair, or verify)" << endl;
+    cerr << "ERROR: No operation was specified (create, repair, verify, extend or update)" << endl;
     return false;
   }
 
@@ -73,7 +73,9 @@ public:
     opNone = 0,
     opCreate,        // Create new PAR2 recovery volumes
     opVerify,        // Verify but don't repair damaged data files
-    opRepair         // Verify and if possible repair damaged data files
+    opRepair,        // Verify and if possible repair damaged data files
+    opExtend,        // Add PAR2 recovery volumes to an existing set
+    opUpdate         // Update an existing PAR2 set for changes to its files
   } Operation;
 
   typedef enum
@@ -91,6 +93,7 @@ public:
   u32                    GetFirstRecoveryBlock(void) const {return firstblock;}
   u32                    GetRecoveryFileCount(void) const  {return recoveryfilecount;}
   u32                    GetRecoveryBlockCount(void) const {return recoveryblockcount;}
+  u32                    GetRedundancy(void) const         {return redundancy;}
   Scheme    GetRecoveryFileScheme(void) const {return recoveryfilescheme;}
   size_t                 GetMemoryLimit(void) const        {return memorylimit;}
   NoiseLevel GetNoiseLevel(void) const        {return noiselevel;}
@@ -106,6 +109,14 @@ public:
 #ifdef _OPENMP
   u32                          GetFileThreads(void) {return filethreads;}
 #endif
+  u32                          GetReadDepth(void) const {return readdepth;}
+  bool                         GetDirectIO(void) const {return directio;}
+  bool                         GetInPlace(void) const {return inplace;}
+  bool                         GetOnDemand(void) const {return ondemand;}
+  bool                         GetMapFiles(void) const {return mapfiles;}
+  bool                         GetPacketIndex(void) const {return packetindex;}
+  bool                         GetRebuildPacketIndex(void) const {return rebuildpacketindex;}
+  bool                         GetCheckpoint(void) const {return checkpoint;}
 
 
   static bool ComputeRecoveryBlockCount(u32 *recoveryblockcount,
@@ -155,6 +166,14 @@ protected:
 #endif
   // NOTE: using the "-t" option to set the number of threads does not
   // end up here, but results in a direct call to "omp_set_num_threads"
+  u32 readdepth;        // Number of block reads to keep in flight
+  bool directio;        // Read source files without using the OS file cache
+  bool inplace;         // Repair damaged files without rebuilding them
+  bool ondemand;        // Only load the recovery volumes that a repair needs
+  bool mapfiles;        // Scan data files through a memory mapping
+  bool packetindex;     // Use and update the index of where the packets are
+  bool rebuildpacketindex; // Replace the packet index without using it
+  bool checkpoint;      // Save the progress of a create or repair, so that it can be resumed
 
   string parfilename;          // The name of the PAR2 file to create, or
                                // the name of the first PAR2 file to read
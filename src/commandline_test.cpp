@@ -1761,6 +1761,433 @@ int test12() {
 }
 
 
+// test long options
+int test13() {
+  // create input file, in case it is read.
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test13 input1.txt\n";
+  input1.close();
+
+  int argc_for_iodepth = 5;
+  const char *argv_for_iodepth[5] = {"par2", "create", "--io-depth=12", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_iodepth;
+  if (!commandline_for_iodepth.Parse(argc_for_iodepth, argv_for_iodepth)) {
+    cout << "CommandLine failed for --io-depth" << endl;
+    return 1;
+  }
+  if (commandline_for_iodepth.GetReadDepth() != 12) {
+    cout << "--io-depth was not set: " << commandline_for_iodepth.GetReadDepth() << endl;
+    return 1;
+  }
+
+  int argc_for_badiodepth = 5;
+  const char *argv_for_badiodepth[5] = {"par2", "create", "--io-depth=x", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_badiodepth;
+  if (commandline_for_badiodepth.Parse(argc_for_badiodepth, argv_for_badiodepth)) {
+    cout << "CommandLine accepted an invalid --io-depth" << endl;
+    return 1;
+  }
+
+  if (commandline_for_iodepth.GetDirectIO()) {
+    cout << "--direct-io should default to off" << endl;
+    return 1;
+  }
+
+  int argc_for_directio = 5;
+  const char *argv_for_directio[5] = {"par2", "create", "--direct-io", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_directio;
+  if (!commandline_for_directio.Parse(argc_for_directio, argv_for_directio)) {
+    cout << "CommandLine failed for --direct-io" << endl;
+    return 1;
+  }
+  if (!commandline_for_directio.GetDirectIO()) {
+    cout << "--direct-io was not set" << endl;
+    return 1;
+  }
+  if (commandline_for_directio.GetInPlace()) {
+    cout << "--in-place should default to off" << endl;
+    return 1;
+  }
+
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test13 foo.par2\n";
+  par2file.close();
+
+  int argc_for_inplace = 4;
+  const char *argv_for_inplace[4] = {"par2", "repair", "--in-place", "foo.par2"};
+  CommandLine commandline_for_inplace;
+  if (!commandline_for_inplace.Parse(argc_for_inplace, argv_for_inplace)) {
+    cout << "CommandLine failed for --in-place" << endl;
+    return 1;
+  }
+  if (!commandline_for_inplace.GetInPlace()) {
+    cout << "--in-place was not set" << endl;
+    return 1;
+  }
+
+  int argc_for_create = 5;
+  const char *argv_for_create[5] = {"par2", "create", "--in-place", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_create;
+  if (commandline_for_create.Parse(argc_for_create, argv_for_create)) {
+    cout << "CommandLine accepted --in-place for create" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
+// test the extend operation
+int test14() {
+  // the PAR2 file must exist when extending
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test14 foo.par2\n";
+  par2file.close();
+
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test14 input1.txt\n";
+  input1.close();
+
+  int argc_for_count = 4;
+  const char *argv_for_count[4] = {"par2", "extend", "-c10", "foo.par2"};
+  CommandLine commandline_for_count;
+  if (!commandline_for_count.Parse(argc_for_count, argv_for_count)) {
+    cout << "CommandLine failed for extend -c10" << endl;
+    return 1;
+  }
+  if (commandline_for_count.GetOperation() != CommandLine::opExtend) {
+    cout << "extend did not set the operation" << endl;
+    return 1;
+  }
+  if (commandline_for_count.GetRecoveryBlockCount() != 10) {
+    cout << "extend -c10 did not set the recovery block count: " << commandline_for_count.GetRecoveryBlockCount() << endl;
+    return 1;
+  }
+
+  int argc_for_default = 3;
+  const char *argv_for_default[3] = {"par2", "e", "foo.par2"};
+  CommandLine commandline_for_default;
+  if (!commandline_for_default.Parse(argc_for_default, argv_for_default)) {
+    cout << "CommandLine failed for e" << endl;
+    return 1;
+  }
+  if (commandline_for_default.GetRedundancy() != 5
+      || commandline_for_default.GetRecoveryBlockCount() != 0
+      || commandline_for_default.GetRecoveryFileScheme() != scVariable) {
+    cout << "extend did not default to 5% redundancy" << endl;
+    return 1;
+  }
+
+  int argc_for_blocksize = 4;
+  const char *argv_for_blocksize[4] = {"par2", "extend", "-s1024", "foo.par2"};
+  CommandLine commandline_for_blocksize;
+  if (commandline_for_blocksize.Parse(argc_for_blocksize, argv_for_blocksize)) {
+    cout << "CommandLine accepted a block size for extend" << endl;
+    return 1;
+  }
+
+  int argc_for_files = 4;
+  const char *argv_for_files[4] = {"par2", "extend", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_files;
+  if (commandline_for_files.Parse(argc_for_files, argv_for_files)) {
+    cout << "CommandLine accepted files for extend" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
+int test15() {
+  // the PAR2 file must exist when updating
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test15 foo.par2\n";
+  par2file.close();
+
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test15 input1.txt\n";
+  input1.close();
+
+  int argc_for_set = 3;
+  const char *argv_for_set[3] = {"par2", "update", "foo.par2"};
+  CommandLine commandline_for_set;
+  if (!commandline_for_set.Parse(argc_for_set, argv_for_set)) {
+    cout << "CommandLine failed for update" << endl;
+    return 1;
+  }
+  if (commandline_for_set.GetOperation() != CommandLine::opUpdate) {
+    cout << "update did not set the operation" << endl;
+    return 1;
+  }
+  if (commandline_for_set.GetExtraFiles().size() != 0) {
+    cout << "update without files had files" << endl;
+    return 1;
+  }
+
+  int argc_for_files = 4;
+  const char *argv_for_files[4] = {"par2", "u", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_files;
+  if (!commandline_for_files.Parse(argc_for_files, argv_for_files)) {
+    cout << "CommandLine failed for u with files" << endl;
+    return 1;
+  }
+  if (commandline_for_files.GetExtraFiles().size() != 1) {
+    cout << "update did not keep its files" << endl;
+    return 1;
+  }
+
+  int argc_for_count = 4;
+  const char *argv_for_count[4] = {"par2", "update", "-c10", "foo.par2"};
+  CommandLine commandline_for_count;
+  if (commandline_for_count.Parse(argc_for_count, argv_for_count)) {
+    cout << "CommandLine accepted a recovery block count for update" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
+int test16() {
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test16 input1.txt\n";
+  input1.close();
+
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test16 foo.par2\n";
+  par2file.close();
+
+  int argc_for_create = 5;
+  const char *argv_for_create[5] = {"par2", "create", "--checkpoint", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_create;
+  if (!commandline_for_create.Parse(argc_for_create, argv_for_create)) {
+    cout << "CommandLine failed for --checkpoint" << endl;
+    return 1;
+  }
+  if (!commandline_for_create.GetCheckpoint()) {
+    cout << "--checkpoint was not set" << endl;
+    return 1;
+  }
+
+  int argc_for_default = 4;
+  const char *argv_for_default[4] = {"par2", "create", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_default;
+  if (!commandline_for_default.Parse(argc_for_default, argv_for_default)) {
+    cout << "CommandLine failed for create" << endl;
+    return 1;
+  }
+  if (commandline_for_default.GetCheckpoint()) {
+    cout << "checkpoints were on by default" << endl;
+    return 1;
+  }
+
+  int argc_for_repair = 4;
+  const char *argv_for_repair[4] = {"par2", "repair", "--checkpoint", "foo.par2"};
+  CommandLine commandline_for_repair;
+  if (!commandline_for_repair.Parse(argc_for_repair, argv_for_repair)) {
+    cout << "CommandLine failed for --checkpoint with repair" << endl;
+    return 1;
+  }
+  if (!commandline_for_repair.GetCheckpoint()) {
+    cout << "--checkpoint was not set for repair" << endl;
+    return 1;
+  }
+
+  int argc_for_verify = 4;
+  const char *argv_for_verify[4] = {"par2", "verify", "--checkpoint", "foo.par2"};
+  CommandLine commandline_for_verify;
+  if (commandline_for_verify.Parse(argc_for_verify, argv_for_verify)) {
+    cout << "CommandLine accepted --checkpoint for verify" << endl;
+    return 1;
+  }
+
+  int argc_for_inplace = 5;
+  const char *argv_for_inplace[5] = {"par2", "repair", "--checkpoint", "--in-place", "foo.par2"};
+  CommandLine commandline_for_inplace;
+  if (commandline_for_inplace.Parse(argc_for_inplace, argv_for_inplace)) {
+    cout << "CommandLine accepted --checkpoint with --in-place" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
+int test17() {
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test17 foo.par2\n";
+  par2file.close();
+
+  int argc_for_repair = 4;
+  const char *argv_for_repair[4] = {"par2", "repair", "--on-demand", "foo.par2"};
+  CommandLine commandline_for_repair;
+  if (!commandline_for_repair.Parse(argc_for_repair, argv_for_repair)) {
+    cout << "CommandLine failed for --on-demand" << endl;
+    return 1;
+  }
+  if (!commandline_for_repair.GetOnDemand()) {
+    cout << "--on-demand was not set" << endl;
+    return 1;
+  }
+
+  int argc_for_default = 3;
+  const char *argv_for_default[3] = {"par2", "verify", "foo.par2"};
+  CommandLine commandline_for_default;
+  if (!commandline_for_default.Parse(argc_for_default, argv_for_default)) {
+    cout << "CommandLine failed for verify" << endl;
+    return 1;
+  }
+  if (commandline_for_default.GetOnDemand()) {
+    cout << "volumes were loaded on demand by default" << endl;
+    return 1;
+  }
+
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test17 input1.txt\n";
+  input1.close();
+
+  int argc_for_create = 5;
+  const char *argv_for_create[5] = {"par2", "create", "--on-demand", "foo.par2", "input1.txt"};
+  CommandLine commandline_for_create;
+  if (commandline_for_create.Parse(argc_for_create, argv_for_create)) {
+    cout << "CommandLine accepted --on-demand for create" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
+int test18() {
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test18 foo.par2\n";
+  par2file.close();
+
+  int argc_for_verify = 4;
+  const char *argv_for_verify[4] = {"par2", "verify", "--packet-index", "foo.par2"};
+  CommandLine commandline_for_verify;
+  if (!commandline_for_verify.Parse(argc_for_verify, argv_for_verify)) {
+    cout << "CommandLine failed for --packet-index" << endl;
+    return 1;
+  }
+  if (!commandline_for_verify.GetPacketIndex() || commandline_for_verify.GetRebuildPacketIndex()) {
+    cout << "--packet-index was not set" << endl;
+    return 1;
+  }
+
+  int argc_for_rebuild = 4;
+  const char *argv_for_rebuild[4] = {"par2", "repair", "--rebuild-packet-index", "foo.par2"};
+  CommandLine commandline_for_rebuild;
+  if (!commandline_for_rebuild.Parse(argc_for_rebuild, argv_for_rebuild)) {
+    cout << "CommandLine failed for --rebuild-packet-index" << endl;
+    return 1;
+  }
+  if (commandline_for_rebuild.GetPacketIndex() || !commandline_for_rebuild.GetRebuildPacketIndex()) {
+    cout << "--rebuild-packet-index was not set" << endl;
+    return 1;
+  }
+
+  int argc_for_default = 3;
+  const char *argv_for_default[3] = {"par2", "verify", "foo.par2"};
+  CommandLine commandline_for_default;
+  if (!commandline_for_default.Parse(argc_for_default, argv_for_default)) {
+    cout << "CommandLine failed for verify" << endl;
+    return 1;
+  }
+  if (commandline_for_default.GetPacketIndex() || commandline_for_default.GetRebuildPacketIndex()) {
+    cout << "the packet index was used by default" << endl;
+    return 1;
+  }
+
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test18 input1.txt\n";
+  input1.close();
+
+  int argc_for_create = 5;
+  const char *argv_for_create[5] = {"par2", "create", "--packet-index", "bar.par2", "input1.txt"};
+  CommandLine commandline_for_create;
+  if (commandline_for_create.Parse(argc_for_create, argv_for_create)) {
+    cout << "CommandLine accepted --packet-index for create" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
+int test19() {
+  ofstream par2file;
+  par2file.open("foo.par2");
+  par2file << "commandline_test test19 foo.par2\n";
+  par2file.close();
+
+  int argc_for_verify = 4;
+  const char *argv_for_verify[4] = {"par2", "verify", "--mmap", "foo.par2"};
+  CommandLine commandline_for_verify;
+  if (!commandline_for_verify.Parse(argc_for_verify, argv_for_verify)) {
+    cout << "CommandLine failed for --mmap" << endl;
+    return 1;
+  }
+  if (!commandline_for_verify.GetMapFiles()) {
+    cout << "--mmap was not set" << endl;
+    return 1;
+  }
+
+  int argc_for_default = 3;
+  const char *argv_for_default[3] = {"par2", "repair", "foo.par2"};
+  CommandLine commandline_for_default;
+  if (!commandline_for_default.Parse(argc_for_default, argv_for_default)) {
+    cout << "CommandLine failed for repair" << endl;
+    return 1;
+  }
+  if (commandline_for_default.GetMapFiles()) {
+    cout << "data files were mapped by default" << endl;
+    return 1;
+  }
+
+  ofstream input1;
+  input1.open("input1.txt");
+  input1 << "commandline_test test19 input1.txt\n";
+  input1.close();
+
+  int argc_for_create = 5;
+  const char *argv_for_create[5] = {"par2", "create", "--mmap", "bar.par2", "input1.txt"};
+  CommandLine commandline_for_create;
+  if (commandline_for_create.Parse(argc_for_create, argv_for_create)) {
+    cout << "CommandLine accepted --mmap for create" << endl;
+    return 1;
+  }
+
+  remove("input1.txt");
+  remove("foo.par2");
+  return 0;
+}
+
+
 int main() {
   cout << "Tests 1 through 4 were moved to libpar2_test." << endl;
 
@@ -1798,6 +2225,34 @@ int main() {
     cerr << "FAILED: test12" << endl;
     return 1;
   }
+  if (test13()) {
+    cerr << "FAILED: test13" << endl;
+    return 1;
+  }
+  if (test14()) {
+    cerr << "FAILED: test14" << endl;
+    return 1;
+  }
+  if (test15()) {
+    cerr << "FAILED: test15" << endl;
+    return 1;
+  }
+  if (test16()) {
+    cerr << "FAILED: test16" << endl;
+    return 1;
+  }
+  if (test17()) {
+    cerr << "FAILED: test17" << endl;
+    return 1;
+  }
+  if (test18()) {
+    cerr << "FAILED: test18" << endl;
+    return 1;
+  }
+  if (test19()) {
+    cerr << "FAILED: test19" << endl;
+    return 1;
+  }
 
   cout << "SUCCESS: commandline_test complete." << endl;
 
@@ -48,35 +48,52 @@ bool DataBlock::ReadData(u64    position, // Position within the block
 {
   assert(diskfile != 0);
 
+  // Compute the file offset and how much data to physically read from disk
+  u64    fileoffset;
+  size_t want = ReadExtent(position, size, fileoffset);
+
+  if (want > 0)
+  {
+    // Read the data from the file into the buffer
+    if (!diskfile->Read(fileoffset, buffer, want))
+      return false;
+  }
+
+  // If the read extends beyond the end of the data block,
+  // then the rest of the buffer is zeroed.
+  if (want < size)
+  {
+    memset(&((u8*)buffer)[want], 0, size-want);
+  }
+
+  return true;
+}
+
+// Work out the file offset of some data at a specified position within a
+// data block, and how much of it can be physically read from disk
+
+size_t DataBlock::ReadExtent(u64    position,   // Position within the block
+                             size_t size,       // Size of the memory buffer
+                             u64   &fileoffset) // File offset of the data
+const
+{
+  assert(diskfile != 0);
+
+  fileoffset = offset + position;
+
   // Check to see if the position from which data is to be read
   // is within the bounds of the data block
   if (length > position)
   {
-    // Compute the file offset and how much data to physically read from disk
-    u64    fileoffset = offset + position;
-    size_t want       = (size_t)min(
+    return (size_t)min(
         min((u64)size, length - position),
         diskfile->FileSize() - fileoffset
     );
-
-    // Read the data from the file into the buffer
-    if (!diskfile->Read(fileoffset, buffer, want))
-      return false;
-
-    // If the read extends beyond the end of the data block,
-    // then the rest of the buffer is zeroed.
-    if (want < size)
-    {
-      memset(&((u8*)buffer)[want], 0, size-want);
-    }
   }
   else
   {
-    // Zero the whole buffer
-    memset(buffer, 0, size);
+    return 0;
   }
-
-  return true;
 }
 
 // Write some data at a specified position within a datablock
@@ -108,3 +125,30 @@ bool DataBlock::WriteData(u64         position, // Position within the block
 
   return true;
 }
+
+// Queue a write of some data at a specified position within a datablock,
+// to be issued when the WriteCoalescer is flushed
+
+void DataBlock::WriteData(u64             position, // Position within the block
+                          size_t          size,     // Size of the memory buffer
+                          const void     *buffer,   // Pointer to memory buffer
+                          size_t         &wrote,    // Amount that will be written
+                          WriteCoalescer &writer)   // Where to queue the write
+{
+  assert(diskfile != 0);
+
+  wrote = 0;
+
+  // Check to see if the position from which data is to be written
+  // is within the bounds of the data block
+  if (length > position)
+  {
+    // Compute the file offset and how much data to physically write to disk
+    u64    fileoffset = offset + position;
+    size_t have       = (size_t)min((u64)size, length - position);
+
+    writer.Add(diskfile, fileoffset, buffer, have);
+
+    wrote = have;
+  }
+}
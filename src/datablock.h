@@ -65,9 +65,17 @@ public:
   // Read some of the data from disk into memory.
   bool ReadData(u64 position, size_t size, void *buffer);
 
+  // Work out where a read of some of the data is located on disk, and how
+  // much of it is actually present (the rest of the buffer must be zeroed).
+  size_t ReadExtent(u64 position, size_t size, u64 &fileoffset) const;
+
   // Write some of the data from memory to disk
   bool WriteData(u64 position, size_t size, const void *buffer, size_t &wrote);
 
+  // Queue a write of some of the data, which is done when the
+  // writer is flushed.  The buffer must not change until then.
+  void WriteData(u64 position, size_t size, const void *buffer, size_t &wrote, WriteCoalescer &writer);
+
 protected:
   DiskFile *diskfile;  // Which disk file is the block associated with
   u64       offset;    // What is the file offset
@@ -33,6 +33,10 @@ static char THIS_FILE[]=__FILE__;
 #define BLKGETSIZE64 DIOCGMEDIASIZE
 #endif
 
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
 
 #ifdef _WIN32
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -51,6 +55,7 @@ DiskFile::DiskFile(std::ostream &sout, std::ostream &serr)
   hFile = INVALID_HANDLE_VALUE;
 
   exists = false;
+  direct = false;
 }
 
 
@@ -214,6 +219,19 @@ bool DiskFile::Write(u64 _offset, const void *buffer, size_t length, LengthType
   return true;
 }
 
+bool DiskFile::WriteGather(u64 _offset, const void * const *buffers, const size_t *lengths, u32 count)
+{
+  for (u32 i=0; i<count; i++)
+  {
+    if (!Write(_offset, buffers[i], lengths[i]))
+      return false;
+
+    _offset += lengths[i];
+  }
+
+  return true;
+}
+
 // Open the file
 
 bool DiskFile::Open(const string &_filename, u64 _filesize)
@@ -246,6 +264,83 @@ bool DiskFile::Open(const string &_filename, u64 _filesize)
   return true;
 }
 
+bool DiskFile::OpenForWrite(void)
+{
+  assert(hFile == INVALID_HANDLE_VALUE);
+
+  filesize = GetFileSize(filename);
+
+  hFile = ::CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+  {
+    DWORD error = ::GetLastError();
+
+    *serr << "Could not open \"" << filename << "\" for writing: " << ErrorMessage(error) << endl;
+
+    return false;
+  }
+
+  offset = 0;
+  exists = true;
+
+  return true;
+}
+
+bool DiskFile::OpenForWrite(const string &_filename)
+{
+  filename = _filename;
+
+  return OpenForWrite();
+}
+
+bool DiskFile::SetFileSize(u64 _filesize)
+{
+  assert(hFile != INVALID_HANDLE_VALUE);
+
+  LONG* ptrfilesize = (LONG*)&_filesize;
+  LONG lowoffset = ptrfilesize[0];
+  LONG highoffset = ptrfilesize[1];
+
+  if (INVALID_SET_FILE_POINTER == SetFilePointer(hFile, lowoffset, &highoffset, FILE_BEGIN) ||
+      !::SetEndOfFile(hFile))
+  {
+    DWORD error = ::GetLastError();
+
+    *serr << "Could not set size of \"" << filename << "\": " << ErrorMessage(error) << endl;
+
+    return false;
+  }
+
+  offset = _filesize;
+  filesize = _filesize;
+
+  return true;
+}
+
+bool DiskFile::Flush(void)
+{
+  assert(hFile != INVALID_HANDLE_VALUE);
+
+  if (!::FlushFileBuffers(hFile))
+  {
+    DWORD error = ::GetLastError();
+
+    *serr << "Could not flush \"" << filename << "\" to disk: " << ErrorMessage(error) << endl;
+
+    return false;
+  }
+
+  return true;
+}
+
+// Unbuffered reads (FILE_FLAG_NO_BUFFERING) are not used on Windows,
+// so the file is just opened normally.
+
+bool DiskFile::OpenDirect(void)
+{
+  return Open();
+}
+
 // Read some data from disk
 
 bool DiskFile::Read(u64 _offset, void *buffer, size_t length, LengthType maxlength)
@@ -313,6 +408,24 @@ void DiskFile::Close(void)
   }
 }
 
+// Read ahead and cache eviction are left to Windows
+
+void DiskFile::AdviseSequential(void)
+{
+}
+
+void DiskFile::AdviseRandom(void)
+{
+}
+
+void DiskFile::Prefetch(u64 _offset, u64 length)
+{
+}
+
+void DiskFile::Discard(u64 _offset, u64 length)
+{
+}
+
 string DiskFile::GetCanonicalPathname(string filename)
 {
   char fullname[MAX_PATH];
@@ -430,12 +543,80 @@ u64 DiskFile::GetFileSize(string filename)
   }
 }
 
+u64 DiskFile::GetModifiedTime(string filename)
+{
+  struct _stati64 st;
+  if (0 == _stati64(filename.c_str(), &st))
+  {
+    return st.st_mtime;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
 bool DiskFile::FileExists(string filename)
 {
   struct _stati64 st;
   return ((0 == _stati64(filename.c_str(), &st)) && (0 != (st.st_mode & S_IFREG)));
 }
 
+u64 DiskFile::CopyFrom(DiskFile &source, u64 sourceoffset, u64 _offset, u64 length)
+{
+  return 0;
+}
+
+u64 DiskFile::GetDeviceId(string filename)
+{
+  // For a local file, this is the drive number
+  struct _stati64 st;
+  if (0 == _stati64(filename.c_str(), &st))
+  {
+    return st.st_dev;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+u64 DiskFile::GetFileIndex(string filename)
+{
+  // stat() does not give a file index on Windows, so it is asked for
+  // from an open handle
+  HANDLE hFile = ::CreateFileA(filename.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return 0;
+
+  u64 index = 0;
+  BY_HANDLE_FILE_INFORMATION information;
+  if (::GetFileInformationByHandle(hFile, &information))
+    index = ((u64)information.nFileIndexHigh << 32) | information.nFileIndexLow;
+
+  ::CloseHandle(hFile);
+  return index;
+}
+
+bool DiskFile::IsRotational(string path)
+{
+  // The seek penalty of a drive is not looked up
+  return false;
+}
+
+u64 DiskFile::GetFreeSpace(string path)
+{
+  ULARGE_INTEGER available;
+  if (::GetDiskFreeSpaceExA(path.c_str(), &available, NULL, NULL))
+  {
+    return available.QuadPart;
+  }
+  else
+  {
+    return ~(u64)0;
+  }
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #else // !_WIN32
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -443,7 +624,6 @@ bool DiskFile::FileExists(string filename)
 #ifdef HAVE_FSEEKO
 # define OffsetType off_t
 # define MaxOffset ((off_t)0x7fffffffffffffffULL)
-# define fseek fseeko
 #else
 # if _FILE_OFFSET_BITS == 64
 #  define OffsetType unsigned long long
@@ -454,6 +634,57 @@ bool DiskFile::FileExists(string filename)
 # endif
 #endif
 
+#include <fcntl.h>
+
+#ifndef O_BINARY
+# define O_BINARY 0
+#endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+#ifndef EDQUOT
+# define EDQUOT ENOSPC
+#endif
+
+#ifdef HAVE_SYS_STATVFS_H
+#include <sys/statvfs.h>
+#endif
+#include <sys/resource.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef HAVE_PWRITEV
+#include <sys/uio.h>
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+#endif
+
+// Allocate disk space for the whole of a file. Returns 0 or an errno value.
+static int AllocateFileSpace(int fd, u64 filesize)
+{
+#ifdef HAVE_FALLOCATE
+  int result;
+  do
+  {
+    result = fallocate(fd, 0, 0, (OffsetType)filesize);
+  } while (result < 0 && errno == EINTR);
+
+  if (result == 0)
+    return 0;
+  if (errno != EOPNOTSUPP && errno != ENOSYS)
+    return errno;
+#endif
+
+#ifdef HAVE_POSIX_FALLOCATE
+  return posix_fallocate(fd, 0, (OffsetType)filesize);
+#else
+  return EOPNOTSUPP;
+#endif
+}
+
 
 DiskFile::DiskFile(std::ostream &sout, std::ostream &serr)
 : sout(&sout)
@@ -461,18 +692,18 @@ DiskFile::DiskFile(std::ostream &sout, std::ostream &serr)
 {
   //filename;
   filesize = 0;
-  offset = 0;
 
-  file = 0;
+  fd = -1;
 
   exists = false;
+  direct = false;
 }
 
 
 DiskFile::~DiskFile(void)
 {
-  if (file != 0)
-    fclose(file);
+  if (fd >= 0)
+    close(fd);
 }
 
 bool DiskFile::CreateParentDirectory(string _pathname)
@@ -504,7 +735,7 @@ bool DiskFile::CreateParentDirectory(string _pathname)
 // space on disk for it.
 bool DiskFile::Create(string _filename, u64 _filesize)
 {
-  assert(file == 0);
+  assert(fd < 0);
 
   filename = _filename;
   filesize = _filesize;
@@ -520,72 +751,75 @@ bool DiskFile::Create(string _filename, u64 _filesize)
     return false;
   }
 
-  file = fopen(_filename.c_str(), "wb");
-  if (file == 0)
+  if (_filesize > (u64)MaxOffset)
+  {
+    *serr << "Requested file size for " << _filename << " is too large." << endl;
+    return false;
+  }
+
+  // The file is opened read/write so that data written during a repair
+  // can be read back through the same handle when it is verified.
+  fd = open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_BINARY | O_CLOEXEC, 0666);
+  if (fd < 0)
   {
     *serr << "Could not create " << _filename << ": " << strerror(errno) << endl;
 
     return false;
   }
 
-  if (_filesize > (u64)MaxOffset)
+  // Allocate the disk space now, so that the file does not become fragmented
+  // when passes write to parts of it in turn, and so that running out of
+  // space is found before any data is processed.
+  int error = _filesize > 0 ? AllocateFileSpace(fd, _filesize) : 0;
+  if (error == ENOSPC || error == EDQUOT || error == EFBIG)
   {
-    *serr << "Requested file size for " << _filename << " is too large." << endl;
+    *serr << "Could not create " << _filename << ": " << strerror(error) << " (" << _filesize << " bytes needed)" << endl;
+
+    close(fd);
+    fd = -1;
+    ::remove(filename.c_str());
     return false;
   }
 
-  if (_filesize > 0)
+  // Where space cannot be allocated, just set the size of the file
+  if (error != 0)
   {
-    if (fseek(file, (OffsetType)_filesize-1, SEEK_SET))
+    u8 zero = 0;
+    ssize_t wrote;
+    do
     {
-      *serr << "Could not set end of file of " << _filename << ": " << strerror(errno) << endl;
+      wrote = pwrite(fd, &zero, 1, (OffsetType)_filesize-1);
+    } while (wrote < 0 && errno == EINTR);
 
-      fclose(file);
-      file = 0;
-      ::remove(filename.c_str());
-      return false;
-    }
-
-    if (1 != fwrite(&_filesize, 1, 1, file))
+    if (wrote != 1)
     {
       *serr << "Could not set end of file of " << _filename << ": " << strerror(errno) << endl;
 
-      fclose(file);
-      file = 0;
+      close(fd);
+      fd = -1;
       ::remove(filename.c_str());
       return false;
     }
   }
 
-  offset = filesize;
-
   exists = true;
   return true;
 }
 
 // Write some data to disk
+// pwrite() is used so that no file position is shared between callers.
 
 bool DiskFile::Write(u64 _offset, const void *buffer, size_t length, LengthType maxlength)
 {
-  assert(file != 0);
+  assert(fd >= 0);
 
-  if (offset != _offset)
+  if (_offset > (u64)MaxOffset || length > (u64)MaxOffset - _offset)
   {
-    if (_offset > (u64)MaxOffset)
-    {
-        *serr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset << endl;
-      return false;
-    }
-
-
-    if (fseek(file, (OffsetType)_offset, SEEK_SET))
-    {
-      *serr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset << ": " << strerror(errno) << endl;
-      return false;
-    }
-    offset = _offset;
+    *serr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset << endl;
+    return false;
   }
 
+  u64 position = _offset;
   while (length > 0) {
 
     LengthType write;
@@ -594,31 +828,105 @@ bool DiskFile::Write(u64 _offset, const void *buffer, size_t length, LengthType
     else
       write = length;
 
-    LengthType wrote = fwrite(buffer, 1, write, file);
-    if (wrote != write)
+    ssize_t wrote = pwrite(fd, buffer, write, (OffsetType)position);
+    if (wrote < 0 && errno == EINTR)
+      continue;
+    if (wrote <= 0)
     {
-      *serr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset << ": " << strerror(errno) << endl;
+      *serr << "Could not write " << (u64)length << " bytes to " << filename << " at offset " << _offset << ": " << strerror(wrote < 0 ? errno : EIO) << endl;
       return false;
     }
 
-    offset += wrote;
+    position += wrote;
     length -= wrote;
     buffer = ((char *) buffer) + wrote;
+  }
 
-    if (filesize < offset)
+  if (filesize < position)
+  {
+    filesize = position;
+  }
+
+  return true;
+}
+
+bool DiskFile::WriteGather(u64 _offset, const void * const *buffers, const size_t *lengths, u32 count)
+{
+#ifdef HAVE_PWRITEV
+  assert(fd >= 0);
+
+  u64 total = 0;
+  for (u32 i=0; i<count; i++)
+    total += lengths[i];
+
+  if (_offset > (u64)MaxOffset || total > (u64)MaxOffset - _offset)
+  {
+    *serr << "Could not write " << total << " bytes to " << filename << " at offset " << _offset << endl;
+    return false;
+  }
+
+  vector<struct iovec> iov(count);
+  for (u32 i=0; i<count; i++)
+  {
+    iov[i].iov_base = (void*)buffers[i];
+    iov[i].iov_len = lengths[i];
+  }
+
+  u64 position = _offset;
+  u32 first = 0;
+  while (first < count)
+  {
+    int batch = (int)min((u32)IOV_MAX, count - first);
+
+    ssize_t wrote = pwritev(fd, &iov[first], batch, (OffsetType)position);
+    if (wrote < 0 && errno == EINTR)
+      continue;
+    if (wrote <= 0)
     {
-      filesize = offset;
+      *serr << "Could not write " << total - (position - _offset) << " bytes to " << filename << " at offset " << position << ": " << strerror(wrote < 0 ? errno : EIO) << endl;
+      return false;
+    }
+
+    position += wrote;
+
+    // Skip over the buffers which have been written, and
+    // adjust the one which was only partly written
+    while (first < count && (size_t)wrote >= iov[first].iov_len)
+    {
+      wrote -= iov[first].iov_len;
+      first++;
+    }
+    if (wrote > 0)
+    {
+      iov[first].iov_base = (char*)iov[first].iov_base + wrote;
+      iov[first].iov_len -= wrote;
     }
   }
 
+  if (filesize < position)
+  {
+    filesize = position;
+  }
+
+  return true;
+#else
+  for (u32 i=0; i<count; i++)
+  {
+    if (!Write(_offset, buffers[i], lengths[i]))
+      return false;
+
+    _offset += lengths[i];
+  }
+
   return true;
+#endif
 }
 
 // Open the file
 
 bool DiskFile::Open(const string &_filename, u64 _filesize)
 {
-  assert(file == 0);
+  assert(fd < 0);
 
   filename = _filename;
   filesize = _filesize;
@@ -629,42 +937,120 @@ bool DiskFile::Open(const string &_filename, u64 _filesize)
     return false;
   }
 
-  file = fopen(filename.c_str(), "rb");
-  if (file == 0)
+  fd = open(filename.c_str(), O_RDONLY | O_BINARY | O_CLOEXEC);
+  if (fd < 0)
   {
     return false;
   }
 
-  offset = 0;
   exists = true;
 
   return true;
 }
 
-// Read some data from disk
+bool DiskFile::OpenForWrite(void)
+{
+  assert(fd < 0);
 
-bool DiskFile::Read(u64 _offset, void *buffer, size_t length, LengthType maxlength)
+  filesize = GetFileSize(filename);
+
+  fd = open(filename.c_str(), O_RDWR | O_BINARY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    *serr << "Could not open " << filename << " for writing: " << strerror(errno) << endl;
+    return false;
+  }
+
+  exists = true;
+
+  return true;
+}
+
+bool DiskFile::OpenForWrite(const string &_filename)
 {
-  assert(file != 0);
+  filename = _filename;
 
-  if (offset != _offset)
+  return OpenForWrite();
+}
+
+bool DiskFile::SetFileSize(u64 _filesize)
+{
+  assert(fd >= 0);
+
+  if (_filesize > (u64)MaxOffset || 0 != ftruncate(fd, (OffsetType)_filesize))
   {
-    if (_offset > (u64)MaxOffset)
-    {
-      *serr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << endl;
-      return false;
-    }
+    *serr << "Could not set size of " << filename << ": " << strerror(_filesize > (u64)MaxOffset ? EFBIG : errno) << endl;
+    return false;
+  }
 
+  filesize = _filesize;
 
-    if (fseek(file, (OffsetType)_offset, SEEK_SET))
-    {
-      *serr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << ": " << strerror(errno) << endl;
-      return false;
-    }
-    offset = _offset;
+  return true;
+}
+
+bool DiskFile::Flush(void)
+{
+  assert(fd >= 0);
+
+  if (0 != fsync(fd))
+  {
+    *serr << "Could not flush " << filename << " to disk: " << strerror(errno) << endl;
+    return false;
   }
 
+  return true;
+}
+
+// Open the file with O_DIRECT, so that reads bypass the page cache.
+
+bool DiskFile::OpenDirect(void)
+{
+#ifdef O_DIRECT
+  assert(fd < 0);
+
+  u64 _filesize = GetFileSize(filename);
+  if (_filesize > (u64)MaxOffset)
+  {
+    *serr << "File size for " << filename << " is too large." << endl;
+    return false;
+  }
+
+  fd = open(filename.c_str(), O_RDONLY | O_BINARY | O_CLOEXEC | O_DIRECT);
+  if (fd >= 0)
+  {
+    filesize = _filesize;
+    exists = true;
+    direct = true;
+
+    return true;
+  }
+
+  // Some filesystems (such as tmpfs) do not support O_DIRECT
+  if (errno != EINVAL)
+    return false;
+#endif
+
+  return Open();
+}
+
+// Read some data from disk
+// pread() does not use or modify the file position, so several threads
+// may read different parts of the file through the same handle.
+
+bool DiskFile::Read(u64 _offset, void *buffer, size_t length, LengthType maxlength)
+{
+  assert(fd >= 0);
+
+  if (_offset > (u64)MaxOffset || length > (u64)MaxOffset - _offset)
+  {
+    *serr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << endl;
+    return false;
+  }
+
+  if (direct)
+    return ReadDirect(_offset, buffer, length);
 
+  u64 position = _offset;
   while (length > 0) {
 
     LengthType want;
@@ -673,16 +1059,19 @@ bool DiskFile::Read(u64 _offset, void *buffer, size_t length, LengthType maxleng
     else
       want = length;
 
-    LengthType got = fread(buffer, 1, want, file);
-    if (got != want)
+    ssize_t got = pread(fd, buffer, want, (OffsetType)position);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
     {
-      // NOTE: This can happen on error or when hitting the end-of-file.
+      // NOTE: got is 0 when hitting the end-of-file.
 
-      *serr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << ": " << strerror(errno) << endl;
+      *serr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << ": " << (got < 0 ? strerror(errno) : "End of file") << endl;
       return false;
     }
 
-    offset += got;
+    // A short read is not an error; continue from where it stopped.
+    position += got;
     length -= got;
     buffer = ((char *) buffer) + got;
 
@@ -692,13 +1081,144 @@ bool DiskFile::Read(u64 _offset, void *buffer, size_t length, LengthType maxleng
   return true;
 }
 
+// The same file may be read from several threads, so each thread keeps
+// its own bounce buffer for unaligned direct reads, which only grows.
+struct DirectBounceBuffer
+{
+  u8 *data;
+  size_t size;
+
+  DirectBounceBuffer(void) : data(0), size(0) {}
+  ~DirectBounceBuffer(void)
+  {
+    if (data)
+      ALIGN_FREE(data);
+  }
+};
+
+static thread_local DirectBounceBuffer directbounce;
+
+// Read from a file opened with O_DIRECT.  The file offset, the length
+// and the memory address must all be aligned, so a request which is not
+// is read in aligned pieces into a bounce buffer and copied from there.
+// Reads of the last part of the file may end early at the end-of-file.
+
+bool DiskFile::ReadDirect(u64 _offset, void *buffer, size_t length)
+{
+  const u64 mask = DIRECT_IO_ALIGNMENT - 1;
+
+  u8 *bounce = 0;
+  size_t bouncesize = 0;
+  if (((_offset | length | (u64)(uintptr_t)buffer) & mask) != 0)
+  {
+    bouncesize = (size_t)((length + 2 * mask) & ~mask);
+    if (bouncesize > DIRECT_IO_BOUNCE_SIZE)
+      bouncesize = DIRECT_IO_BOUNCE_SIZE;
+    if (directbounce.size < bouncesize)
+    {
+      if (directbounce.data)
+        ALIGN_FREE(directbounce.data);
+      ALIGN_ALLOC(directbounce.data, bouncesize, DIRECT_IO_ALIGNMENT);
+      directbounce.size = directbounce.data ? bouncesize : 0;
+      if (!directbounce.data)
+      {
+        *serr << "Could not allocate buffer for reading " << filename << endl;
+        return false;
+      }
+    }
+    bounce = directbounce.data;
+  }
+
+  u64 position = _offset;
+  size_t remaining = length;
+  while (remaining > 0)
+  {
+    ssize_t got;
+    size_t have = 0;
+    if (bounce)
+    {
+      u64 start = position & ~mask;
+      size_t skip = (size_t)(position - start);
+      size_t want = min(remaining, bouncesize - skip);
+      size_t span = (size_t)((skip + want + mask) & ~mask);
+
+      got = pread(fd, bounce, span, (OffsetType)start);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= (ssize_t)skip)
+        got = got < 0 ? got : 0;
+      else
+      {
+        have = min(want, (size_t)got - skip);
+        memcpy(buffer, bounce + skip, have);
+      }
+    }
+    else
+    {
+      got = pread(fd, buffer, remaining, (OffsetType)position);
+      if (got < 0 && errno == EINTR)
+        continue;
+      have = got;
+    }
+
+    if (got <= 0)
+    {
+      *serr << "Could not read " << (u64)length << " bytes from " << filename << " at offset " << _offset << ": " << (got < 0 ? strerror(errno) : "End of file") << endl;
+      return false;
+    }
+
+    position += have;
+    remaining -= have;
+    buffer = ((char *) buffer) + have;
+  }
+
+  return true;
+}
+
 void DiskFile::Close(void)
 {
-  if (file != 0)
+  if (fd >= 0)
   {
-    fclose(file);
-    file = 0;
+    close(fd);
+    fd = -1;
   }
+  direct = false;
+}
+
+// The whole file will be read in order, so the kernel can read ahead further
+void DiskFile::AdviseSequential(void)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (fd >= 0 && !direct)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+// Reads will jump about the file, so kernel read ahead would be wasted
+void DiskFile::AdviseRandom(void)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (fd >= 0 && !direct)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+}
+
+// Start reading part of the file into the page cache
+void DiskFile::Prefetch(u64 _offset, u64 length)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (fd >= 0 && !direct && length > 0)
+    posix_fadvise(fd, (OffsetType)_offset, (OffsetType)length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+// Part of the file will not be needed again, so it can be dropped from the page cache
+void DiskFile::Discard(u64 _offset, u64 length)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (fd >= 0 && !direct && length > 0)
+    posix_fadvise(fd, (OffsetType)_offset, (OffsetType)length, POSIX_FADV_DONTNEED);
+#endif
 }
 
 // Attempt to get the full pathname of the file
@@ -914,11 +1434,137 @@ u64 DiskFile::GetFileSize(string filename)
   }
 }
 
+u64 DiskFile::GetModifiedTime(string filename)
+{
+  struct stat st;
+  if (0 == stat(filename.c_str(), &st))
+  {
+    return st.st_mtime;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
 bool DiskFile::FileExists(string filename)
 {
   struct stat st;
   return ((0 == stat(filename.c_str(), &st)) && (0 != (st.st_mode & S_IFREG)));
 }
+
+u64 DiskFile::CopyFrom(DiskFile &source, u64 sourceoffset, u64 _offset, u64 length)
+{
+  assert(fd >= 0 && source.fd >= 0);
+
+  if (sourceoffset > (u64)MaxOffset || _offset > (u64)MaxOffset ||
+      length > (u64)MaxOffset - sourceoffset || length > (u64)MaxOffset - _offset)
+    return 0;
+
+  u64 copied = 0;
+
+#ifdef FICLONERANGE
+  // Share the disk blocks.  This only works for whole filesystem blocks,
+  // and only on filesystems such as btrfs and XFS.
+  struct file_clone_range clone;
+  clone.src_fd = source.fd;
+  clone.src_offset = sourceoffset;
+  clone.src_length = length;
+  clone.dest_offset = _offset;
+  if (0 == ioctl(fd, FICLONERANGE, &clone))
+    copied = length;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  // Copy within the kernel
+  while (copied < length)
+  {
+    loff_t in = (loff_t)(sourceoffset + copied);
+    loff_t out = (loff_t)(_offset + copied);
+    ssize_t result = copy_file_range(source.fd, &in, fd, &out, (size_t)min(length - copied, (u64)MAX_LENGTH), 0);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      break;
+
+    copied += result;
+  }
+#endif
+
+  if (filesize < _offset + copied)
+  {
+    filesize = _offset + copied;
+  }
+
+  return copied;
+}
+
+u64 DiskFile::GetDeviceId(string filename)
+{
+  struct stat st;
+  if (0 == stat(filename.c_str(), &st))
+  {
+    return st.st_dev;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+u64 DiskFile::GetFileIndex(string filename)
+{
+  struct stat st;
+  if (0 == stat(filename.c_str(), &st))
+  {
+    return st.st_ino;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+bool DiskFile::IsRotational(string path)
+{
+#ifdef __linux__
+  struct stat st;
+  if (0 == stat(path.c_str(), &st))
+  {
+    // The device of a partition has no queue of its own, so
+    // look at the disk which the partition is part of
+    char name[64];
+    snprintf(name, sizeof(name), "/sys/dev/block/%u:%u", (unsigned int)major(st.st_dev), (unsigned int)minor(st.st_dev));
+
+    const char *queues[] = {"/queue/rotational", "/../queue/rotational"};
+    for (unsigned int i=0; i<sizeof(queues)/sizeof(queues[0]); i++)
+    {
+      FILE *f = fopen((string(name) + queues[i]).c_str(), "r");
+      if (f)
+      {
+        int rotational = fgetc(f);
+        fclose(f);
+        return rotational == '1';
+      }
+    }
+  }
+#endif
+
+  return false;
+}
+
+u64 DiskFile::GetFreeSpace(string path)
+{
+#ifdef HAVE_SYS_STATVFS_H
+  struct statvfs st;
+  if (0 == statvfs(path.c_str(), &st))
+  {
+    return (u64)st.f_bavail * st.f_frsize;
+  }
+#endif
+
+  return ~(u64)0;
+}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #endif
 
@@ -941,7 +1587,7 @@ bool DiskFile::Delete(void)
 #ifdef _WIN32
   assert(hFile == INVALID_HANDLE_VALUE);
 #else
-  assert(file == 0);
+  assert(fd < 0);
 #endif
 
   if (filename.size() > 0 && 0 == unlink(filename.c_str()))
@@ -1026,7 +1672,7 @@ bool DiskFile::Rename(string _filename)
 #ifdef _WIN32
   assert(hFile == INVALID_HANDLE_VALUE);
 #else
-  assert(file == 0);
+  assert(fd < 0);
 #endif
 
   if (::rename(filename.c_str(), _filename.c_str()) == 0)
@@ -1043,6 +1689,59 @@ bool DiskFile::Rename(string _filename)
   }
 }
 
+bool DiskFile::Replace(const string &_filename, const void *buffer, size_t length)
+{
+  string name = _filename + ".tmp";
+
+  if (FileExists(name) && 0 != unlink(name.c_str()))
+  {
+    *serr << "Cannot delete " << name << endl;
+
+    return false;
+  }
+
+  bool success = Create(name, length) &&
+                 Write(0, buffer, length) &&
+                 Flush();
+  Close();
+
+#ifdef _WIN32
+  // The old file cannot be replaced while it exists
+  if (success && FileExists(_filename))
+    success = 0 == ::remove(_filename.c_str());
+#endif
+
+  return success && Rename(_filename);
+}
+
+bool DiskFile::DeleteReplaced(const string &_filename)
+{
+  bool success = true;
+
+  string names[] = {_filename, _filename + ".tmp"};
+  for (u32 i=0; i<sizeof(names)/sizeof(names[0]); i++)
+  {
+    if (FileExists(names[i]))
+    {
+      filename = names[i];
+      success = Delete() && success;
+    }
+  }
+
+  return success;
+}
+
+string DiskFile::ReplacedFileName(const string &filename)
+{
+  if (FileExists(filename))
+    return filename;
+
+  if (FileExists(filename + ".tmp"))
+    return filename + ".tmp";
+
+  return string();
+}
+
 #ifdef _WIN32
 string DiskFile::ErrorMessage(DWORD error)
 {
@@ -1133,3 +1832,164 @@ u64 FileSizeCache::get(const string &filename) {
   //  }
   return filesize;
 }
+
+
+FileHandleCache::FileHandleCache(u32 _capacity)
+: capacity(_capacity)
+, entries()
+, idle()
+, hits(0)
+, misses(0)
+, evictions(0)
+{
+  if (capacity == 0)
+  {
+#ifdef _WIN32
+    capacity = 512;
+#else
+    // Leave plenty of descriptors for everything else, such as
+    // the recovery files and the files being repaired
+    capacity = MAX_CACHED_FILES;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+      capacity = (u32)min((rlim_t)MAX_CACHED_FILES, limit.rlim_cur / 2);
+    }
+#endif
+    if (capacity < 16)
+      capacity = 16;
+  }
+}
+
+FileHandleCache::~FileHandleCache(void)
+{
+  Clear();
+}
+
+bool FileHandleCache::Acquire(DiskFile *diskfile, bool direct)
+{
+  map<DiskFile*, Entry>::iterator e = entries.find(diskfile);
+  if (e != entries.end())
+  {
+    hits++;
+
+    // It is no longer idle
+    if (e->second.users++ == 0)
+      idle.erase(e->second.position);
+
+    return true;
+  }
+
+  // Leave files which someone else opened alone
+  if (diskfile->IsOpen())
+    return true;
+
+  misses++;
+
+  // Make room by closing the least recently used files
+  while (entries.size() >= capacity && !idle.empty())
+  {
+    DiskFile *oldest = idle.front();
+    idle.pop_front();
+
+    oldest->Close();
+    entries.erase(oldest);
+    evictions++;
+  }
+
+  if (!(direct ? diskfile->OpenDirect() : diskfile->Open()))
+    return false;
+
+  Entry &entry = entries[diskfile];
+  entry.users = 1;
+
+  return true;
+}
+
+void FileHandleCache::Release(DiskFile *diskfile)
+{
+  map<DiskFile*, Entry>::iterator e = entries.find(diskfile);
+  if (e == entries.end())
+    return;
+
+  assert(e->second.users > 0);
+  if (--e->second.users == 0)
+    e->second.position = idle.insert(idle.end(), diskfile);
+}
+
+void FileHandleCache::Clear(void)
+{
+  for (map<DiskFile*, Entry>::iterator e = entries.begin(); e != entries.end(); ++e)
+  {
+    e->first->Close();
+  }
+  entries.clear();
+  idle.clear();
+}
+
+
+WriteCoalescer::WriteCoalescer(void)
+: writes(0)
+, calls(0)
+{
+}
+
+bool WriteCoalescer::Write::operator<(const Write &other) const
+{
+  if (diskfile != other.diskfile)
+    return std::less<DiskFile*>()(diskfile, other.diskfile);
+
+  return offset < other.offset;
+}
+
+void WriteCoalescer::Add(DiskFile *diskfile, u64 offset, const void *buffer, size_t length)
+{
+  if (length == 0)
+    return;
+
+  Write write = {diskfile, offset, buffer, length};
+  pending.push_back(write);
+
+  writes++;
+}
+
+bool WriteCoalescer::Flush(void)
+{
+  std::stable_sort(pending.begin(), pending.end());
+
+  vector<const void*> buffers;
+  vector<size_t> lengths;
+
+  bool success = true;
+  size_t start = 0;
+  while (success && start < pending.size())
+  {
+    // Find the run of writes which follow on from each other
+    size_t last = start;
+    u64 end = pending[start].offset + pending[start].length;
+    while (last + 1 < pending.size() &&
+           pending[last + 1].diskfile == pending[start].diskfile &&
+           pending[last + 1].offset == end)
+    {
+      last++;
+      end += pending[last].length;
+    }
+
+    buffers.clear();
+    lengths.clear();
+    for (size_t i=start; i<=last; i++)
+    {
+      buffers.push_back(pending[i].buffer);
+      lengths.push_back(pending[i].length);
+    }
+
+    calls++;
+    success = pending[start].diskfile->WriteGather(pending[start].offset, &buffers[0], &lengths[0], (u32)buffers.size());
+
+    start = last + 1;
+  }
+
+  pending.clear();
+
+  return success;
+}
@@ -33,6 +33,13 @@
 #define LengthType size_t
 #endif
 
+// Reads from a file opened with OpenDirect() must start at an offset,
+// and be to a memory address, that is a multiple of this.
+#define DIRECT_IO_ALIGNMENT 4096
+
+// Unaligned direct reads go through a bounce buffer of at most this size.
+#define DIRECT_IO_BOUNCE_SIZE (1048576)
+
 
 #include <list>
 using std::list;
@@ -62,16 +69,46 @@ public:
   bool Write(u64 offset, const void *buffer, size_t length,
 	     LengthType maxlength = MAX_LENGTH);
 
+  // Write several buffers, one after the other, starting at the offset.
+  // Where it is supported, they are written with a single system call.
+  bool WriteGather(u64 offset, const void * const *buffers, const size_t *lengths, u32 count);
+
+  // Copy data from another open file without passing it through memory,
+  // sharing the disk blocks between the files where the filesystem can.
+  // Returns how much was copied, which is 0 where this is not supported.
+  // Anything which was not copied must be read and written instead.
+  u64 CopyFrom(DiskFile &source, u64 sourceoffset, u64 offset, u64 length);
+
   // Open the file
   bool Open(void);
   bool Open(const string &filename);
   bool Open(const string &filename, u64 filesize);
 
+  // Open an existing file so that it can be changed
+  bool OpenForWrite(void);
+  bool OpenForWrite(const string &filename);
+
+  // Change the length of an open file
+  bool SetFileSize(u64 filesize);
+
+  // Make sure that what has been written to the file is on disk
+  bool Flush(void);
+
+  // Open the file for reading without going through the OS file cache.
+  // If the filesystem does not support that, the file is opened normally.
+  bool OpenDirect(void);
+
+  // Was the file opened for direct (uncached) reads
+  bool IsDirect(void) const {return direct;}
+
   // Check to see if the file is open
 #ifdef _WIN32
   bool IsOpen(void) const {return hFile != INVALID_HANDLE_VALUE;}
 #else
-  bool IsOpen(void) const {return file != 0;}
+  bool IsOpen(void) const {return fd >= 0;}
+
+  // The file descriptor, for issuing asynchronous I/O
+  int Descriptor(void) const {return fd;}
 #endif
 
   // Read some data from the file
@@ -79,6 +116,13 @@ public:
   bool Read(u64 offset, void *buffer, size_t length,
 	    LengthType maxlength = MAX_LENGTH);
 
+  // Hints to the OS about how the file is about to be read.
+  // They do nothing where they are not supported.
+  void AdviseSequential(void);
+  void AdviseRandom(void);
+  void Prefetch(u64 offset, u64 length);
+  void Discard(u64 offset, u64 length);
+
   // Close the file
   void Close(void);
 
@@ -98,6 +142,17 @@ public:
   // Delete the file
   bool Delete(void);
 
+  // Files which are only ever replaced as a whole are written in full to
+  // the name with ".tmp" added, which then replaces the file.
+
+  // Write a new file with the specified contents in place of the specified
+  // file.  A new file which was left behind by an earlier replacement
+  // which did not finish is discarded.
+  bool Replace(const string &filename, const void *buffer, size_t length);
+
+  // Delete the specified file, and any new file which was to replace it
+  bool DeleteReplaced(const string &filename);
+
 public:
   static string GetCanonicalPathname(string filename);
 
@@ -113,6 +168,30 @@ public:
   static bool FileExists(string filename);
   static u64 GetFileSize(string filename);
 
+  // The file to read for the specified file which is only ever replaced as
+  // a whole: the file itself, or if it was deleted before the new file
+  // replaced it, the new file.  If there is neither, "" is returned.
+  static string ReplacedFileName(const string &filename);
+
+  // When the file was last changed.  If it cannot be determined, 0 is returned.
+  static u64 GetModifiedTime(string filename);
+
+  // Identifies the device which holds the specified file.  Files on the
+  // same device have the same value.  If it cannot be determined, 0 is returned.
+  static u64 GetDeviceId(string filename);
+
+  // Identifies the specified file on its device (on POSIX systems, its
+  // inode number).  If it cannot be determined, 0 is returned.
+  static u64 GetFileIndex(string filename);
+
+  // Is the specified file or directory on a rotating disk, where seeks
+  // are slow.  If it cannot be determined, false is returned.
+  static bool IsRotational(string path);
+
+  // How much space is free on the disk that holds the specified
+  // directory. If this cannot be determined, ~0 is returned.
+  static u64 GetFreeSpace(string path);
+
   // Search the specified path for files which match the specified wildcard
   // and return their names in a list.
   static std::unique_ptr< list<string> > FindFiles(string path, string wildcard, bool recursive);
@@ -130,19 +209,26 @@ protected:
   // OS file handle
 #ifdef _WIN32
   HANDLE hFile;
-#else
-  FILE *file;
-#endif
 
   // Current offset within the file
   u64    offset;
+#else
+  // Reads and writes are positional (pread/pwrite), so there is no
+  // shared file offset and the descriptor can be used from several threads.
+  int    fd;
+#endif
 
   // Does the file exist
   bool   exists;
 
+  // Was the file opened with OpenDirect()
+  bool   direct;
+
 protected:
 #ifdef _WIN32
   static string ErrorMessage(DWORD error);
+#else
+  bool ReadDirect(u64 offset, void *buffer, size_t length);
 #endif
 };
 
@@ -172,4 +258,94 @@ protected:
   map<string, u64> cache;
 };
 
+// The most files that a FileHandleCache will keep open
+#define MAX_CACHED_FILES 4096
+
+// This class keeps DiskFile objects open after they have been read from,
+// so that files which are read repeatedly (such as in every pass of a
+// create or repair) are not opened and closed each time. The number of
+// open files is limited according to the process's limit on open files,
+// and the least recently used file is closed to make room for another.
+// Files which were already open are left to their owner.
+class FileHandleCache
+{
+public:
+  // A capacity of 0 means one based on the limit on open files
+  FileHandleCache(u32 capacity = 0);
+  ~FileHandleCache(void);
+
+  // Make sure that a file is open, and keep it open at least until
+  // the matching Release()
+  bool Acquire(DiskFile *diskfile, bool direct = false);
+  void Release(DiskFile *diskfile);
+
+  // Close all of the files which were opened by the cache
+  void Clear(void);
+
+  u32 Capacity(void) const {return capacity;}
+
+  // Statistics for how well the cache has worked
+  u64 Hits(void) const {return hits;}
+  u64 Misses(void) const {return misses;}
+  u64 Evictions(void) const {return evictions;}
+
+protected:
+  struct Entry
+  {
+    u32 users;                          // How many Acquire()s are outstanding
+    list<DiskFile*>::iterator position; // Position in idle list, when idle
+  };
+
+  u32 capacity;
+  map<DiskFile*, Entry> entries;  // The files which the cache opened
+  list<DiskFile*> idle;           // Files not in use, least recently used first
+
+  u64 hits;
+  u64 misses;
+  u64 evictions;
+
+private:
+  FileHandleCache(const FileHandleCache &);
+  FileHandleCache& operator=(const FileHandleCache &);
+};
+
+// This class gathers writes to a set of files, so that they can be issued
+// together in order of file and offset.  Writes which are adjacent in a
+// file are combined into a single call.  The buffers which are passed to
+// Add() must not be changed until Flush() has been called.
+class WriteCoalescer
+{
+public:
+  WriteCoalescer(void);
+
+  // Queue a write
+  void Add(DiskFile *diskfile, u64 offset, const void *buffer, size_t length);
+
+  // Issue all of the queued writes
+  bool Flush(void);
+
+  // How many writes are queued
+  size_t Pending(void) const {return pending.size();}
+
+  // How many writes have been added, and how many calls were needed
+  u64 Writes(void) const {return writes;}
+  u64 Calls(void) const {return calls;}
+
+protected:
+  struct Write
+  {
+    DiskFile   *diskfile;
+    u64         offset;
+    const void *buffer;
+    size_t      length;
+
+    bool operator<(const Write &other) const;
+  };
+
+  vector<Write> pending;
+
+  u64 writes;
+  u64 calls;
+};
+
 #endif // __DISKFILE_H__
@@ -730,6 +730,400 @@ int test6() {
 }
 
 
+// Testing concurrent Read() calls through a single handle.
+// Reads are positional, so each thread must get the data
+// at the offset it asked for, regardless of the others.
+int test7() {
+  const size_t block_size = 4096;
+  const int block_count = 64;
+
+  {
+    DiskFile diskfile(cout, cerr);
+    if (!diskfile.Create("input1.txt", block_size * block_count)) {
+      cout << "Create failed!" << endl;
+      return 1;
+    }
+
+    u8 *buffer = new u8[block_size];
+    for (int i = 0; i < block_count; i++) {
+      memset(buffer, i, block_size);
+      if (!diskfile.Write(i * block_size, buffer, block_size)) {
+        cout << "Write failed" << endl;
+        delete [] buffer;
+        return 1;
+      }
+    }
+    delete [] buffer;
+
+    diskfile.Close();
+  }
+
+  DiskFile diskfile(cout, cerr);
+  if (!diskfile.Open("input1.txt")) {
+    cout << "Open failed" << endl;
+    return 1;
+  }
+
+  int failures = 0;
+  #pragma omp parallel for reduction(+:failures)
+  for (int i = 0; i < block_count * 4; i++) {
+    // visit the blocks out of order
+    int block = (i * 37) % block_count;
+    u8 buffer[block_size];
+    if (!diskfile.Read(block * block_size, buffer, block_size, 1000)) {
+      failures++;
+      continue;
+    }
+    for (size_t j = 0; j < block_size; j++) {
+      if (buffer[j] != (u8)block) {
+        failures++;
+        break;
+      }
+    }
+  }
+
+  diskfile.Close();
+  remove("input1.txt");
+
+  if (failures) {
+    cout << "Concurrent reads returned wrong data " << failures << " times" << endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+// Testing Read() on a file opened with OpenDirect().
+// Unaligned offsets, lengths and buffers must all work.
+int test8() {
+  // not a multiple of the alignment, so the last read ends early at EOF
+  const size_t file_size = 3 * DIRECT_IO_ALIGNMENT + 1000;
+
+  u8 *data = new u8[file_size];
+  for (size_t i = 0; i < file_size; i++)
+    data[i] = (u8)(i * 7 + i / 251);
+
+  DiskFile diskfile(cout, cerr);
+  if (!diskfile.Create("input1.txt", file_size)
+      || !diskfile.Write(0, data, file_size)) {
+    cout << "Create failed!" << endl;
+    delete [] data;
+    return 1;
+  }
+  diskfile.Close();
+
+  if (!diskfile.OpenDirect()) {
+    cout << "OpenDirect failed" << endl;
+    delete [] data;
+    return 1;
+  }
+
+  // O_DIRECT is not supported everywhere, in which case the file
+  // is opened normally and this just tests ordinary reads.
+  if (!diskfile.IsDirect())
+    cout << "NOTE: direct I/O is not supported here" << endl;
+
+  const size_t offsets[] = {0, 1, 4095, 4096, 5000, 2 * DIRECT_IO_ALIGNMENT, file_size - 1};
+  const size_t lengths[] = {1, 100, 4096, 8192, 10000};
+
+  u8 *buffer = new u8[file_size + 1];
+  int result = 0;
+  for (size_t o = 0; o < sizeof(offsets)/sizeof(offsets[0]) && !result; o++) {
+    for (size_t l = 0; l < sizeof(lengths)/sizeof(lengths[0]) && !result; l++) {
+      size_t offset = offsets[o];
+      size_t length = min(lengths[l], file_size - offset);
+
+      // read to an unaligned address too
+      u8 *target = buffer + (l & 1);
+      if (!diskfile.Read(offset, target, length)
+	  || memcmp(target, data + offset, length) != 0) {
+	cout << "Direct read of " << length << " bytes at offset " << offset << " failed" << endl;
+	result = 1;
+      }
+    }
+  }
+
+  diskfile.Close();
+  if (diskfile.IsDirect()) {
+    cout << "Close did not reset the direct flag" << endl;
+    result = 1;
+  }
+  remove("input1.txt");
+
+  delete [] buffer;
+  delete [] data;
+
+  return result;
+}
+
+
+// Testing GetFreeSpace() and that Create() makes a file of the right size
+// (which is allocated on disk where the filesystem supports it).
+int test9() {
+  const size_t file_size = 1048576 + 123;
+
+  u64 before = DiskFile::GetFreeSpace("." PATHSEP);
+  if (before == 0 || before == ~(u64)0) {
+    cout << "GetFreeSpace failed: " << before << endl;
+    return 1;
+  }
+
+  DiskFile diskfile(cout, cerr);
+  if (!diskfile.Create("input1.txt", file_size)) {
+    cout << "Create failed!" << endl;
+    return 1;
+  }
+
+  if (DiskFile::GetFileSize("input1.txt") != file_size) {
+    cout << "Create made a file of the wrong size: " << DiskFile::GetFileSize("input1.txt") << endl;
+    diskfile.Close();
+    remove("input1.txt");
+    return 1;
+  }
+
+  u8 *buffer = new u8[file_size];
+  memset(buffer, 0xff, file_size);
+  int result = 0;
+  if (!diskfile.Read(0, buffer, file_size)) {
+    cout << "Read of new file failed" << endl;
+    result = 1;
+  }
+  for (size_t i = 0; i < file_size && !result; i++) {
+    if (buffer[i] != 0) {
+      cout << "New file is not zero filled at offset " << i << endl;
+      result = 1;
+    }
+  }
+  delete [] buffer;
+
+  diskfile.Close();
+  remove("input1.txt");
+
+  return result;
+}
+
+
+// Testing FileHandleCache: files are kept open until the cache is full,
+// then the least recently used idle file is closed.
+int test10() {
+  const char *names[3] = {"input1.txt", "input2.txt", "input3.txt"};
+  for (int i = 0; i < 3; i++) {
+    ofstream out(names[i], std::ofstream::binary);
+    out << names[i];
+  }
+
+  int result = 0;
+  {
+    DiskFile file1(cout, cerr), file2(cout, cerr), file3(cout, cerr), other(cout, cerr);
+    file1.Open(names[0]); file1.Close();
+    file2.Open(names[1]); file2.Close();
+    file3.Open(names[2]); file3.Close();
+
+    FileHandleCache cache(2);
+
+    // miss, hit
+    if (!cache.Acquire(&file1) || !file1.IsOpen()) {
+      cout << "Acquire did not open the file" << endl;
+      result = 1;
+    }
+    cache.Release(&file1);
+    cache.Acquire(&file1);
+    cache.Release(&file1);
+    if (!file1.IsOpen() || cache.Hits() != 1 || cache.Misses() != 1) {
+      cout << "file was not kept open: " << cache.Hits() << " hits" << endl;
+      result = 1;
+    }
+
+    // filling the cache evicts file1, the least recently used
+    cache.Acquire(&file2);
+    cache.Release(&file2);
+    cache.Acquire(&file3);
+    if (file1.IsOpen() || !file2.IsOpen() || !file3.IsOpen() || cache.Evictions() != 1) {
+      cout << "wrong file was closed" << endl;
+      result = 1;
+    }
+
+    // a file in use is not closed, even if the cache is full
+    cache.Acquire(&file1);
+    if (!file3.IsOpen() || file2.IsOpen() || !file1.IsOpen()) {
+      cout << "file in use was closed" << endl;
+      result = 1;
+    }
+    cache.Release(&file1);
+    cache.Release(&file3);
+
+    // files opened elsewhere are left alone
+    other.Open(names[0]);
+    cache.Acquire(&other);
+    cache.Release(&other);
+    cache.Clear();
+    if (!other.IsOpen() || file1.IsOpen() || file3.IsOpen()) {
+      cout << "Clear closed the wrong files" << endl;
+      result = 1;
+    }
+    other.Close();
+  }
+
+  for (int i = 0; i < 3; i++)
+    remove(names[i]);
+
+  return result;
+}
+
+
+// Testing WriteCoalescer: writes queued out of order end up in the
+// right place, and adjacent writes are combined.
+int test11() {
+  const size_t piece = 1000;
+  const int pieces = 8;
+
+  DiskFile file1(cout, cerr), file2(cout, cerr);
+  if (!file1.Create("input1.txt", piece * pieces) || !file2.Create("input2.txt", piece * pieces)) {
+    cout << "Create failed!" << endl;
+    return 1;
+  }
+
+  u8 *buffer = new u8[piece * pieces];
+  for (size_t i = 0; i < piece * pieces; i++)
+    buffer[i] = (u8)(i * 7 + i / 251);
+
+  WriteCoalescer writer;
+  // file1 gets every piece, in reverse order, so they can all be combined
+  for (int i = pieces - 1; i >= 0; i--)
+    writer.Add(&file1, i * piece, buffer + i * piece, piece);
+  // file2 gets every other piece, so none of them can be combined
+  for (int i = 0; i < pieces; i += 2)
+    writer.Add(&file2, i * piece, buffer + i * piece, piece);
+
+  int result = 0;
+  if (writer.Pending() != (size_t)(pieces + pieces / 2)) {
+    cout << "Wrong number of pending writes: " << writer.Pending() << endl;
+    result = 1;
+  }
+  if (!result && !writer.Flush()) {
+    cout << "Flush failed" << endl;
+    result = 1;
+  }
+  if (!result && (writer.Pending() != 0 || writer.Writes() != (u64)(pieces + pieces / 2) || writer.Calls() != 1 + pieces / 2)) {
+    cout << "Writes were not combined as expected: " << writer.Writes() << " writes, " << writer.Calls() << " calls" << endl;
+    result = 1;
+  }
+
+  u8 *check = new u8[piece * pieces];
+  if (!result && (!file1.Read(0, check, piece * pieces) || memcmp(check, buffer, piece * pieces) != 0)) {
+    cout << "Combined writes have the wrong contents" << endl;
+    result = 1;
+  }
+  if (!result && !file2.Read(0, check, piece * pieces)) {
+    cout << "Read of separate writes failed" << endl;
+    result = 1;
+  }
+  for (int i = 0; i < pieces && !result; i++) {
+    bool written = (i % 2 == 0);
+    for (size_t j = 0; j < piece; j++) {
+      if (check[i * piece + j] != (written ? buffer[i * piece + j] : 0)) {
+        cout << "Separate writes have the wrong contents at offset " << i * piece + j << endl;
+        result = 1;
+        break;
+      }
+    }
+  }
+  delete [] check;
+  delete [] buffer;
+
+  file1.Close();
+  file2.Close();
+  remove("input1.txt");
+  remove("input2.txt");
+
+  return result;
+}
+
+
+// Testing GetDeviceId: files in the same directory are on the same device.
+// Testing GetFileIndex: different files have different indexes.
+int test12() {
+  {
+    ofstream out1("input1.txt", std::ofstream::binary);
+    out1 << "input1.txt";
+    ofstream out2("input2.txt", std::ofstream::binary);
+    out2 << "input2.txt";
+  }
+
+  int result = 0;
+  if (DiskFile::GetDeviceId("input1.txt") != DiskFile::GetDeviceId("input2.txt")) {
+    cout << "Files in one directory are on different devices" << endl;
+    result = 1;
+  }
+  if (DiskFile::GetDeviceId("doesnotexist.txt") != 0) {
+    cout << "A missing file has a device" << endl;
+    result = 1;
+  }
+  if (DiskFile::GetFileIndex("input1.txt") == DiskFile::GetFileIndex("input2.txt")) {
+    cout << "Two files have the same index" << endl;
+    result = 1;
+  }
+  if (DiskFile::GetFileIndex("doesnotexist.txt") != 0) {
+    cout << "A missing file has an index" << endl;
+    result = 1;
+  }
+
+  remove("input1.txt");
+  remove("input2.txt");
+
+  return result;
+}
+
+
+// Testing CopyFrom: whatever it reports as copied must be in place.
+// Where copying within the OS is not supported, it copies nothing.
+int test13() {
+  const size_t file_size = 3 * 65536 + 1234;
+
+  u8 *buffer = new u8[file_size];
+  for (size_t i = 0; i < file_size; i++)
+    buffer[i] = (u8)(i * 13 + i / 4099);
+
+  DiskFile source(cout, cerr), target(cout, cerr);
+  if (!source.Create("input1.txt", file_size) || !source.Write(0, buffer, file_size) ||
+      !target.Create("input2.txt", file_size)) {
+    cout << "Create failed!" << endl;
+    delete [] buffer;
+    return 1;
+  }
+
+  int result = 0;
+  u64 copied = target.CopyFrom(source, 100, 4000, file_size - 4000);
+  if (copied > file_size - 4000) {
+    cout << "CopyFrom copied too much: " << copied << endl;
+    result = 1;
+  }
+
+  u8 *check = new u8[file_size];
+  if (!result && !target.Read(0, check, file_size)) {
+    cout << "Read of copy failed" << endl;
+    result = 1;
+  }
+  for (size_t i = 0; i < file_size && !result; i++) {
+    u8 expected = (i >= 4000 && i < 4000 + copied) ? buffer[i - 4000 + 100] : 0;
+    if (check[i] != expected) {
+      cout << "Copy has the wrong contents at offset " << i << endl;
+      result = 1;
+    }
+  }
+  delete [] check;
+  delete [] buffer;
+
+  source.Close();
+  target.Close();
+  remove("input1.txt");
+  remove("input2.txt");
+
+  return result;
+}
+
+
 int main() {
   if (test1()) {
     cerr << "FAILED: test1" << endl;
@@ -755,6 +1149,34 @@ int main() {
     cerr << "FAILED: test6" << endl;
     return 1;
   }
+  if (test7()) {
+    cerr << "FAILED: test7" << endl;
+    return 1;
+  }
+  if (test8()) {
+    cerr << "FAILED: test8" << endl;
+    return 1;
+  }
+  if (test9()) {
+    cerr << "FAILED: test9" << endl;
+    return 1;
+  }
+  if (test10()) {
+    cerr << "FAILED: test10" << endl;
+    return 1;
+  }
+  if (test11()) {
+    cerr << "FAILED: test11" << endl;
+    return 1;
+  }
+  if (test12()) {
+    cerr << "FAILED: test12" << endl;
+    return 1;
+  }
+  if (test13()) {
+    cerr << "FAILED: test13" << endl;
+    return 1;
+  }
 
   cout << "SUCCESS: diskfile_test complete." << endl;
 
@@ -21,6 +21,11 @@
 #include "libpar2internal.h"
 #include "hasher.h"
 
+#if defined(HAVE_SYS_MMAN_H) && !defined(_WIN32)
+#include <sys/mman.h>
+#define USE_SCAN_MAPPING
+#endif
+
 #ifdef _MSC_VER
 #ifdef _DEBUG
 #undef THIS_FILE
@@ -33,29 +38,39 @@ static char THIS_FILE[]=__FILE__;
 
 FileCheckSummer::FileCheckSummer(DiskFile   *_diskfile,
                                  u64         _blocksize,
-                                 const u32 (&_windowtable)[256])
+                                 const u32 (&_windowtable)[256],
+                                 bool        _usemapping)
 : diskfile(_diskfile)
 , blocksize(_blocksize)
 , windowtable(_windowtable)
 , filesize(_diskfile->FileSize())
+, usemapping(_usemapping)
 , currentoffset(0)
 , buffer(0)
 , outpointer(0)
 , inpointer(0)
 , tailpointer(0)
+, heapbuffer(0)
+, mapping(0)
+, mapoffset(0)
+, maplength(0)
 , readoffset(0)
+, discardoffset(0)
 , checksum(0)
 , hasblockhash(false)
 , contextfull()
 , context16k()
 , hasher(NULL)
 {
-  buffer = new char[(size_t)blocksize*2];
 }
 
 FileCheckSummer::~FileCheckSummer(void)
 {
-  delete [] buffer;
+  delete [] heapbuffer;
+#ifdef USE_SCAN_MAPPING
+  if (mapping)
+    munmap(mapping, maplength);
+#endif
   if (hasher)
     hasher->destroy();
 }
@@ -79,7 +94,22 @@ void FileCheckSummer::StopHasher(void)
 // Start reading the file at the beginning
 bool FileCheckSummer::Start(void)
 {
-  currentoffset = readoffset = 0;
+  currentoffset = readoffset = discardoffset = 0;
+
+  // The file is read from start to finish
+  diskfile->AdviseSequential();
+
+  // Only map the file if the whole window fits within it
+  if (usemapping && filesize >= 2*blocksize && Map(0))
+  {
+    buffer = mapping;
+  }
+  else
+  {
+    if (!heapbuffer)
+      heapbuffer = new char[(size_t)blocksize*2];
+    buffer = heapbuffer;
+  }
 
   tailpointer = outpointer = buffer;
   inpointer = &buffer[blocksize];
@@ -125,6 +155,9 @@ bool FileCheckSummer::Jump(u64 distance)
   currentoffset += distance;
   if (currentoffset >= filesize)
   {
+    if (mapping)
+      Unmap();
+
     currentoffset = filesize;
     tailpointer = outpointer = buffer;
     memset(buffer, 0, (size_t)blocksize);
@@ -139,7 +172,12 @@ bool FileCheckSummer::Jump(u64 distance)
 
   // Is there any data left in the buffer that we are keeping
   size_t keep = tailpointer - outpointer;
-  if (keep > 0)
+  if (mapping)
+  {
+    // It is already in place; just move the window along the mapping
+    MoveWindow();
+  }
+  else if (keep > 0)
   {
     // Move it back to the start of the buffer
     memmove(buffer, outpointer, keep);
@@ -215,6 +253,8 @@ bool FileCheckSummer::Fill(bool longfill)
   if (tailpointer >= &buffer[blocksize] && !longfill)
     return true;
 
+  DiscardBehind();
+
   // Try reading at least one block of data
   const char *target = tailpointer == buffer ? &buffer[blocksize] : &buffer[2*blocksize];
   // How much data can we read into the buffer
@@ -222,8 +262,8 @@ bool FileCheckSummer::Fill(bool longfill)
 
   if (want > 0)
   {
-    // Read data
-    if (!diskfile->Read(readoffset, tailpointer, want))
+    // Read data, unless it is already mapped
+    if (!mapping && !diskfile->Read(readoffset, tailpointer, want))
       return false;
 
     UpdateHashes(readoffset, tailpointer, want);
@@ -242,6 +282,118 @@ bool FileCheckSummer::Fill(bool longfill)
   return true;
 }
 
+// Map a section of the file which starts at or just before the specified
+// offset. If there was already a mapping, the window is moved to the new
+// one. NOTE: The file must not be truncated whilst it is mapped.
+bool FileCheckSummer::Map(u64 offset)
+{
+#ifdef USE_SCAN_MAPPING
+  if (!diskfile->IsOpen())
+    return false;
+
+  u64 pagesize = (u64)sysconf(_SC_PAGESIZE);
+  u64 start = offset - offset % pagesize;
+  u64 length = min(max((u64)MAX_SCAN_MAPPING, 4*blocksize), filesize - start);
+  if (length != (size_t)length)
+    return false;
+
+  void *section = mmap(0, (size_t)length, PROT_READ, MAP_SHARED, diskfile->Descriptor(), (off_t)start);
+  if (section == MAP_FAILED)
+    return false;
+
+  // The file is scanned from start to finish
+  madvise(section, (size_t)length, MADV_SEQUENTIAL);
+
+  if (mapping)
+  {
+    char *newbuffer = (char*)section + (size_t)(mapoffset + (buffer - mapping) - start);
+    outpointer  = &newbuffer[outpointer - buffer];
+    inpointer   = &newbuffer[inpointer - buffer];
+    tailpointer = &newbuffer[tailpointer - buffer];
+    buffer      = newbuffer;
+
+    munmap(mapping, maplength);
+  }
+
+  mapping = (char*)section;
+  mapoffset = start;
+  maplength = (size_t)length;
+
+  return true;
+#else
+  (void)offset;
+  return false;
+#endif
+}
+
+// Start the window at outpointer, which must lie within the mapping
+void FileCheckSummer::MoveWindow(void)
+{
+  buffer = outpointer;
+  inpointer = &buffer[blocksize];
+
+  // Near the end of the file, the window needs padding with zeros
+  if (currentoffset + 2*blocksize > filesize)
+  {
+    Unmap();
+  }
+  // Does the window run off the end of the mapped section
+  else if (currentoffset + 2*blocksize > mapoffset + maplength)
+  {
+    if (!Map(currentoffset))
+      Unmap();
+  }
+}
+
+// Copy the data in the window to a buffer, and continue reading from
+// the file instead of the mapping
+void FileCheckSummer::Unmap(void)
+{
+#ifdef USE_SCAN_MAPPING
+  if (!heapbuffer)
+    heapbuffer = new char[(size_t)blocksize*2];
+
+  size_t keep = tailpointer - buffer;
+  memcpy(heapbuffer, buffer, keep);
+
+  outpointer  = &heapbuffer[outpointer - buffer];
+  inpointer   = &heapbuffer[inpointer - buffer];
+  tailpointer = &heapbuffer[keep];
+  buffer      = heapbuffer;
+
+  munmap(mapping, maplength);
+  mapping = 0;
+  maplength = 0;
+#endif
+}
+
+// The scan never goes back, so data before the window will not be needed
+// again. Letting the OS drop it stops a scan of a large file from pushing
+// everything else out of the page cache.
+void FileCheckSummer::DiscardBehind(void)
+{
+  // File offset of the start of the buffer
+  u64 windowstart = readoffset - (tailpointer - buffer);
+  if (windowstart < discardoffset + SCAN_DISCARD_SIZE)
+    return;
+
+#ifdef USE_SCAN_MAPPING
+  // Pages which are still mapped would not be dropped
+  if (mapping && windowstart > mapoffset)
+  {
+    u64 pagesize = (u64)sysconf(_SC_PAGESIZE);
+    u64 start = max(discardoffset, mapoffset);
+    start += (pagesize - start % pagesize) % pagesize;
+    u64 end = windowstart - windowstart % pagesize;
+    if (end > start)
+      madvise(&mapping[start - mapoffset], (size_t)(end - start), MADV_DONTNEED);
+  }
+#endif
+
+  diskfile->Discard(discardoffset, windowstart - discardoffset);
+  discardoffset = windowstart;
+}
+
 // Update the full file hash and the 16k hash using the new data
 void FileCheckSummer::UpdateHashes(u64 offset, const void *buffer, size_t length)
 {
@@ -33,13 +33,28 @@
 // block of data is expected to start. Whilst the file is being scanned
 // the object also computes the MD5 Hash of the whole file and of
 // the first 16k of the file for later tests.
+//
+// When asked to, and where possible, the file is memory mapped rather
+// than read into a buffer, and the window is just a pointer into the
+// mapping.  A read error in a mapped file cannot be handled (the process
+// is sent SIGBUS), so by default the file is read. Large
+// files are mapped a section at a time. Near the end of the file, where
+// the window has to be padded with zeros, the data is copied to a
+// buffer and read as usual.
+
+// The OS is told that it can drop data behind the window this many bytes at a time
+#define SCAN_DISCARD_SIZE (8 * 1048576)
+
+// How much of a file is mapped at once
+#define MAX_SCAN_MAPPING (sizeof(size_t) > 4 ? ((size_t)1 << 30) : ((size_t)64 << 20))
 
 class FileCheckSummer
 {
 public:
   FileCheckSummer(DiskFile   *diskfile,
                   u64         blocksize,
-                  const u32 (&windowtable)[256]);
+                  const u32 (&windowtable)[256],
+                  bool        usemapping = false);
   ~FileCheckSummer(void);
 
   // Start reading the file at the beginning
@@ -81,15 +96,25 @@ protected:
 
   u64         filesize;
 
+  bool        usemapping;    // whether the file may be memory mapped
+
   u64         currentoffset; // file offset for current window position
   char       *buffer;        // buffer for reading from the file
   char       *outpointer;    // position in buffer of scan window
   char       *inpointer;     // &outpointer[blocksize];
   char       *tailpointer;   // after last valid data in buffer
 
+  char       *heapbuffer;    // allocated buffer, when not using the mapping
+  char       *mapping;       // mapped section of the file
+  u64         mapoffset;     // file offset of the mapped section
+  size_t      maplength;     // length of the mapped section
+
   // File offset for next read
   u64         readoffset;
 
+  // Data before this offset has been dropped from the page cache
+  u64         discardoffset;
+
   // Current block checksum/hash
   u32         checksum;
   MD5Hash     blockhash;
@@ -108,6 +133,18 @@ protected:
   // Set longfill = true to force fill the whole buffer
   bool Fill(bool longfill = false);
 
+  // Map the section of the file starting at the specified offset
+  bool Map(u64 offset);
+
+  // Make the window start at outpointer within the mapping
+  void MoveWindow(void);
+
+  // Copy the window to a buffer and stop using the mapping
+  void Unmap(void);
+
+  // Drop data which the window has passed from the page cache
+  void DiscardBehind(void);
+
   // Stop using the multi-hash context due to file/block hash desync
   void StopHasher(void);
 
@@ -163,6 +200,9 @@ inline bool FileCheckSummer::Step(void)
   // we have reached the end of the file
   if (++currentoffset >= filesize)
   {
+    if (mapping)
+      Unmap();
+
     currentoffset = filesize;
     tailpointer = outpointer = buffer;
     memset(buffer, 0, (size_t)blocksize);
@@ -189,6 +229,13 @@ inline bool FileCheckSummer::Step(void)
 
   assert(outpointer == &buffer[blocksize]);
 
+  // Move the window along the mapping
+  if (mapping)
+  {
+    MoveWindow();
+    return true;
+  }
+
   // Copy the data back to the beginning of the buffer
   memcpy(buffer, outpointer, (size_t)blocksize);
   inpointer = outpointer;
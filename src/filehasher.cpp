@@ -0,0 +1,199 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "libpar2internal.h"
+#include "../parpar/hasher/crc_zeropad.h"
+
+#ifdef _MSC_VER
+#ifdef _DEBUG
+#undef THIS_FILE
+static char THIS_FILE[]=__FILE__;
+#define new DEBUG_NEW
+#endif
+#endif
+
+FileHasher::FileHasher(u64 _filesize, u64 _blocksize, u32 _threads)
+: filesize(_filesize)
+, blocksize(_blocksize)
+, threads(_threads < 2 ? 2 : _threads)
+, offset(0)
+, blocks((size_t)((_filesize + _blocksize-1) / _blocksize))
+, nextfile(jobs.end())
+, stopping(false)
+{
+  for (vector<Block>::iterator block = blocks.begin(); block != blocks.end(); ++block)
+    block->crc = 0;
+
+  // One thread for the file hash, and as many as are useful for the blocks
+  workers.push_back(std::thread(&FileHasher::FileThread, this));
+
+  size_t count = min((size_t)(threads - 1), max(blocks.size(), (size_t)1));
+  for (size_t i=0; i<count; i++)
+    workers.push_back(std::thread(&FileHasher::BlockThread, this));
+}
+
+FileHasher::~FileHasher(void)
+{
+  Wait();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  workready.notify_all();
+
+  for (vector<std::thread>::iterator worker = workers.begin(); worker != workers.end(); ++worker)
+    worker->join();
+}
+
+std::future<void> FileHasher::Start(const void *buffer, size_t length)
+{
+  // The part of a block which is carried over from the last buffer must
+  // not be hashed until the rest of the block before it has been
+  if (offset % blocksize != 0)
+    Wait();
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  jobs.push_back(Job());
+  Job &job = jobs.back();
+  job.data = (const u8*)buffer;
+  job.length = length;
+  job.filedone = false;
+  job.partsleft = 0;
+  std::future<void> result = job.done.get_future();
+
+  if (nextfile == jobs.end())
+    nextfile = --jobs.end();
+
+  // Split the data where the blocks start
+  size_t used = 0;
+  while (used < length)
+  {
+    u64 position = offset + used;
+
+    Part part;
+    part.blocknumber = (u32)(position / blocksize);
+    part.data = &job.data[used];
+    part.length = (size_t)min((u64)(length - used), blocksize - position % blocksize);
+    part.job = &job;
+    parts.push_back(part);
+    job.partsleft++;
+
+    used += part.length;
+  }
+  offset += length;
+
+  workready.notify_all();
+
+  return result;
+}
+
+void FileHasher::Wait(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  workdone.wait(lock, [this]{return jobs.empty();});
+}
+
+void FileHasher::Finish(MD5Hash &filehash)
+{
+  filecontext.Final(filehash);
+
+  for (size_t blocknumber=0; blocknumber<blocks.size(); blocknumber++)
+  {
+    Block &block = blocks[blocknumber];
+
+    // The last block is padded with zeros
+    u64 length = min(blocksize, filesize - blocknumber * blocksize);
+    if (length < blocksize)
+    {
+      block.context.Update((size_t)(blocksize - length));
+      block.crc = crc_zeroPad(block.crc, blocksize - length);
+    }
+
+    block.context.Final(block.hash);
+  }
+}
+
+// Add each buffer to the file hash, in the order they were given
+void FileHasher::FileThread(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for (;;)
+  {
+    workready.wait(lock, [this]{return stopping || nextfile != jobs.end();});
+    if (nextfile == jobs.end())
+      break;
+
+    list<Job>::iterator job = nextfile;
+    lock.unlock();
+    filecontext.Update(job->data, job->length);
+    lock.lock();
+
+    job->filedone = true;
+    ++nextfile;
+    if (job->partsleft == 0)
+      Complete(job);
+  }
+}
+
+void FileHasher::BlockThread(void)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for (;;)
+  {
+    workready.wait(lock, [this]{return stopping || !parts.empty();});
+    if (parts.empty())
+      break;
+
+    Part part = parts.front();
+    parts.pop_front();
+    Block &block = blocks[part.blocknumber];
+
+    // Each block is in at most one part which is waiting, so no other
+    // thread is changing it.  The crc of the part is added to the crc
+    // of the data before it in the block.
+    lock.unlock();
+    block.context.Update(part.data, part.length);
+    block.crc = CRCUpdateBlock(block.crc, (u64)part.length) ^ CRCCompute(part.length, part.data);
+    lock.lock();
+
+    Job *job = part.job;
+    if (--job->partsleft == 0 && job->filedone)
+    {
+      for (list<Job>::iterator j = jobs.begin(); j != jobs.end(); ++j)
+      {
+        if (&*j == job)
+        {
+          Complete(j);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void FileHasher::Complete(list<Job>::iterator job)
+{
+  job->done.set_value();
+  jobs.erase(job);
+  workdone.notify_all();
+}
@@ -0,0 +1,129 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __FILEHASHER_H__
+#define __FILEHASHER_H__
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+
+// Files which are smaller than this are hashed on one thread
+#define FILEHASHER_MIN_FILESIZE (64 * 1048576)
+
+// How much of the file is hashed at a time
+#define FILEHASHER_BUFFER_SIZE (8 * 1048576)
+
+// A FileHasher computes the hash of a whole file, and the hash and crc
+// of each of its blocks, on several threads.
+//
+// The file hash has to be computed from the start of the file to the end,
+// so one thread does nothing else.  The blocks are independent of each
+// other, so the data which is given to the hasher is split where the
+// blocks start, and the parts are hashed by the other threads.  A block
+// which is larger than the data given at a time is carried over from
+// one part to the next.
+//
+// The caller reads the file and hands it over a buffer at a time with
+// Start(), which returns straight away, so the next buffer can be read
+// while the last one is being hashed.  Several buffers can be waiting to
+// be hashed, and each buffer must not be changed until the future which
+// Start() returned for it is ready, or until Wait() returns.
+
+class FileHasher
+{
+public:
+  // threads includes the one which computes the file hash
+  FileHasher(u64 filesize, u64 blocksize, u32 threads);
+  ~FileHasher(void);
+
+  // Start hashing the data which follows on from the data given before
+  std::future<void> Start(const void *buffer, size_t length);
+
+  // Wait for all of the data given to Start() to be hashed
+  void Wait(void);
+
+  // Finish the hashes, once all of the file has been hashed.
+  // The last block is padded with zeros.
+  void Finish(MD5Hash &filehash);
+
+  // The hash and crc of a block, once Finish() has been called
+  const MD5Hash& BlockHash(u32 blocknumber) const {return blocks[blocknumber].hash;}
+  u32 BlockCRC(u32 blocknumber) const {return blocks[blocknumber].crc;}
+
+protected:
+  struct Block
+  {
+    MD5Context context;
+    u32        crc;
+    MD5Hash    hash;
+  };
+
+  // A buffer given to Start()
+  struct Job
+  {
+    const u8          *data;
+    size_t             length;
+    bool               filedone;  // Has it been added to the file hash
+    size_t             partsleft; // How many of its parts are still to be hashed
+    std::promise<void> done;
+  };
+
+  // The part of a buffer which belongs to one block
+  struct Part
+  {
+    u32         blocknumber;
+    const u8   *data;
+    size_t      length;
+    Job        *job;
+  };
+
+  void FileThread(void);
+  void BlockThread(void);
+
+  // Finish with a job once all of it has been hashed
+  void Complete(list<Job>::iterator job);
+
+  u64 filesize;
+  u64 blocksize;
+  u32 threads;
+
+  u64 offset;           // How much of the file has been given to Start()
+
+  MD5Context    filecontext;
+  vector<Block> blocks;
+
+  std::mutex              mutex;
+  std::condition_variable workready; // There is something to hash, or the threads must stop
+  std::condition_variable workdone;  // A job has been finished
+  list<Job>               jobs;      // The jobs which are not finished, oldest first
+  list<Job>::iterator     nextfile;  // The next job to add to the file hash
+  list<Part>              parts;     // The parts which are waiting to be hashed
+  bool                    stopping;
+
+  vector<std::thread> workers;
+
+private:
+  FileHasher(const FileHasher &);
+  FileHasher& operator=(const FileHasher &);
+};
+
+#endif // __FILEHASHER_H__
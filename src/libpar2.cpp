@@ -28,6 +28,9 @@ Result par2create(std::ostream &sout,
 #ifdef _OPENMP
 		  const u32 filethreads,
 #endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const bool checkpoint,
 		  const string &parfilename,
 		  const vector<string> &extrafiles,
 		  const u64 blocksize,
@@ -45,6 +48,9 @@ Result par2create(std::ostream &sout,
 #ifdef _OPENMP
 				  filethreads,
 #endif
+				  readdepth,
+				  directio,
+				  checkpoint,
 				  parfilename,
 				  extrafiles,
 				  blocksize,
@@ -57,6 +63,76 @@ Result par2create(std::ostream &sout,
 }
 
 
+Result par2extend(std::ostream &sout,
+		  std::ostream &serr,
+		  const NoiseLevel noiselevel,
+		  const size_t memorylimit,
+		  const string &basepath,
+		  const u32 nthreads,
+#ifdef _OPENMP
+		  const u32 filethreads,
+#endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const string &parfilename,
+		  const Scheme recoveryfilescheme,
+		  const u32 recoveryfilecount,
+		  const u32 recoveryblockcount,
+		  const u32 redundancy
+		  )
+{
+  Par2Creator creator(sout, serr, noiselevel);
+  Result result = creator.Extend(
+				 memorylimit,
+				 basepath,
+				 nthreads,
+#ifdef _OPENMP
+				 filethreads,
+#endif
+				 readdepth,
+				 directio,
+				 parfilename,
+				 recoveryfilescheme,
+				 recoveryfilecount,
+				 recoveryblockcount,
+				 redundancy
+				 );
+  return result;
+}
+
+
+Result par2update(std::ostream &sout,
+		  std::ostream &serr,
+		  const NoiseLevel noiselevel,
+		  const size_t memorylimit,
+		  const string &basepath,
+		  const u32 nthreads,
+#ifdef _OPENMP
+		  const u32 filethreads,
+#endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const string &parfilename,
+		  const vector<string> &extrafiles
+		  )
+{
+  Par2Creator creator(sout, serr, noiselevel);
+  Result result = creator.Update(
+				 memorylimit,
+				 basepath,
+				 nthreads,
+#ifdef _OPENMP
+				 filethreads,
+#endif
+				 readdepth,
+				 directio,
+				 parfilename,
+				 extrafiles
+				 );
+  return result;
+}
+
+
 Result par2repair(std::ostream &sout,
 		  std::ostream &serr,
 		  const NoiseLevel noiselevel,
@@ -66,6 +142,14 @@ Result par2repair(std::ostream &sout,
 #ifdef _OPENMP
 		  const u32 filethreads,
 #endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const bool inplace,
+		  const bool checkpoint,
+		  const bool ondemand,
+		  const bool mapfiles,
+		  const bool packetindex,
+		  const bool rebuildpacketindex,
 		  const string &parfilename,
 		  const vector<string> &extrafiles,
 		  const bool dorepair,   // derived from operation
@@ -82,6 +166,14 @@ Result par2repair(std::ostream &sout,
 #ifdef _OPENMP
 				   filethreads,
 #endif
+				   readdepth,
+				   directio,
+				   inplace,
+				   checkpoint,
+				   ondemand,
+				   mapfiles,
+				   packetindex,
+				   rebuildpacketindex,
 				   parfilename,
 				   extrafiles,
 				   dorepair,
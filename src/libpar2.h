@@ -145,6 +145,9 @@ Result par2create(std::ostream &sout,
 #ifdef _OPENMP
 			  const u32 filethreads,
 #endif
+			  const u32 readdepth,
+			  const bool directio,
+			  const bool checkpoint,
 			  const std::string &parfilename,
 			  const std::vector<std::string> &extrafiles,
 			  const u64 blocksize,
@@ -155,6 +158,47 @@ Result par2create(std::ostream &sout,
 			  );
 
 
+// Add recovery files to an existing PAR2 recovery set.  If
+// recoveryblockcount is 0, the redundancy (%) decides how many
+// recovery blocks are added.
+Result par2extend(std::ostream &sout,
+		  std::ostream &serr,
+		  const NoiseLevel noiselevel,
+		  const size_t memorylimit,
+		  const std::string &basepath,
+		  const u32 nthreads,
+#ifdef _OPENMP
+		  const u32 filethreads,
+#endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const std::string &parfilename,
+		  const Scheme recoveryfilescheme,
+		  const u32 recoveryfilecount,
+		  const u32 recoveryblockcount,
+		  const u32 redundancy
+		  );
+
+
+// Update an existing PAR2 recovery set after some of its source files
+// have been changed in place.  If no files are given, the files of the
+// set are used.
+Result par2update(std::ostream &sout,
+		  std::ostream &serr,
+		  const NoiseLevel noiselevel,
+		  const size_t memorylimit,
+		  const std::string &basepath,
+		  const u32 nthreads,
+#ifdef _OPENMP
+		  const u32 filethreads,
+#endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const std::string &parfilename,
+		  const std::vector<std::string> &extrafiles
+		  );
+
+
 Result par2repair(std::ostream &sout,
 		  std::ostream &serr,
 		  const NoiseLevel noiselevel,
@@ -164,6 +208,14 @@ Result par2repair(std::ostream &sout,
 #ifdef _OPENMP
 		  const u32 filethreads,
 #endif
+		  const u32 readdepth,
+		  const bool directio,
+		  const bool inplace,
+		  const bool checkpoint,
+		  const bool ondemand,
+		  const bool mapfiles,
+		  const bool packetindex,
+		  const bool rebuildpacketindex,
 		  const std::string &parfilename,
 		  const std::vector<std::string> &extrafiles,
 		  const bool dorepair,   // derived from operation
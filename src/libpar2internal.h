@@ -197,7 +197,10 @@ char *strchr(), *strrchr();
 // STL includes
 #include <list>
 #include <map>
+#include <set>
 #include <algorithm>
+#include <chrono>
+#include <ctime>
 
 #include <ctype.h>
 #include <iomanip>
@@ -224,6 +227,8 @@ using namespace std;
 
 #include "diskfile.h"
 #include "datablock.h"
+#include "blockreader.h"
+#include "passplan.h"
 
 #include "criticalpacket.h"
 #include "par2creatorsourcefile.h"
@@ -233,10 +238,14 @@ using namespace std;
 #include "descriptionpacket.h"
 #include "verificationpacket.h"
 #include "recoverypacket.h"
+#include "undojournal.h"
+#include "checkpoint.h"
+#include "packetindex.h"
 
 #include "par2repairersourcefile.h"
 
 #include "filechecksummer.h"
+#include "filehasher.h"
 #include "verificationhashtable.h"
 
 #include "par2creator.h"
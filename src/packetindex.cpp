@@ -0,0 +1,285 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#include "libpar2internal.h"
+
+#ifdef _MSC_VER
+#ifdef _DEBUG
+#undef THIS_FILE
+static char THIS_FILE[]=__FILE__;
+#define new DEBUG_NEW
+#endif
+#endif
+
+// The index starts with a header, which is followed by an entry for each
+// file.  Each entry is followed by the name of the file and then by the
+// packets which were found in it.  The hash in the header covers
+// everything which follows it.
+
+#ifdef _WIN32
+#pragma pack(push, 1)
+#define PACKED
+#else
+#define PACKED __attribute__ ((packed))
+#endif
+
+struct PACKETINDEXHEADER
+{
+  MAGIC   magic;
+  MD5Hash hash;
+  leu32   filecount;
+} PACKED;
+
+struct PACKETINDEXFILE
+{
+  leu64   filesize;
+  leu64   modifiedtime;
+  leu64   fileindex;
+  leu32   namelength;
+  leu32   packetcount;
+} PACKED;
+
+struct PACKETINDEXPACKET
+{
+  leu64         offset;
+  PACKET_HEADER header;
+  leu32         exponent;
+} PACKED;
+
+#ifdef _WIN32
+#pragma pack(pop)
+#endif
+#undef PACKED
+
+static const MAGIC packetindex_magic = {{'P', 'A', 'R', '2', 'P', 'I', 'D', 'X'}};
+
+// Files which were changed less than this many seconds before they were
+// searched are not recorded
+#define PACKETINDEX_SETTLE_TIME 2
+
+
+PacketIndex::PacketIndex(std::ostream &sout, std::ostream &serr)
+: sout(sout)
+, serr(serr)
+, files()
+, changed(false)
+{
+}
+
+PacketIndex::~PacketIndex(void)
+{
+}
+
+string PacketIndex::FileName(const string &parfilename)
+{
+  string name = parfilename;
+  if (name.size() >= 5 && 0 == stricmp(name.substr(name.size()-5).c_str(), ".par2"))
+    name = name.substr(0, name.size()-5);
+
+  return name + ".par2index";
+}
+
+bool PacketIndex::Load(const string &filename)
+{
+  files.clear();
+  changed = false;
+
+  // If the old index was deleted before the new one replaced it,
+  // the new one is used
+  string name = DiskFile::ReplacedFileName(filename);
+  if (name.empty())
+    return false;
+
+  DiskFile file(sout, serr);
+  if (!file.Open(name))
+    return false;
+
+  PACKETINDEXHEADER header;
+  vector<u8> data;
+  bool success = file.FileSize() >= sizeof(header) &&
+                 file.Read(0, &header, sizeof(header)) &&
+                 header.magic == packetindex_magic;
+  if (success)
+  {
+    data.resize((size_t)(file.FileSize() - sizeof(header)));
+    success = data.empty() || file.Read(sizeof(header), &data[0], data.size());
+  }
+  file.Close();
+
+  if (success)
+  {
+    MD5Context context;
+    context.Update(&header.filecount, sizeof(header) - offsetof(PACKETINDEXHEADER, filecount));
+    context.Update(data.empty() ? 0 : &data[0], data.size());
+    MD5Hash hash;
+    context.Final(hash);
+    success = hash == header.hash;
+  }
+
+  // Read the entry for each file, making sure that it does not go
+  // beyond the end of the index
+  size_t position = 0;
+  for (u32 i=0; success && i<header.filecount; i++)
+  {
+    PACKETINDEXFILE entry;
+    success = data.size() - position >= sizeof(entry);
+    if (!success)
+      break;
+    memcpy(&entry, &data[position], sizeof(entry));
+    position += sizeof(entry);
+
+    success = data.size() - position >= (u64)entry.namelength + (u64)entry.packetcount * sizeof(PACKETINDEXPACKET);
+    if (!success)
+      break;
+
+    string filename((const char*)&data[position], (size_t)entry.namelength);
+    position += entry.namelength;
+
+    File &indexfile = files[filename];
+    indexfile.filesize = entry.filesize;
+    indexfile.modifiedtime = entry.modifiedtime;
+    indexfile.fileindex = entry.fileindex;
+    indexfile.packets.resize(entry.packetcount);
+    for (u32 j=0; j<entry.packetcount; j++, position += sizeof(PACKETINDEXPACKET))
+    {
+      PACKETINDEXPACKET packet;
+      memcpy(&packet, &data[position], sizeof(packet));
+      indexfile.packets[j].offset = packet.offset;
+      indexfile.packets[j].header = packet.header;
+      indexfile.packets[j].exponent = packet.exponent;
+    }
+  }
+  success = success && position == data.size();
+
+  if (!success)
+  {
+    sout << "The packet index " << name << " is damaged and will be rebuilt." << endl;
+    files.clear();
+    changed = true;
+    return false;
+  }
+
+  return true;
+}
+
+bool PacketIndex::Save(const string &filename)
+{
+  if (!changed)
+    return true;
+
+  // Forget files which no longer exist
+  for (map<string, File>::iterator f = files.begin(); f != files.end(); )
+  {
+    if (DiskFile::FileExists(f->first))
+      ++f;
+    else
+      files.erase(f++);
+  }
+
+  PACKETINDEXHEADER header;
+  header.magic = packetindex_magic;
+  header.filecount = (u32)files.size();
+
+  vector<u8> data(sizeof(header));
+  for (map<string, File>::const_iterator f = files.begin(); f != files.end(); ++f)
+  {
+    PACKETINDEXFILE entry;
+    entry.filesize = f->second.filesize;
+    entry.modifiedtime = f->second.modifiedtime;
+    entry.fileindex = f->second.fileindex;
+    entry.namelength = (u32)f->first.size();
+    entry.packetcount = (u32)f->second.packets.size();
+    data.insert(data.end(), (const u8*)&entry, (const u8*)&entry + sizeof(entry));
+    data.insert(data.end(), f->first.begin(), f->first.end());
+
+    for (vector<Packet>::const_iterator p = f->second.packets.begin(); p != f->second.packets.end(); ++p)
+    {
+      PACKETINDEXPACKET packet;
+      packet.offset = p->offset;
+      packet.header = p->header;
+      packet.exponent = p->exponent;
+      data.insert(data.end(), (const u8*)&packet, (const u8*)&packet + sizeof(packet));
+    }
+  }
+
+  MD5Context context;
+  context.Update(&header.filecount, sizeof(header) - offsetof(PACKETINDEXHEADER, filecount));
+  context.Update(&data[sizeof(header)], data.size() - sizeof(header));
+  context.Final(header.hash);
+  memcpy(&data[0], &header, sizeof(header));
+
+  // Write the new index in full before it replaces the old one
+  DiskFile file(sout, serr);
+  bool success = file.Replace(filename, &data[0], data.size());
+
+  if (!success)
+    serr << "Could not write the packet index " << filename << endl;
+  else
+    changed = false;
+
+  return success;
+}
+
+bool PacketIndex::Remove(const string &filename)
+{
+  DiskFile file(sout, serr);
+  return file.DeleteReplaced(filename);
+}
+
+bool PacketIndex::Find(const string &filename, vector<Packet> &packets) const
+{
+  map<string, File>::const_iterator f = files.find(DiskFile::GetCanonicalPathname(filename));
+  if (f == files.end())
+    return false;
+
+  // Has the file changed since it was searched
+  if (f->second.filesize != DiskFile::GetFileSize(filename) ||
+      f->second.modifiedtime != DiskFile::GetModifiedTime(filename) ||
+      f->second.fileindex != DiskFile::GetFileIndex(filename))
+    return false;
+
+  packets = f->second.packets;
+  return true;
+}
+
+void PacketIndex::Add(const string &filename, const vector<Packet> &packets)
+{
+  string name = DiskFile::GetCanonicalPathname(filename);
+
+  File indexfile;
+  indexfile.filesize = DiskFile::GetFileSize(filename);
+  indexfile.modifiedtime = DiskFile::GetModifiedTime(filename);
+  indexfile.fileindex = DiskFile::GetFileIndex(filename);
+  indexfile.packets = packets;
+
+  // A file which was changed too recently might change again without its
+  // modification time changing, and one whose time is not known cannot
+  // be checked at all
+  if (indexfile.modifiedtime == 0 ||
+      indexfile.modifiedtime + PACKETINDEX_SETTLE_TIME > (u64)time(0))
+  {
+    if (files.erase(name) > 0)
+      changed = true;
+    return;
+  }
+
+  files[name] = indexfile;
+  changed = true;
+}
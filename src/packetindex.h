@@ -0,0 +1,93 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+
+#ifndef __PACKETINDEX_H__
+#define __PACKETINDEX_H__
+
+// A PacketIndex remembers where the packets are in PAR2 files, so that
+// files which have not changed since they were last loaded do not have
+// to be searched for packets again.  The index is kept next to the main
+// PAR2 file, with ".par2index" in place of ".par2".
+//
+// A file is recognised by its full path, and is only taken to be
+// unchanged if its size, modification time and inode number are all
+// the same as when it was searched.  Files which were changed in the
+// last few seconds before they were searched are not recorded, as a
+// further change within the same second would not show in the time.
+// The whole index is covered by a hash, so one which is damaged or was
+// not completely written is ignored.
+
+class PacketIndex
+{
+public:
+  PacketIndex(std::ostream &sout, std::ostream &serr);
+  ~PacketIndex(void);
+
+  // A packet which was found in a file, along with the exponent if it
+  // is a recovery packet
+  struct Packet
+  {
+    u64           offset;
+    PACKET_HEADER header;
+    u32           exponent;
+  };
+
+  // The name of the index for the specified PAR2 file
+  static string FileName(const string &parfilename);
+
+  // Load the index.  If there is no index, or it cannot be used,
+  // false is returned, and the index is empty.
+  bool Load(const string &filename);
+
+  // Write the index, if anything has been added to it since it was loaded
+  bool Save(const string &filename);
+
+  // Delete the index
+  bool Remove(const string &filename);
+
+  // Get the packets which were found in a file, if it has not changed
+  // since.  Several files can be looked up at once.
+  bool Find(const string &filename, vector<Packet> &packets) const;
+
+  // Record the packets which were found in a file
+  void Add(const string &filename, const vector<Packet> &packets);
+
+protected:
+  // What a file was like when it was searched
+  struct File
+  {
+    u64 filesize;
+    u64 modifiedtime;
+    u64 fileindex;
+    vector<Packet> packets;
+  };
+
+  std::ostream &sout;
+  std::ostream &serr;
+
+  map<string, File> files;    // Indexed by the full path of the file
+  bool              changed;  // Whether files have been added since loading
+
+private:
+  PacketIndex(const PacketIndex &);
+  PacketIndex& operator=(const PacketIndex &);
+};
+
+#endif // __PACKETINDEX_H__
@@ -68,6 +68,9 @@ int main(int argc, char *argv[])
 #ifdef _OPENMP
 			    commandline->GetFileThreads(),
 #endif
+			    commandline->GetReadDepth(),
+			    commandline->GetDirectIO(),
+			    commandline->GetCheckpoint(),
 			    commandline->GetParFilename(),
 			    commandline->GetExtraFiles(),
 
@@ -79,6 +82,45 @@ int main(int argc, char *argv[])
 			    commandline->GetRecoveryBlockCount()
 			    );
 
+        break;
+      case CommandLine::opExtend:
+	// Add recovery data to an existing set
+	result = par2extend(std::cout,
+			    std::cerr,
+			    commandline->GetNoiseLevel(),
+			    commandline->GetMemoryLimit(),
+			    commandline->GetBasePath(),
+			    commandline->GetNumThreads(),
+#ifdef _OPENMP
+			    commandline->GetFileThreads(),
+#endif
+			    commandline->GetReadDepth(),
+			    commandline->GetDirectIO(),
+			    commandline->GetParFilename(),
+			    commandline->GetRecoveryFileScheme(),
+			    commandline->GetRecoveryFileCount(),
+			    commandline->GetRecoveryBlockCount(),
+			    commandline->GetRedundancy()
+			    );
+
+        break;
+      case CommandLine::opUpdate:
+	// Update an existing set for changes to its files
+	result = par2update(std::cout,
+			    std::cerr,
+			    commandline->GetNoiseLevel(),
+			    commandline->GetMemoryLimit(),
+			    commandline->GetBasePath(),
+			    commandline->GetNumThreads(),
+#ifdef _OPENMP
+			    commandline->GetFileThreads(),
+#endif
+			    commandline->GetReadDepth(),
+			    commandline->GetDirectIO(),
+			    commandline->GetParFilename(),
+			    commandline->GetExtraFiles()
+			    );
+
         break;
       case CommandLine::opVerify:
       case CommandLine::opRepair:
@@ -110,6 +152,14 @@ int main(int argc, char *argv[])
 #ifdef _OPENMP
 				  commandline->GetFileThreads(),
 #endif
+				  commandline->GetReadDepth(),
+				  commandline->GetDirectIO(),
+				  commandline->GetInPlace(),
+				  commandline->GetCheckpoint(),
+				  commandline->GetOnDemand(),
+				  commandline->GetMapFiles(),
+				  commandline->GetPacketIndex(),
+				  commandline->GetRebuildPacketIndex(),
 				  commandline->GetParFilename(),
 				  commandline->GetExtraFiles(),
 				  commandline->GetOperation() == CommandLine::opRepair,
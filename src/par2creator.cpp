@@ -42,6 +42,15 @@ Par2Creator::Par2Creator(std::ostream &sout, std::ostream &serr, const NoiseLeve
 , blocksize(0)
 , chunksize(0)
 , transferbuffer(0)
+, transferbuffercount(NUM_TRANSFER_BUFFERS)
+, hashbuffercount(NUM_TRANSFER_BUFFERS)
+, outputgroupsize(1)
+, outputpasssize(0)
+, readdepth(DEFAULT_READ_DEPTH)
+, hashreaddepth(DEFAULT_READ_DEPTH)
+, hashbuffer(0)
+, directio(false)
+, readdevicecount(1)
 
 , sourcefilecount(0)
 , sourceblockcount(0)
@@ -54,6 +63,9 @@ Par2Creator::Par2Creator(std::ostream &sout, std::ostream &serr, const NoiseLeve
 
 , mainpacket(0)
 , creatorpacket(0)
+, firstpacket(true)
+, existingmainpacket(0)
+, updatecommitted(false)
 
 , sourcefiles()
 , sourceblocks()
@@ -65,21 +77,52 @@ Par2Creator::Par2Creator(std::ostream &sout, std::ostream &serr, const NoiseLeve
 , totaldata(0)
 
 , deferhashcomputation(false)
+, hashwholeblocks(true)
 #ifdef _OPENMP
 , mttotalsize(0)
 #endif
+, checkpointing(false)
+, resuming(false)
+, checkpoint(sout, serr)
 {
   setup_hasher();
 }
 
 Par2Creator::~Par2Creator(void)
 {
+  // The cached files are about to be deleted
+  filecache.Clear();
+
   delete mainpacket;
   delete creatorpacket;
+  delete existingmainpacket;
+
+  for (map<MD5Hash, DescriptionPacket*>::iterator descriptionpacket = descriptionpacketmap.begin();
+       descriptionpacket != descriptionpacketmap.end();
+       ++descriptionpacket)
+  {
+    delete descriptionpacket->second;
+  }
+  for (map<MD5Hash, VerificationPacket*>::iterator verificationpacket = verificationpacketmap.begin();
+       verificationpacket != verificationpacketmap.end();
+       ++verificationpacket)
+  {
+    delete verificationpacket->second;
+  }
+  for (vector<DiskFile*>::iterator existingfile = existingfiles.begin();
+       existingfile != existingfiles.end();
+       ++existingfile)
+  {
+    delete *existingfile;
+  }
 
-  delete [] (u8*)transferbuffer;
+  if (transferbuffer)
+    ALIGN_FREE(transferbuffer);
+  if (hashbuffer)
+    ALIGN_FREE(hashbuffer);
 
   parpar.deinit();
+  solver.deinit();
 
   vector<Par2CreatorSourceFile*>::iterator sourcefile = sourcefiles.begin();
   while (sourcefile != sourcefiles.end())
@@ -96,6 +139,9 @@ Result Par2Creator::Process(
 #ifdef _OPENMP
 			    const u32 _filethreads,
 #endif
+			    const u32 _readdepth,
+			    const bool _directio,
+			    const bool _checkpoint,
 			    const string &parfilename,
 			    const vector<string> &_extrafiles,
 			    const u64 _blocksize,
@@ -107,6 +153,10 @@ Result Par2Creator::Process(
 #ifdef _OPENMP
   filethreads = _filethreads;
 #endif
+  if (_readdepth != 0)
+    readdepth = _readdepth;
+  directio = _directio;
+  checkpointing = _checkpoint;
 
   // Get information from commandline
   blocksize = _blocksize;
@@ -134,21 +184,13 @@ Result Par2Creator::Process(
   }
 
   // Determine how much recovery data can be computed on one pass
-  if (!CalculateProcessBlockSize(memorylimit))
+  if (!CalculateProcessBlockSize(memorylimit, basepath))
     return eLogicError;
 
   // Init ParPar backend
-  if (!parpar.init(chunksize, {{&parparcpu, 0, (size_t)chunksize}}))
-    return eLogicError;
-  if (nthreads != 0)
-    parparcpu.setNumThreads(nthreads);
-
-  // If there aren't many input blocks, restrict the submission batch size
-  u32 inputbatch = 0;
-  if (sourceblockcount < 12)
-    inputbatch = sourceblockcount;
-  if (!parparcpu.init(GF16_AUTO, inputbatch))
-    return eMemoryError;
+  Result result = InitialiseBackend(nthreads);
+  if (result != eSuccess)
+    return result;
 
   if (noiselevel > nlQuiet)
   {
@@ -161,6 +203,18 @@ Result Par2Creator::Process(
     sout << endl;
   }
 
+  // An interrupted create may have left a checkpoint, as well as the
+  // recovery files which it had started to write
+  if (checkpointing)
+  {
+    checkpointname = Checkpoint::FileName(parfilename);
+    resuming = checkpoint.Load(checkpointname);
+  }
+
+  // Make sure that the recovery files will fit before doing any work
+  if (!resuming && !CheckFreeSpace(parfilename))
+    return eFileIOError;
+
   // Open all of the source files, compute the Hashes and CRC values, and store
   // the results in the file verification and file description packets.
   if (!OpenSourceFiles(extrafiles, basepath))
@@ -179,217 +233,1653 @@ Result Par2Creator::Process(
     return eLogicError;
 
   // Create all of the output files and allocate all packets to appropriate file offsets.
-  if (!InitialiseOutputFiles(parfilename))
+  if (!InitialiseOutputFiles(parfilename, true, resuming))
     return eFileIOError;
 
-  if (recoveryblockcount > 0)
-  {
-    // Allocate memory buffers for reading and writing data to disk.
-    if (!AllocateBuffers())
-      return eMemoryError;
-
-    // Set output exponents
-    vector<u16> recoveryindices(recoveryblockcount);
-    for (u16 i = 0; i < recoveryblockcount; i++)
-      recoveryindices[i] = i + firstrecoveryblock;
-    if (!parpar.setRecoverySlices(recoveryindices))
-      return eMemoryError;
+  // Compute the recovery data and write everything to the recovery files.
+  return WriteRecoveryFiles();
+}
 
-    // Set the total amount of data to be processed.
-    progress = 0;
-    totaldata = blocksize * sourceblockcount;
+// Add recovery files to an existing recovery set.  The file description and
+// file verification packets of the set are used as they are, so the source
+// files do not have to be hashed again, and the new recovery blocks have
+// exponents which the set does not already use.
+Result Par2Creator::Extend(
+			   const size_t memorylimit,
+			   const string &basepath,
+			   const u32 nthreads,
+#ifdef _OPENMP
+			   const u32 _filethreads,
+#endif
+			   const u32 _readdepth,
+			   const bool _directio,
+			   const string &parfilename,
+			   const Scheme _recoveryfilescheme,
+			   const u32 _recoveryfilecount,
+			   const u32 _recoveryblockcount,
+			   const u32 redundancy)
+{
+#ifdef _OPENMP
+  filethreads = _filethreads;
+#endif
+  if (_readdepth != 0)
+    readdepth = _readdepth;
+  directio = _directio;
 
-    // Start at an offset of 0 within a block.
-    u64 blockoffset = 0;
-    while (blockoffset < blocksize) // Continue until the end of the block.
-    {
-      // Work out how much data to process this time.
-      size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
-      if (!parpar.setCurrentSliceSize(blocklength))
-        return eMemoryError;
+  // Get information from commandline
+  recoveryblockcount = _recoveryblockcount;
+  recoveryfilecount = _recoveryfilecount;
+  recoveryfilescheme = _recoveryfilescheme;
 
-      // Read source data, process it through the RS matrix and write it to disk.
-      if (!ProcessData(blockoffset, blocklength))
-        return eFileIOError;
+  // Load the critical packets of the existing set, and find out which
+  // recovery blocks it already has
+  string setname;
+  if (!LoadRecoverySet(parfilename, setname))
+    return eInsufficientCriticalData;
 
-      blockoffset += blocklength;
-    }
+  // Open the source files, using the Hashes and CRC values from the set
+  if (!OpenExistingSourceFiles(basepath))
+    return eFileIOError;
 
-    if (noiselevel > nlQuiet)
-      sout << "Writing recovery packets" << endl;
+  // If the number of recovery blocks was not given, work it out from
+  // the number of source blocks in the set
+  if (recoveryblockcount == 0)
+  {
+    recoveryblockcount = max((u32)1, (sourceblockcount * redundancy + 50) / 100);
+  }
 
-    // Finish computation of the recovery packets and write the headers to disk.
-    if (!WriteRecoveryPacketHeaders())
-      return eFileIOError;
+  // Check that the last recovery block number would not be too large
+  if (firstrecoveryblock + recoveryblockcount >= 65536)
+  {
+    serr << "The recovery set already has recovery blocks up to number " << firstrecoveryblock - 1
+         << ", so " << recoveryblockcount << " more cannot be added." << endl;
+    return eInvalidCommandLineArguments;
+  }
 
-    // Finish computing the full file hash values of the source files
-    if (!FinishFileHashComputation())
-      return eLogicError;
+  // Determine how many recovery files to create.
+  if (!ComputeRecoveryFileCount(sout,
+				serr,
+				&recoveryfilecount,
+				recoveryfilescheme,
+				recoveryblockcount,
+				largestfilesize,
+				blocksize)) {
+    return eInvalidCommandLineArguments;
   }
 
-  // Fill in all remaining details in the critical packets.
-  if (!FinishCriticalPackets())
+  // Determine how much recovery data can be computed on one pass
+  if (!CalculateProcessBlockSize(memorylimit, basepath))
     return eLogicError;
 
+  // The Hashes and CRC values are already known
+  deferhashcomputation = false;
+
+  // Init ParPar backend
+  Result result = InitialiseBackend(nthreads);
+  if (result != eSuccess)
+    return result;
+
   if (noiselevel > nlQuiet)
-    sout << "Writing verification packets" << endl;
+  {
+    // Display information.
+    sout << "Block size: " << blocksize << endl;
+    sout << "Source file count: " << sourcefilecount << endl;
+    sout << "Source block count: " << sourceblockcount << endl;
+    sout << "First recovery block: " << firstrecoveryblock << endl;
+    sout << "Recovery block count: " << recoveryblockcount << endl;
+    sout << "Recovery file count: " << recoveryfilecount << endl;
+    sout << endl;
+  }
 
-  // Write all other critical packets to disk.
-  if (!WriteCriticalPackets())
+  // Make sure that the recovery files will fit before doing any work
+  if (!CheckFreeSpace(setname))
     return eFileIOError;
 
-  // Close all files.
-  if (!CloseFiles())
-    return eFileIOError;
+  // Create the creator packet.
+  if (!CreateCreatorPacket())
+    return eLogicError;
 
-  if (noiselevel > nlSilent)
-    sout << "Done" << endl;
+  // Initialise all of the source blocks ready to start reading data from the source files.
+  if (!CreateSourceBlocks())
+    return eLogicError;
 
-  return eSuccess;
+  // Create the new recovery files.  The set already has a file with no
+  // recovery blocks.
+  if (!InitialiseOutputFiles(setname, false, false))
+    return eFileIOError;
+
+  // Compute the recovery data and write everything to the recovery files.
+  return WriteRecoveryFiles();
 }
 
-// Compute block size from block count or vice versa depending on which was
-// specified on the command line
-bool Par2Creator::ComputeBlockCount(const vector<string> &extrafiles)
+// Update an existing recovery set after some of its source files have been
+// changed in place.  The source files are hashed again, and their block
+// hashes are compared with those in the set to find which blocks have
+// changed.  As the old contents of those blocks are no longer on disk, they
+// are recovered from the rest of the source data and a few of the recovery
+// blocks, and the difference between the old and new contents is then added
+// to every recovery block.  If the files of the set have changed, or if
+// that would be more work than computing the recovery data again, the
+// recovery files are created again instead.
+Result Par2Creator::Update(
+			   const size_t memorylimit,
+			   const string &basepath,
+			   const u32 nthreads,
+#ifdef _OPENMP
+			   const u32 _filethreads,
+#endif
+			   const u32 _readdepth,
+			   const bool _directio,
+			   const string &parfilename,
+			   const vector<string> &_extrafiles)
 {
-  FileSizeCache filesize_cache;
-
-  largestfilesize = 0;
-  for (vector<string>::const_iterator i=extrafiles.begin(); i!=extrafiles.end(); i++)
+#ifdef _OPENMP
+  filethreads = _filethreads;
+#endif
+  if (_readdepth != 0)
+    readdepth = _readdepth;
+  directio = _directio;
+
+  // Load the critical packets of the existing set, and find out where
+  // its packets are
+  string setname;
+  if (!LoadRecoverySet(parfilename, setname))
+    return eInsufficientCriticalData;
+
+  // A new main packet is created for the files as they are now
+  existingmainpacket = mainpacket;
+  mainpacket = 0;
+
+  // Unless files were given, use those of the set
+  vector<string> extrafiles = _extrafiles;
+  if (extrafiles.empty())
   {
-    u64 filesize = filesize_cache.get(*i);
-    if (largestfilesize < filesize)
+    for (u32 filenumber=0; filenumber<existingmainpacket->TotalFileCount(); filenumber++)
     {
-      largestfilesize = filesize;
+      const DescriptionPacket *descriptionpacket = descriptionpacketmap[existingmainpacket->FileId(filenumber)];
+      string filename = basepath + DescriptionPacket::TranslateFilenameFromPar2ToLocal(sout, serr, noiselevel, descriptionpacket->FileName());
+
+      if (!DiskFile::FileExists(filename))
+      {
+        serr << "The source file \"" << descriptionpacket->FileName() << "\" could not be found." << endl;
+        return eFileIOError;
+      }
+
+      // Empty files are left out, as they are when creating
+      if (DiskFile::GetFileSize(filename) > 0)
+        extrafiles.push_back(filename);
     }
   }
+  sourcefilecount = (u32)extrafiles.size();
+
+  // The set keeps its block size
+  if (!ComputeBlockCount(extrafiles))
+    return eInvalidCommandLineArguments;
 
+  // Open all of the source files, and compute the Hashes and CRC values
+  // of their blocks now, so that they can be compared with those of the set
+  deferhashcomputation = false;
+  if (!OpenSourceFiles(extrafiles, basepath))
+    return eFileIOError;
 
-  if (blocksize == 0)
+  // Create the main packet and determine the setid to use with all packets
+  if (!CreateMainPacket())
+    return eLogicError;
+
+  // Create the creator packet.
+  if (!CreateCreatorPacket())
+    return eLogicError;
+
+  // Find out which blocks have changed
+  bool samefiles = FindChangedBlocks();
+
+  if (samefiles && changedblocks.empty() && mainpacket->SetId() == setid)
   {
-    serr << "ERROR: Block size was zero!" << endl;
-    return false;
+    if (noiselevel > nlSilent)
+      sout << "The recovery files are up to date." << endl;
+    return eSuccess;
   }
 
-  if (blocksize % 4 != 0)
+  // The set keeps the same number of recovery blocks
+  set<u32> exponents;
+  for (vector<ExistingPacket>::const_iterator packet = existingpackets.begin();
+       packet != existingpackets.end();
+       ++packet)
   {
-    serr << "ERROR: Block size was not a multiple of 4 bytes!" << endl;
-    return false;
+    if (recoveryblockpacket_type == packet->header.type && setid == packet->header.setid)
+      exponents.insert(packet->exponent);
   }
+  recoveryblockcount = (u32)exponents.size();
+  firstrecoveryblock = exponents.empty() ? 0 : *exponents.begin();
 
+  if (noiselevel > nlQuiet)
+  {
+    // Display information.
+    sout << "Block size: " << blocksize << endl;
+    sout << "Source file count: " << sourcefilecount << endl;
+    sout << "Source block count: " << sourceblockcount << endl;
+    if (samefiles)
+      sout << "Changed block count: " << changedblocks.size() << endl;
+    sout << "Recovery block count: " << recoveryblockcount << endl;
+    sout << endl;
+  }
 
-  u64 count = 0;
+  // Changing the recovery data costs as much as computing one recovery
+  // block from every source block, for each changed block, plus one for
+  // every recovery block.  It also needs as many intact recovery blocks
+  // as there are changed blocks.
+  u64 changedcount = changedblocks.size();
+  if (!samefiles)
+  {
+    if (noiselevel > nlSilent)
+      sout << "The files of the recovery set, or the order of their blocks, have changed, so the recovery files will be created again." << endl;
+  }
+  else if (changedcount > 0 &&
+           changedcount * (sourceblockcount + recoveryblockcount) >= (u64)sourceblockcount * recoveryblockcount)
+  {
+    samefiles = false;
+    if (noiselevel > nlSilent)
+      sout << "Too many blocks have changed to update the recovery data, so the recovery files will be created again." << endl;
+  }
+  else if (!ChooseSolverBlocks())
+  {
+    samefiles = false;
+    if (noiselevel > nlSilent)
+      sout << "There are not enough intact recovery blocks to update the recovery data, so the recovery files will be created again." << endl;
+  }
 
-  for (vector<string>::const_iterator i=extrafiles.begin(); i!=extrafiles.end(); i++)
+  if (!samefiles)
+    return RecreateRecoveryFiles(memorylimit, nthreads, basepath, setname);
+
+  return UpdateRecoveryFiles(memorylimit, nthreads);
+}
+
+// Load the critical packets of an existing recovery set from all of the
+// files which belong to it.
+bool Par2Creator::LoadRecoverySet(const string &par2filename, string &setname)
+{
+  // Split the PAR2 filename into path and name parts
+  string path;
+  string name;
+  DiskFile::SplitFilename(par2filename, path, name);
+
+  // Trim ".par2" off of the end of the name
+  if (name.length() > 5 && 0 == stricmp(name.substr(name.length()-5).c_str(), ".par2"))
   {
-    count += (filesize_cache.get(*i) + blocksize-1) / blocksize;
+    name = name.substr(0, name.length()-5);
   }
 
-  if (count > 32768)
+  // If what is left ends in ".volNNN-NNN" or ".volNNN+NNN" strip that as well
+  string::size_type where = name.find_last_of('.');
+  if (where != string::npos &&
+      name.length() > where+4 &&
+      0 == stricmp(name.substr(where+1, 3).c_str(), "vol") &&
+      name.find_first_not_of("0123456789+-", where+4) == string::npos)
   {
-    serr << "Block size is too small. It would require " << count << "blocks." << endl;
-    return false;
+    name = name.substr(0, where);
   }
 
-  sourceblockcount = (u32)count;
+  setname = path + name;
 
-  return true;
-}
+  // If an update was interrupted after all of its changes had been written,
+  // the undo journals which it left are deleted rather than rolled back
+  updatemarker = setname + ".par2commit";
+  updatecommitted = DiskFile::FileExists(updatemarker);
 
+  // Load the file that was named first, so that its setid is used, and
+  // then any other files called "name.par2" or "name.*.par2"
+  if (!LoadPacketsFromFile(par2filename))
+    return false;
 
+  list<string> par2list;
+  par2list.push_back(setname + ".par2");
+  {
+    std::unique_ptr< list<string> > files(DiskFile::FindFiles(path, name + ".*.par2", false));
+    par2list.merge(*files);
+    std::unique_ptr< list<string> > filesu(DiskFile::FindFiles(path, name + ".*.PAR2", false));
+    par2list.merge(*filesu);
+  }
+  string loaded = DiskFile::GetCanonicalPathname(par2filename);
+  for (list<string>::const_iterator s=par2list.begin(); s!=par2list.end(); ++s)
+  {
+    if (DiskFile::FileExists(*s) && DiskFile::GetCanonicalPathname(*s) != loaded &&
+        !LoadPacketsFromFile(*s))
+      return false;
+  }
 
-// Determine how much recovery data can be computed on one pass
-bool Par2Creator::CalculateProcessBlockSize(size_t memorylimit)
-{
-  // Are we computing any recovery blocks
-  if (recoveryblockcount == 0)
+  if (updatecommitted)
   {
-    chunksize = 0;
+    if (!DeleteUpdateMarker())
+      return false;
+    updatecommitted = false;
+  }
 
-    deferhashcomputation = false;
+  if (mainpacket == 0)
+  {
+    serr << "The main packet of the recovery set could not be found." << endl;
+    return false;
   }
-  else
+
+  // Every file in the set must have its description, and every file with
+  // recovery data must have its block Hashes and CRC values, unless it is empty
+  for (u32 filenumber=0; filenumber<mainpacket->TotalFileCount(); filenumber++)
   {
-    // Would single pass processing use too much memory
-    if (blocksize * recoveryblockcount > memorylimit)
+    map<MD5Hash, DescriptionPacket*>::const_iterator d = descriptionpacketmap.find(mainpacket->FileId(filenumber));
+    if (d == descriptionpacketmap.end())
     {
-      // Pick a size that is small enough
-      chunksize = ~3 & (memorylimit / recoveryblockcount);
-
-      deferhashcomputation = false;
+      serr << "The recovery set is missing the description of one of its files." << endl;
+      return false;
     }
-    else
-    {
-      chunksize = (size_t)blocksize;
 
-      deferhashcomputation = true;
+    if (filenumber < mainpacket->RecoverableFileCount() &&
+        d->second->FileSize() > 0 &&
+        verificationpacketmap.find(mainpacket->FileId(filenumber)) == verificationpacketmap.end())
+    {
+      serr << "The recovery set is missing the block hashes of \"" << d->second->FileName() << "\"." << endl;
+      return false;
     }
   }
 
+  blocksize = mainpacket->BlockSize();
+
+  // The new recovery blocks follow the highest one that the set has
+  firstrecoveryblock = 0;
+  for (vector<ExistingPacket>::const_iterator packet = existingpackets.begin();
+       packet != existingpackets.end();
+       ++packet)
+  {
+    if (recoveryblockpacket_type == packet->header.type && setid == packet->header.setid)
+      firstrecoveryblock = max(firstrecoveryblock, packet->exponent + 1);
+  }
+
   return true;
 }
 
-
-// Open all of the source files, compute the Hashes and CRC values, and store
-// the results in the file verification and file description packets.
-bool Par2Creator::OpenSourceFiles(const vector<string> &extrafiles, string basepath)
+// Load the critical packets from a file, and record where each packet of
+// the set is.  Files which cannot be read, and damaged packets, are skipped.
+// The recovery packets are not checked here, as that would mean reading all
+// of their data.
+bool Par2Creator::LoadPacketsFromFile(const string &filename)
 {
-#ifdef _OPENMP
-  bool openfailed = false;
-  u64 totalprogress = 0;
-
-  //Total size of files for mt-progress line
-  for (size_t i=0; i<extrafiles.size(); ++i)
-    mttotalsize += DiskFile::GetFileSize(extrafiles[i]);
-#endif
+  DiskFile *diskfile = new DiskFile(sout, serr);
 
-  #pragma omp parallel for schedule(dynamic) num_threads(Par2Creator::GetFileThreads())
-  for (int i=0; i< static_cast<int>(extrafiles.size()); ++i)
+  // Put back a file whose update did not finish, or keep it if the update
+  // of the whole set was committed
+  if (UndoJournal::Exists(filename))
   {
-#ifdef _OPENMP
-    if (openfailed)
-      continue;
-#endif
-
-    Par2CreatorSourceFile *sourcefile = new Par2CreatorSourceFile;
-
-    string name;
-    DiskFile::SplitRelativeFilename(extrafiles[i], basepath, name);
-
     if (noiselevel > nlSilent)
     {
-      #pragma omp critical
-      sout << "Opening: " << name << endl;
+      string path;
+      string name;
+      DiskFile::SplitFilename(filename, path, name);
+      if (updatecommitted)
+        sout << "Finishing the interrupted update of \"" << name << "\"." << endl;
+      else
+        sout << "Undoing the unfinished update of \"" << name << "\"." << endl;
     }
 
-    // Open the source file and compute its Hashes and CRCs.
-#ifdef _OPENMP
-    if (!sourcefile->Open(noiselevel, sout, serr, extrafiles[i], blocksize, deferhashcomputation, basepath, mttotalsize, totalprogress))
-#else
-    if (!sourcefile->Open(noiselevel, sout, serr, extrafiles[i], blocksize, deferhashcomputation, basepath))
-#endif
+    UndoJournal journal(sout, serr);
+    bool success = diskfile->OpenForWrite(filename) &&
+                   (updatecommitted ? journal.Commit(*diskfile) : journal.RollBack(*diskfile));
+    diskfile->Close();
+    if (!success)
     {
-      delete sourcefile;
-#ifdef _OPENMP
-      openfailed = true;
-      continue;
-#else
+      delete diskfile;
       return false;
-#endif
-    }
-
-    // Record the file verification and file description packets
-    // in the critical packet list.
-    #pragma omp critical
-    {
-    sourcefile->RecordCriticalPackets(criticalpackets);
-
-    // Add the source file to the sourcefiles array.
-    sourcefiles.push_back(sourcefile);
     }
-    // Close the source file until its needed
-    sourcefile->Close();
-
+  }
+
+  if (!diskfile->Open(filename))
+  {
+    delete diskfile;
+    return true;
+  }
+  existingfiles.push_back(diskfile);
+
+  if (noiselevel > nlSilent)
+  {
+    string path;
+    string name;
+    DiskFile::SplitFilename(filename, path, name);
+    sout << "Loading \"" << name << "\"." << endl;
+  }
+
+  u64 filesize = diskfile->FileSize();
+
+  // A buffer large enough to hold a whole critical packet
+  size_t buffersize = (size_t)min((u64)1048576, filesize);
+  u8 *buffer = new u8[buffersize];
+
+  u64 offset = 0;
+  while (offset + sizeof(PACKET_HEADER) <= filesize)
+  {
+    PACKET_HEADER header;
+    if (!diskfile->Read(offset, &header, sizeof(header)))
+      break;
+
+    // If this is not a packet, search for the next one
+    if (packet_magic != header.magic)
+    {
+      size_t want = (size_t)min((u64)buffersize, filesize-offset);
+      if (!diskfile->Read(offset, buffer, want))
+        break;
+
+      size_t current = 1;
+      while (current + sizeof(MAGIC) <= want && 0 != memcmp(&buffer[current], &packet_magic, sizeof(MAGIC)))
+      {
+        current++;
+      }
+
+      // If the magic was not found, continue from just before the end of
+      // the buffer, in case it spans the boundary
+      offset += (current + sizeof(MAGIC) <= want) ? current : max((size_t)1, want + 1 - sizeof(MAGIC));
+      continue;
+    }
+
+    // Check the packet length
+    if (sizeof(PACKET_HEADER) > header.length ||
+        0 != (header.length & 3) ||
+        filesize < offset + header.length)
+    {
+      offset++;
+      continue;
+    }
+
+    ExistingPacket existing;
+    existing.diskfile = diskfile;
+    existing.offset = offset;
+    existing.header = header;
+    existing.exponent = 0;
+
+    // Only the exponent of a recovery packet is needed
+    if (recoveryblockpacket_type == header.type)
+    {
+      RECOVERYBLOCKPACKET packet;
+      if (header.length >= sizeof(packet) &&
+          diskfile->Read(offset, &packet, sizeof(packet)))
+      {
+        existing.exponent = packet.exponent;
+        existingpackets.push_back(existing);
+      }
+      offset += header.length;
+      continue;
+    }
+
+    // Check the packet hash of any other packet
+    MD5Context context;
+    context.Update(&header.setid, sizeof(header)-offsetof(PACKET_HEADER, setid));
+
+    u64 current = offset+sizeof(PACKET_HEADER);
+    u64 limit = offset+header.length;
+    while (current < limit)
+    {
+      size_t want = (size_t)min((u64)buffersize, limit-current);
+      if (!diskfile->Read(current, buffer, want))
+        break;
+      context.Update(buffer, want);
+      current += want;
+    }
+
+    MD5Hash hash;
+    context.Final(hash);
+    if (current < limit || hash != header.hash)
+    {
+      offset++;
+      continue;
+    }
+
+    // The first good packet decides which set is being extended or updated
+    if (firstpacket)
+    {
+      setid = header.setid;
+      firstpacket = false;
+    }
+
+    if (setid == header.setid)
+    {
+      if (mainpacket_type == header.type)
+      {
+        if (mainpacket == 0)
+        {
+          MainPacket *packet = new MainPacket;
+          if (packet->Load(diskfile, offset, header))
+            mainpacket = packet;
+          else
+            delete packet;
+        }
+      }
+      else if (filedescriptionpacket_type == header.type)
+      {
+        DescriptionPacket *packet = new DescriptionPacket;
+        if (!packet->Load(diskfile, offset, header))
+        {
+          delete packet;
+          offset++;
+          continue;
+        }
+        existing.fileid = packet->FileId();
+        if (descriptionpacketmap.find(packet->FileId()) == descriptionpacketmap.end())
+          descriptionpacketmap[packet->FileId()] = packet;
+        else
+          delete packet;
+      }
+      else if (fileverificationpacket_type == header.type)
+      {
+        VerificationPacket *packet = new VerificationPacket;
+        if (!packet->Load(diskfile, offset, header))
+        {
+          delete packet;
+          offset++;
+          continue;
+        }
+        existing.fileid = packet->FileId();
+        if (verificationpacketmap.find(packet->FileId()) == verificationpacketmap.end())
+          verificationpacketmap[packet->FileId()] = packet;
+        else
+          delete packet;
+      }
+
+      existingpackets.push_back(existing);
+    }
+
+    offset += header.length;
+  }
+
+  delete [] buffer;
+  diskfile->Close();
+
+  return true;
+}
+
+// Open the source files of an existing recovery set.  The file description
+// and file verification packets from the set are passed to the source files,
+// along with the main packet, to be written again to the new recovery files.
+bool Par2Creator::OpenExistingSourceFiles(const string &basepath)
+{
+  for (u32 filenumber=0; filenumber<mainpacket->TotalFileCount(); filenumber++)
+  {
+    const MD5Hash &fileid = mainpacket->FileId(filenumber);
+    map<MD5Hash, DescriptionPacket*>::iterator d = descriptionpacketmap.find(fileid);
+
+    // Files without recovery data only need their descriptions
+    if (filenumber >= mainpacket->RecoverableFileCount())
+    {
+      criticalpackets.push_back(d->second);
+      continue;
+    }
+
+    DescriptionPacket *descriptionpacket = d->second;
+    descriptionpacketmap.erase(d);
+
+    VerificationPacket *verificationpacket = 0;
+    map<MD5Hash, VerificationPacket*>::iterator v = verificationpacketmap.find(fileid);
+    if (v != verificationpacketmap.end())
+    {
+      verificationpacket = v->second;
+      verificationpacketmap.erase(v);
+    }
+
+    if (noiselevel > nlSilent)
+      sout << "Opening: " << descriptionpacket->FileName() << endl;
+
+    u64 filesize = descriptionpacket->FileSize();
+
+    // Open the source file, which takes the packets
+    Par2CreatorSourceFile *sourcefile = new Par2CreatorSourceFile;
+    if (!sourcefile->Open(noiselevel, sout, serr, descriptionpacket, verificationpacket, blocksize, basepath))
+    {
+      delete sourcefile;
+      return false;
+    }
+
+    // Record the file verification and file description packets
+    // in the critical packet list.
+    sourcefile->RecordCriticalPackets(criticalpackets);
+
+    sourcefiles.push_back(sourcefile);
+    sourceblockcount += sourcefile->BlockCount();
+    largestfilesize = max(largestfilesize, filesize);
+
+    // Close the source file until its needed
+    sourcefile->Close();
+  }
+
+  sourcefilecount = (u32)sourcefiles.size();
+
+  // The main packet is written to the new recovery files as it is
+  criticalpackets.push_back(mainpacket);
+
+  return true;
+}
+
+// Compare the block Hashes and CRC values of the source files with those in
+// the recovery set.  The blocks are numbered in the order of the files in
+// the main packet, which is the order of their FileIds, so the files must
+// not only have the same names and numbers of blocks, but be in the same
+// order.  A file whose first 16k has changed has a new FileId, and might
+// have moved.
+bool Par2Creator::FindChangedBlocks(void)
+{
+  changedblocks.clear();
+
+  if (existingmainpacket->RecoverableFileCount() != existingmainpacket->TotalFileCount() ||
+      existingmainpacket->TotalFileCount() != sourcefiles.size())
+    return false;
+
+  u32 blocknumber = 0;
+  for (u32 filenumber=0; filenumber<sourcefiles.size(); filenumber++)
+  {
+    const MD5Hash &fileid = existingmainpacket->FileId(filenumber);
+    const DescriptionPacket *olddescriptionpacket = descriptionpacketmap[fileid];
+    const Par2CreatorSourceFile *sourcefile = sourcefiles[filenumber];
+    u32 blockcount = sourcefile->BlockCount();
+
+    if (sourcefile->GetDescriptionPacket()->FileName() != olddescriptionpacket->FileName() ||
+        (olddescriptionpacket->FileSize() + blocksize-1) / blocksize != blockcount)
+      return false;
+
+    if (blockcount == 0)
+      continue;
+
+    const VerificationPacket *oldverificationpacket = verificationpacketmap[fileid];
+    const VerificationPacket *verificationpacket = sourcefile->GetVerificationPacket();
+    if (oldverificationpacket->BlockCount() != blockcount)
+      return false;
+
+    for (u32 blockindex=0; blockindex<blockcount; blockindex++, blocknumber++)
+    {
+      const FILEVERIFICATIONENTRY *oldentry = oldverificationpacket->VerificationEntry(blockindex);
+      const FILEVERIFICATIONENTRY *entry = verificationpacket->VerificationEntry(blockindex);
+
+      if (oldentry->hash != entry->hash || (u32)oldentry->crc != (u32)entry->crc)
+        changedblocks.push_back(blocknumber);
+    }
+  }
+
+  return true;
+}
+
+// Choose a recovery block, with a different exponent, for each changed
+// block.  Each one is checked against its packet hash first, as the data
+// which is recovered from them is added to every recovery block.
+bool Par2Creator::ChooseSolverBlocks(void)
+{
+  set<u32> chosen;
+  for (vector<ExistingPacket>::const_iterator packet = existingpackets.begin();
+       packet != existingpackets.end() && solverpackets.size() < changedblocks.size();
+       ++packet)
+  {
+    if (recoveryblockpacket_type == packet->header.type &&
+        setid == packet->header.setid &&
+        packet->header.length == sizeof(RECOVERYBLOCKPACKET) + blocksize &&
+        chosen.find(packet->exponent) == chosen.end() &&
+        VerifyExistingPacket(*packet))
+    {
+      chosen.insert(packet->exponent);
+      solverpackets.push_back(&*packet);
+    }
+  }
+
+  return solverpackets.size() == changedblocks.size();
+}
+
+// Read a whole packet of the recovery set, and check its packet hash.
+bool Par2Creator::VerifyExistingPacket(const ExistingPacket &packet)
+{
+  if (!filecache.Acquire(packet.diskfile))
+    return false;
+
+  size_t buffersize = 1024*1024;
+  u8 *buffer = new u8[buffersize];
+
+  MD5Context context;
+  u64 offset = packet.offset + offsetof(PACKET_HEADER, setid);
+  u64 end = packet.offset + packet.header.length;
+  bool success = true;
+  while (success && offset < end)
+  {
+    size_t want = (size_t)min((u64)buffersize, end - offset);
+    success = packet.diskfile->Read(offset, buffer, want);
+    context.Update(buffer, want);
+    offset += want;
+  }
+
+  delete [] buffer;
+  filecache.Release(packet.diskfile);
+
+  MD5Hash hash;
+  context.Final(hash);
+
+  return success && hash == packet.header.hash;
+}
+
+// Add the changes to the recovery data.  Every recovery packet of the set
+// is read and written again where it is, a chunk at a time, along with
+// the critical packets, which are replaced by new ones of the same size.
+Result Par2Creator::UpdateRecoveryFiles(const size_t memorylimit, const u32 nthreads)
+{
+  u32 changedcount = (u32)changedblocks.size();
+
+  // Each recovery packet is rewritten using the output of the backend for
+  // its exponent.  Packets which are not the right size are damaged and
+  // are left alone.
+  vector<u16> exponents;
+  map<u32, u32> exponentoutputs;
+  for (vector<ExistingPacket>::const_iterator packet = existingpackets.begin();
+       packet != existingpackets.end();
+       ++packet)
+  {
+    if (recoveryblockpacket_type == packet->header.type &&
+        setid == packet->header.setid &&
+        packet->header.length == sizeof(RECOVERYBLOCKPACKET) + blocksize)
+    {
+      map<u32, u32>::const_iterator output = exponentoutputs.find(packet->exponent);
+      if (output == exponentoutputs.end())
+      {
+        output = exponentoutputs.insert(pair<u32, u32>(packet->exponent, (u32)exponents.size())).first;
+        exponents.push_back((u16)packet->exponent);
+      }
+
+      updatedpackets.push_back(&*packet);
+      updatedoutputs.push_back(output->second);
+    }
+  }
+
+  // Determine how much data can be processed on one pass.  The backends
+  // hold the recovery data for each exponent and the old contents of the
+  // changed blocks, and the differences are also kept.
+  u64 buffercount = exponents.size() + 2 * changedcount;
+  if (buffercount == 0 || blocksize * buffercount <= memorylimit)
+    chunksize = (size_t)blocksize;
+  else
+    chunksize = ~3 & (memorylimit / buffercount);
+
+  // Open the files of the set so that they can be written to.  Those which
+  // were opened to check packet hashes are closed first.
+  filecache.Clear();
+  for (vector<DiskFile*>::const_iterator existingfile = existingfiles.begin();
+       existingfile != existingfiles.end();
+       ++existingfile)
+  {
+    if (!(*existingfile)->OpenForWrite())
+      return eFileIOError;
+  }
+
+  // The transfer buffer holds the buffers of the reader, followed by the
+  // differences, the data of a recovery packet, and an output of the backend
+  transferbuffercount = 0;
+  if (changedcount > 0)
+  {
+    // The old contents of the changed blocks are computed from the rest
+    // of the source blocks and the chosen recovery blocks
+    vector<bool> present(sourceblockcount, true);
+    for (u32 i=0; i<changedcount; i++)
+      present[changedblocks[i]] = false;
+    if (!rs.SetInput(present, sout, serr))
+      return eLogicError;
+    for (u32 i=0; i<changedcount; i++)
+    {
+      if (!rs.SetOutput(true, (u16)solverpackets[i]->exponent))
+        return eLogicError;
+    }
+    if (!rs.Compute(noiselevel, sout, serr))
+      return eLogicError;
+
+    // Read the blocks which have not changed and the chosen recovery blocks,
+    // which are the inputs of the RS matrix, and then the changed blocks
+    if (!CreateSourceBlocks())
+      return eLogicError;
+
+    solverblocks.resize(changedcount);
+    for (u32 i=0; i<changedcount; i++)
+    {
+      solverblocks[i].SetLocation(solverpackets[i]->diskfile, solverpackets[i]->offset + sizeof(RECOVERYBLOCKPACKET));
+      solverblocks[i].SetLength(blocksize);
+    }
+
+    readblocks.clear();
+    for (u32 i=0; i<sourceblockcount; i++)
+    {
+      if (present[i])
+        readblocks.push_back(&sourceblocks[i]);
+    }
+    for (u32 i=0; i<changedcount; i++)
+      readblocks.push_back(&solverblocks[i]);
+    for (u32 i=0; i<changedcount; i++)
+      readblocks.push_back(&sourceblocks[changedblocks[i]]);
+    readdevicecount = ParallelReader::FindDevices(readblocks, readdevices);
+
+    if (readdepth > 1 && (u64)chunksize * readdepth * readdevicecount > MAX_READ_AHEAD)
+      readdepth = max((u32)1, (u32)(MAX_READ_AHEAD / max((u64)chunksize * readdevicecount, (u64)1)));
+    transferbuffercount = NUM_TRANSFER_BUFFERS + readdepth * readdevicecount - 1;
+
+    // Init ParPar backends
+    Result result = InitialiseBackend(solver, solvercpu, sourceblockcount, nthreads);
+    if (result != eSuccess)
+      return result;
+    if (!solver.setRecoverySlices(changedcount))
+      return eMemoryError;
+
+    result = InitialiseBackend(parpar, parparcpu, changedcount, nthreads);
+    if (result != eSuccess)
+      return result;
+    if (!parpar.setRecoverySlices(exponents))
+      return eMemoryError;
+  }
+
+  ALIGN_ALLOC(transferbuffer, chunksize * (transferbuffercount + changedcount + 2), DIRECT_IO_ALIGNMENT);
+  if (transferbuffer == NULL)
+  {
+    serr << "Could not allocate buffer memory." << endl;
+    return eMemoryError;
+  }
+
+  // The new recovery packets are where the old ones are, and the old data
+  // of each is hashed as it is read, to find any which were damaged
+  recoverypackets.resize(updatedpackets.size());
+  oldpackethashes.resize(updatedpackets.size());
+  for (u32 i=0; i<updatedpackets.size(); i++)
+  {
+    const ExistingPacket &existing = *updatedpackets[i];
+    recoverypackets[i].Create(existing.diskfile, existing.offset, blocksize, existing.exponent, mainpacket->SetId());
+
+    RECOVERYBLOCKPACKET packet;
+    packet.header = existing.header;
+    packet.exponent = existing.exponent;
+    oldpackethashes[i].Update(&packet.header.setid, RecoveryPacket::HashedHeaderSize());
+  }
+
+  // Save the packets before any of them are changed, so that the set can
+  // be put back as it was if the update does not finish
+  if (!WriteUpdateJournals())
+  {
+    RollBackUpdateJournals();
+    return eFileIOError;
+  }
+
+  // Set the total amount of data to be processed.
+  progress = 0;
+  totaldata = blocksize * (sourceblockcount + updatedpackets.size());
+
+  // Start at an offset of 0 within a block.
+  u64 blockoffset = 0;
+  while (blockoffset < blocksize) // Continue until the end of the block.
+  {
+    // Work out how much data to process this time.
+    size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
+    if (changedcount > 0 &&
+        (!solver.setCurrentSliceSize(blocklength) || !parpar.setCurrentSliceSize(blocklength)))
+    {
+      RollBackUpdateJournals();
+      return eMemoryError;
+    }
+
+    // Recover the old data, and add the differences to the recovery packets
+    if (!UpdateData(blockoffset, blocklength))
+    {
+      RollBackUpdateJournals();
+      return eFileIOError;
+    }
+
+    blockoffset += blocklength;
+  }
+  filecache.Clear();
+
+  if (noiselevel > nlQuiet)
+    sout << "Writing recovery packets" << endl;
+
+  // Packets which were already damaged keep their old headers, so that
+  // they are still seen to be damaged
+  u32 damaged = 0;
+  for (u32 i=0; i<updatedpackets.size(); i++)
+  {
+    MD5Hash hash;
+    oldpackethashes[i].Final(hash);
+    if (hash != updatedpackets[i]->header.hash)
+    {
+      damaged++;
+      continue;
+    }
+
+    if (!recoverypackets[i].WriteHeader())
+    {
+      RollBackUpdateJournals();
+      return eFileIOError;
+    }
+  }
+  if (damaged > 0 && noiselevel > nlSilent)
+    sout << damaged << " recovery blocks were already damaged, and have not been updated." << endl;
+
+  // Fill in all remaining details in the critical packets.
+  if (!FinishCriticalPackets())
+  {
+    RollBackUpdateJournals();
+    return eLogicError;
+  }
+
+  if (noiselevel > nlQuiet)
+    sout << "Writing verification packets" << endl;
+
+  if (!RewriteCriticalPackets() || !CommitUpdateJournals())
+  {
+    RollBackUpdateJournals();
+    return eFileIOError;
+  }
+
+  // Close all files.
+  for (vector<DiskFile*>::const_iterator existingfile = existingfiles.begin();
+       existingfile != existingfiles.end();
+       ++existingfile)
+  {
+    (*existingfile)->Close();
+  }
+
+  if (noiselevel > nlSilent)
+    sout << "Done" << endl;
+
+  return eSuccess;
+}
+
+// Recover the old contents of the changed blocks, turn them into the
+// difference from the new contents, and add the recovery data for those
+// differences to each recovery packet.
+bool Par2Creator::UpdateData(u64 blockoffset, size_t blocklength)
+{
+  u32 changedcount = (u32)changedblocks.size();
+  u32 solverinputcount = sourceblockcount;
+
+  u8 *deltabuffer = (u8*)transferbuffer + chunksize * transferbuffercount;
+  u8 *packetbuffer = deltabuffer + chunksize * changedcount;
+  u8 *outputbuffer = packetbuffer + chunksize;
+
+  if (changedcount > 0)
+  {
+    // Reads are queued ahead of the block being processed, on each
+    // device that the blocks are on
+    ParallelReader reader(serr, filecache);
+    reader.Init(readdevicecount, readdepth, directio, chunksize < blocksize);
+    reader.Start(readblocks, readdevices, blockoffset, blocklength, transferbuffer, chunksize, transferbuffercount);
+
+    // Clear existing output data in backends
+    solver.discardOutput();
+    parpar.discardOutput();
+
+    // Temporary storage for factors
+    vector<u16> factors(changedcount);
+
+    // For each block, in the order in which they are read
+    for (size_t processed = 0; processed < readblocks.size(); processed++)
+    {
+      // Wait for the data from the next block
+      u32 inputindex;
+      void *inputbuffer;
+      if (!reader.Next(inputindex, inputbuffer))
+        return false;
+
+      // Is this one of the new contents of the changed blocks
+      if (inputindex >= solverinputcount)
+      {
+        memcpy(deltabuffer + chunksize * (inputindex - solverinputcount), inputbuffer, blocklength);
+        reader.Done(inputbuffer, std::future<void>());
+      }
+      else
+      {
+        // Copy RS matrix column to send to backend
+        for (u32 outputindex=0; outputindex<changedcount; outputindex++)
+          factors[outputindex] = rs.GetFactor(inputindex, outputindex);
+        // Wait for ParPar backend to be ready, if busy
+        solver.waitForAdd();
+        // Send block to backend
+        reader.Done(inputbuffer, solver.addInput(inputbuffer, blocklength, factors.data()));
+      }
+
+      if (noiselevel > nlQuiet)
+      {
+        // Update a progress indicator
+        u32 oldfraction = (u32)(1000 * progress / totaldata);
+        progress += blocklength;
+        u32 newfraction = (u32)(1000 * progress / totaldata);
+
+        if (oldfraction != newfraction)
+        {
+          sout << "Processing: " << newfraction/10 << '.' << newfraction%10 << "%\r" << flush;
+        }
+      }
+    }
+
+    // Flush backend
+    solver.endInput().get();
+
+    // Close the files that were read
+    if (!reader.Finish())
+      return false;
+
+    // The differences between the old and new contents of the changed
+    // blocks are the inputs for the changes to the recovery data
+    for (u32 i=0; i<changedcount; i++)
+    {
+      if (!solver.getOutput(i, outputbuffer).get())
+      {
+        serr << "Internal checksum failure in changed block " << changedblocks[i] << endl;
+        return false;
+      }
+
+      u32 *delta = (u32*)(deltabuffer + chunksize * i);
+      const u32 *old = (const u32*)outputbuffer;
+      for (size_t word=0; word<blocklength/4; word++)
+        delta[word] ^= old[word];
+
+      parpar.waitForAdd();
+      parpar.addInput(delta, blocklength, (u16)changedblocks[i]);
+    }
+
+    // Flush backend
+    parpar.endInput().get();
+  }
+
+  // Add the changes to each recovery packet
+  u32 output = ~0;
+  for (u32 i=0; i<updatedpackets.size(); i++)
+  {
+    if (!recoverypackets[i].GetDataBlock()->ReadData(blockoffset, blocklength, packetbuffer))
+      return false;
+    oldpackethashes[i].Update(packetbuffer, blocklength);
+
+    if (changedcount > 0)
+    {
+      if (output != updatedoutputs[i])
+      {
+        output = updatedoutputs[i];
+        if (!parpar.getOutput(output, outputbuffer).get())
+        {
+          serr << "Internal checksum failure in recovery packet " << recoverypackets[i].Exponent() << endl;
+          return false;
+        }
+      }
+
+      u32 *data = (u32*)packetbuffer;
+      const u32 *change = (const u32*)outputbuffer;
+      for (size_t word=0; word<blocklength/4; word++)
+        data[word] ^= change[word];
+    }
+
+    if (!recoverypackets[i].WriteData(blockoffset, blocklength, packetbuffer))
+      return false;
+
+    if (noiselevel > nlQuiet)
+    {
+      // Update a progress indicator
+      u32 oldfraction = (u32)(1000 * progress / totaldata);
+      progress += blocklength;
+      u32 newfraction = (u32)(1000 * progress / totaldata);
+
+      if (oldfraction != newfraction)
+      {
+        sout << "Processing: " << newfraction/10 << '.' << newfraction%10 << "%\r" << flush;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Write the new critical packets of the set over the old ones.  Those of
+// any other type, and any which are not the same size as the new ones, are
+// kept, but with the new setid.
+bool Par2Creator::RewriteCriticalPackets(void)
+{
+  for (vector<ExistingPacket>::const_iterator existing = existingpackets.begin();
+       existing != existingpackets.end();
+       ++existing)
+  {
+    if (recoveryblockpacket_type == existing->header.type || setid != existing->header.setid)
+      continue;
+
+    // Find the new packet which replaces it
+    const CriticalPacket *packet = 0;
+    if (fileverificationpacket_type == existing->header.type ||
+        filedescriptionpacket_type == existing->header.type)
+    {
+      for (u32 filenumber=0; filenumber<existingmainpacket->TotalFileCount(); filenumber++)
+      {
+        if (existingmainpacket->FileId(filenumber) == existing->fileid)
+        {
+          if (fileverificationpacket_type == existing->header.type)
+            packet = sourcefiles[filenumber]->GetVerificationPacket();
+          else
+            packet = sourcefiles[filenumber]->GetDescriptionPacket();
+          break;
+        }
+      }
+    }
+    else if (mainpacket_type == existing->header.type)
+      packet = mainpacket;
+    else if (creatorpacket_type == existing->header.type)
+      packet = creatorpacket;
+
+    if (packet != 0 && packet->PacketLength() == existing->header.length)
+    {
+      if (!packet->WritePacket(*existing->diskfile, existing->offset))
+        return false;
+      continue;
+    }
+
+    // Keep the packet, with the new setid and packet hash
+    u8 *data = new u8[(size_t)existing->header.length];
+    bool success = existing->diskfile->Read(existing->offset, data, (size_t)existing->header.length);
+    if (success)
+    {
+      PACKET_HEADER *header = (PACKET_HEADER*)data;
+      header->setid = mainpacket->SetId();
+
+      MD5Context context;
+      context.Update(&header->setid, (size_t)existing->header.length - offsetof(PACKET_HEADER, setid));
+      context.Final(header->hash);
+
+      success = existing->diskfile->Write(existing->offset, data, (size_t)existing->header.length);
+    }
+    delete [] data;
+
+    if (!success)
+      return false;
+  }
+
+  return true;
+}
+
+// Save the packets of the set which are in each file, as they are before
+// the update changes them.
+bool Par2Creator::WriteUpdateJournals(void)
+{
+  journalledfiles.clear();
+
+  // The journals hold a copy of every packet of the set, so there must be
+  // room for the whole set a second time.  The files of the set are all
+  // in the same directory.
+  u64 needed = 0;
+  for (vector<ExistingPacket>::const_iterator existing = existingpackets.begin();
+       existing != existingpackets.end();
+       ++existing)
+  {
+    if (setid == existing->header.setid)
+      needed += existing->header.length;
+  }
+
+  if (needed > 0 && !existingfiles.empty())
+  {
+    string path;
+    string name;
+    DiskFile::SplitFilename(existingfiles.front()->FileName(), path, name);
+
+    u64 available = DiskFile::GetFreeSpace(path);
+    if (needed > available)
+    {
+      serr << "There is not enough disk space for the undo journals: " << needed << " bytes are needed but only " << available << " bytes are free." << endl;
+      return false;
+    }
+  }
+
+  for (vector<DiskFile*>::const_iterator existingfile = existingfiles.begin();
+       existingfile != existingfiles.end();
+       ++existingfile)
+  {
+    UndoJournal journal(sout, serr);
+    bool changed = false;
+
+    for (vector<ExistingPacket>::const_iterator existing = existingpackets.begin();
+         existing != existingpackets.end();
+         ++existing)
+    {
+      if (existing->diskfile == *existingfile && setid == existing->header.setid)
+      {
+        journal.Add(existing->offset, existing->header.length);
+        changed = true;
+      }
+    }
+
+    if (!changed)
+      continue;
+
+    if (!journal.Write(**existingfile))
+      return false;
+    journalledfiles.push_back(*existingfile);
+  }
+
+  return true;
+}
+
+// Keep the changes to the files of the set.  All of them are flushed to
+// disk, and then the marker which commits the update of the whole set is
+// written, before any of the journals are deleted.  If the update stops
+// before the marker is written every file is rolled back, and if it stops
+// after, the remaining journals are deleted, so that the files of the set
+// are never left partly updated.
+bool Par2Creator::CommitUpdateJournals(void)
+{
+  for (vector<DiskFile*>::const_iterator file = journalledfiles.begin();
+       file != journalledfiles.end();
+       ++file)
+  {
+    if (!(*file)->Flush())
+      return false;
+  }
+
+  DiskFile marker(sout, serr);
+  if (!marker.Create(updatemarker, 0))
+    return false;
+  bool written = marker.Flush();
+  marker.Close();
+  if (!written)
+  {
+    marker.Delete();
+    return false;
+  }
+
+  // The update can no longer be rolled back
+  while (!journalledfiles.empty())
+  {
+    UndoJournal journal(sout, serr);
+    if (!journal.Commit(*journalledfiles.back()))
+      break;
+    journalledfiles.pop_back();
+  }
+
+  if (!journalledfiles.empty() || !DeleteUpdateMarker())
+  {
+    serr << "The undo journals of the recovery set could not all be deleted.  The next update or extend will delete them." << endl;
+    journalledfiles.clear();
+  }
+
+  return true;
+}
+
+// Delete the marker which commits an update, once none of the files of the
+// set has an undo journal.
+bool Par2Creator::DeleteUpdateMarker(void)
+{
+  DiskFile marker(sout, serr);
+  if (!marker.Open(updatemarker))
+    return false;
+  marker.Close();
+
+  return marker.Delete();
+}
+
+// Put the files of the set back as they were before the update
+void Par2Creator::RollBackUpdateJournals(void)
+{
+  filecache.Clear();
+
+  for (vector<DiskFile*>::const_iterator file = journalledfiles.begin();
+       file != journalledfiles.end();
+       ++file)
+  {
+    UndoJournal journal(sout, serr);
+    bool success = ((*file)->IsOpen() || (*file)->OpenForWrite()) && journal.RollBack(**file);
+    if (!success)
+      serr << "The recovery file " << (*file)->FileName() << " could not be put back as it was.  Run the update again to restore it." << endl;
+  }
+  journalledfiles.clear();
+}
+
+// Replace the recovery files with new ones for the files as they are now.
+// The new set has as many recovery blocks as the old one, starting at the
+// same exponent, but the sizes of the files are chosen as they are by
+// default when creating.
+Result Par2Creator::RecreateRecoveryFiles(const size_t memorylimit, const u32 nthreads, const string &basepath, const string &setname)
+{
+  recoveryfilescheme = scVariable;
+  recoveryfilecount = 0;
+
+  // Determine how many recovery files to create.
+  if (!ComputeRecoveryFileCount(sout,
+				serr,
+				&recoveryfilecount,
+				recoveryfilescheme,
+				recoveryblockcount,
+				largestfilesize,
+				blocksize)) {
+    return eInvalidCommandLineArguments;
+  }
+
+  // Determine how much recovery data can be computed on one pass
+  if (!CalculateProcessBlockSize(memorylimit, basepath))
+    return eLogicError;
+
+  // The Hashes and CRC values are already known
+  deferhashcomputation = false;
+
+  // Init ParPar backend
+  Result result = InitialiseBackend(nthreads);
+  if (result != eSuccess)
+    return result;
+
+  // Make sure that the recovery files will fit, alongside those of the
+  // old set, before doing any work
+  if (!CheckFreeSpace(setname))
+    return eFileIOError;
+
+  // Initialise all of the source blocks ready to start reading data from the source files.
+  if (!CreateSourceBlocks())
+    return eLogicError;
+
+  // Create all of the output files and allocate all packets to appropriate
+  // file offsets.  They are written under temporary names, so that the old
+  // set is still there if the new one cannot be finished.
+  const string suffix = ".tmp";
+  if (!InitialiseOutputFiles(setname, true, false, suffix))
+  {
+    DeleteRecoveryFiles();
+    return eFileIOError;
+  }
+
+  // The new files may only take the place of those of the old set
+  set<DiskFile*> oldfiles;
+  set<string> oldnames;
+  for (vector<ExistingPacket>::const_iterator existing = existingpackets.begin();
+       existing != existingpackets.end();
+       ++existing)
+  {
+    if (setid == existing->header.setid && oldfiles.insert(existing->diskfile).second)
+      oldnames.insert(DiskFile::GetCanonicalPathname(existing->diskfile->FileName()));
+  }
+  for (vector<DiskFile>::const_iterator recoveryfile = recoveryfiles.begin();
+       recoveryfile != recoveryfiles.end();
+       ++recoveryfile)
+  {
+    string filename = recoveryfile->FileName();
+    filename = filename.substr(0, filename.size() - suffix.size());
+    if (DiskFile::FileExists(filename) && oldnames.count(DiskFile::GetCanonicalPathname(filename)) == 0)
+    {
+      serr << "Could not create \"" << filename << "\": File already exists." << endl;
+      DeleteRecoveryFiles();
+      return eFileIOError;
+    }
+  }
+
+  // Compute the recovery data and write everything to the recovery files.
+  result = WriteRecoveryFiles();
+  if (result != eSuccess)
+  {
+    DeleteRecoveryFiles();
+    return result;
+  }
+
+  // Make sure that the new files are on disk before the old ones go
+  for (vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin();
+       recoveryfile != recoveryfiles.end();
+       ++recoveryfile)
+  {
+    bool success = recoveryfile->OpenForWrite() && recoveryfile->Flush();
+    recoveryfile->Close();
+    if (!success)
+    {
+      DeleteRecoveryFiles();
+      return eFileIOError;
+    }
+  }
+
+  // Delete the files of the old set, and give the new ones their names
+  for (set<DiskFile*>::const_iterator oldfile = oldfiles.begin();
+       oldfile != oldfiles.end();
+       ++oldfile)
+  {
+    if ((*oldfile)->IsOpen())
+      (*oldfile)->Close();
+    if (!(*oldfile)->Delete())
+      return eFileIOError;
+  }
+  for (vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin();
+       recoveryfile != recoveryfiles.end();
+       ++recoveryfile)
+  {
+    string filename = recoveryfile->FileName();
+    if (!recoveryfile->Rename(filename.substr(0, filename.size() - suffix.size())))
+      return eFileIOError;
+  }
+
+  return eSuccess;
+}
+
+// Delete the recovery files which have been created so far
+void Par2Creator::DeleteRecoveryFiles(void)
+{
+  filecache.Clear();
+
+  for (vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin();
+       recoveryfile != recoveryfiles.end();
+       ++recoveryfile)
+  {
+    if (recoveryfile->IsOpen())
+      recoveryfile->Close();
+    if (DiskFile::FileExists(recoveryfile->FileName()))
+      recoveryfile->Delete();
+  }
+}
+
+// Compute block size from block count or vice versa depending on which was
+// specified on the command line
+bool Par2Creator::ComputeBlockCount(const vector<string> &extrafiles)
+{
+  FileSizeCache filesize_cache;
+
+  largestfilesize = 0;
+  for (vector<string>::const_iterator i=extrafiles.begin(); i!=extrafiles.end(); i++)
+  {
+    u64 filesize = filesize_cache.get(*i);
+    if (largestfilesize < filesize)
+    {
+      largestfilesize = filesize;
+    }
+  }
+
+
+  if (blocksize == 0)
+  {
+    serr << "ERROR: Block size was zero!" << endl;
+    return false;
+  }
+
+  if (blocksize % 4 != 0)
+  {
+    serr << "ERROR: Block size was not a multiple of 4 bytes!" << endl;
+    return false;
+  }
+
+
+  u64 count = 0;
+
+  for (vector<string>::const_iterator i=extrafiles.begin(); i!=extrafiles.end(); i++)
+  {
+    count += (filesize_cache.get(*i) + blocksize-1) / blocksize;
+  }
+
+  if (count > 32768)
+  {
+    serr << "Block size is too small. It would require " << count << "blocks." << endl;
+    return false;
+  }
+
+  sourceblockcount = (u32)count;
+
+  return true;
+}
+
+
+
+// Determine how much recovery data can be computed on one pass
+bool Par2Creator::CalculateProcessBlockSize(size_t memorylimit, const string &basepath)
+{
+  // Are we computing any recovery blocks
+  if (recoveryblockcount == 0)
+  {
+    chunksize = 0;
+    outputpasssize = 0;
+
+    deferhashcomputation = false;
+  }
+  else
+  {
+    // Would single pass processing use too much memory
+    if (blocksize * recoveryblockcount > memorylimit)
+    {
+      // Choose whether to process part of each block, or only some of the
+      // recovery blocks, on each pass, depending on how costly it is to
+      // seek on the disk which holds the source files
+      bool rotational = DiskFile::IsRotational(basepath.empty() ? "." : basepath);
+
+      PassPlan plan;
+      plan.Choose(blocksize, sourceblockcount, sourcefilecount, recoveryblockcount, memorylimit, rotational);
+      chunksize = plan.ChunkSize();
+      outputpasssize = plan.OutputsPerPass();
+
+      if (noiselevel > nlNormal)
+      {
+        size_t slicesize = ~3 & (memorylimit / recoveryblockcount);
+        u64 tenths = (u64)(10 * plan.Cost() + 0.5);
+        sout << "Estimated read time " << tenths/10 << '.' << tenths%10 << "s";
+        if (slicesize > 0 && plan.OutputPasses() > 1)
+        {
+          tenths = (u64)(10 * PassPlan::EstimateCost(blocksize, sourceblockcount, sourcefilecount, recoveryblockcount, slicesize, recoveryblockcount, rotational) + 0.5);
+          sout << ", or " << tenths/10 << '.' << tenths%10 << "s reading part of each block on every pass";
+        }
+        sout << (rotational ? " (rotating disk)" : "") << endl;
+      }
+
+      // The hashes are computed in the first pass, while the backend
+      // processes the first chunk of each block.  That pass reads whole
+      // blocks if a few of them fit in memory.  Otherwise it reads the
+      // rest of each block after the chunk, a little at a time.
+      deferhashcomputation = true;
+      hashwholeblocks = chunksize == blocksize || blocksize * NUM_TRANSFER_BUFFERS <= memorylimit;
+    }
+    else
+    {
+      chunksize = (size_t)blocksize;
+      outputpasssize = recoveryblockcount;
+
+      deferhashcomputation = true;
+      hashwholeblocks = true;
+    }
+  }
+
+  return true;
+}
+
+
+// Initialise the ParPar backend
+Result Par2Creator::InitialiseBackend(const u32 nthreads)
+{
+  return InitialiseBackend(parpar, parparcpu, sourceblockcount, nthreads);
+}
+
+Result Par2Creator::InitialiseBackend(PAR2Proc &proc, PAR2ProcCPU &proccpu, u32 inputcount, const u32 nthreads)
+{
+  if (!proc.init(chunksize, {{&proccpu, 0, (size_t)chunksize}}))
+    return eLogicError;
+  if (nthreads != 0)
+    proccpu.setNumThreads(nthreads);
+
+  // If there aren't many input blocks, restrict the submission batch size
+  u32 inputbatch = 0;
+  if (inputcount < 12)
+    inputbatch = inputcount;
+  if (!proccpu.init(GF16_AUTO, inputbatch))
+    return eMemoryError;
+
+  return eSuccess;
+}
+
+// Check that there is enough disk space for the recovery files.  Only the
+// recovery packets are counted, as the other packets are comparatively small.
+// The files themselves are allocated in full when they are created.
+bool Par2Creator::CheckFreeSpace(const string &parfilename)
+{
+  string path;
+  string name;
+  DiskFile::SplitFilename(parfilename, path, name);
+
+  u64 needed = recoveryblockcount * (sizeof(RECOVERYBLOCKPACKET) + blocksize);
+  u64 available = DiskFile::GetFreeSpace(path);
+
+  if (needed > available)
+  {
+    serr << "There is not enough disk space for the recovery files: " << needed << " bytes are needed but only " << available << " bytes are free." << endl;
+    return false;
+  }
+
+  return true;
+}
+
+// Open all of the source files, compute the Hashes and CRC values, and store
+// the results in the file verification and file description packets.
+bool Par2Creator::OpenSourceFiles(const vector<string> &extrafiles, string basepath)
+{
+#ifdef _OPENMP
+  bool openfailed = false;
+  u64 totalprogress = 0;
+
+  //Total size of files for mt-progress line
+  for (size_t i=0; i<extrafiles.size(); ++i)
+    mttotalsize += DiskFile::GetFileSize(extrafiles[i]);
+#endif
+
+  // The threads which are not busy with a file of their own can help to
+  // hash the blocks of a large file
+  u32 hashthreads = parparcpu.getNumThreads();
+#ifdef _OPENMP
+  u32 filesatonce = min((u32)extrafiles.size(), Par2Creator::GetFileThreads());
+  if (filesatonce > 1)
+    hashthreads /= filesatonce;
+#endif
+
+  #pragma omp parallel for schedule(dynamic) num_threads(Par2Creator::GetFileThreads())
+  for (int i=0; i< static_cast<int>(extrafiles.size()); ++i)
+  {
+#ifdef _OPENMP
+    if (openfailed)
+      continue;
+#endif
+
+    Par2CreatorSourceFile *sourcefile = new Par2CreatorSourceFile;
+
+    string name;
+    DiskFile::SplitRelativeFilename(extrafiles[i], basepath, name);
+
+    if (noiselevel > nlSilent)
+    {
+      #pragma omp critical
+      sout << "Opening: " << name << endl;
+    }
+
+    // Open the source file and compute its Hashes and CRCs.
+#ifdef _OPENMP
+    if (!sourcefile->Open(noiselevel, sout, serr, extrafiles[i], blocksize, deferhashcomputation, basepath, hashthreads, mttotalsize, totalprogress))
+#else
+    if (!sourcefile->Open(noiselevel, sout, serr, extrafiles[i], blocksize, deferhashcomputation, basepath, hashthreads))
+#endif
+    {
+      delete sourcefile;
+#ifdef _OPENMP
+      openfailed = true;
+      continue;
+#else
+      return false;
+#endif
+    }
+
+    // Record the file verification and file description packets
+    // in the critical packet list.
+    #pragma omp critical
+    {
+    sourcefile->RecordCriticalPackets(criticalpackets);
+
+    // Add the source file to the sourcefiles array.
+    sourcefiles.push_back(sourcefile);
+    }
+    // Close the source file until its needed
+    sourcefile->Close();
+
   }
 
 #ifdef _OPENMP
@@ -460,7 +1950,7 @@ public:
 };
 
 // Create all of the output files and allocate all packets to appropriate file offsets.
-bool Par2Creator::InitialiseOutputFiles(const string &parfilename)
+bool Par2Creator::InitialiseOutputFiles(const string &parfilename, bool indexfile, bool reuse, const string &suffix)
 {
   // Allocate the recovery packets
   recoverypackets.resize(recoveryblockcount);
@@ -588,136 +2078,531 @@ bool Par2Creator::InitialiseOutputFiles(const string &parfilename)
         }
       }
 
-      u32 digitsLow = 1;
-      for (u32 t=limitLow; t>=10; t/=10)
-      {
-        digitsLow++;
-      }
+      u32 digitsLow = 1;
+      for (u32 t=limitLow; t>=10; t/=10)
+      {
+        digitsLow++;
+      }
+
+      u32 digitsCount = 1;
+      for (u32 t=limitCount; t>=10; t/=10)
+      {
+        digitsCount++;
+      }
+
+      sprintf(filenameformat, "%%s.vol%%0%dd+%%0%dd.par2", (int) digitsLow, (int) digitsCount);
+    }
+
+    // Set the filenames
+    for (u32 filenumber=0; filenumber<recoveryfilecount; filenumber++)
+    {
+      char filename[_MAX_PATH];
+      snprintf(filename, sizeof(filename), filenameformat, parfilename.c_str(), fileallocations[filenumber].exponent, fileallocations[filenumber].count);
+      fileallocations[filenumber].filename = filename;
+    }
+    fileallocations[recoveryfilecount].filename = parfilename + ".par2";
+  }
+
+  // Allocate the recovery files
+  {
+    recoveryfiles.resize(indexfile ? recoveryfilecount+1 : recoveryfilecount, DiskFile(sout, serr)); // pass default constructor.
+
+    // Sort critical packets, so we get consistency.
+    criticalpackets.sort(CriticalPacket::CompareLess);
+
+    // Allocate packets to the output files
+    {
+      const MD5Hash &setid = mainpacket->SetId();
+      vector<RecoveryPacket>::iterator recoverypacket = recoverypackets.begin();
+
+      vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin();
+      vector<FileAllocation>::iterator fileallocation = fileallocations.begin();
+
+      // For each recovery file:
+      while (recoveryfile != recoveryfiles.end())
+      {
+        // How many recovery blocks in this file
+        u32 count = fileallocation->count;
+
+        // start at the beginning of the recovery file
+        u64 offset = 0;
+
+        if (count == 0)
+        {
+          // Write one set of critical packets
+          list<CriticalPacket*>::const_iterator nextCriticalPacket = criticalpackets.begin();
+
+          while (nextCriticalPacket != criticalpackets.end())
+          {
+            criticalpacketentries.push_back(CriticalPacketEntry(&*recoveryfile,
+                                                                offset,
+                                                                *nextCriticalPacket));
+            offset += (*nextCriticalPacket)->PacketLength();
+
+            ++nextCriticalPacket;
+          }
+        }
+        else
+        {
+          // How many copies of each critical packet
+          u32 copies = 0;
+          for (u32 t=count; t>0; t>>=1)
+          {
+            copies++;
+          }
+
+          // Get ready to iterate through the critical packets
+          u64 packetCount = 0;
+          list<CriticalPacket*>::const_iterator nextCriticalPacket = criticalpackets.end();
+
+          // What is the first exponent
+          u32 exponent = fileallocation->exponent;
+
+          // Start allocating the recovery packets
+          u32 limit = exponent + count;
+          while (exponent < limit)
+          {
+            // Add the next recovery packet
+            recoverypacket->Create(&*recoveryfile, offset, blocksize, exponent, setid);
+
+            offset += recoverypacket->PacketLength();
+            ++recoverypacket;
+            ++exponent;
+
+            // Add some critical packets
+            packetCount += copies * criticalpackets.size();
+            while (packetCount >= count)
+            {
+              if (nextCriticalPacket == criticalpackets.end()) nextCriticalPacket = criticalpackets.begin();
+              criticalpacketentries.push_back(CriticalPacketEntry(&*recoveryfile,
+                                                                  offset,
+                                                                  *nextCriticalPacket));
+              offset += (*nextCriticalPacket)->PacketLength();
+              ++nextCriticalPacket;
+
+              packetCount -= count;
+            }
+          }
+        }
+
+        // Add one copy of the creator packet
+        criticalpacketentries.push_back(CriticalPacketEntry(&*recoveryfile,
+                                                            offset,
+                                                            creatorpacket));
+        offset += creatorpacket->PacketLength();
+
+        // Create the file on disk and make it the required size.  When
+        // resuming, the files which were started before are used again.
+        if (reuse && DiskFile::FileExists(fileallocation->filename))
+        {
+          if (!recoveryfile->OpenForWrite(fileallocation->filename) ||
+              !recoveryfile->SetFileSize(offset))
+            return false;
+        }
+        else
+        {
+          // A file with the suffix is left over from an earlier attempt
+          // which did not finish
+          string filename = fileallocation->filename + suffix;
+          if (!suffix.empty() && DiskFile::FileExists(filename))
+          {
+            DiskFile leftover(sout, serr);
+            if (!leftover.Open(filename))
+              return false;
+            leftover.Close();
+            if (!leftover.Delete())
+              return false;
+          }
+
+          if (!recoveryfile->Create(filename, offset))
+            return false;
+        }
+
+        ++recoveryfile;
+        ++fileallocation;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Compute the recovery data and write all of the packets to the recovery files.
+Result Par2Creator::WriteRecoveryFiles(void)
+{
+  if (recoveryblockcount > 0)
+  {
+    // Allocate memory buffers for reading and writing data to disk.
+    if (!AllocateBuffers())
+      return eMemoryError;
+
+    // Set output exponents
+    vector<u16> recoveryindices(recoveryblockcount);
+    for (u16 i = 0; i < recoveryblockcount; i++)
+      recoveryindices[i] = i + firstrecoveryblock;
+
+    // The recovery packets are hashed in the same groups as they are written
+    packethasher.Start(recoverypackets, outputgroupsize);
+
+    u32 outputpasses = (recoveryblockcount + outputpasssize - 1) / outputpasssize;
+    u32 slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+    if (noiselevel > nlQuiet && outputpasses * slicepasses > 1)
+    {
+      sout << "Processing in " << outputpasses * slicepasses << " passes: ";
+      if (outputpasses > 1)
+        sout << outputpasssize << " of the " << recoveryblockcount << " recovery blocks";
+      if (outputpasses > 1 && slicepasses > 1)
+        sout << " and ";
+      if (slicepasses > 1)
+        sout << chunksize << " bytes of each block";
+      sout << " at a time" << endl;
+    }
+
+    // Set the total amount of data to be processed.
+    progress = 0;
+    totaldata = blocksize * sourceblockcount * outputpasses;
+
+    // Carry on from where an interrupted create stopped
+    u32 firstpass = 0;
+    if (checkpointing && !ResumeFromCheckpoint(firstpass))
+      return eFileIOError;
+
+    // Each pass over the outputs reads all of the source data, and the
+    // first of them is the largest, which is when the backend allocates
+    // its memory
+    u32 pass = 0;
+    for (u32 firstoutput = 0; firstoutput < recoveryblockcount; firstoutput += outputpasssize)
+    {
+      u32 outputcount = min(outputpasssize, recoveryblockcount - firstoutput);
+      if (!parpar.setRecoverySlices(outputcount, &recoveryindices[firstoutput]))
+        return eMemoryError;
+
+      // Start at an offset of 0 within a block.
+      u64 blockoffset = 0;
+      while (blockoffset < blocksize) // Continue until the end of the block.
+      {
+        // Work out how much data to process this time.
+        size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
+
+        // Skip the passes which were finished before the create was interrupted
+        if (pass < firstpass)
+        {
+          progress += (u64)blocklength * sourceblockcount;
+        }
+        else
+        {
+          if (!parpar.setCurrentSliceSize(blocklength))
+            return eMemoryError;
+
+          // Read source data, process it through the RS matrix and write it to disk.
+          if (!ProcessData(blockoffset, blocklength, firstoutput, outputcount))
+            return eFileIOError;
+
+          // The first pass has read all of the source data, so the hashes
+          // of the source files are complete
+          if (deferhashcomputation)
+          {
+            if (!FinishFileHashComputation())
+              return eLogicError;
+            deferhashcomputation = false;
+          }
+
+          // Save the progress, unless there is nothing left to do
+          if (checkpointing && pass + 1 < outputpasses * slicepasses && !SaveCheckpoint(pass + 1))
+            return eFileIOError;
+        }
+
+        blockoffset += blocklength;
+        pass++;
+      }
+    }
+
+    // Close the files that were kept open between passes
+    if (noiselevel > nlNormal && filecache.Misses() > 0)
+    {
+      u64 opens = filecache.Hits() + filecache.Misses();
+      sout << "Open file cache: " << filecache.Hits() << " of " << opens << " file accesses found the file open ("
+           << 100 * filecache.Hits() / opens << "%), " << filecache.Evictions() << " files closed to stay within "
+           << filecache.Capacity() << " open files" << endl;
+    }
+    filecache.Clear();
+
+    if (noiselevel > nlQuiet)
+      sout << "Writing recovery packets" << endl;
+
+    // Finish computation of the recovery packets and write the headers to disk.
+    if (!WriteRecoveryPacketHeaders())
+      return eFileIOError;
+  }
+
+  // Fill in all remaining details in the critical packets.
+  if (!FinishCriticalPackets())
+    return eLogicError;
+
+  if (noiselevel > nlQuiet)
+    sout << "Writing verification packets" << endl;
+
+  // Write all other critical packets to disk.
+  if (!WriteCriticalPackets())
+    return eFileIOError;
+
+  // Close all files.
+  if (!CloseFiles())
+    return eFileIOError;
+
+  // The recovery files are complete, so the checkpoint is not needed
+  if (checkpointing && !checkpoint.Remove(checkpointname))
+    return eFileIOError;
+
+  if (noiselevel > nlSilent)
+    sout << "Done" << endl;
 
-      u32 digitsCount = 1;
-      for (u32 t=limitCount; t>=10; t/=10)
-      {
-        digitsCount++;
-      }
+  return eSuccess;
+}
 
-      sprintf(filenameformat, "%%s.vol%%0%dd+%%0%dd.par2", (int) digitsLow, (int) digitsCount);
-    }
+// Compute a hash of everything which decides what each pass writes to the
+// recovery files, so that a checkpoint can be matched to the create it
+// was saved by.
+MD5Hash Par2Creator::CheckpointJobId(void) const
+{
+  MD5Context context;
+  context.Update(&mainpacket->SetId(), sizeof(MD5Hash));
 
-    // Set the filenames
-    for (u32 filenumber=0; filenumber<recoveryfilecount; filenumber++)
+  // How the work is split into passes
+  u64 values[] = {blocksize, chunksize, outputpasssize, outputgroupsize, deferhashcomputation,
+                  firstrecoveryblock, recoveryblockcount};
+  context.Update(values, sizeof(values));
+
+  // The source files must not have been changed since the checkpoint was saved
+  const DiskFile *lastfile = 0;
+  for (vector<DataBlock>::const_iterator sourceblock = sourceblocks.begin(); sourceblock != sourceblocks.end(); ++sourceblock)
+  {
+    if (sourceblock->GetDiskFile() != lastfile)
     {
-      char filename[_MAX_PATH];
-      snprintf(filename, sizeof(filename), filenameformat, parfilename.c_str(), fileallocations[filenumber].exponent, fileallocations[filenumber].count);
-      fileallocations[filenumber].filename = filename;
+      lastfile = sourceblock->GetDiskFile();
+      u64 modified = DiskFile::GetModifiedTime(lastfile->FileName());
+      context.Update(&modified, sizeof(modified));
     }
-    fileallocations[recoveryfilecount].filename = parfilename + ".par2";
   }
 
-  // Allocate the recovery files
+  // Where the recovery packets are
+  for (vector<DiskFile>::const_iterator recoveryfile = recoveryfiles.begin(); recoveryfile != recoveryfiles.end(); ++recoveryfile)
+  {
+    string name = recoveryfile->FileName();
+    u64 size = recoveryfile->FileSize();
+    context.Update(name.c_str(), name.size() + 1);
+    context.Update(&size, sizeof(size));
+  }
+  for (vector<RecoveryPacket>::const_iterator recoverypacket = recoverypackets.begin(); recoverypacket != recoverypackets.end(); ++recoverypacket)
   {
-    recoveryfiles.resize(recoveryfilecount+1, DiskFile(sout, serr)); // pass default constructor.
+    u32 exponent = recoverypacket->Exponent();
+    context.Update(&exponent, sizeof(exponent));
+  }
 
-    // Sort critical packets, so we get consistency.
-    criticalpackets.sort(CriticalPacket::CompareLess);
+  MD5Hash jobid;
+  context.Final(jobid);
+  return jobid;
+}
 
-    // Allocate packets to the output files
-    {
-      const MD5Hash &setid = mainpacket->SetId();
-      vector<RecoveryPacket>::iterator recoverypacket = recoverypackets.begin();
+// Carry on from the checkpoint left by an interrupted create, if it
+// belongs to this create and the recovery data which it records is intact.
+bool Par2Creator::ResumeFromCheckpoint(u32 &firstpass)
+{
+  u32 slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+  u32 passes = slicepasses * ((recoveryblockcount + outputpasssize - 1) / outputpasssize);
+  MD5Hash jobid = CheckpointJobId();
 
-      vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin();
-      vector<FileAllocation>::iterator fileallocation = fileallocations.begin();
+  firstpass = 0;
 
-      // For each recovery file:
-      while (recoveryfile != recoveryfiles.end())
-      {
-        // How many recovery blocks in this file
-        u32 count = fileallocation->count;
+  if (resuming)
+  {
+    if (checkpoint.JobId() != jobid ||
+        checkpoint.PacketCRCs().size() != recoveryblockcount ||
+        checkpoint.Passes() >= passes)
+    {
+      if (noiselevel > nlSilent)
+        sout << "The checkpoint " << checkpointname << " is for different source files or options, so the recovery files will be created from the start." << endl;
+    }
+    else if (checkpoint.Passes() > 0)
+    {
+      if (noiselevel > nlQuiet)
+        sout << "Checking the recovery data which was written before" << endl;
 
-        // start at the beginning of the recovery file
-        u64 offset = 0;
+      bool intact;
+      if (!CheckWrittenData(checkpoint.Passes(), intact))
+        return false;
 
-        if (count == 0)
-        {
-          // Write one set of critical packets
-          list<CriticalPacket*>::const_iterator nextCriticalPacket = criticalpackets.begin();
+      // The hashes of the source files were computed in the first pass
+      if (deferhashcomputation &&
+          (checkpoint.FileHashes().size() != sourcefiles.size() || checkpoint.BlockEntries().size() != sourceblockcount))
+        intact = false;
 
-          while (nextCriticalPacket != criticalpackets.end())
-          {
-            criticalpacketentries.push_back(CriticalPacketEntry(&*recoveryfile,
-                                                                offset,
-                                                                *nextCriticalPacket));
-            offset += (*nextCriticalPacket)->PacketLength();
+      if (intact)
+      {
+        firstpass = checkpoint.Passes();
 
-            ++nextCriticalPacket;
-          }
-        }
-        else
+        if (deferhashcomputation)
         {
-          // How many copies of each critical packet
-          u32 copies = 0;
-          for (u32 t=count; t>0; t>>=1)
+          const FILEVERIFICATIONENTRY *entries = &checkpoint.BlockEntries()[0];
+          for (u32 i=0; i<sourcefiles.size(); i++)
           {
-            copies++;
+            sourcefiles[i]->SetHashes(checkpoint.FileHashes()[i], entries);
+            entries += sourcefiles[i]->BlockCount();
           }
+          deferhashcomputation = false;
+        }
 
-          // Get ready to iterate through the critical packets
-          u64 packetCount = 0;
-          list<CriticalPacket*>::const_iterator nextCriticalPacket = criticalpackets.end();
-
-          // What is the first exponent
-          u32 exponent = fileallocation->exponent;
+        if (noiselevel > nlSilent)
+          sout << "Resuming from the checkpoint, with " << firstpass << " of the " << passes << " passes finished." << endl;
+      }
+      else
+      {
+        if (noiselevel > nlSilent)
+          sout << "The recovery data does not match the checkpoint " << checkpointname << ", so the recovery files will be created from the start." << endl;
 
-          // Start allocating the recovery packets
-          u32 limit = exponent + count;
-          while (exponent < limit)
-          {
-            // Add the next recovery packet
-            recoverypacket->Create(&*recoveryfile, offset, blocksize, exponent, setid);
+        // Forget the data which was hashed
+        packethasher.Start(recoverypackets, outputgroupsize);
+      }
+    }
+  }
 
-            offset += recoverypacket->PacketLength();
-            ++recoverypacket;
-            ++exponent;
+  if (firstpass > 0)
+    return true;
 
-            // Add some critical packets
-            packetCount += copies * criticalpackets.size();
-            while (packetCount >= count)
-            {
-              if (nextCriticalPacket == criticalpackets.end()) nextCriticalPacket = criticalpackets.begin();
-              criticalpacketentries.push_back(CriticalPacketEntry(&*recoveryfile,
-                                                                  offset,
-                                                                  *nextCriticalPacket));
-              offset += (*nextCriticalPacket)->PacketLength();
-              ++nextCriticalPacket;
+  // Save a checkpoint before anything is written, so that the recovery
+  // files are used again if the create is interrupted
+  checkpoint.JobId(jobid);
+  checkpoint.PacketCRCs().assign(recoveryblockcount, 0);
+  checkpoint.FileHashes().clear();
+  checkpoint.BlockEntries().clear();
+  checkpoint.FileNames().clear();
 
-              packetCount -= count;
-            }
-          }
-        }
+  return SaveCheckpoint(0);
+}
 
-        // Add one copy of the creator packet
-        criticalpacketentries.push_back(CriticalPacketEntry(&*recoveryfile,
-                                                            offset,
-                                                            creatorpacket));
-        offset += creatorpacket->PacketLength();
+// Read the recovery data which the finished passes wrote, to check it
+// against the crcs in the checkpoint, and to hash it.
+bool Par2Creator::CheckWrittenData(u32 passes, bool &intact)
+{
+  // Whole outputs were written by the finished passes over the outputs,
+  // and the start of the outputs of the pass which was interrupted
+  u32 slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+  u32 wholeoutputs = min(recoveryblockcount, (passes / slicepasses) * outputpasssize);
+  u32 partoutputs = min(recoveryblockcount, wholeoutputs + outputpasssize);
+  u64 partlength = min(blocksize, (u64)(passes % slicepasses) * chunksize);
+
+  vector<u32> crcs(recoveryblockcount, 0);
+  vector<const void*> buffers(outputgroupsize);
+
+  // The data is hashed in the same groups as it was written
+  for (u32 first = 0; first < recoveryblockcount; first += outputgroupsize)
+  {
+    u32 count = min(outputgroupsize, recoveryblockcount - first);
+    u64 length = first < wholeoutputs ? blocksize : first < partoutputs ? partlength : 0;
 
-        // Create the file on disk and make it the required size
-        if (!recoveryfile->Create(fileallocation->filename, offset))
+    for (u64 offset = 0; offset < length; offset += chunksize)
+    {
+      size_t size = (size_t)min((u64)chunksize, length - offset);
+      for (u32 i=0; i<count; i++)
+      {
+        void *buffer = (char*)transferbuffer + chunksize * i;
+        if (!recoverypackets[first + i].GetDataBlock()->ReadData(offset, size, buffer))
           return false;
 
-        ++recoveryfile;
-        ++fileallocation;
+        crcs[first + i] = CRCUpdateBlock(crcs[first + i], (u64)size) ^ CRCCompute(size, buffer);
+        buffers[i] = buffer;
       }
+
+      packethasher.Update(first, &buffers[0], size);
     }
   }
 
+  intact = crcs == checkpoint.PacketCRCs();
+
   return true;
 }
 
+// Save the progress, once the recovery data which was written is on disk.
+bool Par2Creator::SaveCheckpoint(u32 passes)
+{
+  for (vector<DiskFile>::iterator recoveryfile = recoveryfiles.begin(); recoveryfile != recoveryfiles.end(); ++recoveryfile)
+  {
+    if (!recoveryfile->Flush())
+      return false;
+  }
+
+  // Once the source files have been hashed, the hashes are saved so that
+  // they do not have to be computed again
+  if (!deferhashcomputation && checkpoint.FileHashes().empty())
+  {
+    for (vector<Par2CreatorSourceFile*>::const_iterator sourcefile = sourcefiles.begin(); sourcefile != sourcefiles.end(); ++sourcefile)
+    {
+      checkpoint.FileHashes().push_back((*sourcefile)->GetDescriptionPacket()->HashFull());
+
+      const VerificationPacket *verificationpacket = (*sourcefile)->GetVerificationPacket();
+      for (u32 blocknumber = 0; blocknumber < verificationpacket->BlockCount(); blocknumber++)
+        checkpoint.BlockEntries().push_back(*verificationpacket->VerificationEntry(blocknumber));
+    }
+  }
+
+  checkpoint.Passes(passes);
+
+  return checkpoint.Save(checkpointname);
+}
+
 // Allocate memory buffers for reading and writing data to disk.
 bool Par2Creator::AllocateBuffers(void)
 {
-  transferbuffer = new u8[chunksize * NUM_TRANSFER_BUFFERS];
+  // The source files are read with a separate reader for each device
+  // that they are on
+  readblocks.resize(sourceblocks.size());
+  for (size_t i=0; i<sourceblocks.size(); i++)
+    readblocks[i] = &sourceblocks[i];
+  readdevicecount = ParallelReader::FindDevices(readblocks, readdevices);
+
+  // Each read which is in flight needs its own buffer, in addition to
+  // those being transferred to the backend.  Limit the read ahead so
+  // that it does not use an excessive amount of memory.
+  if (readdepth > 1 && (u64)chunksize * readdepth * readdevicecount > MAX_READ_AHEAD)
+    readdepth = max((u32)1, (u32)(MAX_READ_AHEAD / max((u64)chunksize * readdevicecount, (u64)1)));
+  transferbuffercount = NUM_TRANSFER_BUFFERS + readdepth * readdevicecount - 1;
+
+  // The recovery data is written, and hashed, a group of outputs at a
+  // time, with the transfer buffers split between the groups.  Have enough
+  // buffers for a group to fill several multi-buffer hashes, within the
+  // read ahead limit.
+  u32 outputbuffercount = NUM_OUTPUT_GROUPS * min(outputpasssize, (u32)(4 * RECOVERY_HASH_LANES));
+  if ((u64)chunksize * outputbuffercount > MAX_READ_AHEAD)
+    outputbuffercount = (u32)(MAX_READ_AHEAD / max((u64)chunksize, (u64)1));
+  transferbuffercount = max(transferbuffercount, outputbuffercount);
+  outputgroupsize = transferbuffercount / NUM_OUTPUT_GROUPS;
+
+  // The packets are hashed in groups which are counted from the first
+  // output, so each pass over the outputs starts at the start of a group
+  if (outputpasssize < recoveryblockcount)
+  {
+    if (outputgroupsize > outputpasssize)
+      outputgroupsize = outputpasssize;
+    else
+      outputpasssize -= outputpasssize % outputgroupsize;
+  }
+
+  // When the hashes are computed as the data is processed, the first pass
+  // reads whole blocks even if only a chunk of each is processed.  The
+  // transfer buffer is made large enough for that pass.
+  hashreaddepth = readdepth;
+  hashbuffercount = transferbuffercount;
+  size_t buffersize = chunksize * transferbuffercount;
+  if (deferhashcomputation && chunksize < blocksize && hashwholeblocks)
+  {
+    if (hashreaddepth > 1 && blocksize * hashreaddepth * readdevicecount > MAX_READ_AHEAD)
+      hashreaddepth = max((u32)1, (u32)(MAX_READ_AHEAD / (blocksize * readdevicecount)));
+    hashbuffercount = NUM_TRANSFER_BUFFERS + hashreaddepth * readdevicecount - 1;
+    buffersize = max(buffersize, (size_t)blocksize * hashbuffercount);
+  }
+
+  // The buffer is aligned so that direct reads can go straight into it
+  ALIGN_ALLOC(transferbuffer, buffersize, DIRECT_IO_ALIGNMENT);
 
   if (transferbuffer == NULL)
   {
@@ -725,79 +2610,146 @@ bool Par2Creator::AllocateBuffers(void)
     return false;
   }
 
+  // Otherwise the rest of each block is read into a buffer of its own
+  if (deferhashcomputation && !hashwholeblocks)
+  {
+    ALIGN_ALLOC(hashbuffer, HASH_BUFFER_SIZE, DIRECT_IO_ALIGNMENT);
+
+    if (hashbuffer == NULL)
+    {
+      serr << "Could not allocate buffer memory." << endl;
+      return false;
+    }
+  }
+
   return true;
 }
 
+// Wait for a buffer to be finished with by both the backend and a hasher
+static void WaitForBoth(std::future<void> first, std::future<void> second)
+{
+  first.wait();
+  second.wait();
+}
+
 // Read source data, process it through the RS matrix and write it to disk.
-bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength)
+bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount)
 {
-  // If we have deferred computation of the file hash and block crc and hashes
-  // sourcefile and sourceindex will be used to update them during
-  // the main recovery block computation
-  vector<Par2CreatorSourceFile*>::iterator sourcefile = sourcefiles.begin();
-  u32 sourceindex = 0;
+  // If we have deferred computation of the file hash and block crc and hashes,
+  // they are updated during the first pass of the recovery block computation.
+  // That pass reads whole blocks, whether or not all of each is processed.
+  // The blocks of each file are processed in order, since a file is only on
+  // one device.
+  bool hashing = deferhashcomputation && blockoffset == 0 && firstoutput == 0;
+  vector<Par2CreatorSourceFile*> blockfile;
+  vector<u32> blockindex;
+  if (hashing)
+  {
+    blockfile.reserve(sourceblockcount);
+    blockindex.reserve(sourceblockcount);
+    for (vector<Par2CreatorSourceFile*>::iterator sourcefile = sourcefiles.begin();
+         sourcefile != sourcefiles.end();
+         ++sourcefile)
+    {
+      for (u32 sourceindex = 0; sourceindex < (*sourcefile)->BlockCount(); sourceindex++)
+      {
+        blockfile.push_back(*sourcefile);
+        blockindex.push_back(sourceindex);
+      }
+    }
+  }
 
-  vector<DataBlock>::iterator sourceblock;
-  u32 inputblock;
+  // Reads are queued ahead of the block being processed, on each
+  // device that the source files are on
+  ParallelReader reader(serr, filecache);
 
-  DiskFile *lastopenfile = NULL;
+  // Whole blocks of large files are hashed on other threads, while the
+  // next blocks are read.  Only the file which each device is reading
+  // has a hasher at a time.
+  u32 hashthreads = parparcpu.getNumThreads() / readdevicecount;
+  map<Par2CreatorSourceFile*, std::unique_ptr<FileHasher> > filehashers;
+
+  if (hashing && hashwholeblocks)
+  {
+    reader.Init(readdevicecount, hashreaddepth, directio, false);
+    reader.Start(readblocks, readdevices, 0, (size_t)blocksize, transferbuffer, (size_t)blocksize, hashbuffercount);
+  }
+  else
+  {
+    reader.Init(readdevicecount, readdepth, directio, chunksize < blocksize);
+    reader.Start(readblocks, readdevices, blockoffset, blocklength, transferbuffer, chunksize, transferbuffercount);
+  }
 
-  // For tracking input buffer availability
-  future<void> bufferavail[NUM_TRANSFER_BUFFERS];
-  u32 bufferindex = NUM_TRANSFER_BUFFERS - 1;
-  // Set all input buffers to available
-  for (i32 i = 0; i < NUM_TRANSFER_BUFFERS; i++)
+  if (noiselevel > nlNormal && blockoffset == 0 && firstoutput == 0)
   {
-    promise<void> stub;
-    bufferavail[i] = stub.get_future();
-    stub.set_value();
+    sout << "Reading with " << reader.EngineName() << " I/O, " << reader.Depth() << " reads in flight";
+    if (reader.Devices() > 1)
+      sout << " from " << reader.Devices() << " devices";
+    sout << endl;
+    if (hashing && blocklength < blocksize)
+      sout << "Reading " << (hashwholeblocks ? "whole blocks" : "the rest of each block") << " in the first pass to compute the hashes" << endl;
   }
 
   // Clear existing output data in backend
   parpar.discardOutput();
 
-  // For each input block
-  for ((sourceblock=sourceblocks.begin()),(inputblock=0);
-       sourceblock != sourceblocks.end();
-       ++sourceblock, ++inputblock)
+  // For each input block, in the order in which they are read
+  for (u32 processed = 0; processed < sourceblockcount; processed++)
   {
-    // Are we reading from a new file?
-    if (lastopenfile != (*sourceblock).GetDiskFile())
+    // Wait for the data from the next input block
+    u32 inputblock;
+    void *inputbuffer;
+    if (!reader.Next(inputblock, inputbuffer))
+      return false;
+
+    // Wait for ParPar backend to be ready, if busy
+    parpar.waitForAdd();
+    // Send block to backend
+    std::future<void> added = parpar.addInput(inputbuffer, blocklength, inputblock);
+
+    FileHasher *filehasher = 0;
+    if (hashing && hashwholeblocks && hashthreads > 1)
     {
-      // Close the last file
-      if (lastopenfile != NULL)
+      Par2CreatorSourceFile *sourcefile = blockfile[inputblock];
+      u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
+      if (filesize >= FILEHASHER_MIN_FILESIZE && sourcefile->BlockCount() > 1)
       {
-        lastopenfile->Close();
+        std::unique_ptr<FileHasher> &hasher = filehashers[sourcefile];
+        if (!hasher)
+          hasher.reset(new FileHasher(filesize, blocksize, hashthreads));
+        filehasher = hasher.get();
       }
+    }
 
-      // Open the new file
-      lastopenfile = (*sourceblock).GetDiskFile();
-      if (!lastopenfile->Open())
+    if (filehasher)
+    {
+      // The buffer can be reused once both the backend and the hasher
+      // have finished with it
+      Par2CreatorSourceFile *sourcefile = blockfile[inputblock];
+      u32 sourceindex = blockindex[inputblock];
+      u64 length = min(blocksize, sourcefile->GetDescriptionPacket()->FileSize() - sourceindex * blocksize);
+      std::future<void> hashed = filehasher->Start(inputbuffer, (size_t)length);
+      reader.Done(inputbuffer, std::async(std::launch::deferred, WaitForBoth, std::move(added), std::move(hashed)));
+
+      // Once all of the file has been hashed, its hasher is finished with
+      if (sourceindex + 1 == sourcefile->BlockCount())
       {
-        return false;
+        filehasher->Wait();
+        sourcefile->SetHashes(*filehasher);
+        filehashers.erase(sourcefile);
       }
     }
-
-    // Wait for next input buffer to become available
-    bufferindex = (bufferindex + 1) % NUM_TRANSFER_BUFFERS;
-    void *inputbuffer = (char*)transferbuffer + chunksize * bufferindex;
-    bufferavail[bufferindex].get();
-    
-    // Read data from the current input block
-    if (!sourceblock->ReadData(blockoffset, blocklength, inputbuffer))
-      return false;
-
-    // Wait for ParPar backend to be ready, if busy
-    parpar.waitForAdd();
-    // Send block to backend
-    bufferavail[bufferindex] = parpar.addInput(inputbuffer, blocklength, inputblock);
-
-    if (deferhashcomputation)
+    else
     {
-      assert(blockoffset == 0 && blocklength == blocksize);
-      assert(sourcefile != sourcefiles.end());
+      reader.Done(inputbuffer, std::move(added));
 
-      (*sourcefile)->UpdateHashes(sourceindex, inputbuffer, blocklength);
+      if (hashing)
+      {
+        // Whilst the backend processes the chunk, hash it and then the rest
+        // of the block
+        if (!HashBlock(inputblock, blockfile[inputblock], blockindex[inputblock], inputbuffer, blocklength))
+          return false;
+      }
     }
 
     if (noiselevel > nlQuiet)
@@ -812,81 +2764,219 @@ bool Par2Creator::ProcessData(u64 blockoffset, size_t blocklength)
         sout << "Processing: " << newfraction/10 << '.' << newfraction%10 << "%\r" << flush;
       }
     }
-
-    // Work out which source file the next block belongs to
-    if (++sourceindex >= (*sourcefile)->BlockCount())
-    {
-      sourceindex = 0;
-      ++sourcefile;
-    }
   }
 
   // Flush backend
   parpar.endInput().get();
 
-  // Close the last file
-  if (lastopenfile != NULL)
-  {
-    lastopenfile->Close();
-  }
+  // Close the files that were read
+  if (!reader.Finish())
+    return false;
+
+  if (noiselevel > nlNormal)
+    sout << "Read " << reader.BytesRead() << " bytes at " << reader.ReadRate() / 1048576 << " MB/s" << (directio ? " using direct I/O" : "") << endl;
 
   if (noiselevel > nlQuiet)
     sout << "Writing recovery packets\r";
 
-  if (recoveryblockcount > 0)
+  if (outputcount > 0)
   {
-    // For output, we only need two transfer buffers
-    future<bool> outbufavail[2];
-    // Prepare first output
-    outbufavail[0] = parpar.getOutput(0, transferbuffer);
+    // The transfer buffers are split into groups of outputs.  Once all of
+    // the outputs in a group are ready, the group is hashed and written on
+    // another thread, while the backend fills the other groups.  The
+    // recovery files of a group are written in parallel.
+    u32 groupsize = outputgroupsize;
+    u32 groupcount = (outputcount + groupsize - 1) / groupsize;
+    u32 outputbuffercount = groupsize * NUM_OUTPUT_GROUPS;
+    vector< future<bool> > outbufavail(outputbuffercount);
+    vector< vector<const void*> > groupbuffers(NUM_OUTPUT_GROUPS, vector<const void*>(groupsize));
+    vector< future<bool> > groupwritten(NUM_OUTPUT_GROUPS);
+
+    // Prepare the first outputs.  The outputs of the backend are numbered
+    // from the first output of this pass.
+    for (u32 output=0; output<outputbuffercount && output<outputcount; output++)
+    {
+      void *outputbuffer = (char*)transferbuffer + chunksize * output;
+      outbufavail[output] = parpar.getOutput(output, outputbuffer);
+    }
 
-    // For each output block
-    for (u32 outputblock=0; outputblock<recoveryblockcount;outputblock++)
+    bool success = true;
+
+    // For each group of outputs
+    for (u32 group=0; success && group<groupcount; group++)
     {
-      // Prepare next output
-      u32 nextoutputblock = outputblock + 1;
-      if (nextoutputblock < recoveryblockcount)
+      u32 slot = group % NUM_OUTPUT_GROUPS;
+      u32 first = firstoutput + group * groupsize;
+      u32 last = min(first + groupsize, firstoutput + outputcount);
+
+      for (u32 outputblock=first; outputblock<last; outputblock++)
       {
-        void *nextoutputbuffer = (char*)transferbuffer + chunksize * (nextoutputblock & 1);
-        outbufavail[nextoutputblock & 1] = parpar.getOutput(nextoutputblock, nextoutputbuffer);
+        u32 bufferindex = (outputblock - firstoutput) % outputbuffercount;
+
+        // Wait for current buffer to be available
+        if (!outbufavail[bufferindex].get())
+        {
+          serr << "Internal checksum failure in recovery packet " << recoverypackets[outputblock].Exponent() << endl;
+          success = false;
+          break;
+        }
+
+        void *outputbuffer = (char*)transferbuffer + chunksize * bufferindex;
+        groupbuffers[slot][outputblock - first] = outputbuffer;
       }
+      if (!success)
+        break;
+
+      // Hash and write the group on another thread
+      groupwritten[slot] = std::async(std::launch::async, &Par2Creator::WriteOutputGroup, this,
+                                      first, &groupbuffers[slot], blockoffset, blocklength);
 
-      // Wait for current buffer to be available
-      if (!outbufavail[outputblock & 1].get())
+      // Once the previous group has been written, reuse its buffers for
+      // the outputs which follow the last group that was requested
+      if (group > 0)
       {
-        serr << "Internal checksum failure in recovery packet " << recoverypackets[outputblock].Exponent() << endl;
-        return false;
+        if (!groupwritten[(group - 1) % NUM_OUTPUT_GROUPS].get())
+        {
+          success = false;
+          break;
+        }
+
+        u32 nextgroup = group - 1 + NUM_OUTPUT_GROUPS;
+        for (u32 nextoutput = nextgroup * groupsize;
+             nextoutput < (nextgroup + 1) * groupsize && nextoutput < outputcount;
+             nextoutput++)
+        {
+          void *nextoutputbuffer = (char*)transferbuffer + chunksize * (nextoutput % outputbuffercount);
+          outbufavail[nextoutput % outputbuffercount] = parpar.getOutput(nextoutput, nextoutputbuffer);
+        }
       }
-      
-      // Write the data to the recovery packet
-      void *outputbuffer = (char*)transferbuffer + chunksize * (outputblock & 1);
-      if (!recoverypackets[outputblock].WriteData(blockoffset, blocklength, outputbuffer))
-        return false;
     }
+
+    // Wait for the last groups to be written.  The buffers must not be
+    // freed while outputs are still pending.
+    for (u32 i=0; i<NUM_OUTPUT_GROUPS; i++)
+      if (groupwritten[i].valid() && !groupwritten[i].get())
+        success = false;
+    for (u32 i=0; i<outputbuffercount; i++)
+      if (outbufavail[i].valid()) outbufavail[i].wait();
+
+    if (!success)
+      return false;
   }
 
   if (noiselevel > nlQuiet)
-    sout << "Wrote " << recoveryblockcount * blocklength << " bytes to disk" << endl;
+    sout << "Wrote " << (u64)outputcount * blocklength << " bytes to disk" << endl;
 
   return true;
 }
 
-// Finish computation of the recovery packets and write the headers to disk.
-bool Par2Creator::WriteRecoveryPacketHeaders(void)
+// Update the hashes of a source file with a block which was read in the
+// first pass.  If only a chunk of the block was read, the rest of it is
+// read here, whilst the backend is busy with the chunk.
+bool Par2Creator::HashBlock(u32 inputblock, Par2CreatorSourceFile *sourcefile, u32 sourceindex, const void *buffer, size_t length)
 {
-  // For each recovery packet
-  for (vector<RecoveryPacket>::iterator recoverypacket = recoverypackets.begin();
-       recoverypacket != recoverypackets.end();
-       ++recoverypacket)
+  if (hashwholeblocks)
   {
-    // Finish the packet header and write it to disk
-    if (!recoverypacket->WriteHeader())
+    sourcefile->UpdateHashes(sourceindex, buffer, (size_t)blocksize);
+    return true;
+  }
+
+  sourcefile->UpdateHashes(sourceindex, 0, buffer, length, blocksize);
+
+  DataBlock *datablock = readblocks[inputblock];
+  if (length >= datablock->GetLength())
+    return true;
+
+  DiskFile *diskfile = datablock->GetDiskFile();
+  if (!filecache.Acquire(diskfile, directio))
+    return false;
+
+  for (u64 position = length; position < datablock->GetLength(); position += HASH_BUFFER_SIZE)
+  {
+    size_t want = (size_t)min((u64)HASH_BUFFER_SIZE, datablock->GetLength() - position);
+    if (!datablock->ReadData(position, want, hashbuffer))
+    {
+      filecache.Release(diskfile);
       return false;
+    }
+
+    sourcefile->UpdateHashes(sourceindex, position, hashbuffer, want, blocksize);
+  }
+
+  filecache.Release(diskfile);
+
+  return true;
+}
+
+// Hash a group of outputs and write them to the recovery files.  This is
+// done on a separate thread, while the backend prepares other outputs.
+bool Par2Creator::WriteOutputGroup(u32 first, const vector<const void*> *buffers, u64 blockoffset, size_t blocklength)
+{
+  packethasher.Update(first, &(*buffers)[0], blocklength);
+
+  u32 count = min(outputgroupsize, recoveryblockcount - first);
+
+  // Keep the crcs of what has been written to each packet, for the checkpoint
+  if (checkpointing)
+  {
+    vector<u32> &crcs = checkpoint.PacketCRCs();
+    for (u32 i=0; i<count; i++)
+      crcs[first + i] = CRCUpdateBlock(crcs[first + i], (u64)blocklength) ^ CRCCompute(blocklength, (*buffers)[i]);
+  }
+
+  // The outputs are in order of file and offset, so the outputs for each
+  // recovery file follow each other.  The chunks of the packets are never
+  // next to each other in a file, so each one is written separately.
+  vector<u32> files;
+  for (u32 i=0; i<count; i++)
+  {
+    if (i == 0 || recoverypackets[first + i].GetDataBlock()->GetDiskFile() != recoverypackets[first + i - 1].GetDataBlock()->GetDiskFile())
+      files.push_back(i);
+  }
+  files.push_back(count);
+
+  u32 threads = max((u32)1, min((u32)MAX_WRITE_THREADS, (u32)files.size() - 1));
+  if (threads == 1)
+    return WriteOutputFiles(first, buffers, blockoffset, blocklength, &files, 0, 1);
+
+  // Each thread writes whole files, so the writes to a file are still
+  // issued in order of offset
+  vector< future<bool> > results;
+  for (u32 t=0; t<threads; t++)
+    results.push_back(std::async(std::launch::async, &Par2Creator::WriteOutputFiles, this,
+                                 first, buffers, blockoffset, blocklength, &files, t, threads));
+
+  bool success = true;
+  for (u32 t=0; t<threads; t++)
+    if (!results[t].get())
+      success = false;
+
+  return success;
+}
+
+bool Par2Creator::WriteOutputFiles(u32 first, const vector<const void*> *buffers, u64 blockoffset, size_t blocklength,
+                                   const vector<u32> *files, u32 firstfile, u32 step)
+{
+  for (size_t file = firstfile; file + 1 < files->size(); file += step)
+  {
+    for (u32 i=(*files)[file]; i<(*files)[file + 1]; i++)
+    {
+      size_t wrote;
+      if (!recoverypackets[first + i].GetDataBlock()->WriteData(blockoffset, blocklength, (*buffers)[i], wrote))
+        return false;
+    }
   }
 
   return true;
 }
 
+// Finish computation of the recovery packets and write the headers to disk.
+bool Par2Creator::WriteRecoveryPacketHeaders(void)
+{
+  // Finish the packet hashes and write the headers to disk
+  return packethasher.WriteHeaders();
+}
+
 bool Par2Creator::FinishFileHashComputation(void)
 {
   // If we deferred the computation of the full file hash, then we finish it now
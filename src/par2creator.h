@@ -26,6 +26,32 @@
 class MainPacket;
 class CreatorPacket;
 class CriticalPacket;
+class DescriptionPacket;
+class VerificationPacket;
+
+// The recovery data is written in this many groups of outputs, so that
+// some groups can be written while others are being computed
+#define NUM_OUTPUT_GROUPS 3
+
+// The most recovery files which are written at once
+#define MAX_WRITE_THREADS 8
+
+// When whole blocks do not fit in memory, the first pass reads the rest
+// of each block, after the chunk which is processed, this much at a time
+#define HASH_BUFFER_SIZE (1048576)
+
+// Where a packet of an existing recovery set was found, when the set is
+// being extended or updated.  Recovery packets of any set are recorded,
+// but other packets only if they are from the set and undamaged.
+class ExistingPacket
+{
+public:
+  DiskFile     *diskfile;
+  u64           offset;
+  PACKET_HEADER header;
+  MD5Hash       fileid;   // Of a file description or file verification packet
+  u32           exponent; // Of a recovery packet
+};
 
 
 class Par2Creator
@@ -41,6 +67,9 @@ public:
 #ifdef _OPENMP
 		 const u32 filethreads,
 #endif
+		 const u32 readdepth,
+		 const bool directio,
+		 const bool checkpoint,
 		 const string &parfilename,
 		 const vector<string> &extrafiles,
 		 const u64 blocksize,
@@ -50,6 +79,37 @@ public:
 		 const u32 recoveryblockcount
 		 );
 
+  // Add recovery files to an existing recovery set, using the hashes
+  // which it already has for the source files
+  Result Extend(const size_t memorylimit,
+		const string &basepath,
+		const u32 nthreads,
+#ifdef _OPENMP
+		const u32 filethreads,
+#endif
+		const u32 readdepth,
+		const bool directio,
+		const string &parfilename,
+		const Scheme recoveryfilescheme,
+		const u32 recoveryfilecount,
+		const u32 recoveryblockcount,
+		const u32 redundancy
+		);
+
+  // Update an existing recovery set after some of its source files have
+  // been changed in place, by adding the changes to the recovery data
+  Result Update(const size_t memorylimit,
+		const string &basepath,
+		const u32 nthreads,
+#ifdef _OPENMP
+		const u32 filethreads,
+#endif
+		const u32 readdepth,
+		const bool directio,
+		const string &parfilename,
+		const vector<string> &extrafiles
+		);
+
 protected:
   // Steps in the creation process:
 
@@ -58,7 +118,10 @@ protected:
   bool ComputeBlockCount(const vector<string> &extrafiles);
 
   // Determine how much recovery data can be computed on one pass
-  bool CalculateProcessBlockSize(size_t memorylimit);
+  bool CalculateProcessBlockSize(size_t memorylimit, const string &basepath);
+
+  // Check that there is enough disk space for the recovery files
+  bool CheckFreeSpace(const string &par2filename);
 
   // Open all of the source files, compute the Hashes and CRC values, and store
   // the results in the file verification and file description packets.
@@ -67,6 +130,68 @@ protected:
   // Create the main packet and determine the set_id_hash to use with all packets
   bool CreateMainPacket(void);
 
+  // Steps in extending an existing recovery set:
+
+  // Load the critical packets of the recovery set, and find the first
+  // recovery block exponent which it does not already use.
+  bool LoadRecoverySet(const string &par2filename, string &setname);
+
+  // Load the main, file description and file verification packets from
+  // one of the files of the recovery set, and note where its packets are.
+  bool LoadPacketsFromFile(const string &filename);
+
+  // Open the source files described by the recovery set, using the
+  // Hashes and CRC values from its packets.
+  bool OpenExistingSourceFiles(const string &basepath);
+
+  // Steps in updating an existing recovery set:
+
+  // Compare the block Hashes and CRC values of the source files with those
+  // in the recovery set, and list the blocks which have changed.  Returns
+  // false if the files, or how they are divided into blocks, have changed.
+  bool FindChangedBlocks(void);
+
+  // Choose intact recovery blocks from which the old contents of the
+  // changed blocks can be recovered.
+  bool ChooseSolverBlocks(void);
+
+  // Check the packet hash of a packet of the recovery set.
+  bool VerifyExistingPacket(const ExistingPacket &packet);
+
+  // Add the changes to the recovery data, and write the packets again
+  // where they are.
+  Result UpdateRecoveryFiles(const size_t memorylimit, const u32 nthreads);
+
+  // Recover the old contents of the changed blocks, and add the difference
+  // to each recovery packet.
+  bool UpdateData(u64 blockoffset, size_t blocklength);
+
+  // Write the new critical packets over the old ones.
+  bool RewriteCriticalPackets(void);
+
+  // Save the packets of the set in undo journals before they are
+  // changed, and then either keep the changes or put the packets back.
+  bool WriteUpdateJournals(void);
+  bool CommitUpdateJournals(void);
+  void RollBackUpdateJournals(void);
+
+  // Delete the marker which shows that an update of the set was committed.
+  bool DeleteUpdateMarker(void);
+
+  // Replace the recovery files with new ones, with the same number of
+  // recovery blocks.  The old files are only removed once all of the
+  // new ones have been written.
+  Result RecreateRecoveryFiles(const size_t memorylimit, const u32 nthreads, const string &basepath, const string &setname);
+
+  // Delete the recovery files which have been created so far.
+  void DeleteRecoveryFiles(void);
+
+  // Steps shared by creating, extending and updating:
+
+  // Initialise the ParPar backend
+  Result InitialiseBackend(const u32 nthreads);
+  Result InitialiseBackend(PAR2Proc &proc, PAR2ProcCPU &proccpu, u32 inputcount, const u32 nthreads);
+
   // Create the creator packet.
   bool CreateCreatorPacket(void);
 
@@ -74,13 +199,46 @@ protected:
   bool CreateSourceBlocks(void);
 
   // Create all of the output files and allocate all packets to appropriate file offsets.
-  bool InitialiseOutputFiles(const string &par2filename);
+  // The file with no recovery blocks is only created if indexfile is set.
+  // Files which already exist are reused when reuse is set, rather
+  // than that being an error.  When suffix is given, it is added to the
+  // name of each file, and any file of that name is replaced.
+  bool InitialiseOutputFiles(const string &par2filename, bool indexfile, bool reuse, const string &suffix = string());
+
+  // Compute the recovery data and write all of the packets to the recovery files.
+  Result WriteRecoveryFiles(void);
 
   // Allocate memory buffers for reading and writing data to disk.
   bool AllocateBuffers(void);
 
   // Read source data, process it through the RS matrix and write it to disk.
-  bool ProcessData(u64 blockoffset, size_t blocklength);
+  bool ProcessData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount);
+
+  // Update the hashes of a source file with a block which was read in the
+  // first pass, reading the rest of the block if only a chunk of it was read.
+  bool HashBlock(u32 inputblock, Par2CreatorSourceFile *sourcefile, u32 sourceindex, const void *buffer, size_t length);
+
+  // Identify everything which decides what is written on each pass
+  MD5Hash CheckpointJobId(void) const;
+
+  // Carry on from the checkpoint of an interrupted create, if there is
+  // one which can be used.  firstpass is set to the first pass needed.
+  bool ResumeFromCheckpoint(u32 &firstpass);
+
+  // Check and hash the recovery data which the finished passes wrote
+  bool CheckWrittenData(u32 passes, bool &intact);
+
+  // Save the progress after a pass
+  bool SaveCheckpoint(u32 passes);
+
+  // Hash a group of outputs and write them to the recovery files
+  bool WriteOutputGroup(u32 first, const vector<const void*> *buffers, u64 blockoffset, size_t blocklength);
+
+  // Write the outputs of a group to every step'th of its recovery files,
+  // starting with the first.  The files are given by where their outputs
+  // start in the group.
+  bool WriteOutputFiles(u32 first, const vector<const void*> *buffers, u64 blockoffset, size_t blocklength,
+                        const vector<u32> *files, u32 firstfile, u32 step);
 
   // Finish computation of the recovery packets and write the headers to disk.
   bool WriteRecoveryPacketHeaders(void);
@@ -115,7 +273,22 @@ protected:
   size_t chunksize;   // How much of each block will be processed at a
                       // time (due to memory constraints).
 
-  void *transferbuffer;  // chunksize * num_transfer_buffers
+  void *transferbuffer;  // chunksize * transferbuffercount (or blocksize * hashbuffercount, if larger)
+  u32 transferbuffercount; // How many chunks the transfer buffer holds
+  u32 hashbuffercount;     // How many whole blocks it holds in the pass which computes the hashes
+  u32 outputgroupsize;     // How many outputs are written together
+  u32 outputpasssize;      // How many recovery blocks are computed on each pass
+                           // over the source data
+
+  u32 readdepth;         // How many block reads are kept in flight
+  u32 hashreaddepth;     // How many whole block reads are kept in flight in that pass
+  void *hashbuffer;      // Holds the rest of a block, when whole blocks are not read in that pass
+  bool directio;         // Whether source files are read bypassing the OS file cache
+  FileHandleCache filecache; // Keeps source files open between passes
+
+  vector<DataBlock*> readblocks; // The source blocks, in the order they are read
+  vector<u32> readdevices;       // Which device each source block is on
+  u32 readdevicecount;           // How many devices the source blocks are on
 
   u32 sourcefilecount;   // Number of source files for which recovery data will be computed.
   u32 sourceblockcount;  // Total number of data blocks that the source files will be
@@ -135,6 +308,28 @@ protected:
   MainPacket    *mainpacket;    // The main packet
   CreatorPacket *creatorpacket; // The creator packet
 
+  bool    firstpacket;          // Whether or not a valid packet has been found (when extending).
+  MD5Hash setid;                // The setid of the existing set (when extending).
+  MainPacket *existingmainpacket; // The main packet of the existing set (when updating).
+  map<MD5Hash, DescriptionPacket*>  descriptionpacketmap;  // Packets loaded from an existing set,
+  map<MD5Hash, VerificationPacket*> verificationpacketmap; // which no source file has taken.
+  vector<DiskFile*>      existingfiles;   // The files of an existing set.
+  vector<ExistingPacket> existingpackets; // Where the packets of the set are in them.
+
+  // When updating:
+  vector<u32>            changedblocks;   // The source blocks which have changed.
+  vector<const ExistingPacket*> solverpackets;  // Intact recovery packets used to recover
+  vector<DataBlock>      solverblocks;          // the old contents of those blocks.
+  ReedSolomon<Galois16>  rs;              // The RS matrix for recovering them.
+  PAR2Proc               solver;          // ParPar backend for recovering them.
+  PAR2ProcCPU            solvercpu;
+  vector<const ExistingPacket*> updatedpackets; // The recovery packets of the set, in the
+  vector<u32>            updatedoutputs;        // order of recoverypackets, and which
+  vector<MD5Context>     oldpackethashes;       // output of parpar each of them needs.
+  vector<DiskFile*>      journalledfiles; // The files of the set with an undo journal.
+  string                 updatemarker;    // Written when the update of the set is committed,
+  bool                   updatecommitted; // and whether one was found when loading the set.
+
   vector<Par2CreatorSourceFile*> sourcefiles;  // Array containing details of the source files
                                                // as well as the file verification and file
                                                // description packets for them.
@@ -143,6 +338,7 @@ protected:
 
   vector<DiskFile>           recoveryfiles;    // Array with one entry for every recovery file.
   vector<RecoveryPacket>     recoverypackets;  // Array with one entry for every recovery packet.
+  RecoveryPacketHasher       packethasher;     // Computes the hashes of the recovery packets.
 
   list<CriticalPacket*>      criticalpackets;  // A list of all of the critical packets.
   list<CriticalPacketEntry>  criticalpacketentries; // A list of which critical packet will
@@ -154,13 +350,20 @@ protected:
   u64 progress;     // How much data has been processed.
   u64 totaldata;    // Total amount of data to be processed.
 
-  bool deferhashcomputation; // If we have enough memory to compute all recovery data
-                             // in one pass, then we can defer the computation of
-                             // the full file hash and block crc and hashes until
-                             // the recovery data is computed.
+  bool deferhashcomputation; // The computation of the full file hash and block
+                             // crc and hashes is deferred until the first pass of
+                             // the recovery data computation.
+  bool hashwholeblocks;      // Whether that pass reads whole blocks.  If there is
+                             // not enough memory, it reads the chunk which is
+                             // processed, and then the rest of the block separately.
 #ifdef _OPENMP
   u64 mttotalsize;           // Total size of files for mt-progress line
 #endif
+
+  bool       checkpointing;  // Whether the progress is saved, so that the create can be resumed
+  bool       resuming;       // Whether an interrupted create left a checkpoint
+  string     checkpointname; // The file which the progress is saved in
+  Checkpoint checkpoint;     // The progress
 };
 
 #endif // __PAR2CREATOR_H__
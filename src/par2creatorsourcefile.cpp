@@ -39,6 +39,7 @@ Par2CreatorSourceFile::Par2CreatorSourceFile(void)
   //parfilename;
   blockcount = 0;
   hasher = HasherInput_Create();
+  hashesset = false;
 }
 
 Par2CreatorSourceFile::~Par2CreatorSourceFile(void)
@@ -54,9 +55,9 @@ Par2CreatorSourceFile::~Par2CreatorSourceFile(void)
 // in a file description packet and a file verification packet.
 
 #ifdef _OPENMP
-bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath, u64 totalsize, u64 &totalprogress)
+bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath, u32 hashthreads, u64 totalsize, u64 &totalprogress)
 #else
-bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath)
+bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath, u32 hashthreads)
 #endif
 {
   // Get the filename and filesize
@@ -86,9 +87,9 @@ bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std:
     return false;
 
   // Do we want to defer the computation of the full file hash, and
-  // the block crc and hashes. This is only permitted if there
-  // is sufficient memory available to create all recovery blocks
-  // in one pass of the source files (i.e. chunksize == blocksize)
+  // the block crc and hashes. This is only permitted if the first
+  // pass of the recovery block computation reads whole blocks
+  // (which it always does when chunksize == blocksize)
   if (deferhashcomputation)
   {
     // Initialise a buffer to read the first 16k of the source file
@@ -121,12 +122,23 @@ bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std:
   }
   else
   {
+    // A large file can have its blocks hashed on other threads, whilst
+    // the file hash is computed and the next part of the file is read
+    FileHasher *filehasher = 0;
+    if (hashthreads > 1 && filesize >= FILEHASHER_MIN_FILESIZE && blockcount > 1)
+      filehasher = new FileHasher(filesize, blocksize, hashthreads);
+
     // Initialise a buffer to read the source file
     size_t buffersize = 1024*1024;
     if (buffersize > min(blocksize,filesize))
       buffersize = (size_t)min(blocksize,filesize);
+    if (filehasher)
+      buffersize = FILEHASHER_BUFFER_SIZE;
     char *buffer = new char[buffersize];
 
+    // The file hasher needs a second buffer to read into
+    char *spare = filehasher ? new char[buffersize] : 0;
+
     // Get ready to start reading source file to compute the hashes and crcs
     u64 offset = 0;
     u32 blocknumber = 0;
@@ -143,8 +155,10 @@ bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std:
       // Read some data from the file into the buffer
       if (!diskfile->Read(offset, buffer, want))
       {
+        delete filehasher;
         diskfile->Close();
         delete [] buffer;
+        delete [] spare;
         return false;
       }
 
@@ -163,11 +177,20 @@ bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std:
         }
       }
 
+      if (filehasher)
+      {
+        // Hash what was just read, and read the next part of the
+        // file into the other buffer in the meantime
+        filehasher->Wait();
+        filehasher->Start(buffer, want);
+        std::swap(buffer, spare);
+      }
+
       // Get ready to update block hashes and crcs
       u32 used = 0;
 
       // Whilst we have not used all of the data we just read
-      while (used < want)
+      while (!filehasher && used < want)
       {
         // How much of it can we use for the current block
         u32 use = (u32)min(need, (u64)(want-used));
@@ -219,23 +242,39 @@ bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std:
       offset += want;
     }
 
-    // Did we finish the last block
-    if (need > 0)
-    {
-      MD5Hash blockhash;
-      u32 blockcrc = HasherGetBlock(hasher, blockhash, need);
+    MD5Hash filehash;
 
-      // Store the block hash and block crc in the file verification packet.
-      verificationpacket->SetBlockHashAndCRC(blocknumber, blockhash, blockcrc);
+    if (filehasher)
+    {
+      filehasher->Wait();
+      filehasher->Finish(filehash);
 
-      blocknumber++;
+      // Store the block hashes and block crcs in the file verification packet.
+      for (blocknumber=0; blocknumber<blockcount; blocknumber++)
+        verificationpacket->SetBlockHashAndCRC(blocknumber, filehasher->BlockHash(blocknumber), filehasher->BlockCRC(blocknumber));
 
-      need = 0;
+      delete filehasher;
+      delete [] spare;
     }
+    else
+    {
+      // Did we finish the last block
+      if (need > 0)
+      {
+        MD5Hash blockhash;
+        u32 blockcrc = HasherGetBlock(hasher, blockhash, need);
 
-    // Finish computing the file hash.
-    MD5Hash filehash;
-    hasher->end(filehash.hash);
+        // Store the block hash and block crc in the file verification packet.
+        verificationpacket->SetBlockHashAndCRC(blocknumber, blockhash, blockcrc);
+
+        blocknumber++;
+
+        need = 0;
+      }
+
+      // Finish computing the file hash.
+      hasher->end(filehash.hash);
+    }
 
     // Store the file hash in the file description packet.
     descriptionpacket->HashFull(filehash);
@@ -257,6 +296,76 @@ bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std:
   return true;
 }
 
+// Take the file description and file verification packets from an existing
+// recovery set, and open the source file that they describe.
+
+bool Par2CreatorSourceFile::Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, DescriptionPacket *_descriptionpacket, VerificationPacket *_verificationpacket, u64 blocksize, string basepath)
+{
+  descriptionpacket = _descriptionpacket;
+  verificationpacket = _verificationpacket;
+
+  // Work out where the file is on disk
+  parfilename = descriptionpacket->FileName();
+  diskfilename = basepath + DescriptionPacket::TranslateFilenameFromPar2ToLocal(sout, serr, noiselevel, parfilename);
+
+  filesize = descriptionpacket->FileSize();
+  blockcount = (u32)((filesize + blocksize-1) / blocksize);
+
+  if (blockcount != (verificationpacket == 0 ? 0 : verificationpacket->BlockCount()))
+  {
+    serr << "The recovery set does not have the block hashes of \"" << parfilename << "\"." << endl;
+    return false;
+  }
+
+  if (!DiskFile::FileExists(diskfilename))
+  {
+    serr << "The source file \"" << diskfilename << "\" does not exist." << endl;
+    return false;
+  }
+
+  if (DiskFile::GetFileSize(diskfilename) != filesize)
+  {
+    serr << "The source file \"" << diskfilename << "\" has changed since the recovery set was created." << endl;
+    return false;
+  }
+
+  // Create the diskfile object
+  diskfile = new DiskFile(sout, serr);
+
+  // Open the source file
+  if (!diskfile->Open(diskfilename, filesize))
+    return false;
+
+  // Check the first 16k of the file, which catches most changes to it
+  // without reading the whole file
+  size_t buffersize = 16 * 1024;
+  if (buffersize > filesize)
+    buffersize = (size_t)filesize;
+  char *buffer = new char[buffersize];
+
+  if (!diskfile->Read(0, buffer, buffersize))
+  {
+    diskfile->Close();
+    delete [] buffer;
+    return false;
+  }
+
+  MD5Context context;
+  context.Update(buffer, buffersize);
+  delete [] buffer;
+  MD5Hash hash;
+  context.Final(hash);
+
+  if (hash != descriptionpacket->Hash16k())
+  {
+    serr << "The source file \"" << diskfilename << "\" has changed since the recovery set was created." << endl;
+    diskfile->Close();
+    return false;
+  }
+
+  return true;
+}
+
 void Par2CreatorSourceFile::Close(void)
 {
   diskfile->Close();
@@ -268,7 +377,8 @@ void Par2CreatorSourceFile::RecordCriticalPackets(list<CriticalPacket*> &critica
   // Add the file description packet and file verification packet to
   // the critical packet list.
   criticalpackets.push_back(descriptionpacket);
-  criticalpackets.push_back(verificationpacket);
+  if (verificationpacket != 0)
+    criticalpackets.push_back(verificationpacket);
 }
 
 bool Par2CreatorSourceFile::CompareLess(const Par2CreatorSourceFile* const &left, const Par2CreatorSourceFile* const &right)
@@ -317,10 +427,36 @@ void Par2CreatorSourceFile::UpdateHashes(u32 blocknumber, const void *buffer, si
   verificationpacket->SetBlockHashAndCRC(blocknumber, blockhash, blockcrc);
 }
 
+void Par2CreatorSourceFile::UpdateHashes(u32 blocknumber, u64 blockoffset, const void *buffer, size_t length, u64 blocksize)
+{
+  // Requires: deferhashcomputation must've been true
+
+  // How much of the block is within the file
+  const u64 blocklength = min(blocksize, filesize - (u64)blocknumber * blocksize);
+  if (blockoffset >= blocklength)
+    return;
+  if ((u64)length > blocklength - blockoffset)
+    length = (size_t)(blocklength - blockoffset);
+
+  hasher->update(buffer, length);
+
+  // Finish the crc and hash of the block with its last part
+  if (blockoffset + length == blocklength)
+  {
+    MD5Hash blockhash;
+    u32 blockcrc = HasherGetBlock(hasher, blockhash, blocksize - blocklength);
+
+    verificationpacket->SetBlockHashAndCRC(blocknumber, blockhash, blockcrc);
+  }
+}
+
 void Par2CreatorSourceFile::FinishHashes(void)
 {
   // Requires: deferhashcomputation must've been true
 
+  if (hashesset)
+    return;
+
   // Finish computation of the full file hash
   MD5Hash hash;
   hasher->end(hash.hash);
@@ -328,3 +464,28 @@ void Par2CreatorSourceFile::FinishHashes(void)
   // Store it in the description packet
   descriptionpacket->HashFull(hash);
 }
+
+void Par2CreatorSourceFile::SetHashes(const MD5Hash &hashfull, const FILEVERIFICATIONENTRY *entries)
+{
+  for (u32 blocknumber = 0; blocknumber < blockcount; blocknumber++)
+  {
+    verificationpacket->SetBlockHashAndCRC(blocknumber, entries[blocknumber].hash, entries[blocknumber].crc);
+  }
+
+  descriptionpacket->HashFull(hashfull);
+  hashesset = true;
+}
+
+void Par2CreatorSourceFile::SetHashes(FileHasher &filehasher)
+{
+  MD5Hash hashfull;
+  filehasher.Finish(hashfull);
+
+  for (u32 blocknumber = 0; blocknumber < blockcount; blocknumber++)
+  {
+    verificationpacket->SetBlockHashAndCRC(blocknumber, filehasher.BlockHash(blocknumber), filehasher.BlockCRC(blocknumber));
+  }
+
+  descriptionpacket->HashFull(hashfull);
+  hashesset = true;
+}
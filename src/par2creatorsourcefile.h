@@ -24,6 +24,7 @@
 class DescriptionPacket;
 class VerificationPacket;
 class DiskFile;
+class FileHasher;
 
 // The Par2CreatorSourceFile contains the file verification and file description
 // packet for one source file.
@@ -40,12 +41,20 @@ public:
   ~Par2CreatorSourceFile(void);
 
   // Open the source file and compute the Hashes and CRCs.
+  // A large file has its blocks hashed on up to hashthreads threads.
   //bool Open(NoiseLevel noiselevel, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath);
 #ifdef _OPENMP
-  bool Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath, u64 totalsize, u64 &totalprogress);
+  bool Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath, u32 hashthreads, u64 totalsize, u64 &totalprogress);
 #else
-  bool Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath);
+  bool Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, const string &extrafile, u64 blocksize, bool deferhashcomputation, string basepath, u32 hashthreads);
 #endif
+
+  // Open the source file described by the file description and file
+  // verification packets of an existing recovery set.  The packets are
+  // used as they are, and the file is only checked against its size and
+  // the hash of its first 16k.
+  bool Open(NoiseLevel noiselevel, std::ostream &sout, std::ostream &serr, DescriptionPacket *descriptionpacket, VerificationPacket *verificationpacket, u64 blocksize, string basepath);
+
   void Close(void);
 
   // Recover the file description and file verification packets
@@ -64,12 +73,29 @@ public:
   // Update the file hash and the block crc and hashes
   void UpdateHashes(u32 blocknumber, const void *buffer, size_t length);
 
-  // Finish computation of the file hash
+  // Update the file hash and the block crc and hashes with part of a
+  // block.  The parts must be given in order, and the block is finished
+  // with its last part.
+  void UpdateHashes(u32 blocknumber, u64 blockoffset, const void *buffer, size_t length, u64 blocksize);
+
+  // Finish computation of the file hash, unless the hashes were set
   void FinishHashes(void);
 
+  // Use the file hash and the block crc and hashes which were computed
+  // by an earlier run, instead of computing them from the data
+  void SetHashes(const MD5Hash &hashfull, const FILEVERIFICATIONENTRY *entries);
+
+  // Use the file hash and the block crc and hashes which a FileHasher
+  // has computed from all of the data of the file
+  void SetHashes(FileHasher &filehasher);
+
   // How many blocks does this source file use
   u32 BlockCount(void) const {return blockcount;}
 
+  // The file description and file verification packets
+  const DescriptionPacket* GetDescriptionPacket(void) const {return descriptionpacket;}
+  const VerificationPacket* GetVerificationPacket(void) const {return verificationpacket;}
+
 protected:
   DescriptionPacket  *descriptionpacket;  // The file description packet.
   VerificationPacket *verificationpacket; // The file verification packet.
@@ -82,6 +108,7 @@ protected:
   u32    blockcount;    // How many blocks the file will be divided into.
 
   IHasherInput* hasher;  // hasher context used to calculate block and file hashes
+  bool          hashesset; // The hashes were set rather than computed with hasher
 };
 
 #endif // __PAR2CREATORSOURCEFILE_H__
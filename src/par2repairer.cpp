@@ -43,10 +43,13 @@ Par2Repairer::Par2Repairer(std::ostream &sout, std::ostream &serr, const NoiseLe
 , basepath()
 , setid()
 , recoverypacketmap()
+, alternatepackets()
 , diskFileMap()
 , sourcefilemap()
 , sourcefiles()
 , verifylist()
+, inplacelist()
+, inplaceblocks()
 , backuplist()
 , par2list()
 , sourceblocks()
@@ -58,6 +61,8 @@ Par2Repairer::Par2Repairer(std::ostream &sout, std::ostream &serr, const NoiseLe
 , copyblocks()
 , outputblocks()
 , rs()
+, packetindex(sout, serr)
+, checkpoint(sout, serr)
 {
   setup_hasher();
 
@@ -70,6 +75,7 @@ Par2Repairer::Par2Repairer(std::ostream &sout, std::ostream &serr, const NoiseLe
 
   blocksize = 0;
   chunksize = 0;
+  outputpasssize = 0;
 
   sourceblockcount = 0;
   availableblockcount = 0;
@@ -85,6 +91,19 @@ Par2Repairer::Par2Repairer(std::ostream &sout, std::ostream &serr, const NoiseLe
   missingfilecount = 0;
 
   transferbuffer = 0;
+  transferbuffercount = NUM_TRANSFER_BUFFERS;
+  readdepth = DEFAULT_READ_DEPTH;
+  directio = false;
+  inplace = false;
+  ondemand = false;
+  mapfiles = false;
+  deferloading = false;
+  usepacketindex = false;
+  indexedfilecount = 0;
+  readdevicecount = 1;
+
+  checkpointing = false;
+  resuming = false;
 
   progress = 0;
   totaldata = 0;
@@ -99,7 +118,11 @@ Par2Repairer::Par2Repairer(std::ostream &sout, std::ostream &serr, const NoiseLe
 
 Par2Repairer::~Par2Repairer(void)
 {
-  delete [] (u8*)transferbuffer;
+  // The cached files are about to be deleted
+  filecache.Clear();
+
+  if (transferbuffer)
+    ALIGN_FREE(transferbuffer);
 
   parpar.deinit();
 
@@ -111,6 +134,14 @@ Par2Repairer::~Par2Repairer(void)
     ++rp;
   }
 
+  multimap<u32,RecoveryPacket*>::iterator ap = alternatepackets.begin();
+  while (ap != alternatepackets.end())
+  {
+    delete (*ap).second;
+
+    ++ap;
+  }
+
   map<MD5Hash,Par2RepairerSourceFile*>::iterator sf = sourcefilemap.begin();
   while (sf != sourcefilemap.end())
   {
@@ -131,6 +162,14 @@ Result Par2Repairer::Process(
 #ifdef _OPENMP
 			     const u32 _filethreads,
 #endif
+			     const u32 _readdepth,
+			     const bool _directio,
+			     const bool _inplace,
+			     const bool _checkpoint,
+			     const bool _ondemand,
+			     const bool _mapfiles,
+			     const bool _packetindex,
+			     const bool _rebuildpacketindex,
 			     string parfilename,
 			     const vector<string> &_extrafiles,
 			     const bool dorepair,   // derived from operation
@@ -142,6 +181,13 @@ Result Par2Repairer::Process(
 #ifdef _OPENMP
   filethreads = _filethreads;
 #endif
+  if (_readdepth != 0)
+    readdepth = _readdepth;
+  directio = _directio;
+  inplace = _inplace;
+  checkpointing = _checkpoint;
+  ondemand = _ondemand;
+  mapfiles = _mapfiles;
 
   // Should we skip data whilst scanning files
   skipdata = _skipdata;
@@ -159,10 +205,21 @@ Result Par2Repairer::Process(
 
   par2list.push_back(parfilename);
 
+  // Load the index of where the packets are in the PAR2 files.  When it is
+  // rebuilt, what it holds is ignored, and it is replaced.
+  usepacketindex = _packetindex || _rebuildpacketindex;
+  if (usepacketindex && !_rebuildpacketindex)
+    packetindex.Load(PacketIndex::FileName(searchpath + name));
+
   // Load packets from the main PAR2 file
   if (!LoadPacketsFromFile(searchpath + name))
     return eLogicError;
 
+  // If the recovery volumes are loaded on demand, and the main PAR2 file
+  // has all of the critical packets, the other PAR2 files are put off
+  // until it is known how many recovery blocks are needed
+  deferloading = ondemand && HaveCriticalPackets();
+
   // Load packets from other PAR2 files with names based on the original PAR2 file
   if (!LoadPacketsFromOtherFiles(parfilename))
     return eLogicError;
@@ -171,6 +228,8 @@ Result Par2Repairer::Process(
   if (!LoadPacketsFromExtraFiles(extrafiles))
     return eLogicError;
 
+  deferloading = false;
+
   if (noiselevel > nlQuiet)
     sout << endl;
 
@@ -183,6 +242,21 @@ Result Par2Repairer::Process(
   if (!CreateSourceFileList())
     return eLogicError;
 
+  // Undo any in-place repair which was interrupted, so that the files
+  // are verified as they were before it started
+  if (dorepair && !RollBackInterruptedRepairs())
+    return eFileIOError;
+
+  // An interrupted repair may have left a checkpoint, as well as the
+  // files which it had started to write
+  if (dorepair && checkpointing)
+  {
+    checkpointname = Checkpoint::FileName(searchpath + name);
+    resuming = checkpoint.Load(checkpointname);
+    if (resuming)
+      UseCheckpointFiles(extrafiles);
+  }
+
   // Determine the total number of DataBlocks for the recoverable source files
   // The allocate the DataBlocks and assign them to each source file
   if (!AllocateSourceBlocks())
@@ -215,6 +289,24 @@ Result Par2Repairer::Process(
   if (noiselevel > nlSilent)
     sout << endl;
 
+  // Load the recovery volumes which are needed for the repair
+  if (!LoadNeededVolumes())
+    return eLogicError;
+
+  // Make sure that the recovery blocks which the repair would use are not
+  // damaged, before saying whether repair is possible
+  if (!CheckNeededRecoveryPackets())
+    return eFileIOError;
+
+  // Record where the packets are in the PAR2 files which were searched
+  if (usepacketindex)
+  {
+    if (noiselevel > nlQuiet)
+      sout << "Used the packet index for " << indexedfilecount << " of the PAR2 files." << endl << endl;
+
+    packetindex.Save(PacketIndex::FileName(searchpath + name));
+  }
+
   // Check the verification results and report the results
   if (!CheckVerificationResults())
     return eRepairNotPossible;
@@ -275,43 +367,120 @@ Result Par2Repairer::Process(
         if (sourceblockcount < 12)
           inputbatch = sourceblockcount;
 
-        if (!parparcpu.init(GF16_AUTO, inputbatch) || !parpar.setRecoverySlices(missingblockcount))
+        if (!parparcpu.init(GF16_AUTO, inputbatch) || !parpar.setRecoverySlices(outputpasssize))
         {
           DeleteIncompleteTargetFiles();
           return eMemoryError;
         }
 
         // Set the total amount of data to be processed.
+        u32 outputpasses = outputpasssize == 0 ? 1 : (missingblockcount + outputpasssize - 1) / outputpasssize;
         progress = 0;
-        totaldata = blocksize * sourceblockcount;
+        totaldata = blocksize * sourceblockcount * outputpasses;
+
+        // Save what will be overwritten in the files being repaired in place
+        if (!WriteUndoJournals())
+        {
+          DeleteIncompleteTargetFiles();
+          return eFileIOError;
+        }
+
+        // Copy as much of the intact data as possible without reading it
+        CopyIntactBlocks();
+
+        // Carry on from where an interrupted repair stopped
+        u32 firstpass = 0;
+        if (checkpointing && !ResumeFromCheckpoint(firstpass))
+        {
+          DeleteIncompleteTargetFiles();
+          return eFileIOError;
+        }
+        u32 slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+        u32 pass = 0;
 
-        // Start at an offset of 0 within a block.
-        u64 blockoffset = 0;
-        while (blockoffset < blocksize) // Continue until the end of the block.
+        // Each pass over the missing blocks reads all of the input blocks
+        u32 firstoutput = 0;
+        do
         {
-          // Work out how much data to process this time.
-          size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
-          if (!parpar.setCurrentSliceSize(blocklength))
+          u32 outputcount = min(outputpasssize, missingblockcount - firstoutput);
+          if (!parpar.setRecoverySlices(outputcount))
           {
             DeleteIncompleteTargetFiles();
             return eMemoryError;
           }
 
-          // Read source data, process it through the RS matrix and write it to disk.
-          if (!ProcessData(blockoffset, blocklength))
+          // Start at an offset of 0 within a block.
+          u64 blockoffset = 0;
+          while (blockoffset < blocksize) // Continue until the end of the block.
           {
-            // Delete all of the partly reconstructed files
-            DeleteIncompleteTargetFiles();
-            return eFileIOError;
+            // Work out how much data to process this time.
+            size_t blocklength = (size_t)min((u64)chunksize, blocksize-blockoffset);
+
+            // Skip the passes which were finished before the repair was interrupted
+            if (pass < firstpass)
+            {
+              progress += (u64)blocklength * sourceblockcount;
+            }
+            else
+            {
+              if (!parpar.setCurrentSliceSize(blocklength))
+              {
+                DeleteIncompleteTargetFiles();
+                return eMemoryError;
+              }
+
+              // Read source data, process it through the RS matrix and write it to disk.
+              if (!ProcessData(blockoffset, blocklength, firstoutput, outputcount))
+              {
+                // Delete all of the partly reconstructed files
+                DeleteIncompleteTargetFiles();
+                return eFileIOError;
+              }
+
+              // Save the progress, unless there is nothing left to do
+              if (checkpointing && pass + 1 < outputpasses * slicepasses && !SaveCheckpoint(pass + 1))
+              {
+                DeleteIncompleteTargetFiles();
+                return eFileIOError;
+              }
+            }
+
+            // Advance to the need offset within each block
+            blockoffset += blocklength;
+            pass++;
           }
 
-          // Advance to the need offset within each block
-          blockoffset += blocklength;
+          firstoutput += outputpasssize;
+        } while (firstoutput < missingblockcount);
+
+        // Close the files that were kept open between passes
+        if (noiselevel > nlNormal && filecache.Misses() > 0)
+        {
+          u64 opens = filecache.Hits() + filecache.Misses();
+          sout << "Open file cache: " << filecache.Hits() << " of " << opens << " file accesses found the file open ("
+               << 100 * filecache.Hits() / opens << "%), " << filecache.Evictions() << " files closed to stay within "
+               << filecache.Capacity() << " open files" << endl;
+        }
+        filecache.Clear();
+
+        // All of the repaired data has been written, so the checkpoint is
+        // not needed
+        if (checkpointing && !checkpoint.Remove(checkpointname))
+        {
+          DeleteIncompleteTargetFiles();
+          return eFileIOError;
         }
 
         if (noiselevel > nlSilent)
           sout << endl << "Verifying repaired files:" << endl << endl;
 
+        // Check the blocks which were written to the files repaired in place
+        if (!VerifyInPlaceFiles())
+        {
+          DeleteIncompleteTargetFiles();
+          return eFileIOError;
+        }
+
         // Verify that all of the reconstructed target files are now correct
         if (!VerifyTargetFiles(basepath))
         {
@@ -343,6 +512,9 @@ Result Par2Repairer::Process(
   {
     RemoveBackupFiles();
     RemoveParFiles();
+
+    if (usepacketindex)
+      packetindex.Remove(PacketIndex::FileName(searchpath + name));
   }
 
   return eSuccess;
@@ -351,48 +523,220 @@ Result Par2Repairer::Process(
 // Load the packets from the specified file
 bool Par2Repairer::LoadPacketsFromFile(string filename)
 {
-  // Skip the file if it has already been processed
-  if (diskFileMap.Find(filename) != 0)
+  return LoadPacketsFromFiles(vector<string>(1, filename));
+}
+
+// Load the packets from the specified files.  The files are searched
+// for packets in parallel, and the packets which are found are then
+// added in the order of the files, exactly as if the files had been
+// loaded one at a time, so which packets are used does not depend on
+// which file was searched first.
+bool Par2Repairer::LoadPacketsFromFiles(const vector<string> &filenames)
+{
+  // Skip files which have already been processed, or which are listed
+  // twice, even under different names
+  vector<string> names;
+  {
+    std::set<string> seen;
+    for (vector<string>::const_iterator f=filenames.begin(); f!=filenames.end(); ++f)
+    {
+      string filename = DiskFile::GetCanonicalPathname(*f);
+      if (diskFileMap.Find(filename) == 0 && seen.insert(filename).second)
+        names.push_back(filename);
+    }
+  }
+
+  // Put the files off if they are to be loaded on demand
+  if (deferloading)
   {
+    deferredvolumes.insert(deferredvolumes.end(), names.begin(), names.end());
     return true;
   }
 
-  DiskFile *diskfile = new DiskFile(sout, serr);
+  vector<DiskFile*> diskfiles(names.size(), (DiskFile*)0);
+  vector< vector<FoundPacket> > foundpackets(names.size());
+  vector<bool> indexed(names.size(), false);
+
+  // Only show the progress of the search if there is just one file
+  bool showprogress = names.size() == 1;
 
-  // Open the file
-  if (!diskfile->Open(filename))
+  #pragma omp parallel for schedule(dynamic) num_threads(Par2Repairer::GetFileThreads())
+  for (int i=0; i<(int)names.size(); i++)
   {
-    // If we could not open the file, ignore the error and
-    // proceed to the next file
-    delete diskfile;
-    return true;
+    DiskFile *diskfile = new DiskFile(sout, serr);
+
+    // Open the file
+    if (!diskfile->Open(names[i]))
+    {
+      // If we could not open the file, ignore the error and
+      // proceed to the next file
+      delete diskfile;
+      continue;
+    }
+
+    // Use the packet index if the file has not changed, or else search it
+    if (usepacketindex && FindIndexedPackets(diskfile, foundpackets[i]))
+      indexed[i] = true;
+    else
+      FindPackets(diskfile, foundpackets[i], showprogress);
+
+    // We have finished with the file for now
+    diskfile->Close();
+
+    diskfiles[i] = diskfile;
   }
 
-  if (noiselevel > nlSilent)
+  for (size_t i=0; i<names.size(); i++)
   {
-    string path;
-    string name;
-    DiskFile::SplitFilename(filename, path, name);
-    sout << "Loading \"" << name << "\"." << endl;
+    if (diskfiles[i] == 0)
+      continue;
+
+    if (usepacketindex)
+    {
+      if (indexed[i])
+      {
+        indexedfilecount++;
+      }
+      else
+      {
+        // Remember what was found in the file
+        vector<PacketIndex::Packet> packets(foundpackets[i].size());
+        for (size_t j=0; j<packets.size(); j++)
+        {
+          packets[j].offset = foundpackets[i][j].offset;
+          packets[j].header = foundpackets[i][j].header;
+          packets[j].exponent = foundpackets[i][j].exponent;
+        }
+        packetindex.Add(names[i], packets);
+      }
+    }
+
+    LoadFoundPackets(diskfiles[i], foundpackets[i]);
   }
 
-  // How many useable packets have we found
-  u32 packets = 0;
+  return true;
+}
 
-  // How many recovery packets were there
-  u32 recoverypackets = 0;
+// Get the packets in a file from the packet index, if the file has not
+// changed since it was searched.  The critical packets are small, so their
+// hashes are checked again, and if any of them is wrong the file is
+// searched instead.  The hashes of the recovery packets are checked if
+// they are used for a repair.
+bool Par2Repairer::FindIndexedPackets(DiskFile *diskfile, vector<FoundPacket> &packets)
+{
+  vector<PacketIndex::Packet> indexedpackets;
+  if (!packetindex.Find(diskfile->FileName(), indexedpackets))
+    return false;
+
+  vector<u8> buffer;
+  for (vector<PacketIndex::Packet>::const_iterator ip=indexedpackets.begin(); ip!=indexedpackets.end(); ++ip)
+  {
+    FoundPacket packet;
+    packet.offset = ip->offset;
+    packet.header = ip->header;
+    packet.exponent = ip->exponent;
+    packet.checked = recoveryblockpacket_type != ip->header.type;
+
+    if (packet.checked)
+    {
+      MD5Context context;
+      context.Update(&packet.header.setid, sizeof(PACKET_HEADER)-offsetof(PACKET_HEADER, setid));
+
+      u64 current = packet.offset + sizeof(PACKET_HEADER);
+      u64 limit = packet.offset + packet.header.length;
+      while (current < limit)
+      {
+        size_t want = (size_t)min((u64)1048576, limit-current);
+        buffer.resize(want);
+        if (!diskfile->Read(current, &buffer[0], want))
+          break;
+
+        context.Update(&buffer[0], want);
+        current += want;
+      }
+
+      MD5Hash hash;
+      context.Final(hash);
+      if (current < limit || hash != packet.header.hash)
+      {
+        packets.clear();
+        return false;
+      }
+    }
+
+    packets.push_back(packet);
+  }
+
+  return true;
+}
+
+// Make sure that the buffer holds the part of the file which starts at
+// offset and is length bytes long.  If it does not, readsize bytes of
+// the file are read into the buffer from offset.
+static bool FillPacketBuffer(DiskFile *diskfile, u8 *buffer, u64 &bufferoffset, size_t &bufferlength,
+                             u64 offset, size_t length, size_t readsize)
+{
+  if (offset >= bufferoffset && offset + length <= bufferoffset + bufferlength)
+    return true;
+
+  readsize = (size_t)min((u64)max(readsize, length), diskfile->FileSize() - offset);
+  if (!diskfile->Read(offset, buffer, readsize))
+  {
+    bufferlength = 0;
+    return false;
+  }
+
+  bufferoffset = offset;
+  bufferlength = readsize;
+  return true;
+}
+
+// Find the first place in the buffer where the packet magic starts.
+// memchr() is vectorised by the C library, so the first byte of the
+// magic is searched for with it, and only the places where that is
+// found are compared with the whole magic.
+static const u8* FindPacketMagic(const u8 *current, const u8 *end)
+{
+  while (end - current >= (ptrdiff_t)sizeof(MAGIC))
+  {
+    current = (const u8*)memchr(current, packet_magic.magic[0], (end - current) - sizeof(MAGIC) + 1);
+    if (current == 0)
+      break;
+
+    if (0 == memcmp(current, &packet_magic, sizeof(MAGIC)))
+      return current;
+
+    current++;
+  }
+
+  return end;
+}
 
+// Search a file for packets whose hash is correct.  Nothing is changed
+// other than the list of packets, so several files can be searched at once.
+void Par2Repairer::FindPackets(DiskFile *diskfile, vector<FoundPacket> &packets, bool showprogress)
+{
   // How big is the file
   u64 filesize = diskfile->FileSize();
   if (filesize > 0)
   {
     // Allocate a buffer to read data into
-    // The buffer should be large enough to hold a whole
-    // critical packet (i.e. file verification, file description, main,
-    // and creator), but not necessarily a whole recovery packet.
+    // The file is read a buffer at a time, and the packet headers, and the
+    // critical packets (i.e. file verification, file description, main,
+    // and creator), which are in the buffer are used from there.  Only
+    // the packets which extend beyond the buffer need another read.
     size_t buffersize = (size_t)min((u64)1048576, filesize);
     u8 *buffer = new u8[buffersize];
 
+    // Which part of the file is in the buffer
+    u64 bufferoffset = 0;
+    size_t bufferlength = 0;
+
+    // How much to read when the next header is not in the buffer.  After
+    // a recovery packet whose data was not read, the next packet is most
+    // likely another one, so only its header and exponent are read.
+    size_t readsize = buffersize;
+
     // Progress indicator
     u64 progress = 0;
 
@@ -402,7 +746,7 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
     // Continue as long as there is at least enough for the packet header
     while (offset + sizeof(PACKET_HEADER) <= filesize)
     {
-      if (noiselevel > nlQuiet)
+      if (showprogress && noiselevel > nlQuiet)
       {
         // Update a progress indicator
         u32 oldfraction = (u32)(1000 * progress / filesize);
@@ -414,56 +758,33 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
         }
       }
 
-      // Attempt to read the next packet header
-      PACKET_HEADER header;
-      if (!diskfile->Read(offset, &header, sizeof(header)))
+      if (!FillPacketBuffer(diskfile, buffer, bufferoffset, bufferlength, offset, sizeof(PACKET_HEADER), readsize))
         break;
+      readsize = buffersize;
 
-      // Does this look like it might be a packet
-      if (packet_magic != header.magic)
+      // Look for the magic in what has been read
+      const u8 *end = &buffer[bufferlength];
+      const u8 *current = FindPacketMagic(&buffer[offset - bufferoffset], end);
+      if (current == end)
       {
-        offset++;
-
-        // Is there still enough for at least a whole packet header
-        while (offset + sizeof(PACKET_HEADER) <= filesize)
-        {
-          // How much can we read into the buffer
-          size_t want = (size_t)min((u64)buffersize, filesize-offset);
-
-          // Fill the buffer
-          if (!diskfile->Read(offset, buffer, want))
-          {
-            offset = filesize;
-            break;
-          }
-
-          // Scan the buffer for the magic value
-          u8 *current = buffer;
-          u8 *limit = &buffer[want-sizeof(PACKET_HEADER)];
-          while (current <= limit && packet_magic != ((PACKET_HEADER*)current)->magic)
-          {
-            current++;
-          }
-
-          // What file offset did we reach
-          offset += current-buffer;
-
-          // Did we find the magic
-          if (current <= limit)
-          {
-            memcpy(&header, current, sizeof(header));
-            break;
-          }
-        }
+        // The magic might start in the last few bytes of the buffer
+        offset = bufferoffset + bufferlength - (sizeof(MAGIC) - 1);
+        continue;
+      }
+      offset = bufferoffset + (current - buffer);
 
-        // Did we reach the end of the file
-        if (offset + sizeof(PACKET_HEADER) > filesize)
-        {
-          break;
-        }
+      // Did we reach the end of the file
+      if (offset + sizeof(PACKET_HEADER) > filesize)
+      {
+        break;
       }
 
       // We have found the magic
+      if (!FillPacketBuffer(diskfile, buffer, bufferoffset, bufferlength, offset, sizeof(PACKET_HEADER), buffersize))
+        break;
+
+      PACKET_HEADER header;
+      memcpy(&header, &buffer[offset - bufferoffset], sizeof(header));
 
       // Check the packet length
       if (sizeof(PACKET_HEADER) > header.length || // packet length is too small
@@ -474,41 +795,112 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
         continue;
       }
 
-      // Compute the MD5 Hash of the packet
-      MD5Context context;
-      context.Update(&header.setid, sizeof(header)-offsetof(PACKET_HEADER, setid));
+      // The exponent of a recovery packet follows its header
+      u32 exponent = 0;
+      if (recoveryblockpacket_type == header.type && header.length > sizeof(RECOVERYBLOCKPACKET))
+      {
+        if (!FillPacketBuffer(diskfile, buffer, bufferoffset, bufferlength, offset, sizeof(RECOVERYBLOCKPACKET), buffersize))
+          break;
+        exponent = ((const RECOVERYBLOCKPACKET*)&buffer[offset - bufferoffset])->exponent;
+      }
 
-      // How much more do I need to read to get the whole packet
-      u64 current = offset+sizeof(PACKET_HEADER);
-      u64 limit = offset+header.length;
-      while (current < limit)
+      // Once the set and its block size are known, a recovery packet of the
+      // set is accepted from its header, and its hash is only checked if its
+      // data is used for a repair.  Hashing all of the recovery data would
+      // otherwise be most of the work of loading, even if nothing is damaged.
+      bool checked = firstpacket ||
+                     mainpacket == 0 ||
+                     recoveryblockpacket_type != header.type ||
+                     setid != header.setid ||
+                     header.length != sizeof(RECOVERYBLOCKPACKET) + mainpacket->BlockSize();
+
+      if (checked)
       {
-        size_t want = (size_t)min((u64)buffersize, limit-current);
+        // Compute the MD5 Hash of the packet
+        MD5Context context;
+        context.Update(&header.setid, sizeof(header)-offsetof(PACKET_HEADER, setid));
+
+        // Hash the rest of the packet, using what is already in the buffer
+        u64 current = offset+sizeof(PACKET_HEADER);
+        u64 limit = offset+header.length;
+        while (current < limit)
+        {
+          size_t want = (size_t)min((u64)buffersize, limit-current);
 
-        if (!diskfile->Read(current, buffer, want))
-          break;
+          if (current >= bufferoffset && current < bufferoffset + bufferlength)
+            want = (size_t)min((u64)want, bufferoffset + bufferlength - current);
+          else if (!FillPacketBuffer(diskfile, buffer, bufferoffset, bufferlength, current, want, buffersize))
+            break;
 
-        context.Update(buffer, want);
+          context.Update(&buffer[current - bufferoffset], want);
 
-        current += want;
-      }
+          current += want;
+        }
 
-      // Did the whole packet get processed
-      if (current<limit)
-      {
-        offset++;
-        continue;
-      }
+        // Did the whole packet get processed
+        if (current<limit)
+        {
+          offset++;
+          continue;
+        }
 
-      // Check the calculated packet hash against the value in the header
-      MD5Hash hash;
-      context.Final(hash);
-      if (hash != header.hash)
+        // Check the calculated packet hash against the value in the header
+        MD5Hash hash;
+        context.Final(hash);
+        if (hash != header.hash)
+        {
+          offset++;
+          continue;
+        }
+      }
+      else
       {
-        offset++;
-        continue;
+        readsize = sizeof(RECOVERYBLOCKPACKET);
       }
 
+      // Remember where the packet is, to be loaded later
+      FoundPacket packet;
+      packet.offset = offset;
+      packet.header = header;
+      packet.exponent = exponent;
+      packet.checked = checked;
+      packets.push_back(packet);
+
+      // Advance to the next packet
+      offset += header.length;
+    }
+
+    delete [] buffer;
+  }
+}
+
+// Load the packets which were found in a file
+void Par2Repairer::LoadFoundPackets(DiskFile *diskfile, const vector<FoundPacket> &foundpackets)
+{
+  if (noiselevel > nlSilent)
+  {
+    string path;
+    string name;
+    DiskFile::SplitFilename(diskfile->FileName(), path, name);
+    sout << "Loading \"" << name << "\"." << endl;
+  }
+
+  // How many useable packets have we found
+  u32 packets = 0;
+
+  // How many recovery packets were there
+  u32 recoverypackets = 0;
+
+  // How many alternate recovery packets were there before
+  size_t alternates = alternatepackets.size();
+
+  if (!foundpackets.empty() && diskfile->Open())
+  {
+    for (vector<FoundPacket>::const_iterator fp=foundpackets.begin(); fp!=foundpackets.end(); ++fp)
+    {
+      PACKET_HEADER header = fp->header;
+      u64 offset = fp->offset;
+
       // If this is the first packet that we have found then record the setid
       if (firstpacket)
       {
@@ -522,7 +914,7 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
         // Is it a packet type that we are interested in
         if (recoveryblockpacket_type == header.type)
         {
-          if (LoadRecoveryPacket(diskfile, offset, header))
+          if (LoadRecoveryPacket(diskfile, offset, header, fp->exponent, fp->checked))
           {
             recoverypackets++;
             packets++;
@@ -557,19 +949,14 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
           }
         }
       }
-
-      // Advance to the next packet
-      offset += header.length;
     }
 
-    delete [] buffer;
+    // We have finished with the file for now
+    diskfile->Close();
   }
 
-  // We have finished with the file for now
-  diskfile->Close();
-
   // Did we actually find any interesting packets
-  if (packets > 0)
+  if (packets > 0 || alternatepackets.size() > alternates)
   {
     if (noiselevel > nlQuiet)
     {
@@ -588,33 +975,46 @@ bool Par2Repairer::LoadPacketsFromFile(string filename)
       sout << "No new packets found" << endl;
     delete diskfile;
   }
-
-  return true;
 }
 
 // Finish loading a recovery packet
-bool Par2Repairer::LoadRecoveryPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header)
+bool Par2Repairer::LoadRecoveryPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 exponent, bool checked)
 {
   RecoveryPacket *packet = new RecoveryPacket;
 
-  // Load the packet from disk
-  if (!packet->Load(diskfile, offset, header))
+  // Load the packet, whose exponent was found with it
+  if (!packet->Load(diskfile, offset, header, exponent, checked))
   {
     delete packet;
     return false;
   }
 
-  // What is the exponent value of this recovery packet
-  u32 exponent = packet->Exponent();
-
   // Try to insert the new packet into the recovery packet map
   pair<map<u32,RecoveryPacket*>::const_iterator, bool> location = recoverypacketmap.insert(pair<u32,RecoveryPacket*>(exponent, packet));
 
   // Did the insert fail
   if (!location.second)
   {
-    // The packet must be a duplicate of one we already have
-    delete packet;
+    RecoveryPacket *existing = location.first->second;
+
+    // The packet is a duplicate of one we already have, unless the hash of
+    // one of them has not been checked, in which case either one could be
+    // damaged.  A checked packet is preferred, and when neither has been
+    // checked the new one is kept in case the other turns out to be damaged.
+    if (existing->Checked())
+    {
+      delete packet;
+      return false;
+    }
+
+    if (packet->Checked())
+    {
+      alternatepackets.insert(pair<u32,RecoveryPacket*>(exponent, existing));
+      recoverypacketmap[exponent] = packet;
+      return true;
+    }
+
+    alternatepackets.insert(pair<u32,RecoveryPacket*>(exponent, packet));
     return false;
   }
 
@@ -844,10 +1244,7 @@ bool Par2Repairer::LoadPacketsFromOtherFiles(string filename)
     par2list.merge(*filesu);
 
     // Load packets from each file that was found
-    for (list<string>::const_iterator s=par2list.begin(); s!=par2list.end(); ++s)
-    {
-      LoadPacketsFromFile(*s);
-    }
+    LoadPacketsFromFiles(vector<string>(par2list.begin(), par2list.end()));
 
     // delete files;  Taken care of by unique_ptr<>
     // delete filesu;
@@ -856,26 +1253,313 @@ bool Par2Repairer::LoadPacketsFromOtherFiles(string filename)
   return true;
 }
 
+// Whether a file is a PAR2 file, from whether its name contains ".par2".
+// The files kept next to a PAR2 file, such as "name.par2index", and the
+// ".tmp" files which replace them, are not.
+static bool IsPar2FileName(const string &filename)
+{
+  if (string::npos == filename.find(".par2") &&
+      string::npos == filename.find(".PAR2"))
+    return false;
+
+  string name = filename;
+  if (name.size() >= 4 && 0 == stricmp(name.substr(name.size()-4).c_str(), ".tmp"))
+    name = name.substr(0, name.size()-4);
+
+  const char *suffixes[] = {".par2index", ".par2undo", ".par2checkpoint", ".par2commit"};
+  for (u32 i=0; i<sizeof(suffixes)/sizeof(suffixes[0]); i++)
+  {
+    size_t length = strlen(suffixes[i]);
+    if (name.size() >= length && 0 == stricmp(name.substr(name.size()-length).c_str(), suffixes[i]))
+      return false;
+  }
+
+  return true;
+}
+
 // Load packets from any other PAR2 files whose names are given on the command line
 bool Par2Repairer::LoadPacketsFromExtraFiles(const vector<string> &extrafiles)
 {
+  vector<string> filenames;
+
   for (vector<string>::const_iterator i=extrafiles.begin(); i!=extrafiles.end(); i++)
   {
     string filename = *i;
 
     // If the filename contains ".par2" anywhere
-    if (string::npos != filename.find(".par2") ||
-        string::npos != filename.find(".PAR2"))
+    if (IsPar2FileName(filename))
     {
-      LoadPacketsFromFile(filename);
+      filenames.push_back(filename);
     }
   }
 
-  return true;
+  return LoadPacketsFromFiles(filenames);
 }
 
-// Check that the packets are consistent and discard any that are not
-bool Par2Repairer::CheckPacketConsistency(void)
+// Are all of the critical packets for the files in the set loaded
+bool Par2Repairer::HaveCriticalPackets(void) const
+{
+  if (mainpacket == 0)
+    return false;
+
+  for (u32 filenumber=0; filenumber<mainpacket->TotalFileCount(); filenumber++)
+  {
+    map<MD5Hash, Par2RepairerSourceFile*>::const_iterator sf = sourcefilemap.find(mainpacket->FileId(filenumber));
+    if (sf == sourcefilemap.end() || sf->second->GetDescriptionPacket() == 0)
+      return false;
+
+    // The recoverable files also need their verification packets
+    if (filenumber < mainpacket->RecoverableFileCount() && sf->second->GetVerificationPacket() == 0)
+      return false;
+  }
+
+  return true;
+}
+
+// How many recovery blocks a volume which has not been loaded holds.
+// This is taken from the "+NNN" in a name such as "name.vol012+010.par2",
+// or failing that, is the most that would fit in the size of the file.
+u32 Par2Repairer::VolumeBlockCount(const string &filename) const
+{
+  string path;
+  string name;
+  DiskFile::SplitFilename(filename, path, name);
+
+  string::size_type where = name.find_last_of('.');
+  if (where != string::npos && 0 == stricmp(name.substr(where+1).c_str(), "par2"))
+  {
+    string::size_type plus = name.find_last_of('+', where);
+    string::size_type vol = name.find_last_of('.', where-1);
+    if (plus != string::npos && vol != string::npos && plus > vol &&
+        0 == stricmp(name.substr(vol+1, 3).c_str(), "vol"))
+    {
+      string count = name.substr(plus+1, where-plus-1);
+      if (!count.empty() && count.size() <= 5 && string::npos == count.find_first_not_of("0123456789"))
+        return (u32)atoi(count.c_str());
+    }
+  }
+
+  return (u32)min((u64)65535, DiskFile::GetFileSize(filename) / (sizeof(RECOVERYBLOCKPACKET) + blocksize));
+}
+
+// Load as few of the recovery volumes which were put off as will give
+// enough recovery blocks for the repair.  Of the sets of volumes which
+// have enough blocks, the one with the fewest blocks is chosen, so that
+// as little as possible is read, and then the one with fewest volumes.
+bool Par2Repairer::LoadNeededVolumes(void)
+{
+  while (recoverypacketmap.size() < missingblockcount && !deferredvolumes.empty())
+  {
+    u32 needed = missingblockcount - (u32)recoverypacketmap.size();
+
+    vector<u32> blockcounts;
+    u32 mostblocks = 0;
+    for (vector<string>::const_iterator v=deferredvolumes.begin(); v!=deferredvolumes.end(); ++v)
+    {
+      blockcounts.push_back(VolumeBlockCount(*v));
+      mostblocks = max(mostblocks, blockcounts.back());
+    }
+
+    // volumes[total] is the fewest volumes whose blocks add up to total,
+    // and taken[i][total] is whether volume i is one of them
+    const u32 none = ~(u32)0;
+    u32 limit = needed + mostblocks;
+    vector<u32> volumes(limit+1, none);
+    vector< vector<bool> > taken(blockcounts.size(), vector<bool>(limit+1, false));
+    volumes[0] = 0;
+    for (size_t i=0; i<blockcounts.size(); i++)
+    {
+      u32 count = blockcounts[i];
+      if (count == 0)
+        continue;
+
+      for (u32 total=limit; total>=count; total--)
+      {
+        if (volumes[total-count] != none && volumes[total-count] + 1 < volumes[total])
+        {
+          volumes[total] = volumes[total-count] + 1;
+          taken[i][total] = true;
+        }
+      }
+    }
+
+    // The fewest blocks which are enough.  If no volumes are, all of them
+    // are loaded, as the counts could be wrong.
+    vector<string> chosen;
+    u32 total = needed;
+    while (total <= limit && volumes[total] == none)
+      total++;
+    if (total > limit)
+    {
+      chosen.swap(deferredvolumes);
+    }
+    else
+    {
+      vector<bool> load(blockcounts.size(), false);
+      for (size_t i=blockcounts.size(); i-- > 0 && total > 0; )
+      {
+        if (taken[i][total])
+        {
+          load[i] = true;
+          total -= blockcounts[i];
+        }
+      }
+
+      vector<string> remaining;
+      for (size_t i=0; i<blockcounts.size(); i++)
+        (load[i] ? chosen : remaining).push_back(deferredvolumes[i]);
+      deferredvolumes.swap(remaining);
+    }
+
+    if (noiselevel > nlSilent)
+      sout << "Loading " << chosen.size() << " of the recovery volumes for " << needed << " more recovery blocks." << endl;
+
+    if (!LoadPacketsFromFiles(chosen))
+      return false;
+
+    DiscardBadRecoveryPackets();
+
+    if (noiselevel > nlSilent)
+      sout << endl;
+  }
+
+  return true;
+}
+
+// Discard recovery packets which do not have the block size of the set
+void Par2Repairer::DiscardBadRecoveryPackets(void)
+{
+  map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
+  while (rp != recoverypacketmap.end())
+  {
+    if (rp->second->BlockSize() == blocksize)
+    {
+      ++rp;
+    }
+    else
+    {
+      serr << "Incorrect sized recovery block for exponent " << rp->second->Exponent() << " discarded" << endl;
+
+      delete rp->second;
+      map<u32,RecoveryPacket*>::iterator x = rp++;
+      recoverypacketmap.erase(x);
+    }
+  }
+
+  multimap<u32,RecoveryPacket*>::iterator ap = alternatepackets.begin();
+  while (ap != alternatepackets.end())
+  {
+    if (ap->second->BlockSize() == blocksize)
+    {
+      ++ap;
+    }
+    else
+    {
+      delete ap->second;
+      multimap<u32,RecoveryPacket*>::iterator x = ap++;
+      alternatepackets.erase(x);
+    }
+  }
+
+  PromoteAlternatePackets();
+}
+
+// Use an alternate recovery packet for each exponent which has none
+void Par2Repairer::PromoteAlternatePackets(void)
+{
+  multimap<u32,RecoveryPacket*>::iterator ap = alternatepackets.begin();
+  while (ap != alternatepackets.end())
+  {
+    if (recoverypacketmap.insert(pair<u32,RecoveryPacket*>(ap->first, ap->second)).second)
+    {
+      multimap<u32,RecoveryPacket*>::iterator x = ap++;
+      alternatepackets.erase(x);
+    }
+    else
+    {
+      ++ap;
+    }
+  }
+}
+
+// Check the hashes of the recovery packets which a repair would use: the
+// first of them in order of exponent, as chosen by ComputeRSmatrix().  Those
+// which were accepted from their headers when they were loaded are read in
+// full.  A damaged packet is discarded, and another takes its place, which
+// may mean loading more of the recovery volumes which were put off.  This
+// is done before the results of the verification are reported, so that a
+// repair which cannot succeed does not change any of the files.
+bool Par2Repairer::CheckNeededRecoveryPackets(void)
+{
+  if (recoverypacketmap.size() < missingblockcount)
+    return true;
+
+  vector<u8> buffer((size_t)min(blocksize, (u64)1048576));
+
+  for (;;)
+  {
+    u32 damaged = 0;
+    u32 needed = missingblockcount;
+
+    map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
+    while (rp != recoverypacketmap.end() && needed > 0)
+    {
+      RecoveryPacket *packet = rp->second;
+      if (!packet->Checked())
+      {
+        DiskFile *diskfile = packet->GetDataBlock()->GetDiskFile();
+        if (!filecache.Acquire(diskfile))
+          return false;
+
+        packet->StartCheck();
+        bool success = true;
+        for (u64 position = 0; success && position < blocksize; position += buffer.size())
+        {
+          size_t length = (size_t)min((u64)buffer.size(), blocksize - position);
+          success = packet->GetDataBlock()->ReadData(position, length, &buffer[0]);
+          if (success)
+            packet->UpdateCheck(&buffer[0], length);
+        }
+        filecache.Release(diskfile);
+
+        if (!success || !packet->FinishCheck())
+        {
+          if (noiselevel > nlSilent)
+          {
+            string path;
+            string name;
+            DiskFile::SplitFilename(diskfile->FileName(), path, name);
+            sout << "Recovery block " << packet->Exponent() << " in \"" << name << "\" is damaged." << endl;
+          }
+
+          delete packet;
+          map<u32,RecoveryPacket*>::iterator x = rp++;
+          recoverypacketmap.erase(x);
+          damaged++;
+          continue;
+        }
+      }
+
+      ++rp;
+      needed--;
+    }
+
+    if (damaged == 0)
+      return true;
+
+    // A packet with the same exponent which was kept aside can be used
+    // instead, or else more of the recovery volumes which were put off
+    PromoteAlternatePackets();
+    if (!LoadNeededVolumes())
+      return false;
+
+    if (recoverypacketmap.size() < missingblockcount)
+      return true;
+  }
+}
+
+// Check that the packets are consistent and discard any that are not
+bool Par2Repairer::CheckPacketConsistency(void)
 {
   // Do we have a main packet
   if (0 == mainpacket)
@@ -892,24 +1576,7 @@ bool Par2Repairer::CheckPacketConsistency(void)
 
   // Check that the recovery blocks have the correct amount of data
   // and discard any that don't
-  {
-    map<u32,RecoveryPacket*>::iterator rp = recoverypacketmap.begin();
-    while (rp != recoverypacketmap.end())
-    {
-      if (rp->second->BlockSize() == blocksize)
-      {
-        ++rp;
-      }
-      else
-      {
-        serr << "Incorrect sized recovery block for exponent " << rp->second->Exponent() << " discarded" << endl;
-
-        delete rp->second;
-        map<u32,RecoveryPacket*>::iterator x = rp++;
-        recoverypacketmap.erase(x);
-      }
-    }
-  }
+  DiscardBadRecoveryPackets();
 
   // Check for source files that have no description packet or where the
   // verification packet has the wrong number of entries and discard them.
@@ -1283,6 +1950,16 @@ bool Par2Repairer::VerifySourceFiles(const std::string& basepath, std::vector<st
 
       finalresult = false;
     }
+    else if (ResumesTargetFile(sourcefile))
+    {
+      // The file was being rebuilt when the repair was interrupted, so it
+      // is treated as missing, and rebuilt from the same data as before
+      if (noiselevel > nlSilent)
+      {
+        #pragma omp critical
+        sout << "Target: \"" << name << "\" - being repaired." << endl;
+      }
+    }
     else
     {
       DiskFile *diskfile = new DiskFile(sout, serr);
@@ -1352,8 +2029,7 @@ bool Par2Repairer::VerifyExtraFiles(const vector<string> &extrafiles, const stri
       string filename = extrafiles[i];
 
       // If the filename does not include ".par2" we are interested in it.
-      if (string::npos == filename.find(".par2") &&
-          string::npos == filename.find(".PAR2"))
+      if (!IsPar2FileName(filename))
       {
         filename = DiskFile::GetCanonicalPathname(filename);
 
@@ -1621,7 +2297,7 @@ bool Par2Repairer::ScanDataFile(DiskFile                *diskfile,    // [in]
   }
 
   // Create the checksummer for the file and start reading from it
-  FileCheckSummer filechecksummer(diskfile, blocksize, windowtable);
+  FileCheckSummer filechecksummer(diskfile, blocksize, windowtable, mapfiles);
   if (!filechecksummer.Start())
     return false;
 
@@ -2218,6 +2894,110 @@ bool Par2Repairer::CheckVerificationResults(void)
   return true;
 }
 
+// Put back any files whose in-place repair did not finish, using the
+// undo journals which were left next to them.
+bool Par2Repairer::RollBackInterruptedRepairs(void)
+{
+  u32 filenumber = 0;
+  vector<Par2RepairerSourceFile*>::iterator sf = sourcefiles.begin();
+
+  while (sf != sourcefiles.end() && filenumber < mainpacket->TotalFileCount())
+  {
+    string filename = (*sf)->TargetFileName();
+
+    if (UndoJournal::Exists(filename))
+    {
+      string path;
+      string name;
+      DiskFile::SplitFilename(filename, path, name);
+
+      if (noiselevel > nlSilent)
+        sout << "Undoing the unfinished repair of \"" << name << "\"." << endl;
+
+      DiskFile targetfile(sout, serr);
+      if (!targetfile.OpenForWrite(filename))
+        return false;
+
+      UndoJournal journal(sout, serr);
+      bool success = journal.RollBack(targetfile);
+      targetfile.Close();
+
+      if (!success)
+        return false;
+    }
+
+    ++sf;
+    ++filenumber;
+  }
+
+  return true;
+}
+
+// Is the source block at the right place in the target file already
+static bool BlockIsInPlace(const DataBlock &sourceblock, const DiskFile *targetfile, u64 offset, u64 length)
+{
+  u64 fileoffset;
+  return sourceblock.IsSet() &&
+         sourceblock.GetDiskFile() == targetfile &&
+         sourceblock.ReadExtent(0, (size_t)length, fileoffset) == length &&
+         fileoffset == offset;
+}
+
+// A damaged file can be repaired in place if none of the blocks which will
+// be written to it overlap any of the data which will be read from it.
+// The written blocks are verified individually afterwards, so the file
+// must also have block hashes.
+bool Par2Repairer::CanRepairInPlace(const Par2RepairerSourceFile *sourcefile) const
+{
+  const DiskFile *targetfile = sourcefile->GetTargetFile();
+
+  if (sourcefile->GetCompleteFile() != 0 || sourcefile->GetVerificationPacket() == 0)
+    return false;
+
+  // Find the parts of the file which will be read, merging those
+  // which overlap or touch
+  vector< pair<u64, u64> > reads;
+  for (vector<DataBlock>::const_iterator sb = sourceblocks.begin(); sb != sourceblocks.end(); ++sb)
+  {
+    if (sb->IsSet() && sb->GetDiskFile() == targetfile)
+    {
+      u64 fileoffset;
+      size_t length = sb->ReadExtent(0, (size_t)sb->GetLength(), fileoffset);
+      if (length > 0)
+        reads.push_back(pair<u64, u64>(fileoffset, fileoffset + length));
+    }
+  }
+  sort(reads.begin(), reads.end());
+
+  vector< pair<u64, u64> > merged;
+  for (vector< pair<u64, u64> >::const_iterator r = reads.begin(); r != reads.end(); ++r)
+  {
+    if (!merged.empty() && r->first <= merged.back().second)
+      merged.back().second = max(merged.back().second, r->second);
+    else
+      merged.push_back(*r);
+  }
+
+  // Check each of the blocks which will be written
+  u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
+  vector<DataBlock>::const_iterator sb = sourcefile->SourceBlocks();
+  for (u64 offset = 0; offset < filesize; offset += blocksize, ++sb)
+  {
+    u64 length = min(blocksize, filesize - offset);
+    if (BlockIsInPlace(*sb, targetfile, offset, length))
+      continue;
+
+    // The last read which starts before the end of the block is the
+    // only one which can overlap it
+    vector< pair<u64, u64> >::const_iterator r =
+      lower_bound(merged.begin(), merged.end(), pair<u64, u64>(offset + length, 0));
+    if (r != merged.begin() && (r-1)->second > offset)
+      return false;
+  }
+
+  return true;
+}
+
 // Rename any damaged or missnamed target files.
 bool Par2Repairer::RenameTargetFiles(void)
 {
@@ -2235,20 +3015,43 @@ bool Par2Repairer::RenameTargetFiles(void)
     {
       DiskFile *targetfile = sourcefile->GetTargetFile();
 
-      // Rename it
-      diskFileMap.Remove(targetfile);
+      bool repairinplace = false;
+      if (inplace)
+      {
+        repairinplace = CanRepairInPlace(sourcefile);
 
-      if (!targetfile->Rename())
-        return false;
+        if (!repairinplace && noiselevel > nlSilent)
+        {
+          string path;
+          string name;
+          DiskFile::SplitFilename(targetfile->FileName(), path, name);
+          sout << "\"" << name << "\" cannot be repaired in place, so it will be rebuilt." << endl;
+        }
+      }
+
+      if (repairinplace)
+      {
+        // Keep it, and write the damaged blocks into it
+        inplacelist.push_back(sourcefile);
+      }
+      else
+      {
+        // Rename it
+        diskFileMap.Remove(targetfile);
 
-      backuplist.push_back(targetfile);
+        if (!targetfile->Rename())
+          return false;
 
-      bool success = diskFileMap.Insert(targetfile);
-      assert(success);
+        backuplist.push_back(targetfile);
+        backupnames[DiskFile::GetCanonicalPathname(sourcefile->TargetFileName())] = DiskFile::GetCanonicalPathname(targetfile->FileName());
 
-      // We no longer have a target file
-      sourcefile->SetTargetExists(false);
-      sourcefile->SetTargetFile(0);
+        bool success = diskFileMap.Insert(targetfile);
+        assert(success);
+
+        // We no longer have a target file
+        sourcefile->SetTargetExists(false);
+        sourcefile->SetTargetFile(0);
+      }
     }
 
     ++sf;
@@ -2290,6 +3093,14 @@ bool Par2Repairer::RenameTargetFiles(void)
     ++filenumber;
   }
 
+  // The damaged files which an interrupted repair renamed are backups too
+  for (vector<string>::const_iterator b = resumedbackups.begin(); b != resumedbackups.end(); ++b)
+  {
+    DiskFile *diskfile = diskFileMap.Find(*b);
+    if (diskfile != 0)
+      backuplist.push_back(diskfile);
+  }
+
   return true;
 }
 
@@ -2300,6 +3111,73 @@ bool Par2Repairer::CreateTargetFiles(void)
   u32 filenumber = 0;
   vector<Par2RepairerSourceFile*>::iterator sf = sourcefiles.begin();
 
+  // Work out how much space the missing files need in each directory
+  map<string, u64> spaceneeded;
+  while (sf != sourcefiles.end() && filenumber < mainpacket->TotalFileCount())
+  {
+    // The files which an interrupted repair created already have their size
+    if (!(*sf)->GetTargetExists() && !ResumesTargetFile(*sf))
+    {
+      string path;
+      string name;
+      DiskFile::SplitFilename((*sf)->TargetFileName(), path, name);
+      spaceneeded[path] += (*sf)->GetDescriptionPacket()->FileSize();
+    }
+
+    ++sf;
+    ++filenumber;
+  }
+
+  // Add up the space for directories which are on the same device, so
+  // that a lack of space is found before any of the files are created.
+  // A directory whose device cannot be found is checked on its own.
+  struct DeviceSpace
+  {
+    string path;
+    u64    needed;
+    u64    available;
+  };
+  map<pair<u64, string>, DeviceSpace> devicespace;
+  for (map<string, u64>::const_iterator s = spaceneeded.begin(); s != spaceneeded.end(); ++s)
+  {
+    // The directory may not exist yet, in which case look at its parent
+    string path = s->first;
+    u64 available = DiskFile::GetFreeSpace(path);
+    while (available == ~(u64)0 && path.size() > 1)
+    {
+      string parent;
+      string name;
+      DiskFile::SplitFilename(path.substr(0, path.size() - 1), parent, name);
+      if (parent == path)
+        break;
+      path = parent;
+      available = DiskFile::GetFreeSpace(path);
+    }
+
+    u64 device = DiskFile::GetDeviceId(path);
+    pair<u64, string> key(device, device != 0 ? string() : s->first);
+
+    map<pair<u64, string>, DeviceSpace>::iterator d = devicespace.find(key);
+    if (d == devicespace.end())
+    {
+      DeviceSpace space = {s->first, 0, available};
+      d = devicespace.insert(make_pair(key, space)).first;
+    }
+    d->second.needed += s->second;
+  }
+
+  for (map<pair<u64, string>, DeviceSpace>::const_iterator d = devicespace.begin(); d != devicespace.end(); ++d)
+  {
+    if (d->second.needed > d->second.available)
+    {
+      serr << "There is not enough disk space in " << d->second.path << " to repair the missing files: " << d->second.needed << " bytes are needed but only " << d->second.available << " bytes are free." << endl;
+      return false;
+    }
+  }
+
+  filenumber = 0;
+  sf = sourcefiles.begin();
+
   // Create any missing target files
   while (sf != sourcefiles.end() && filenumber < mainpacket->TotalFileCount())
   {
@@ -2312,8 +3190,12 @@ bool Par2Repairer::CreateTargetFiles(void)
       string filename = sourcefile->TargetFileName();
       u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
 
-      // Create the target file
-      if (!targetfile->Create(filename, filesize))
+      // Create the target file, or use the one which an interrupted
+      // repair had started to write
+      bool created = ResumesTargetFile(sourcefile) ?
+                     targetfile->OpenForWrite(filename) && targetfile->SetFileSize(filesize) :
+                     targetfile->Create(filename, filesize);
+      if (!created)
       {
         delete targetfile;
         return false;
@@ -2351,9 +3233,40 @@ bool Par2Repairer::CreateTargetFiles(void)
     ++filenumber;
   }
 
-  return true;
-}
-
+  // Allocate target data blocks in the files being repaired in place,
+  // for those blocks which are not already where they belong
+  for (vector<Par2RepairerSourceFile*>::iterator ip = inplacelist.begin(); ip != inplacelist.end(); ++ip)
+  {
+    Par2RepairerSourceFile *sourcefile = *ip;
+    DiskFile *targetfile = sourcefile->GetTargetFile();
+    u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
+
+    if (targetfile->IsOpen())
+      targetfile->Close();
+    if (!targetfile->OpenForWrite())
+      return false;
+
+    u64 offset = 0;
+    vector<DataBlock>::iterator sb = sourcefile->SourceBlocks();
+    vector<DataBlock>::iterator tb = sourcefile->TargetBlocks();
+
+    while (offset < filesize)
+    {
+      u64 length = min(blocksize, filesize-offset);
+
+      tb->SetLength(length);
+      if (!BlockIsInPlace(*sb, targetfile, offset, length))
+        tb->SetLocation(targetfile, offset);
+
+      offset += blocksize;
+      ++sb;
+      ++tb;
+    }
+  }
+
+  return true;
+}
+
 // Work out which data blocks are available, which need to be copied
 // directly to the output, and which need to be recreated, and compute
 // the appropriate Reed Solomon matrix.
@@ -2459,16 +3372,70 @@ bool Par2Repairer::AllocateBuffers(size_t memorylimit)
   // Would single pass processing use too much memory
   if (blocksize * missingblockcount > memorylimit)
   {
-    // Pick a size that is small enough
-    chunksize = ~3 & (memorylimit / missingblockcount);
+    // Choose whether to reconstruct part of each block, or only some of
+    // the missing blocks, on each pass, depending on how costly it is to
+    // seek on the disk which holds the data files
+    set<DiskFile*> inputfiles;
+    for (vector<DataBlock*>::const_iterator inputblock = inputblocks.begin(); inputblock != inputblocks.end(); ++inputblock)
+      inputfiles.insert((*inputblock)->GetDiskFile());
+    bool rotational = DiskFile::IsRotational(basepath.empty() ? "." : basepath);
+
+    PassPlan plan;
+    plan.Choose(blocksize, (u32)inputblocks.size(), (u32)inputfiles.size(), missingblockcount, memorylimit, rotational);
+    chunksize = plan.ChunkSize();
+    outputpasssize = plan.OutputsPerPass();
+
+    if (noiselevel > nlQuiet)
+    {
+      sout << "Repairing in " << plan.Passes() << " passes: ";
+      if (plan.OutputPasses() > 1)
+        sout << outputpasssize << " of the " << missingblockcount << " missing blocks";
+      if (plan.OutputPasses() > 1 && plan.SlicePasses() > 1)
+        sout << " and ";
+      if (plan.SlicePasses() > 1)
+        sout << chunksize << " bytes of each block";
+      sout << " at a time" << endl;
+    }
+    if (noiselevel > nlNormal)
+    {
+      u64 tenths = (u64)(10 * plan.Cost() + 0.5);
+      sout << "Estimated read time " << tenths/10 << '.' << tenths%10 << "s" << (rotational ? " (rotating disk)" : "") << endl;
+    }
   }
   else
   {
     chunksize = (size_t)blocksize;
+    outputpasssize = missingblockcount;
   }
 
+  return AllocateTransferBuffer();
+}
+
+// Allocate the transfer buffer, for the devices which the input blocks are on
+bool Par2Repairer::AllocateTransferBuffer(void)
+{
+  if (transferbuffer)
+  {
+    ALIGN_FREE(transferbuffer);
+    transferbuffer = 0;
+  }
+
+  // When blocks are being reconstructed, the input blocks are read with
+  // a separate reader for each device that they are on
+  readdevicecount = 1;
+  if (missingblockcount > 0)
+    readdevicecount = ParallelReader::FindDevices(inputblocks, readdevices);
+
+  // Each read which is in flight needs its own buffer, in addition to
+  // those being transferred to the backend.  Limit the read ahead so
+  // that it does not use an excessive amount of memory.
+  if (readdepth > 1 && chunksize * readdepth * readdevicecount > MAX_READ_AHEAD)
+    readdepth = max((u32)1, (u32)(MAX_READ_AHEAD / max(chunksize * readdevicecount, (u64)1)));
+  transferbuffercount = NUM_TRANSFER_BUFFERS + readdepth * readdevicecount - 1;
+
   // Allocate buffer
-  transferbuffer = new u8[(size_t)chunksize * NUM_TRANSFER_BUFFERS];
+  // The buffer is aligned so that direct reads can go straight into it
+  ALIGN_ALLOC(transferbuffer, (size_t)chunksize * transferbuffercount, DIRECT_IO_ALIGNMENT);
 
   if (transferbuffer == NULL)
   {
@@ -2479,90 +3446,386 @@ bool Par2Repairer::AllocateBuffers(size_t memorylimit)
   return true;
 }
 
-// Read source data, process it through the RS matrix and write it to disk.
-bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
+// Save the original contents of the blocks which will be written to the
+// files being repaired in place, and of anything past the end of them.
+// The blocks are remembered so that all of them are checked afterwards,
+// including those whose location is cleared when they are copied.
+bool Par2Repairer::WriteUndoJournals(void)
 {
-  u64 totalwritten = 0;
+  inplaceblocks.assign(inplacelist.size(), vector<u32>());
 
-  vector<DataBlock*>::iterator inputblock = inputblocks.begin();
-  vector<DataBlock*>::iterator copyblock  = copyblocks.begin();
-  u32                          inputindex = 0;
+  for (size_t i=0; i<inplacelist.size(); i++)
+  {
+    Par2RepairerSourceFile *sourcefile = inplacelist[i];
+    DiskFile *targetfile = sourcefile->GetTargetFile();
+    u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
 
-  DiskFile *lastopenfile = NULL;
+    UndoJournal journal(sout, serr);
 
-  // Are there any blocks which need to be reconstructed
-  if (missingblockcount > 0)
+    vector<DataBlock>::iterator tb = sourcefile->TargetBlocks();
+    for (u32 blocknumber=0; blocknumber<sourcefile->BlockCount(); ++blocknumber, ++tb)
+    {
+      if (tb->IsSet())
+      {
+        journal.Add(tb->GetOffset(), tb->GetLength());
+        inplaceblocks[i].push_back(blocknumber);
+      }
+    }
+    if (targetfile->FileSize() > filesize)
+      journal.Add(filesize, targetfile->FileSize() - filesize);
+
+    if (!journal.Write(*targetfile))
+      return false;
+  }
+
+  return true;
+}
+
+// Copy the intact blocks to the target files within the OS, where it can.
+// Runs of blocks which follow on from each other in both the file they
+// were found in and the target file are copied together.  The blocks
+// which are copied have their location cleared, so that they are not
+// copied again when the data is processed.
+void Par2Repairer::CopyIntactBlocks(void)
+{
+  u64 copied = 0;
+
+  size_t first = 0;
+  while (first < copyblocks.size())
   {
-    // For tracking input buffer availability
-    future<void> bufferavail[NUM_TRANSFER_BUFFERS];
-    u32 bufferindex = NUM_TRANSFER_BUFFERS - 1;
-    // Set all input buffers to available
-    for (i32 i = 0; i < NUM_TRANSFER_BUFFERS; i++)
+    // Find the run of blocks, starting with this one, which can be copied
+    // together.  Blocks which are not wholly present in the file they
+    // were found in are left to be padded when they are processed.
+    DiskFile *sourcefile = inputblocks[first]->GetDiskFile();
+    DiskFile *targetfile = copyblocks[first]->GetDiskFile();
+    u64 sourcestart = 0;
+    u64 targetstart = copyblocks[first]->GetOffset();
+    u64 length = 0;
+
+    size_t last = first;
+    while (last < copyblocks.size() && copyblocks[last]->IsSet())
     {
-      promise<void> stub;
-      bufferavail[i] = stub.get_future();
-      stub.set_value();
+      u64 blocklength = copyblocks[last]->GetLength();
+      u64 sourceoffset;
+      if (inputblocks[last]->ReadExtent(0, (size_t)blocklength, sourceoffset) != blocklength)
+        break;
+
+      if (last == first)
+      {
+        sourcestart = sourceoffset;
+      }
+      else if (inputblocks[last]->GetDiskFile() != sourcefile ||
+               copyblocks[last]->GetDiskFile() != targetfile ||
+               sourceoffset != sourcestart + length ||
+               copyblocks[last]->GetOffset() != targetstart + length)
+      {
+        break;
+      }
+
+      length += blocklength;
+      ++last;
     }
 
-    // Clear existing output data in backend
-    parpar.discardOutput();
+    if (last == first)
+    {
+      ++first;
+      continue;
+    }
 
-    // Temporary storage for factors
-    vector<u16> factors(missingblockcount);
+    u64 done = 0;
+    if (targetfile->IsOpen() && filecache.Acquire(sourcefile, directio))
+    {
+      done = targetfile->CopyFrom(*sourcefile, sourcestart, targetstart, length);
+      filecache.Release(sourcefile);
+    }
+
+    // The blocks which were completely copied are finished with
+    u64 offset = 0;
+    for (size_t i = first; i < last && offset + copyblocks[i]->GetLength() <= done; i++)
+    {
+      offset += copyblocks[i]->GetLength();
+      copyblocks[i]->ClearLocation();
+    }
+    copied += offset;
+
+    first = last;
+  }
+
+  if (noiselevel > nlNormal && copied > 0)
+    sout << "Copied " << copied << " bytes of intact data without reading it" << endl;
+}
+
+// Note the files which an interrupted repair had started to write, so
+// that they are not verified, and verify the damaged files which it
+// renamed instead, so that the same blocks are found as before.
+void Par2Repairer::UseCheckpointFiles(vector<string> &extrafiles)
+{
+  const vector<string> &names = checkpoint.FileNames();
+  for (size_t i=0; i+1<names.size(); i+=2)
+  {
+    resumedtargets.insert(names[i]);
+    backupnames[names[i]] = names[i+1];
+
+    if (!names[i+1].empty() && DiskFile::FileExists(names[i+1]))
+    {
+      extrafiles.push_back(names[i+1]);
+      resumedbackups.push_back(names[i+1]);
+    }
+  }
+}
+
+// Whether the target file is one which an interrupted repair had
+// started to write, and which is still there
+bool Par2Repairer::ResumesTargetFile(const Par2RepairerSourceFile *sourcefile) const
+{
+  string filename = DiskFile::GetCanonicalPathname(sourcefile->TargetFileName());
+  return resumedtargets.find(filename) != resumedtargets.end() &&
+         DiskFile::FileExists(filename);
+}
+
+// Add where a block is to the hash of a repair
+static void HashBlockLocation(MD5Context &context, const DataBlock *block, const DiskFile *&lastfile, string &lastname)
+{
+  const DiskFile *diskfile = block->IsSet() ? block->GetDiskFile() : 0;
+  if (diskfile != lastfile)
+  {
+    lastfile = diskfile;
+    lastname = diskfile != 0 ? DiskFile::GetCanonicalPathname(diskfile->FileName()) : string();
+  }
+
+  u64 offset = diskfile != 0 ? block->GetOffset() : 0;
+  context.Update(lastname.c_str(), lastname.size() + 1);
+  context.Update(&offset, sizeof(offset));
+}
+
+// Compute a hash of everything which decides what each pass writes to the
+// target files, so that a checkpoint can be matched to the repair it was
+// saved by.
+MD5Hash Par2Repairer::CheckpointJobId(void) const
+{
+  MD5Context context;
+  context.Update(&setid, sizeof(MD5Hash));
+
+  // How the work is split into passes
+  u64 values[] = {blocksize, chunksize, outputpasssize, missingblockcount, copyblocks.size(), inputblocks.size()};
+  context.Update(values, sizeof(values));
+
+  // Where each block is read from, and where it is written to
+  const DiskFile *lastfile = 0;
+  string lastname;
+  for (vector<DataBlock*>::const_iterator inputblock = inputblocks.begin(); inputblock != inputblocks.end(); ++inputblock)
+    HashBlockLocation(context, *inputblock, lastfile, lastname);
+  for (vector<DataBlock*>::const_iterator copyblock = copyblocks.begin(); copyblock != copyblocks.end(); ++copyblock)
+    HashBlockLocation(context, *copyblock, lastfile, lastname);
+  for (vector<DataBlock*>::const_iterator outputblock = outputblocks.begin(); outputblock != outputblocks.end(); ++outputblock)
+    HashBlockLocation(context, *outputblock, lastfile, lastname);
+
+  MD5Hash jobid;
+  context.Final(jobid);
+  return jobid;
+}
+
+// Carry on from the checkpoint left by an interrupted repair, if it
+// belongs to this repair and the repaired data which it records is intact.
+bool Par2Repairer::ResumeFromCheckpoint(u32 &firstpass)
+{
+  u32 slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+  u32 outputpasses = outputpasssize == 0 ? 1 : (missingblockcount + outputpasssize - 1) / outputpasssize;
+  u32 passes = slicepasses * outputpasses;
+  u32 blockcount = missingblockcount + (u32)copyblocks.size();
+  MD5Hash jobid = CheckpointJobId();
 
-    // For each input block
-    while (inputblock != inputblocks.end())
+  firstpass = 0;
+
+  if (resuming)
+  {
+    if (checkpoint.JobId() != jobid ||
+        checkpoint.PacketCRCs().size() != blockcount ||
+        checkpoint.Passes() >= passes)
+    {
+      if (noiselevel > nlSilent)
+        sout << "The checkpoint " << checkpointname << " is for different files or options, so the files will be repaired from the start." << endl;
+    }
+    else if (checkpoint.Passes() > 0)
     {
-      // Are we reading from a new file?
-      if (lastopenfile != (*inputblock)->GetDiskFile())
+      if (noiselevel > nlQuiet)
+        sout << "Checking the repaired data which was written before" << endl;
+
+      bool intact;
+      if (!CheckWrittenData(checkpoint.Passes(), intact))
+        return false;
+
+      if (intact)
       {
-        // Close the last file
-        if (lastopenfile != NULL)
-        {
-          lastopenfile->Close();
-        }
+        firstpass = checkpoint.Passes();
 
-        // Open the new file
-        lastopenfile = (*inputblock)->GetDiskFile();
-        if (!lastopenfile->Open())
-        {
-          return false;
-        }
+        if (noiselevel > nlSilent)
+          sout << "Resuming from the checkpoint, with " << firstpass << " of the " << passes << " passes finished." << endl;
       }
+      else
+      {
+        if (noiselevel > nlSilent)
+          sout << "The repaired data does not match the checkpoint " << checkpointname << ", so the files will be repaired from the start." << endl;
+      }
+    }
+  }
+
+  if (firstpass > 0)
+    return true;
+
+  // Save a checkpoint before anything is written, so that the files which
+  // are being repaired are used again if the repair is interrupted
+  checkpoint.JobId(jobid);
+  checkpoint.PacketCRCs().assign(blockcount, 0);
+  checkpoint.FileHashes().clear();
+  checkpoint.BlockEntries().clear();
+  checkpoint.FileNames().clear();
+  for (vector<Par2RepairerSourceFile*>::const_iterator sf = verifylist.begin(); sf != verifylist.end(); ++sf)
+  {
+    string filename = DiskFile::GetCanonicalPathname((*sf)->TargetFileName());
+    map<string, string>::const_iterator backup = backupnames.find(filename);
+
+    checkpoint.FileNames().push_back(filename);
+    checkpoint.FileNames().push_back(backup != backupnames.end() ? backup->second : string());
+  }
+
+  return SaveCheckpoint(0);
+}
+
+// Read the repaired data which the finished passes wrote, to check it
+// against the crcs in the checkpoint.
+bool Par2Repairer::CheckWrittenData(u32 passes, bool &intact)
+{
+  // The missing blocks of the finished passes over them were written in
+  // full, and the start of those of the pass which was interrupted.  The
+  // intact blocks are copied by the first pass over the missing blocks.
+  u32 slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+  u32 wholepasses = passes / slicepasses;
+  u64 partlength = min(blocksize, (u64)(passes % slicepasses) * chunksize);
+
+  vector<u32> crcs(checkpoint.PacketCRCs().size(), 0);
+
+  for (u32 index = 0; index < crcs.size(); index++)
+  {
+    DataBlock *block;
+    u64 length;
+    if (index < missingblockcount)
+    {
+      block = outputblocks[index];
+      u32 outputpass = outputpasssize == 0 ? 0 : index / outputpasssize;
+      length = outputpass < wholepasses ? blocksize : outputpass == wholepasses ? partlength : 0;
+    }
+    else
+    {
+      block = copyblocks[index - missingblockcount];
+      if (!block->IsSet())
+        continue;
+      length = wholepasses > 0 ? blocksize : partlength;
+    }
+    length = min(length, block->GetLength());
+
+    for (u64 offset = 0; offset < length; offset += chunksize)
+    {
+      size_t size = (size_t)min(chunksize, length - offset);
+      if (!block->ReadData(offset, size, transferbuffer))
+        return false;
+
+      crcs[index] = CRCUpdateBlock(crcs[index], (u64)size) ^ CRCCompute(size, transferbuffer);
+    }
+  }
+
+  intact = crcs == checkpoint.PacketCRCs();
+
+  return true;
+}
 
-      // Wait for next input buffer to become available
-      bufferindex = (bufferindex + 1) % NUM_TRANSFER_BUFFERS;
-      void *inputbuffer = (char*)transferbuffer + chunksize * bufferindex;
-      bufferavail[bufferindex].get();
+// Save the progress, once the repaired data which was written is on disk.
+bool Par2Repairer::SaveCheckpoint(u32 passes)
+{
+  for (vector<Par2RepairerSourceFile*>::const_iterator sf = verifylist.begin(); sf != verifylist.end(); ++sf)
+  {
+    DiskFile *targetfile = (*sf)->GetTargetFile();
+    if (targetfile->IsOpen() && !targetfile->Flush())
+      return false;
+  }
+
+  checkpoint.Passes(passes);
 
-      // Read data from the current input block
-      if (!(*inputblock)->ReadData(blockoffset, blocklength, inputbuffer))
+  return checkpoint.Save(checkpointname);
+}
+
+// Add data which was written to a repaired block to its crc, for the checkpoint
+void Par2Repairer::RecordWrittenData(u32 index, const void *buffer, size_t length)
+{
+  if (checkpointing && length > 0)
+  {
+    u32 &crc = checkpoint.PacketCRCs()[index];
+    crc = CRCUpdateBlock(crc, (u64)length) ^ CRCCompute(length, buffer);
+  }
+}
+
+// Read source data, process it through the RS matrix and write it to disk.
+bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount)
+{
+  u64 totalwritten = 0;
+
+  // Are there any blocks which need to be reconstructed
+  if (missingblockcount > 0)
+  {
+    // Reads are queued ahead of the block being processed, on each
+    // device that the input blocks are on
+    ParallelReader reader(serr, filecache);
+    reader.Init(readdevicecount, readdepth, directio, chunksize < blocksize);
+    reader.Start(inputblocks, readdevices, blockoffset, blocklength, transferbuffer, (size_t)chunksize, transferbuffercount);
+
+    if (noiselevel > nlNormal && blockoffset == 0 && firstoutput == 0)
+    {
+      sout << "Reading with " << reader.EngineName() << " I/O, " << reader.Depth() << " reads in flight";
+      if (reader.Devices() > 1)
+        sout << " from " << reader.Devices() << " devices";
+      sout << endl;
+    }
+
+    // Clear existing output data in backend
+    parpar.discardOutput();
+
+    // Temporary storage for factors
+    vector<u16> factors(outputcount);
+
+    // For each input block, in the order in which they are read
+    for (size_t processed = 0; processed < inputblocks.size(); processed++)
+    {
+      // Wait for the data from the next input block
+      u32 inputindex;
+      void *inputbuffer;
+      if (!reader.Next(inputindex, inputbuffer))
         return false;
 
-      // Have we reached the last source data block
-      if (copyblock != copyblocks.end())
+      // Is this a source data block.  The intact blocks are copied
+      // on the first pass over the missing blocks.
+      if (firstoutput == 0 && inputindex < copyblocks.size())
       {
         // Does this block need to be copied to the target file
-        if ((*copyblock)->IsSet())
+        if (copyblocks[inputindex]->IsSet())
         {
           size_t wrote;
 
           // Write the block back to disk in the new target file
-          if (!(*copyblock)->WriteData(blockoffset, blocklength, inputbuffer, wrote))
+          if (!copyblocks[inputindex]->WriteData(blockoffset, blocklength, inputbuffer, wrote))
             return false;
+          RecordWrittenData(missingblockcount + inputindex, inputbuffer, wrote);
 
           totalwritten += wrote;
         }
-        ++copyblock;
       }
 
       // Copy RS matrix column to send to backend
-      for (u32 outputindex=0; outputindex<missingblockcount; outputindex++)
-        factors[outputindex] = rs.GetFactor(inputindex, outputindex);
+      for (u32 outputindex=0; outputindex<outputcount; outputindex++)
+        factors[outputindex] = rs.GetFactor(inputindex, firstoutput + outputindex);
       // Wait for ParPar backend to be ready, if busy
       parpar.waitForAdd();
       // Send block to backend
-      bufferavail[bufferindex] = parpar.addInput(inputbuffer, blocklength, factors.data());
+      reader.Done(inputbuffer, parpar.addInput(inputbuffer, blocklength, factors.data()));
 
       if (noiselevel > nlQuiet)
       {
@@ -2576,48 +3839,71 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
           sout << "Repairing: " << newfraction/10 << '.' << newfraction%10 << "%\r" << flush;
         }
       }
-
-      ++inputblock;
-      ++inputindex;
     }
 
     // Flush backend
     parpar.endInput().get();
+
+    // Close the files that were read
+    if (!reader.Finish())
+      return false;
+
+    if (noiselevel > nlNormal)
+      sout << "Read " << reader.BytesRead() << " bytes at " << reader.ReadRate() / 1048576 << " MB/s" << (directio ? " using direct I/O" : "") << endl;
   }
   else
   {
     // Reconstruction is not required, we are just copying blocks between files
 
+    // Reads are queued ahead of the block being processed
+    BlockReader reader(serr, filecache);
+    reader.Init(readdepth, directio, chunksize < blocksize);
+
+    if (noiselevel > nlNormal && blockoffset == 0)
+      sout << "Reading with " << reader.EngineName() << " I/O, " << reader.Depth() << " reads in flight" << endl;
+
+    vector<DataBlock*>::iterator inputblock = inputblocks.begin();
+    vector<DataBlock*>::iterator copyblock  = copyblocks.begin();
+
+    // Reads are queued for the blocks that need to be copied, in order
+    vector<DataBlock*>::iterator readblock = inputblocks.begin();
+    vector<DataBlock*>::iterator readcopyblock = copyblocks.begin();
+    u32                          readindex = 0;
+    u32                          copyindex = 0;
+
     // For each block that might need to be copied
     while (copyblock != copyblocks.end())
     {
       // Does this block need to be copied
       if ((*copyblock)->IsSet())
       {
-        // Are we reading from a new file?
-        if (lastopenfile != (*inputblock)->GetDiskFile())
+        // Keep the read queue full.  The buffers are only reused once
+        // the data in them has been written, so there is no need to
+        // track their availability.
+        while (readcopyblock != copyblocks.end() && readindex < copyindex + reader.Depth())
         {
-          // Close the last file
-          if (lastopenfile != NULL)
-          {
-            lastopenfile->Close();
-          }
-
-          // Open the new file
-          lastopenfile = (*inputblock)->GetDiskFile();
-          if (!lastopenfile->Open())
+          if ((*readcopyblock)->IsSet())
           {
-            return false;
+            void *readbuffer = (char*)transferbuffer + chunksize * (readindex % transferbuffercount);
+            if (!reader.Submit(*readblock, blockoffset, blocklength, readbuffer))
+              return false;
+            ++readindex;
           }
+          ++readcopyblock;
+          ++readblock;
         }
 
-        // Read data from the current input block
-        if (!(*inputblock)->ReadData(blockoffset, blocklength, transferbuffer))
+        // Wait for the data from the current input block
+        if (!reader.Wait())
           return false;
 
+        void *copybuffer = (char*)transferbuffer + chunksize * (copyindex % transferbuffercount);
+        ++copyindex;
+
         size_t wrote;
-        if (!(*copyblock)->WriteData(blockoffset, blocklength, transferbuffer, wrote))
+        if (!(*copyblock)->WriteData(blockoffset, blocklength, copybuffer, wrote))
           return false;
+        RecordWrittenData(missingblockcount + (u32)(copyblock - copyblocks.begin()), copybuffer, wrote);
         totalwritten += wrote;
       }
 
@@ -2637,12 +3923,13 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
       ++copyblock;
       ++inputblock;
     }
-  }
 
-  // Close the last file
-  if (lastopenfile != NULL)
-  {
-    lastopenfile->Close();
+    // Close the files that were read
+    if (!reader.Finish())
+      return false;
+
+    if (noiselevel > nlNormal)
+      sout << "Read " << reader.BytesRead() << " bytes at " << reader.ReadRate() / 1048576 << " MB/s" << (directio ? " using direct I/O" : "") << endl;
   }
 
   if (noiselevel > nlQuiet)
@@ -2650,39 +3937,71 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
 
   if (missingblockcount > 0)
   {
-    // For output, we only need two transfer buffers
-    future<bool> outbufavail[2];
-    // Prepare first output
-    outbufavail[0] = parpar.getOutput(0, transferbuffer);
+    // The transfer buffers are split into two groups.  While the outputs
+    // in one group are being written, the other group is being filled.
+    // The writes for a group are issued together, sorted by file and offset,
+    // so that runs of missing blocks are written with a single call.
+    u32 groupsize = transferbuffercount / 2;
+    u32 outputbuffercount = groupsize * 2;
+    vector< future<bool> > outbufavail(outputbuffercount);
+    WriteCoalescer writer;
+
+    // Prepare the first outputs
+    for (u32 outputindex=0; outputindex<outputbuffercount && outputindex<outputcount; outputindex++)
+    {
+      void *outputbuffer = (char*)transferbuffer + chunksize * outputindex;
+      outbufavail[outputindex] = parpar.getOutput(outputindex, outputbuffer);
+    }
 
     // For each output block that has been recomputed
-    vector<DataBlock*>::iterator outputblock = outputblocks.begin();
-    for (u32 outputindex=0; outputindex<missingblockcount;outputindex++)
+    vector<DataBlock*>::iterator outputblock = outputblocks.begin() + firstoutput;
+    for (u32 outputindex=0; outputindex<outputcount;outputindex++)
     {
-      // Prepare next output
-      u32 nextoutputindex = outputindex + 1;
-      if (nextoutputindex < missingblockcount)
-      {
-        void *nextoutputbuffer = (char*)transferbuffer + chunksize * (nextoutputindex & 1);
-        outbufavail[nextoutputindex & 1] = parpar.getOutput(nextoutputindex, nextoutputbuffer);
-      }
+      u32 bufferindex = outputindex % outputbuffercount;
 
       // Wait for current buffer to be available
-      if (!outbufavail[outputindex & 1].get())
+      if (!outbufavail[bufferindex].get())
       {
-        serr << "Internal checksum failure in block " << outputindex << endl;
+        serr << "Internal checksum failure in block " << firstoutput + outputindex << endl;
+        for (u32 i=0; i<outputbuffercount; i++)
+          if (outbufavail[i].valid()) outbufavail[i].wait();
         return false;
       }
 
-      // Write the data to the target file
-      void *outputbuffer = (char*)transferbuffer + chunksize * (outputindex & 1);
+      // Queue the data to be written to the target file
+      void *outputbuffer = (char*)transferbuffer + chunksize * bufferindex;
       size_t wrote;
-      if (!(*outputblock)->WriteData(blockoffset, blocklength, outputbuffer, wrote))
-        return false;
+      (*outputblock)->WriteData(blockoffset, blocklength, outputbuffer, wrote, writer);
+      RecordWrittenData(firstoutput + outputindex, outputbuffer, wrote);
       totalwritten += wrote;
 
+      // At the end of a group, write it out and reuse its buffers
+      if ((outputindex + 1) % groupsize == 0 || outputindex + 1 == outputcount)
+      {
+        if (!writer.Flush())
+        {
+          // The buffers must not be freed while outputs are still pending
+          for (u32 i=0; i<outputbuffercount; i++)
+            if (outbufavail[i].valid()) outbufavail[i].wait();
+          return false;
+        }
+
+        for (u32 done = outputindex - (outputindex % groupsize); done <= outputindex; done++)
+        {
+          u32 nextoutputindex = done + outputbuffercount;
+          if (nextoutputindex < outputcount)
+          {
+            void *nextoutputbuffer = (char*)transferbuffer + chunksize * (nextoutputindex % outputbuffercount);
+            outbufavail[nextoutputindex % outputbuffercount] = parpar.getOutput(nextoutputindex, nextoutputbuffer);
+          }
+        }
+      }
+
       ++outputblock;
     }
+
+    if (noiselevel > nlNormal)
+      sout << "Wrote " << writer.Writes() << " blocks of recovered data with " << writer.Calls() << " writes" << endl;
   }
 
   if (noiselevel > nlQuiet)
@@ -2691,6 +4010,79 @@ bool Par2Repairer::ProcessData(u64 blockoffset, size_t blocklength)
   return true;
 }
 
+// Check each of the blocks which was written or copied to the files
+// repaired in place against its hash.  The files whose blocks are all
+// correct are complete, and the others are put back as they were.
+bool Par2Repairer::VerifyInPlaceFiles(void)
+{
+  bool finalresult = true;
+
+  vector<u8> buffer((size_t)blocksize);
+
+  for (size_t i=0; i<inplacelist.size(); i++)
+  {
+    Par2RepairerSourceFile *sourcefile = inplacelist[i];
+    DiskFile *targetfile = sourcefile->GetTargetFile();
+    const VerificationPacket *verificationpacket = sourcefile->GetVerificationPacket();
+    u64 filesize = sourcefile->GetDescriptionPacket()->FileSize();
+
+    // Remove anything past the end of the file
+    bool success = DiskFile::GetFileSize(targetfile->FileName()) <= filesize ||
+                   targetfile->SetFileSize(filesize);
+
+    assert(i < inplaceblocks.size());
+    const vector<u32> &blocks = inplaceblocks[i];
+    for (vector<u32>::const_iterator b = blocks.begin(); success && b != blocks.end(); ++b)
+    {
+      u32 blocknumber = *b;
+      u64 offset = blocknumber * blocksize;
+
+      // Blocks are hashed as if they were padded to the full block size
+      size_t length = (size_t)min(blocksize, filesize - offset);
+      if (!targetfile->Read(offset, &buffer[0], length))
+      {
+        success = false;
+        break;
+      }
+      memset(&buffer[length], 0, (size_t)blocksize - length);
+
+      MD5Context context;
+      context.Update(&buffer[0], (size_t)blocksize);
+      MD5Hash hash;
+      context.Final(hash);
+      u32 crc = ~0 ^ CRCUpdateBlock(~0, (size_t)blocksize, &buffer[0]);
+
+      const FILEVERIFICATIONENTRY *entry = verificationpacket->VerificationEntry(blocknumber);
+      success = hash == entry->hash && crc == entry->crc;
+    }
+
+    string path;
+    string name;
+    DiskFile::SplitFilename(targetfile->FileName(), path, name);
+
+    UndoJournal journal(sout, serr);
+    if (success && journal.Commit(*targetfile))
+    {
+      if (noiselevel > nlSilent)
+        sout << "Target: \"" << name << "\" - repaired in place." << endl;
+
+      sourcefile->SetCompleteFile(targetfile);
+    }
+    else
+    {
+      if (noiselevel > nlSilent)
+        sout << "Target: \"" << name << "\" - damaged. Restoring the original." << endl;
+
+      if (!journal.RollBack(*targetfile))
+        finalresult = false;
+    }
+
+    targetfile->Close();
+  }
+
+  return finalresult;
+}
+
 // Verify that all of the reconstructed target files are now correct
 bool Par2Repairer::VerifyTargetFiles(const string &basepath)
 {
@@ -2756,6 +4148,12 @@ bool Par2Repairer::VerifyTargetFiles(const string &basepath)
 // Delete all of the partly reconstructed files
 bool Par2Repairer::DeleteIncompleteTargetFiles(void)
 {
+  filecache.Clear();
+
+  // There is nothing left to resume
+  if (checkpointing)
+    checkpoint.Remove(checkpointname);
+
   vector<Par2RepairerSourceFile*>::iterator sf = verifylist.begin();
 
   // Iterate through each file in the verification list
@@ -2783,6 +4181,21 @@ bool Par2Repairer::DeleteIncompleteTargetFiles(void)
     ++sf;
   }
 
+  // Put back the files which were being repaired in place
+  for (vector<Par2RepairerSourceFile*>::iterator ip = inplacelist.begin(); ip != inplacelist.end(); ++ip)
+  {
+    DiskFile *targetfile = (*ip)->GetTargetFile();
+
+    if (UndoJournal::Exists(targetfile->FileName()) && targetfile->IsOpen())
+    {
+      UndoJournal journal(sout, serr);
+      journal.RollBack(*targetfile);
+    }
+
+    if (targetfile->IsOpen())
+      targetfile->Close();
+  }
+
   return true;
 }
 
@@ -35,6 +35,14 @@ public:
 #ifdef _OPENMP
 		 const u32 filethreads,
 #endif
+		 const u32 readdepth,
+		 const bool directio,
+		 const bool inplace,
+		 const bool checkpoint,
+		 const bool ondemand,
+		 const bool mapfiles,
+		 const bool packetindex,
+		 const bool rebuildpacketindex,
 		 string parfilename,
 		 const vector<string> &extrafiles,
 		 const bool dorepair,   // derived from operation
@@ -46,10 +54,27 @@ public:
 protected:
   // Steps in verifying and repairing files:
 
+  // A packet which has been found in a file, but not yet loaded
+  struct FoundPacket
+  {
+    u64           offset;
+    PACKET_HEADER header;
+    u32           exponent;  // The exponent, for a recovery packet
+    bool          checked;   // Was the hash of the packet checked
+  };
+
   // Load packets from the specified file
   bool LoadPacketsFromFile(string filename);
+  // Load packets from the specified files, searching them in parallel
+  bool LoadPacketsFromFiles(const vector<string> &filenames);
+  // Search a file for packets
+  void FindPackets(DiskFile *diskfile, vector<FoundPacket> &packets, bool showprogress);
+  // Get the packets in a file from the packet index, if it has not changed
+  bool FindIndexedPackets(DiskFile *diskfile, vector<FoundPacket> &packets);
+  // Load the packets which were found in a file
+  void LoadFoundPackets(DiskFile *diskfile, const vector<FoundPacket> &foundpackets);
   // Finish loading a recovery packet
-  bool LoadRecoveryPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
+  bool LoadRecoveryPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 exponent, bool checked);
   // Finish loading a file description packet
   bool LoadDescriptionPacket(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
   // Finish loading a file verification packet
@@ -65,6 +90,27 @@ protected:
   // Load packets from any other PAR2 files whose names are given on the command line
   bool LoadPacketsFromExtraFiles(const vector<string> &extrafiles);
 
+  // Are all of the critical packets for the files in the set loaded
+  bool HaveCriticalPackets(void) const;
+
+  // Load as few of the recovery volumes which were put off as will give
+  // enough recovery blocks for the repair
+  bool LoadNeededVolumes(void);
+
+  // How many recovery blocks a volume which has not been loaded holds
+  u32 VolumeBlockCount(const string &filename) const;
+
+  // Discard recovery packets which do not have the block size of the set
+  void DiscardBadRecoveryPackets(void);
+
+  // Use an alternate recovery packet for each exponent which has none
+  void PromoteAlternatePackets(void);
+
+  // Check the hashes of the recovery packets which a repair would use and
+  // which were not checked when they were loaded, replacing any which are
+  // damaged with others
+  bool CheckNeededRecoveryPackets(void);
+
   // Check that the packets are consistent and discard any that are not
   bool CheckPacketConsistency(void);
 
@@ -112,9 +158,15 @@ protected:
   // Check the verification results and report the results
   bool CheckVerificationResults(void);
 
+  // Put back any files whose in-place repair did not finish
+  bool RollBackInterruptedRepairs(void);
+
   // Rename any damaged or missnamed target files.
   bool RenameTargetFiles(void);
 
+  // Can a damaged file be repaired without rebuilding it
+  bool CanRepairInPlace(const Par2RepairerSourceFile *sourcefile) const;
+
   // Work out which files are being repaired, create them, and allocate
   // target DataBlocks to them, and remember them for later verification.
   bool CreateTargetFiles(void);
@@ -127,8 +179,48 @@ protected:
   // Allocate memory buffers for reading and writing data to disk.
   bool AllocateBuffers(size_t memorylimit);
 
+  // Allocate the transfer buffer, for the devices which the input blocks are on
+  bool AllocateTransferBuffer(void);
+
+  // Save the parts of the files being repaired in place which will be
+  // overwritten, so that the repair can be undone.
+  bool WriteUndoJournals(void);
+
+  // Copy the intact blocks to the target files within the OS, where it can,
+  // so that they do not need to be copied by ProcessData().
+  void CopyIntactBlocks(void);
+
+  // Note the files which an interrupted repair had started to write, so
+  // that they are not verified, and verify the damaged files which it
+  // renamed instead.
+  void UseCheckpointFiles(vector<string> &extrafiles);
+
+  // Whether the target file is one which an interrupted repair had
+  // started to write, and which is still there
+  bool ResumesTargetFile(const Par2RepairerSourceFile *sourcefile) const;
+
+  // Identify everything which decides what is written on each pass
+  MD5Hash CheckpointJobId(void) const;
+
+  // Carry on from the checkpoint of an interrupted repair, if there is
+  // one which can be used.  firstpass is set to the first pass needed.
+  bool ResumeFromCheckpoint(u32 &firstpass);
+
+  // Check the repaired data which the finished passes wrote
+  bool CheckWrittenData(u32 passes, bool &intact);
+
+  // Save the progress after a pass
+  bool SaveCheckpoint(u32 passes);
+
+  // Add data which was written to a repaired block to its crc
+  void RecordWrittenData(u32 index, const void *buffer, size_t length);
+
   // Read source data, process it through the RS matrix and write it to disk.
-  bool ProcessData(u64 blockoffset, size_t blocklength);
+  // The outputcount missing blocks from firstoutput are reconstructed.
+  bool ProcessData(u64 blockoffset, size_t blocklength, u32 firstoutput, u32 outputcount);
+
+  // Verify the blocks which were written to the files repaired in place
+  bool VerifyInPlaceFiles(void);
 
   // Verify that all of the reconstructed target files are now correct
   bool VerifyTargetFiles(const string &basepath);
@@ -165,6 +257,7 @@ protected:
   MD5Hash                   setid;                   // The SetId extracted from the first packet.
 
   map<u32, RecoveryPacket*> recoverypacketmap;       // One recovery packet for each exponent value.
+  multimap<u32, RecoveryPacket*> alternatepackets; // Unchecked recovery packets whose exponent was taken by another unchecked packet.
   MainPacket               *mainpacket;              // One copy of the main packet.
   CreatorPacket            *creatorpacket;           // One copy of the creator packet.
 
@@ -173,11 +266,14 @@ protected:
   map<MD5Hash,Par2RepairerSourceFile*> sourcefilemap;// Map from FileId to SourceFile
   vector<Par2RepairerSourceFile*>      sourcefiles;  // The source files
   vector<Par2RepairerSourceFile*>      verifylist;   // Those source files that are being repaired
+  vector<Par2RepairerSourceFile*>      inplacelist;  // Those source files that are being repaired in place
+  vector<vector<u32> >                 inplaceblocks;// The blocks of each of those which are rewritten or copied
   vector<DiskFile*>                    backuplist;   // Those source files backups
   list<string>                         par2list;     // list of par2 files
 
   u64                       blocksize;               // The block size.
   u64                       chunksize;               // How much of a block can be processed.
+  u32                       outputpasssize;          // How many missing blocks are reconstructed on each pass.
   u32                       sourceblockcount;        // The total number of blocks
   u32                       availableblockcount;     // How many undamaged blocks have been found
   u32                       missingblockcount;       // How many blocks are missing
@@ -205,7 +301,29 @@ protected:
   PAR2Proc parpar;                                   // Main ParPar backend
   PAR2ProcCPU parparcpu;                             // ParPar CPU sub-backend
 
-  void                     *transferbuffer;          // Buffer for reading/writing DataBlocks (chunksize * num_transfer_buffers)
+  void                     *transferbuffer;          // Buffer for reading/writing DataBlocks (chunksize * transferbuffercount)
+  u32                       transferbuffercount;     // How many chunks the transfer buffer holds
+  u32                       readdepth;               // How many block reads are kept in flight
+  bool                      directio;                // Whether data files are read bypassing the OS file cache
+  bool                      inplace;                 // Whether damaged files are repaired without rebuilding them
+  bool                      ondemand;                // Whether recovery volumes are only loaded if they are needed
+  bool                      mapfiles;                // Whether data files are scanned through a memory mapping
+  bool                      deferloading;            // Whether PAR2 files are being put off instead of loaded
+  vector<string>            deferredvolumes;         // The PAR2 files which have not been loaded yet
+  bool                      usepacketindex;          // Whether the packet index is used and kept up to date
+  PacketIndex               packetindex;             // Where the packets are in PAR2 files which have been searched
+  u32                       indexedfilecount;        // How many PAR2 files were found in the packet index
+  FileHandleCache           filecache;               // Keeps data files open between passes
+  vector<u32>               readdevices;             // Which device each input block is on
+  u32                       readdevicecount;         // How many devices the input blocks are on
+
+  bool                      checkpointing;           // Whether the progress is saved, so that the repair can be resumed
+  bool                      resuming;                // Whether an interrupted repair left a checkpoint
+  string                    checkpointname;          // The file which the progress is saved in
+  Checkpoint                checkpoint;              // The progress
+  set<string>               resumedtargets;          // The files which the interrupted repair had started to write
+  vector<string>            resumedbackups;          // and the damaged files which it renamed.
+  map<string, string>       backupnames;             // What each damaged target file was renamed to
 
   u64                       progress;                // How much data has been processed.
   u64                       totaldata;               // Total amount of data to be processed.
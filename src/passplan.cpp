@@ -0,0 +1,113 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "libpar2internal.h"
+
+#ifdef _MSC_VER
+#ifdef _DEBUG
+#undef THIS_FILE
+static char THIS_FILE[]=__FILE__;
+#define new DEBUG_NEW
+#endif
+#endif
+
+PassPlan::PassPlan(void)
+: chunksize(0)
+, outputsperpass(0)
+, slicepasses(1)
+, outputpasses(1)
+, cost(0)
+{
+}
+
+double PassPlan::EstimateCost(u64 blocksize, u32 inputcount, u32 filecount, u32 outputcount,
+                              size_t chunksize, u32 outputsperpass, bool rotational)
+{
+  double seektime = rotational ? PLAN_SEEK_TIME_ROTATIONAL : PLAN_SEEK_TIME;
+  double rate = rotational ? PLAN_TRANSFER_RATE_ROTATIONAL : PLAN_TRANSFER_RATE;
+
+  u32 outputpasses = outputsperpass == 0 ? 1 : (outputcount + outputsperpass - 1) / outputsperpass;
+  u64 slicepasses = (blocksize + chunksize - 1) / chunksize;
+
+  // When whole blocks are read, each file is read from start to end.
+  // Otherwise every read is of a different block.
+  double seeks = (chunksize < blocksize) ? (double)inputcount * slicepasses : (double)filecount;
+  double transfer = (double)inputcount * blocksize / rate;
+
+  return outputpasses * (seeks * seektime + transfer);
+}
+
+void PassPlan::Choose(u64 blocksize, u32 inputcount, u32 filecount, u32 outputcount,
+                      size_t memorylimit, bool rotational)
+{
+  chunksize = (size_t)blocksize;
+  outputsperpass = outputcount;
+  slicepasses = 1;
+  outputpasses = 1;
+
+  // Everything fits in memory, so one pass will do
+  if (outputcount == 0 || blocksize * outputcount <= memorylimit)
+  {
+    cost = EstimateCost(blocksize, inputcount, filecount, outputcount, chunksize, outputsperpass, rotational);
+    return;
+  }
+
+  bool found = false;
+  u32 lastperpass = 0;
+  for (u32 passes = 1; passes <= outputcount; passes++)
+  {
+    u32 perpass = (outputcount + passes - 1) / passes;
+    if (perpass == lastperpass)
+      continue;
+    lastperpass = perpass;
+
+    // The chunk size must be a multiple of 4
+    u64 candidate = ~3 & (memorylimit / perpass);
+    if (candidate > blocksize)
+      candidate = blocksize;
+    if (candidate == 0)
+      continue;
+
+    double estimate = EstimateCost(blocksize, inputcount, filecount, outputcount, (size_t)candidate, perpass, rotational);
+
+    // Prefer fewer passes over the outputs when the costs are the same
+    if (!found || estimate < cost)
+    {
+      found = true;
+      cost = estimate;
+      chunksize = (size_t)candidate;
+      outputsperpass = perpass;
+    }
+
+    // Once whole blocks are read, more passes only read more data
+    if (candidate == blocksize)
+      break;
+  }
+
+  // Not even 4 bytes of one output fit in memory
+  if (!found)
+  {
+    chunksize = 4;
+    outputsperpass = 1;
+    cost = EstimateCost(blocksize, inputcount, filecount, outputcount, chunksize, outputsperpass, rotational);
+  }
+
+  slicepasses = (u32)((blocksize + chunksize - 1) / chunksize);
+  outputpasses = (outputcount + outputsperpass - 1) / outputsperpass;
+}
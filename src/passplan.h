@@ -0,0 +1,79 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __PASSPLAN_H__
+#define __PASSPLAN_H__
+
+// When the outputs of a create or a repair do not all fit in memory, the
+// input blocks are read more than once.  Each pass can either process a
+// slice of every block for all of the outputs, which reads a small part of
+// each block and then seeks to the next one, or process whole blocks for
+// some of the outputs, which reads the data sequentially but reads all of
+// it again for the next group of outputs.  Both can also be combined.
+//
+// A PassPlan chooses how to split up the work by estimating how long the
+// reads will take: one seek for each read which does not follow on from
+// the one before, and the time taken to transfer the data.
+
+// The estimated time for a seek (in seconds), and the transfer rate
+// (in bytes per second), for a rotating disk and for other storage.
+#define PLAN_SEEK_TIME_ROTATIONAL     0.008
+#define PLAN_TRANSFER_RATE_ROTATIONAL (150.0 * 1048576)
+#define PLAN_SEEK_TIME                0.0001
+#define PLAN_TRANSFER_RATE            (500.0 * 1048576)
+
+class PassPlan
+{
+public:
+  PassPlan(void);
+
+  // Choose how to compute outputcount outputs from inputcount blocks of
+  // blocksize bytes, which are held in filecount files, so that the
+  // outputs being computed fit in memorylimit bytes.
+  void Choose(u64 blocksize, u32 inputcount, u32 filecount, u32 outputcount,
+              size_t memorylimit, bool rotational);
+
+  // Estimate how long the reads take when chunksize bytes of each
+  // block are processed for outputsperpass outputs at a time.
+  static double EstimateCost(u64 blocksize, u32 inputcount, u32 filecount, u32 outputcount,
+                             size_t chunksize, u32 outputsperpass, bool rotational);
+
+  // How many bytes of each block are processed at a time
+  size_t ChunkSize(void) const {return chunksize;}
+
+  // How many of the outputs are computed at a time
+  u32 OutputsPerPass(void) const {return outputsperpass;}
+
+  // How many passes are made over the inputs
+  u32 SlicePasses(void) const {return slicepasses;}
+  u32 OutputPasses(void) const {return outputpasses;}
+  u32 Passes(void) const {return slicepasses * outputpasses;}
+
+  // The estimated time for the reads, in seconds
+  double Cost(void) const {return cost;}
+
+protected:
+  size_t chunksize;
+  u32    outputsperpass;
+  u32    slicepasses;
+  u32    outputpasses;
+  double cost;
+};
+
+#endif // __PASSPLAN_H__
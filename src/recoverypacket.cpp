@@ -35,6 +35,7 @@ RecoveryPacket::RecoveryPacket(void)
   diskfile = NULL;
   offset = 0;
   packetcontext = NULL;
+  checked = true;
 }
 
 RecoveryPacket::~RecoveryPacket(void)
@@ -98,6 +99,14 @@ bool RecoveryPacket::WriteHeader(void)
   return diskfile->Write(offset, &packet, sizeof(packet));
 }
 
+bool RecoveryPacket::WriteHeader(const MD5Hash &hash)
+{
+  packet.header.hash = hash;
+
+  // Write the header to disk
+  return diskfile->Write(offset, &packet, sizeof(packet));
+}
+
 // Load the recovery packet from disk.
 //
 // The header of the packet will already have been read from disk. The only
@@ -107,10 +116,12 @@ bool RecoveryPacket::WriteHeader(void)
 
 bool RecoveryPacket::Load(DiskFile      *_diskfile,
                           u64            _offset,
-                          PACKET_HEADER &_header)
+                          PACKET_HEADER &_header,
+                          bool           _checked)
 {
   diskfile = _diskfile;
   offset = _offset;
+  checked = _checked;
 
   // Is the packet actually large enough
   if (_header.length <= sizeof(packet))
@@ -128,3 +139,144 @@ bool RecoveryPacket::Load(DiskFile      *_diskfile,
   // Read the rest of the packet header
   return diskfile->Read(offset + sizeof(packet.header), &packet.exponent, sizeof(packet)-sizeof(packet.header));
 }
+
+bool RecoveryPacket::Load(DiskFile      *_diskfile,
+                          u64            _offset,
+                          PACKET_HEADER &_header,
+                          u32            _exponent,
+                          bool           _checked)
+{
+  diskfile = _diskfile;
+  offset = _offset;
+  checked = _checked;
+
+  // Is the packet actually large enough
+  if (_header.length <= sizeof(packet))
+  {
+    return false;
+  }
+
+  packet.header = _header;
+  packet.exponent = _exponent;
+
+  // Set the data block to immediately follow the header on disk
+  datablock.SetLocation(diskfile, offset + sizeof(packet));
+  datablock.SetLength(packet.header.length - sizeof(packet));
+
+  return true;
+}
+
+// Check the packet hash of a loaded packet, from its recovery data.
+
+void RecoveryPacket::StartCheck(void)
+{
+  delete packetcontext;
+  packetcontext = new MD5Context;
+  packetcontext->Update(HashedHeader(), HashedHeaderSize());
+}
+
+void RecoveryPacket::UpdateCheck(const void *buffer, size_t size)
+{
+  packetcontext->Update(buffer, size);
+}
+
+bool RecoveryPacket::FinishCheck(void)
+{
+  MD5Hash hash;
+  packetcontext->Final(hash);
+  delete packetcontext;
+  packetcontext = NULL;
+
+  checked = hash == packet.header.hash;
+  return checked;
+}
+
+
+RecoveryPacketHasher::RecoveryPacketHasher(void)
+: packets(0)
+, groupsize(0)
+, batches()
+, groupbatches()
+{
+}
+
+RecoveryPacketHasher::~RecoveryPacketHasher(void)
+{
+  for (vector<Batch>::iterator batch = batches.begin(); batch != batches.end(); ++batch)
+    delete batch->context;
+}
+
+void RecoveryPacketHasher::Start(vector<RecoveryPacket> &_packets, u32 _groupsize)
+{
+  // Forget anything which was hashed before
+  for (vector<Batch>::iterator batch = batches.begin(); batch != batches.end(); ++batch)
+    delete batch->context;
+  batches.clear();
+  groupbatches.clear();
+
+  packets = &_packets;
+  groupsize = _groupsize;
+
+  u32 count = (u32)packets->size();
+  vector<const void*> headers;
+
+  // Split each group into batches of similar size
+  for (u32 group = 0; group < count; group += groupsize)
+  {
+    u32 groupcount = min(groupsize, count - group);
+    u32 batchcount = (groupcount + RECOVERY_HASH_LANES - 1) / RECOVERY_HASH_LANES;
+
+    groupbatches.push_back((u32)batches.size());
+
+    u32 first = group;
+    for (u32 b = 0; b < batchcount; b++)
+    {
+      Batch batch;
+      batch.first = first;
+      batch.count = (group + groupcount - first) / (batchcount - b);
+      batch.context = new MD5Multi(batch.count);
+
+      // Start each hash with the packet header
+      headers.resize(batch.count);
+      for (u32 i = 0; i < batch.count; i++)
+        headers[i] = (*packets)[batch.first + i].HashedHeader();
+      batch.context->update(&headers[0], RecoveryPacket::HashedHeaderSize());
+
+      batches.push_back(batch);
+      first += batch.count;
+    }
+  }
+}
+
+void RecoveryPacketHasher::Update(u32 first, const void * const *buffers, size_t size)
+{
+  u32 group = first / groupsize;
+  int begin = (int)groupbatches[group];
+  int end = group + 1 < groupbatches.size() ? (int)groupbatches[group + 1] : (int)batches.size();
+
+  #pragma omp parallel for schedule(dynamic) if (end - begin > 1)
+  for (int b = begin; b < end; b++)
+  {
+    const Batch &batch = batches[b];
+    batch.context->update(&buffers[batch.first - first], size);
+  }
+}
+
+bool RecoveryPacketHasher::WriteHeaders(void)
+{
+  for (vector<Batch>::iterator batch = batches.begin(); batch != batches.end(); ++batch)
+  {
+    batch->context->end();
+
+    for (u32 i = 0; i < batch->count; i++)
+    {
+      MD5Hash hash;
+      batch->context->get1(i, hash.hash);
+
+      if (!(*packets)[batch->first + i].WriteHeader(hash))
+        return false;
+    }
+  }
+
+  return true;
+}
@@ -48,10 +48,26 @@ public:
                  const void *buffer);   // Buffer containing the data to write
   // Finish computing the hash of the recovery packet and write the header to disk.
   bool WriteHeader(void);
+  // Write the header to disk, with a packet hash which was computed separately.
+  bool WriteHeader(const MD5Hash &hash);
 
 public:
-  // Load a recovery packet from a specified file
-  bool Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header);
+  // Load a recovery packet from a specified file.  If the packet hash
+  // was not checked whilst loading it, it must be checked before the
+  // recovery data is relied on.
+  bool Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, bool checked = true);
+  // Load a recovery packet whose exponent is already known, without
+  // reading anything from the file.
+  bool Load(DiskFile *diskfile, u64 offset, PACKET_HEADER &header, u32 exponent, bool checked);
+
+  // Check the packet hash from the recovery data, as it is read a part
+  // at a time from the start of the data to the end.
+  void StartCheck(void);
+  void UpdateCheck(const void *buffer, size_t size);
+  bool FinishCheck(void);
+
+  // Has the packet hash been checked
+  bool Checked(void) const {return checked;}
 
 public:
   // Get the length of the packet.
@@ -66,6 +82,10 @@ public:
   // The data block
   DataBlock* GetDataBlock(void);
 
+  // The part of the packet header which is included in the packet hash
+  const void* HashedHeader(void) const;
+  static size_t HashedHeaderSize(void);
+
 protected:
   DiskFile           *diskfile;       // The specific file that this packet is stored in
   u64                 offset;         // The offset at which the packet is stored
@@ -75,6 +95,8 @@ protected:
   MD5Context         *packetcontext;  // MD5 Context used to compute the packet hash
 
   DataBlock           datablock;      // The recovery data block.
+
+  bool                checked;        // Whether the packet hash has been checked
 };
 
 inline u64 RecoveryPacket::PacketLength(void) const
@@ -97,4 +119,63 @@ inline DataBlock* RecoveryPacket::GetDataBlock(void)
   return &datablock;
 }
 
+inline const void* RecoveryPacket::HashedHeader(void) const
+{
+  return &packet.header.setid;
+}
+
+inline size_t RecoveryPacket::HashedHeaderSize(void)
+{
+  return sizeof(RECOVERYBLOCKPACKET)-offsetof(RECOVERYBLOCKPACKET, header.setid);
+}
+
+// The most recovery packets which are hashed together in the lanes of
+// one multi-buffer MD5 context
+#define RECOVERY_HASH_LANES 16
+
+// A RecoveryPacketHasher computes the packet hashes of a set of recovery
+// packets as they are created.  Rather than each packet being hashed on
+// its own, the packets are split into batches which are each hashed in
+// the lanes of a multi-buffer MD5, and the batches are hashed on separate
+// threads.
+//
+// The packets are also divided into groups, which batches do not cross,
+// and their data is given a group at a time: the same amount of data for
+// every packet in the group.
+
+class RecoveryPacketHasher
+{
+public:
+  RecoveryPacketHasher(void);
+  ~RecoveryPacketHasher(void);
+
+  // Start hashing the packets, in groups of the specified size.  Any
+  // hashing which was started before is abandoned.
+  void Start(vector<RecoveryPacket> &packets, u32 groupsize);
+
+  // Hash the next part of the data of the group which starts with the
+  // specified packet.  There is a buffer for each packet in the group.
+  void Update(u32 first, const void * const *buffers, size_t size);
+
+  // Finish computing the packet hashes and write the headers to disk
+  bool WriteHeaders(void);
+
+protected:
+  struct Batch
+  {
+    u32       first;    // The first packet in the batch
+    u32       count;    // How many packets are in the batch
+    MD5Multi *context;
+  };
+
+  vector<RecoveryPacket> *packets;
+  u32                     groupsize;
+  vector<Batch>           batches;
+  vector<u32>             groupbatches;  // The first batch of each group
+
+private:
+  RecoveryPacketHasher(const RecoveryPacketHasher &);
+  RecoveryPacketHasher& operator=(const RecoveryPacketHasher &);
+};
+
 #endif // __RECOVERYPACKET_H__
@@ -0,0 +1,224 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#include "libpar2internal.h"
+
+#ifdef _MSC_VER
+#ifdef _DEBUG
+#undef THIS_FILE
+static char THIS_FILE[]=__FILE__;
+#define new DEBUG_NEW
+#endif
+#endif
+
+// The journal starts with a header, which is followed by each of the
+// saved parts of the file: its position and length, and then the data.
+
+#ifdef _WIN32
+#pragma pack(push, 1)
+#define PACKED
+#else
+#define PACKED __attribute__ ((packed))
+#endif
+
+struct UNDOJOURNALHEADER
+{
+  MAGIC magic;
+  leu64 filesize;    // The original size of the file
+  leu64 rangecount;  // How many parts of the file were saved
+} PACKED;
+
+struct UNDOJOURNALRANGE
+{
+  leu64 offset;
+  leu64 length;
+} PACKED;
+
+#ifdef _WIN32
+#pragma pack(pop)
+#endif
+#undef PACKED
+
+static const MAGIC undojournal_magic = {{'P', 'A', 'R', '2', 'U', 'N', 'D', 'O'}};
+
+// Data is copied to and from the journal in pieces of this size
+#define UNDO_COPY_SIZE 1048576
+
+
+UndoJournal::UndoJournal(std::ostream &sout, std::ostream &serr)
+: sout(sout)
+, serr(serr)
+{
+}
+
+UndoJournal::~UndoJournal(void)
+{
+}
+
+string UndoJournal::JournalName(const string &filename)
+{
+  return filename + ".par2undo";
+}
+
+bool UndoJournal::Exists(const string &filename)
+{
+  return DiskFile::FileExists(JournalName(filename));
+}
+
+void UndoJournal::Add(u64 offset, u64 length)
+{
+  Range range = {offset, length};
+  ranges.push_back(range);
+}
+
+// Copy some data from one file to another
+static bool CopyData(DiskFile &from, u64 fromoffset, DiskFile &to, u64 tooffset, u64 length, vector<u8> &buffer)
+{
+  while (length > 0)
+  {
+    size_t want = (size_t)min(length, (u64)buffer.size());
+    if (!from.Read(fromoffset, &buffer[0], want) ||
+        !to.Write(tooffset, &buffer[0], want))
+      return false;
+
+    fromoffset += want;
+    tooffset += want;
+    length -= want;
+  }
+
+  return true;
+}
+
+bool UndoJournal::Write(DiskFile &target)
+{
+  string name = JournalName(target.FileName());
+  u64 filesize = target.FileSize();
+
+  // Only the parts which are within the file need to be saved; the
+  // rest is removed by putting back the size of the file
+  u64 journalsize = sizeof(UNDOJOURNALHEADER);
+  for (vector<Range>::iterator range = ranges.begin(); range != ranges.end(); ++range)
+  {
+    range->length = range->offset < filesize ? min(range->length, filesize - range->offset) : 0;
+    journalsize += sizeof(UNDOJOURNALRANGE) + range->length;
+  }
+
+  DiskFile journal(sout, serr);
+  if (!journal.Create(name, journalsize))
+    return false;
+
+  vector<u8> buffer(UNDO_COPY_SIZE);
+  u64 position = sizeof(UNDOJOURNALHEADER);
+  bool success = true;
+  for (vector<Range>::const_iterator range = ranges.begin(); success && range != ranges.end(); ++range)
+  {
+    UNDOJOURNALRANGE header;
+    header.offset = range->offset;
+    header.length = range->length;
+
+    success = journal.Write(position, &header, sizeof(header)) &&
+              CopyData(target, range->offset, journal, position + sizeof(header), range->length, buffer);
+
+    position += sizeof(header) + range->length;
+  }
+
+  // Mark the journal as valid only once all of it is on disk
+  if (success)
+  {
+    UNDOJOURNALHEADER header;
+    header.magic = undojournal_magic;
+    header.filesize = filesize;
+    header.rangecount = ranges.size();
+
+    success = journal.Flush() &&
+              journal.Write(0, &header, sizeof(header)) &&
+              journal.Flush();
+  }
+
+  journal.Close();
+
+  if (!success)
+  {
+    serr << "Could not write the undo journal " << name << endl;
+    journal.Delete();
+  }
+
+  return success;
+}
+
+bool UndoJournal::RollBack(DiskFile &target)
+{
+  string name = JournalName(target.FileName());
+
+  DiskFile journal(sout, serr);
+  if (!journal.Open(name))
+  {
+    serr << "Could not open the undo journal " << name << endl;
+    return false;
+  }
+
+  UNDOJOURNALHEADER header;
+  if (journal.FileSize() < sizeof(header) ||
+      !journal.Read(0, &header, sizeof(header)) ||
+      header.magic != undojournal_magic)
+  {
+    // The journal was never finished, so the file was not changed
+    journal.Close();
+    return journal.Delete();
+  }
+
+  vector<u8> buffer(UNDO_COPY_SIZE);
+  u64 position = sizeof(header);
+  bool success = true;
+  for (u64 i=0; success && i<header.rangecount; i++)
+  {
+    UNDOJOURNALRANGE range;
+    success = journal.Read(position, &range, sizeof(range)) &&
+              CopyData(journal, position + sizeof(range), target, range.offset, range.length, buffer);
+
+    position += sizeof(range) + range.length;
+  }
+
+  success = success &&
+            target.SetFileSize(header.filesize) &&
+            target.Flush();
+
+  journal.Close();
+
+  if (!success)
+  {
+    serr << "Could not restore " << target.FileName() << " from the undo journal " << name << endl;
+    return false;
+  }
+
+  return journal.Delete();
+}
+
+bool UndoJournal::Commit(DiskFile &target)
+{
+  if (!target.Flush())
+    return false;
+
+  DiskFile journal(sout, serr);
+  if (!journal.Open(JournalName(target.FileName())))
+    return false;
+  journal.Close();
+
+  return journal.Delete();
+}
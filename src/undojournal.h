@@ -0,0 +1,74 @@
+//  This file is part of par2cmdline (a PAR 2.0 compatible file verification and
+//  repair tool). See http://parchive.sourceforge.net for details of PAR 2.0.
+//
+//  Copyright (c) 2003 Peter Brian Clements
+//
+//  par2cmdline is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  par2cmdline is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+#ifndef __UNDOJOURNAL_H__
+#define __UNDOJOURNAL_H__
+
+// An UndoJournal keeps a copy of the parts of a file which an in-place
+// repair is about to overwrite, together with the original size of the
+// file, so that the file can be put back as it was if the repair does
+// not finish.  The journal is kept next to the file, with ".par2undo"
+// added to its name.
+//
+// The copy is written, and flushed to disk, before the header which
+// marks the journal as valid.  A journal without a valid header was
+// never finished, so the file which it belongs to was not changed.
+
+class UndoJournal
+{
+public:
+  UndoJournal(std::ostream &sout, std::ostream &serr);
+  ~UndoJournal(void);
+
+  // The name of the journal for a file
+  static string JournalName(const string &filename);
+
+  // Is there a journal for a file, left from a repair which did not finish
+  static bool Exists(const string &filename);
+
+  // Add a part of the file which will be overwritten
+  void Add(u64 offset, u64 length);
+
+  // Save the original contents of the parts of the file, and its size
+  bool Write(DiskFile &target);
+
+  // Put the file back as it was, and delete the journal
+  bool RollBack(DiskFile &target);
+
+  // Make sure the changes to the file are on disk, and delete the journal
+  bool Commit(DiskFile &target);
+
+protected:
+  struct Range
+  {
+    u64 offset;
+    u64 length;
+  };
+
+  std::ostream &sout;
+  std::ostream &serr;
+
+  vector<Range> ranges;
+
+private:
+  UndoJournal(const UndoJournal &);
+  UndoJournal& operator=(const UndoJournal &);
+};
+
+#endif // __UNDOJOURNAL_H__